@@ -504,9 +504,21 @@ class MatMul4Bit(torch.autograd.Function):
             else:
                 return torch.empty(A.shape[:-1] + B_shape[:1], dtype=A.dtype, device=A.device)
 
-        # 1. Dequantize
-        # 2. MatmulnN
-        output = torch.nn.functional.linear(A, F.dequantize_4bit(B, quant_state).to(A.dtype).t(), bias)
+        if (
+            A.device.type == "cpu"
+            and B.shape[0] == 1
+            and A.dtype in F.dtype2scalar_type
+            and quant_state.shape[1] % quant_state.blocksize == 0
+        ):
+            # B holds the transposed weight of a Linear4bit: multiply with its prepacked panels
+            # (hot weights keep them in the weight cache) instead of dequantizing it
+            output = F.gemm_4bit_prepacked(A, F._prepack_4bit_cached(B, quant_state))
+            if bias is not None:
+                output += bias
+        else:
+            # 1. Dequantize (hot CPU weights come from the weight cache, see F.set_cpu_weight_cache)
+            # 2. MatmulnN
+            output = torch.nn.functional.linear(A, F.dequantize_4bit(B, quant_state, cache=True).to(A.dtype).t(), bias)
 
         # 3. Save state
         ctx.state = quant_state
@@ -537,7 +549,12 @@ class MatMul4Bit(torch.autograd.Function):
         # not supported by PyTorch. TODO: create work-around
         # if req_gradB: grad_B = torch.matmul(grad_output.t(), A)
         if req_gradA:
-            grad_A = torch.matmul(grad_output, F.dequantize_4bit(B, ctx.state).to(grad_output.dtype).t())
+            if grad_output.device.type == "cpu" and B.shape[0] == 1 and grad_output.dtype in F.dtype2scalar_type:
+                # B holds the transposed weight of a Linear4bit: decode it on the fly instead of
+                # materializing the dequantized weight and its transpose
+                grad_A = F.gemm_4bit_transposed(grad_output, B, ctx.state)
+            else:
+                grad_A = torch.matmul(grad_output, F.dequantize_4bit(B, ctx.state).to(grad_output.dtype).t())
 
         return grad_A, grad_B, None, grad_bias, None
 
@@ -68,6 +68,29 @@ class BNBNativeLibrary:
 
     def __init__(self, lib: ct.CDLL):
         self._lib = lib
+        lib.cget_cpu_isa.restype = ct.c_char_p
+        lib.cget_thread_affinity.restype = ct.c_bool
+        lib.cget_numa_local.restype = ct.c_bool
+        lib.cget_deterministic.restype = ct.c_bool
+        lib.cautotune_cpu.restype = ct.c_bool
+        lib.csubmit_quantize_blockwise_cpu_batched.restype = ct.c_void_p
+        lib.csubmit_dequantize_blockwise_cpu_batched.restype = ct.c_void_p
+        lib.csubmit_optimizer_32bit_cpu.restype = ct.c_void_p
+        lib.cjob_poll.restype = ct.c_bool
+        lib.cjob_wait_for.restype = ct.c_bool
+        lib.cpaged_alloc_cpu.restype = ct.c_void_p
+        lib.ccheckpoint_writer_open.restype = ct.c_void_p
+        lib.ccheckpoint_writer_write.restype = ct.c_longlong
+        lib.ccheckpoint_writer_quantize_4bit.restype = ct.c_longlong
+        lib.ccheckpoint_writer_close.restype = ct.c_bool
+        lib.cshm_transport_create.restype = ct.c_void_p
+        lib.cweight_cache_dequantize_4bit_cpu.restype = ct.c_void_p
+        lib.cweight_cache_prepack_4bit_cpu.restype = ct.c_void_p
+        lib.cquantized_all_reduce_payload_bytes.restype = ct.c_longlong
+        lib.cquantized_all_reduce_cpu.restype = ct.c_bool
+        lib.coptimizer_32bit_cpu_multi.restype = ct.c_float
+        lib.cgemv_lora_cpu.restype = ct.c_bool
+        lib.coptimizer_4bit_blockwise_cpu.restype = ct.c_bool
 
     def __getattr__(self, item):
         return getattr(self._lib, item)
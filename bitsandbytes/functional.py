@@ -5,8 +5,12 @@
 import ctypes as ct
 from functools import reduce  # Required in Python 3
 import itertools
+import json
+import math
 import operator
-from typing import Any, Dict, Optional, Tuple
+import struct
+from typing import Any, Dict, List, Optional, Sequence, Tuple, Union
+import weakref
 
 import numpy as np
 import torch
@@ -24,6 +28,9 @@ def prod(iterable):
 
 name2qmap = {}
 
+# CpuOptimizer_t in csrc/cpu_ops.h; like on the GPU, LAMB and LARS use the Adam and momentum updates
+str2optimizer_cpu = {"adam": 0, "momentum": 1, "rmsprop": 2, "lars": 3, "adagrad": 4, "lion": 5, "lamb": 0}
+
 if lib and lib.compiled_with_cuda:
     """C FUNCTIONS FOR OPTIMIZERS"""
     str2optimizer32bit = {
@@ -185,6 +192,9 @@ FIRST_CUDA_DEVICE = torch.device("cuda", index=0)
 
 
 def get_paged(*shape, dtype=torch.float32, device=FIRST_CUDA_DEVICE):
+    if device.type == "cpu":
+        return _get_paged_cpu(*shape, dtype=dtype)
+
     num_bytes = dtype2bytes[dtype] * prod(shape)
     cuda_ptr = lib.cget_managed_ptr(ct.c_size_t(num_bytes))
     c_ptr = ct.cast(cuda_ptr, ct.POINTER(ct.c_int))
@@ -195,17 +205,53 @@ def get_paged(*shape, dtype=torch.float32, device=FIRST_CUDA_DEVICE):
     return out
 
 
+def _get_paged_cpu(*shape, dtype=torch.float32):
+    """Zero-initialized tensor in a file-backed mapping, see csrc/cpu_paging.h."""
+    num_bytes = dtype2bytes[dtype] * prod(shape)
+    ptr = lib.cpaged_alloc_cpu(ct.c_size_t(num_bytes))
+    if ptr is None:
+        raise RuntimeError(f"Could not allocate {num_bytes} bytes of paged CPU memory, see BNB_PAGED_DIR")
+    new_array = np.ctypeslib.as_array(ct.cast(ptr, ct.POINTER(ct.c_uint8)), shape=(num_bytes,))
+    # the tensor keeps the array alive, the mapping is released with the last view
+    weakref.finalize(new_array, lib.cpaged_free_cpu, ct.c_void_p(ptr))
+    out = torch.frombuffer(new_array, dtype=dtype, count=prod(shape)).view(shape)
+    out.is_paged = True
+    # the home of the pages is the CPU
+    out.page_deviceid = -1
+    return out
+
+
+def set_cpu_paged_dir(path: Optional[str] = None):
+    """
+    Sets the directory of the files backing paged CPU tensors, e.g. on a local NVMe drive.
+
+    Defaults to `BNB_PAGED_DIR`, `TMPDIR` or `/var/tmp`. Passing `None` restores the default.
+    """
+    lib.cset_paged_dir(None if path is None else str(path).encode())
+
+
 def prefetch_tensor(A, to_cpu=False):
     assert A.is_paged, "Only paged tensors can be prefetched!"
+    num_bytes = dtype2bytes[A.dtype] * A.numel()
+    if A.page_deviceid == -1:
+        # starts reading the pages back from disk and returns
+        lib.cprefetch_cpu(get_ptr(A), ct.c_size_t(num_bytes))
+        return
+
     if to_cpu:
         deviceid = -1
     else:
         deviceid = A.page_deviceid
 
-    num_bytes = dtype2bytes[A.dtype] * A.numel()
     lib.cprefetch(get_ptr(A), ct.c_size_t(num_bytes), ct.c_int32(deviceid))
 
 
+def writeback_tensor(A):
+    """Starts writing a paged CPU tensor back to its file without waiting, so that its pages can be evicted cheaply."""
+    assert A.is_paged and A.page_deviceid == -1, "Only paged CPU tensors can be written back!"
+    lib.cwriteback_cpu(get_ptr(A), ct.c_size_t(dtype2bytes[A.dtype] * A.numel()))
+
+
 def elementwise_func(func_name, A, B, value, prefetch=True):
     func = None
     if A.dtype == torch.float32:
@@ -391,6 +437,16 @@ def create_dynamic_map(signed=True, max_exponent_bits=7, total_bits=8):
     return Tensor(data)
 
 
+def create_dynamic_map_4bit(signed=True):
+    """
+    Creates the 16 values of the 4-bit dynamic map used by 4-bit optimizer states: the map of
+    `create_dynamic_map(signed, max_exponent_bits=3, total_bits=4)` without its padding to 256 values.
+    """
+    data = create_dynamic_map(signed, max_exponent_bits=3, total_bits=4)
+    # one zero belongs to the map, the others are padding
+    return torch.cat([data[data != 0], torch.zeros(1)]).sort().values
+
+
 def create_quantile_map(A, total_bits=8):
     q = estimate_quantiles(A, num_quantiles=2**total_bits - 1)
     q = q.tolist()
@@ -912,6 +968,74 @@ def quantize_blockwise(
     return out, quant_state
 
 
+def _fp8_code(exponent_bits: int) -> Tensor:
+    if not 1 <= exponent_bits <= 6:
+        raise ValueError(f"exponent_bits has to be in [1, 6], got {exponent_bits}")
+    name = f"fp8_e{exponent_bits}m{7 - exponent_bits}"
+    if name not in name2qmap:
+        name2qmap[name] = create_fp8_map(True, exponent_bits, 7 - exponent_bits)
+    return name2qmap[name]
+
+
+def quantize_fp8_blockwise(
+    A: Tensor,
+    exponent_bits=4,
+    absmax: Optional[torch.Tensor] = None,
+    out: Optional[torch.Tensor] = None,
+    blocksize=4096,
+) -> Tuple[Tensor, QuantState]:
+    """
+    Quantize tensor A blockwise to a signed 8-bit float code, e.g. E4M3 or E5M2.
+
+    The result is the same as `quantize_blockwise` with the code
+    `create_fp8_map(True, exponent_bits, 7 - exponent_bits)` and is dequantized with
+    `dequantize_blockwise`. On the CPU, the indices are computed from the float bits of
+    the scaled values instead of searching the code.
+
+    Parameters
+    ----------
+    A : torch.Tensor
+        The input tensor (float32, float16 or bfloat16 on the CPU).
+    exponent_bits : int
+        The number of exponent bits, 1 to 6; 4 for E4M3 and 5 for E5M2.
+    absmax : torch.Tensor
+        The absmax values.
+    out : torch.Tensor
+        The output tensor (8-bit).
+    blocksize : int
+        The number of values that share an absmax.
+
+    Returns
+    -------
+    torch.Tensor:
+        The 8-bit tensor.
+    QuantState:
+        The quantization state to undo the quantization.
+    """
+    code = _fp8_code(exponent_bits)
+
+    if A.device.type != "cpu":
+        return quantize_blockwise(A, code.to(A.device), absmax, out, blocksize)
+    if A.dtype not in dtype2scalar_type:
+        raise ValueError(f"Blockwise quantization only supports 16/32-bit floats, but got {A.dtype}")
+
+    if absmax is None:
+        absmax = torch.zeros(((A.numel() + blocksize - 1) // blocksize,), dtype=torch.float32)
+    if out is None:
+        out = torch.zeros_like(A, dtype=torch.uint8)
+    lib.cquantize_fp8_cpu(
+        get_ptr(code),
+        ct.c_int(exponent_bits),
+        ct.c_int(dtype2scalar_type[A.dtype]),
+        get_ptr(A),
+        get_ptr(absmax),
+        get_ptr(out),
+        ct.c_longlong(blocksize),
+        ct.c_longlong(A.numel()),
+    )
+    return out, QuantState(absmax=absmax, code=code, blocksize=blocksize, dtype=A.dtype)
+
+
 def dequantize_blockwise(
     A: Tensor,
     quant_state: Optional[QuantState] = None,
@@ -1017,238 +1141,1318 @@ def dequantize_blockwise(
     return out
 
 
-def get_4bit_type(typename, device=None, blocksize=64):
-    if device is None:
-        device = "cuda"
-    data = None
-    if typename == "nf4":
-        """ Implements the NF4 data type.
+# ScalarType_t in csrc/common.h
+dtype2scalar_type = {torch.float32: 0, torch.float16: 1, torch.bfloat16: 2}
+# CpuDataType_t in csrc/cpu_ops.h
+str2quant_type_cpu = {"fp4": 1, "nf4": 2}
 
-            Constructs a quantization data type where each bin has equal area under a standard normal distribution N(0, 1) that
-            is normalized into the range [-1, 1].
 
-            For more information read the paper: QLoRA: Efficient Finetuning of Quantized LLMs (https://arxiv.org/abs/2305.14314)
+class QuantizeTensorDesc(ct.Structure):
+    """Mirrors `quantize_tensor_desc` in csrc/cpu_ops.h."""
 
-            Implementation of the NF4 data type in bitsandbytes can be found in the `create_normal_map` function in
-            the `functional.py` file: https://github.com/TimDettmers/bitsandbytes/blob/main/bitsandbytes/functional.py#L236.
-        """
-        data = [
-            -1.0,
-            -0.6961928009986877,
-            -0.5250730514526367,
-            -0.39491748809814453,
-            -0.28444138169288635,
-            -0.18477343022823334,
-            -0.09105003625154495,
-            0.0,
-            0.07958029955625534,
-            0.16093020141124725,
-            0.24611230194568634,
-            0.33791524171829224,
-            0.44070982933044434,
-            0.5626170039176941,
-            0.7229568362236023,
-            1.0,
-        ]
-    elif typename == "fp4":
-        # 0b000 = 0
-        # 0b001 = 0.0625
-        # 0b010 = 8
-        # 0b011 = 12
-        # 0b100 = 4
-        # 0b101 = 6
-        # 0b110 = 2
-        # 0b111 = 3
-        # can also be created with bnb.functional.create_fp8_map(signed=True, exponent_bits=2, precision_bits=1, total_bits=4)
-        data = [0, 0.0625, 8.0, 12.0, 4.0, 6.0, 2.0, 3.0, -0, -0.0625, -8.0, -12.0, -4.0, -6.0, -2.0, -3.0]
-    elif typename == "int4":
-        data = [7, 6, 5, 4, 3, 2, 1, 0, -0, -1, -2, -3, -4, -5, -6, -7]
-    elif typename == "af4":
-        # Taken from: NF4 Isn't Information Theoretically Optimal (and that's Good)
-        # https://arxiv.org/abs/2306.06965
-        if blocksize == 64:
-            data = [
-                -1.0,
-                -0.69441008,
-                -0.51243739,
-                -0.3736951,
-                -0.25607552,
-                -0.14982478,
-                -0.04934812,
-                0.0,
-                0.04273164,
-                0.12934483,
-                0.21961274,
-                0.31675666,
-                0.42563882,
-                0.55496234,
-                0.72424863,
-                1.0,
-            ][::-1]
-        else:
-            raise NotImplementedError("4-bit AbnormalFloats currently only support blocksize 64.")
+    _fields_ = [
+        ("A", ct.c_void_p),
+        ("out", ct.c_void_p),
+        ("absmax", ct.c_void_p),
+        ("code", ct.c_void_p),
+        ("n", ct.c_longlong),
+        ("blocksize", ct.c_longlong),
+        ("dtype", ct.c_int),
+    ]
 
-    if data is None:
-        raise NotImplementedError(f"Typename {typename} not supported")
 
-    data = torch.tensor(data, device=device)
-    data.div_(data.abs().max())
+def _batched_blocksizes(blocksize: Union[int, List[int]], num_tensors: int) -> List[int]:
+    blocksizes = [blocksize] * num_tensors if isinstance(blocksize, int) else list(blocksize)
+    if len(blocksizes) != num_tensors:
+        raise ValueError(f"Expected one blocksize per tensor ({num_tensors}), but got {len(blocksizes)}")
+    return blocksizes
 
-    assert data.numel() == 16
 
-    return data
+def _check_batched_quant_states(As: List[Tensor], quant_states: List[QuantState]):
+    if len(quant_states) != len(As):
+        raise ValueError(f"Expected one quantization state per tensor ({len(As)}), but got {len(quant_states)}")
+    for qs in quant_states:
+        if qs.nested:
+            raise NotImplementedError("Batched dequantization does not support nested quantization states")
 
 
-def quantize_fp4(
-    A: Tensor,
-    absmax: Optional[torch.Tensor] = None,
-    out: Optional[torch.Tensor] = None,
-    blocksize=64,
-    compress_statistics=False,
-    quant_storage=torch.uint8,
-):
-    return quantize_4bit(A, absmax, out, blocksize, compress_statistics, "fp4", quant_storage)
+def _make_tensor_descs(As, outs, absmaxs, codes, blocksizes):
+    # the native call reads len(As) descriptors, so every list has to cover all of them
+    if not len(As) == len(outs) == len(absmaxs) == len(codes) == len(blocksizes):
+        raise ValueError(
+            "Batched blockwise quantization needs the same number of tensors, absmax, codes and blocksizes"
+        )
+    descs = (QuantizeTensorDesc * len(As))()
+    for desc, A, out, absmax, code, blocksize in zip(descs, As, outs, absmaxs, codes, blocksizes):
+        if A.dtype not in dtype2scalar_type:
+            raise ValueError(f"Blockwise quantization only supports 16/32-bit floats, but got {A.dtype}")
+        if any(t.device.type != "cpu" for t in (A, out, absmax, code)):
+            raise ValueError("Batched blockwise quantization requires CPU tensors")
+        if not (A.is_contiguous() and out.is_contiguous()):
+            raise ValueError("Batched blockwise quantization requires contiguous tensors")
+        desc.A = A.data_ptr()
+        desc.out = out.data_ptr()
+        desc.absmax = absmax.data_ptr()
+        desc.code = code.data_ptr()
+        desc.n = A.numel()
+        desc.blocksize = blocksize
+        desc.dtype = dtype2scalar_type[A.dtype]
+    return descs
+
+
+def quantize_blockwise_batched(
+    As: List[Tensor],
+    code: Optional[torch.Tensor] = None,
+    blocksize: Union[int, List[int]] = 4096,
+) -> List[Tuple[Tensor, QuantState]]:
+    """
+    Quantizes many CPU tensors, e.g. a whole state_dict, with a single native call.
 
+    The blocks of all tensors are scheduled over the thread pool together, so small
+    tensors like biases do not each pay for a parallel region of their own.
 
-def quantize_nf4(
-    A: Tensor,
-    absmax: Optional[torch.Tensor] = None,
-    out: Optional[torch.Tensor] = None,
-    blocksize=64,
-    compress_statistics=False,
-    quant_storage=torch.uint8,
-):
-    return quantize_4bit(A, absmax, out, blocksize, compress_statistics, "nf4", quant_storage)
+    Parameters
+    ----------
+    As : List[torch.Tensor]
+        The input tensors (float32, float16 or bfloat16, on the CPU).
+    code : torch.Tensor
+        The quantization map shared by all tensors.
+    blocksize : int or List[int]
+        The blocksize for all tensors, or one blocksize per tensor.
+
+    Returns
+    -------
+    List[Tuple[torch.Tensor, QuantState]]:
+        The 8-bit tensor and the quantization state of each input, as returned by `quantize_blockwise`.
+    """
+    if code is None:
+        if "dynamic" not in name2qmap:
+            name2qmap["dynamic"] = create_dynamic_map()
+        code = name2qmap["dynamic"]
+    code = code.cpu()
+    blocksizes = _batched_blocksizes(blocksize, len(As))
 
+    outs = [torch.empty_like(A, dtype=torch.uint8) for A in As]
+    absmaxs = [torch.empty(((A.numel() + bs - 1) // bs,), dtype=torch.float32) for A, bs in zip(As, blocksizes)]
+    descs = _make_tensor_descs(As, outs, absmaxs, [code] * len(As), blocksizes)
+    lib.cquantize_blockwise_cpu_batched(descs, ct.c_longlong(len(As)))
 
-def quantize_4bit(
-    A: Tensor,
-    absmax: Optional[torch.Tensor] = None,
-    out: Optional[torch.Tensor] = None,
-    blocksize=64,
-    compress_statistics=False,
-    quant_type="fp4",
-    quant_storage=torch.uint8,
-) -> Tuple[Tensor, QuantState]:
+    return [
+        (out, QuantState(absmax=absmax, code=code, blocksize=bs, dtype=A.dtype))
+        for A, out, absmax, bs in zip(As, outs, absmaxs, blocksizes)
+    ]
+
+
+def dequantize_blockwise_batched(As: List[Tensor], quant_states: List[QuantState]) -> List[Tensor]:
     """
-    Quantize tensor A in blocks of 4-bit values.
+    Dequantizes many CPU tensors quantized by `quantize_blockwise` with a single native call.
+
+    The outputs have the dtype recorded in each quantization state. Nested quantization states are not supported.
+    """
+    _check_batched_quant_states(As, quant_states)
+    outs = [torch.empty(A.shape, dtype=qs.dtype) for A, qs in zip(As, quant_states)]
+    codes = [qs.code.cpu() for qs in quant_states]
+    descs = _make_tensor_descs(
+        outs, As, [qs.absmax for qs in quant_states], codes, [qs.blocksize for qs in quant_states]
+    )
+    lib.cdequantize_blockwise_cpu_batched(descs, ct.c_longlong(len(As)))
+    return outs
+
+
+class QuantErrorConfig(ct.Structure):
+    """Mirrors `quant_error_config` in csrc/cpu_ops.h."""
+
+    _fields_ = [
+        ("quant_type", ct.c_int),
+        ("blocksize", ct.c_longlong),
+        ("code", ct.c_void_p),
+        ("nested_code", ct.c_void_p),
+        ("nested_blocksize", ct.c_longlong),
+        ("saturated", ct.c_void_p),
+        ("out", ct.c_void_p),
+        ("absmax", ct.c_void_p),
+        ("sum_squared_error", ct.c_double),
+        ("max_abs_error", ct.c_float),
+        ("offset", ct.c_float),
+    ]
 
-    Quantizes tensor A by dividing it into blocks which are independently quantized to FP4.
+
+def quantization_error_stats(A: Tensor, configs: List[dict], return_quantized=False) -> List[dict]:
+    """
+    Measures the error of several candidate quantization formats for a CPU tensor in one pass.
+
+    Every chunk of A is read once and quantized and dequantized under all configs while it is
+    in the cache; nothing is written unless `return_quantized` is set. Nested configs need the
+    absmax values of the whole tensor first, which costs one more read of A.
 
     Parameters
     ----------
     A : torch.Tensor
-        The input tensor.
-    absmax : torch.Tensor
-        The absmax values.
-    out : torch.Tensor
-        The output tensor.
-    blocksize : int
-        The blocksize used in quantization.
-    quant_type : str
-        The 4-bit quantization data type {fp4, nf4}
+        The input tensor (float32, float16 or bfloat16).
+    configs : List[dict]
+        The candidates, each with a "quant_type" ("8bit", "fp4" or "nf4"), a "blocksize"
+        (4096 for "8bit" and 64 otherwise by default), "nested" (False by default, like
+        compress_statistics of `quantize_4bit`) and, for "8bit", an optional "code"
+        (the dynamic map by default).
+    return_quantized : bool
+        Whether to also return the quantized tensors.
 
     Returns
     -------
-    torch.Tensor:
-        Tensor with packed 4-bit values.
-    tuple(torch.Tensor, torch.Size, torch.dtype, int):
-        The quantization state to undo the quantization.
+    List[dict]:
+        Per config the "mse", the "max_abs_error", the "sqnr" in dB and the number of values
+        per block quantized to the largest magnitude of the code ("saturated", int32). With
+        return_quantized, "quantized" holds the tensor and QuantState that `quantize_blockwise`
+        or `quantize_4bit` would return.
     """
-    if A.device.type != "cuda":
-        raise NotImplementedError(f"Device type not supported for FP4 quantization: {A.device.type}")
-    if quant_type not in ["fp4", "nf4"]:
-        raise NotImplementedError(f"4-bit quantization data type {quant_type} is not implemented.")
-
+    if A.device.type != "cpu":
+        raise NotImplementedError("quantization_error_stats only supports CPU tensors")
+    if A.dtype not in dtype2scalar_type:
+        raise ValueError(f"Blockwise quantization only supports 16/32-bit floats, but got {A.dtype}")
+    A = A.contiguous()
     n = A.numel()
-    input_shape = A.shape
+    if "dynamic" not in name2qmap:
+        name2qmap["dynamic"] = create_dynamic_map()
+
+    descs = (QuantErrorConfig * len(configs))()
+    buffers = []
+    for desc, config in zip(descs, configs):
+        quant_type = config.get("quant_type", "8bit")
+        if quant_type not in ("8bit", "fp4", "nf4"):
+            raise ValueError(f"Unsupported quant_type {quant_type}, expected '8bit', 'fp4' or 'nf4'")
+        blocksize = config.get("blocksize", 4096 if quant_type == "8bit" else 64)
+        if quant_type != "8bit" and blocksize % 2 != 0:
+            raise ValueError(f"4-bit blocksizes have to be even, got {blocksize}")
+        num_blocks = (n + blocksize - 1) // blocksize
+        code = config.get("code", name2qmap["dynamic"]).float().cpu().clone() if quant_type == "8bit" else None
+        nested_code = name2qmap["dynamic"].clone() if config.get("nested", False) else None
+        saturated = torch.empty((num_blocks,), dtype=torch.int32)
+        out = absmax = None
+        if return_quantized:
+            out = (
+                torch.empty_like(A, dtype=torch.uint8)
+                if quant_type == "8bit"
+                else torch.empty(((n + 1) // 2, 1), dtype=torch.uint8)
+            )
+            absmax = torch.empty((num_blocks,), dtype=torch.float32)
+        buffers.append((quant_type, blocksize, code, nested_code, saturated, out, absmax))
+
+        desc.quant_type = 0 if quant_type == "8bit" else str2quant_type_cpu[quant_type]
+        desc.blocksize = blocksize
+        # quantize_blockwise nests with its own blocksize, quantize_4bit with 256
+        desc.nested_blocksize = blocksize if quant_type == "8bit" else 256
+        desc.code = get_ptr(code)
+        desc.nested_code = get_ptr(nested_code)
+        desc.saturated = get_ptr(saturated)
+        desc.out = get_ptr(out)
+        desc.absmax = get_ptr(absmax)
+
+    sum_squared = ct.c_double()
+    lib.cquantization_error_cpu(
+        ct.c_int(dtype2scalar_type[A.dtype]),
+        get_ptr(A),
+        ct.c_longlong(n),
+        descs,
+        ct.c_longlong(len(configs)),
+        ct.byref(sum_squared),
+    )
 
-    if absmax is None:
-        blocks = n // blocksize
-        blocks += 1 if n % blocksize > 0 else 0
-        absmax = torch.zeros((blocks,), device=A.device, dtype=torch.float32)
+    results = []
+    for desc, (quant_type, blocksize, code, nested_code, saturated, out, absmax) in zip(descs, buffers):
+        sse = desc.sum_squared_error
+        result = {
+            "mse": sse / max(n, 1),
+            "max_abs_error": desc.max_abs_error,
+            "sqnr": 10 * math.log10(sum_squared.value / sse) if sse > 0 else math.inf,
+            "saturated": saturated,
+        }
+        if return_quantized:
+            state2 = offset = None
+            if nested_code is not None:
+                offset = torch.tensor(desc.offset)
+                absmax, state2 = quantize_blockwise(absmax - offset, blocksize=desc.nested_blocksize)
+            if quant_type == "8bit":
+                state = QuantState(
+                    absmax=absmax, code=code, blocksize=blocksize, dtype=A.dtype, offset=offset, state2=state2
+                )
+            else:
+                state = QuantState(
+                    absmax=absmax,
+                    shape=A.shape,
+                    dtype=A.dtype,
+                    blocksize=blocksize,
+                    code=get_4bit_type(quant_type, device=A.device),
+                    quant_type=quant_type,
+                    offset=offset,
+                    state2=state2,
+                )
+            result["quantized"] = (out, state)
+        results.append(result)
+    return results
 
-    if out is None:
-        mod = dtype2bytes[quant_storage] * 2
-        out = torch.zeros(((n + 1) // mod, 1), dtype=quant_storage, device=A.device)
 
-    assert blocksize in [4096, 2048, 1024, 512, 256, 128, 64]
+CpuJobCallback = ct.CFUNCTYPE(None, ct.c_void_p)
 
-    prev_device = pre_call(A.device)
-    is_on_gpu([A, out, absmax])
+# Done callbacks of all jobs go through one thunk that lives as long as the module, so
+# that native code never calls into a freed thunk. The user data of the native callback
+# is a key of _job_callbacks, which maps it to a weak reference to the job and the
+# function to call; the weak reference keeps pending callbacks from keeping jobs alive.
+_job_callbacks: Dict[int, Tuple[Any, Any]] = {}
+_job_callback_keys = itertools.count(1)
 
-    if A.dtype == torch.float32:
-        if quant_type == "fp4":
-            lib.cquantize_blockwise_fp32_fp4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int32(blocksize),
-                ct.c_int(n),
-            )
-        else:
-            lib.cquantize_blockwise_fp32_nf4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int32(blocksize),
-                ct.c_int(n),
-            )
-    elif A.dtype == torch.float16:
-        if quant_type == "fp4":
-            lib.cquantize_blockwise_fp16_fp4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int32(blocksize),
-                ct.c_int(n),
-            )
-        else:
-            lib.cquantize_blockwise_fp16_nf4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int32(blocksize),
-                ct.c_int(n),
-            )
-    elif A.dtype == torch.bfloat16:
-        if quant_type == "fp4":
-            lib.cquantize_blockwise_bf16_fp4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int32(blocksize),
-                ct.c_int(n),
-            )
-        else:
-            lib.cquantize_blockwise_bf16_nf4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int32(blocksize),
-                ct.c_int(n),
-            )
-    else:
-        raise ValueError(f"Blockwise quantization only supports 16/32-bit floats, but got {A.dtype}")
-    post_call(A.device)
 
-    code = get_4bit_type(quant_type, device=A.device)
+def _run_job_callback(key):
+    entry = _job_callbacks.pop(key, None)
+    if entry is None:
+        return
+    job_ref, fn = entry
+    job = job_ref()
+    if job is not None:
+        fn(job)
 
-    if compress_statistics:
-        offset = absmax.mean()
-        absmax -= offset
+
+_job_callback_thunk = CpuJobCallback(_run_job_callback)
+
+
+class CpuJob:
+    """
+    Handle of an asynchronous CPU op, returned by the `submit_*` functions.
+
+    The op runs on the native thread pool without holding the GIL. The handle keeps the
+    tensors of the op alive until it completes; dropping the handle waits for the op.
+    """
+
+    def __init__(self, handle: int, tensors, result=None):
+        self._handle = ct.c_void_p(handle)
+        self._tensors = tensors
+        self._result = result
+        self._callback_key = None
+
+    def done(self) -> bool:
+        """Returns whether the op has completed, without blocking."""
+        return lib.cjob_poll(self._handle)
+
+    def wait(self, timeout: Optional[float] = None) -> bool:
+        """Blocks until the op has completed or `timeout` seconds have passed. Returns whether it completed."""
+        if timeout is None:
+            lib.cjob_wait(self._handle)
+            return True
+        return lib.cjob_wait_for(self._handle, ct.c_longlong(int(timeout * 1000)))
+
+    def result(self):
+        """Waits for the op and returns its outputs (`None` for in-place ops like optimizer updates)."""
+        self.wait()
+        return self._result
+
+    def add_done_callback(self, fn):
+        """
+        Calls `fn(job)` once the op has completed, on the native thread that completed it.
+
+        If the op has already completed, `fn` is called right away on the calling thread.
+        Only one callback can be registered per job. Waiting for the job, and dropping the
+        handle, return once `fn` has returned; `fn` itself may wait for the job.
+        """
+        if self._callback_key is not None:
+            raise RuntimeError("A callback is already registered for this job")
+        self._callback_key = next(_job_callback_keys)
+        _job_callbacks[self._callback_key] = (weakref.ref(self), fn)
+        lib.cjob_set_callback(self._handle, _job_callback_thunk, ct.c_void_p(self._callback_key))
+
+    def __del__(self):
+        if getattr(self, "_handle", None) is not None and lib is not None:
+            # returns once a registered callback has returned as well
+            lib.cjob_wait(self._handle)
+            lib.cjob_release(self._handle)
+            self._handle = None
+        if getattr(self, "_callback_key", None) is not None:
+            _job_callbacks.pop(self._callback_key, None)
+
+
+def submit_quantize_blockwise_batched(
+    As: List[Tensor],
+    code: Optional[torch.Tensor] = None,
+    blocksize: Union[int, List[int]] = 4096,
+) -> CpuJob:
+    """
+    Asynchronous version of `quantize_blockwise_batched`.
+
+    Returns immediately. `job.result()` returns the list of `(quantized tensor, QuantState)` pairs.
+    The inputs must not be modified until the job is done.
+    """
+    if code is None:
+        if "dynamic" not in name2qmap:
+            name2qmap["dynamic"] = create_dynamic_map()
+        code = name2qmap["dynamic"]
+    code = code.cpu()
+    blocksizes = _batched_blocksizes(blocksize, len(As))
+
+    outs = [torch.empty_like(A, dtype=torch.uint8) for A in As]
+    absmaxs = [torch.empty(((A.numel() + bs - 1) // bs,), dtype=torch.float32) for A, bs in zip(As, blocksizes)]
+    descs = _make_tensor_descs(As, outs, absmaxs, [code] * len(As), blocksizes)
+    handle = lib.csubmit_quantize_blockwise_cpu_batched(descs, ct.c_longlong(len(As)))
+
+    result = [
+        (out, QuantState(absmax=absmax, code=code, blocksize=bs, dtype=A.dtype))
+        for A, out, absmax, bs in zip(As, outs, absmaxs, blocksizes)
+    ]
+    return CpuJob(handle, (As, code), result)
+
+
+def submit_dequantize_blockwise_batched(As: List[Tensor], quant_states: List[QuantState]) -> CpuJob:
+    """
+    Asynchronous version of `dequantize_blockwise_batched`. `job.result()` returns the dequantized tensors.
+    """
+    _check_batched_quant_states(As, quant_states)
+    outs = [torch.empty(A.shape, dtype=qs.dtype) for A, qs in zip(As, quant_states)]
+    codes = [qs.code.cpu() for qs in quant_states]
+    absmaxs = [qs.absmax for qs in quant_states]
+    descs = _make_tensor_descs(outs, As, absmaxs, codes, [qs.blocksize for qs in quant_states])
+    handle = lib.csubmit_dequantize_blockwise_cpu_batched(descs, ct.c_longlong(len(As)))
+    return CpuJob(handle, (As, codes, absmaxs), outs)
+
+
+def submit_optimizer_update_32bit(
+    optimizer_name: str,
+    g: Tensor,
+    p: Tensor,
+    state1: Tensor,
+    beta1: float,
+    eps: float,
+    step: int,
+    lr: float,
+    state2: Optional[torch.Tensor] = None,
+    beta2: float = 0.0,
+    weight_decay: float = 0.0,
+    gnorm_scale: float = 1.0,
+    unorm_vec: Optional[torch.Tensor] = None,
+    max_unorm: float = 0.0,
+    skip_zeros=False,
+    rounding_seed: Optional[int] = None,
+) -> CpuJob:
+    """
+    Asynchronous version of `optimizer_update_32bit` for CPU tensors.
+
+    `p`, `state1` and `state2` are updated in place once the job is done.
+    """
+    args = _optimizer_32bit_cpu_args(
+        optimizer_name,
+        g,
+        p,
+        state1,
+        state2,
+        unorm_vec,
+        max_unorm,
+        -1.0,
+        beta1,
+        beta2,
+        eps,
+        weight_decay,
+        step,
+        lr,
+        gnorm_scale,
+        skip_zeros,
+        rounding_seed,
+    )
+    handle = lib.csubmit_optimizer_32bit_cpu(*args)
+    return CpuJob(handle, (g, p, state1, state2, unorm_vec))
+
+
+class CpuAllReduce:
+    """
+    Sums gradients over the processes of a data-parallel CPU job on one host.
+
+    Every process (rank) creates a `CpuAllReduce` with the same `name` and parameters,
+    which connects it to the others through a POSIX shared memory segment. `all_reduce`
+    sends the gradients as 8-bit blockwise chunks in the format of `quantize_blockwise`,
+    which cuts the memory traffic of the reduction by about 4x at the cost of
+    quantization noise; all ranks end up with the same values.
+
+    Parameters
+    ----------
+    name : str
+        The name of the shared memory segment, unique per job, e.g. "/bnb-job-1234".
+    rank : int
+        The rank of this process, in [0, world_size).
+    world_size : int
+        The number of processes.
+    chunk_size : int
+        The number of values reduced at once; each rank reduces chunk_size / world_size of them.
+    blocksize : int
+        The number of values that share an absmax.
+    code : torch.Tensor
+        The quantization map, the dynamic map if None. Has to be the same on all ranks.
+    timeout : float
+        Seconds to wait for the other ranks before giving up.
+    """
+
+    def __init__(self, name, rank, world_size, chunk_size=1 << 20, blocksize=4096, code=None, timeout=60.0):
+        self.rank = rank
+        self.world_size = world_size
+        self.chunk_size = chunk_size
+        self.blocksize = blocksize
+        self.code = (code if code is not None else create_dynamic_map()).float().cpu().contiguous()
+        payload_bytes = lib.cquantized_all_reduce_payload_bytes(
+            ct.c_int(world_size),
+            ct.c_longlong(blocksize),
+            ct.c_longlong(chunk_size),
+        )
+        # a ring of 4 chunks lets ranks run up to two chunks ahead of the others
+        handle = lib.cshm_transport_create(
+            name.encode(),
+            ct.c_int(rank),
+            ct.c_int(world_size),
+            ct.c_longlong(payload_bytes),
+            ct.c_int(4),
+            ct.c_longlong(int(timeout * 1000)),
+        )
+        if not handle:
+            raise RuntimeError(f"Could not connect rank {rank} to the shared memory segment {name}")
+        self._handle = ct.c_void_p(handle)
+
+    def all_reduce(self, A: Tensor, average: bool = False) -> Tensor:
+        """Replaces the float32 tensor `A` by its sum (or mean) over all ranks, in place."""
+        if A.device.type != "cpu" or A.dtype != torch.float32 or not A.is_contiguous():
+            raise ValueError("Only contiguous float32 CPU tensors can be reduced")
+        ok = lib.cquantized_all_reduce_cpu(
+            self._handle,
+            get_ptr(self.code),
+            get_ptr(A),
+            ct.c_longlong(A.numel()),
+            ct.c_longlong(self.blocksize),
+            ct.c_longlong(self.chunk_size),
+            ct.c_bool(average),
+        )
+        if not ok:
+            raise RuntimeError(f"All-reduce failed on rank {self.rank}, a peer did not respond")
+        return A
+
+    def __del__(self):
+        if getattr(self, "_handle", None) is not None and lib is not None:
+            lib.ctransport_destroy(self._handle)
+            self._handle = None
+
+
+class ErrorFeedbackCompressor:
+    """
+    Compresses successive CPU gradients of one parameter for communication, with error feedback.
+
+    `compress` adds the residual left by the previous step to the gradient, quantizes the sum
+    blockwise like `quantize_blockwise` ("8bit") or `quantize_4bit` ("fp4", "nf4"), and keeps
+    what the quantization lost as the new residual, all in one pass over the gradient. The
+    payload is decoded with `dequantize_blockwise` or `dequantize_4bit`. Since every error is
+    sent on with the next gradient, the sum of the decoded payloads follows the sum of the
+    gradients, which avoids most of the convergence cost of plain compression.
+
+    Parameters
+    ----------
+    shape : torch.Size
+        The shape of the gradients.
+    quant_type : str
+        "8bit", "fp4" or "nf4".
+    blocksize : int
+        The number of values that share an absmax.
+    residual_dtype : torch.dtype
+        torch.float32, or torch.bfloat16 to halve the memory of the residual.
+    code : torch.Tensor
+        The quantization map for "8bit", the dynamic map if None.
+    """
+
+    def __init__(self, shape, quant_type="8bit", blocksize=4096, residual_dtype=torch.float32, code=None):
+        if quant_type not in ("8bit", "fp4", "nf4"):
+            raise ValueError(f"Unsupported quant_type {quant_type}, expected '8bit', 'fp4' or 'nf4'")
+        if residual_dtype not in (torch.float32, torch.bfloat16):
+            raise ValueError(f"Unsupported residual dtype {residual_dtype}")
+        if quant_type != "8bit" and blocksize % 2 != 0:
+            raise ValueError(f"The blocksize of 4-bit compression has to be even, got {blocksize}")
+        self.shape = torch.Size(shape)
+        self.quant_type = quant_type
+        self.blocksize = blocksize
+        if quant_type == "8bit":
+            self.code = (code if code is not None else create_dynamic_map()).float().cpu().contiguous()
+        else:
+            self.code = get_4bit_type(quant_type, device="cpu")
+        self.residual = torch.zeros(self.shape, dtype=residual_dtype)
+
+    def reset(self):
+        """Forgets the residual, e.g. after the gradients were sent uncompressed."""
+        self.residual.zero_()
+
+    def compress(self, grad: Tensor) -> Tuple[Tensor, QuantState]:
+        """Returns the quantized grad + residual and its state, and updates the residual."""
+        if grad.shape != self.shape or grad.device.type != "cpu":
+            raise ValueError(f"Expected a CPU gradient of shape {tuple(self.shape)}, got {tuple(grad.shape)}")
+        if grad.dtype not in dtype2scalar_type:
+            raise ValueError(f"Gradients of dtype {grad.dtype} are not supported")
+        grad = grad.contiguous()
+        n = grad.numel()
+        absmax = torch.empty((n + self.blocksize - 1) // self.blocksize, dtype=torch.float32)
+        if self.quant_type == "8bit":
+            out = torch.empty(self.shape, dtype=torch.uint8)
+            quant_type = 0
+        else:
+            out = torch.empty(((n + 1) // 2, 1), dtype=torch.uint8)
+            quant_type = str2quant_type_cpu[self.quant_type]
+        lib.cerror_feedback_compress_cpu(
+            ct.c_int(quant_type),
+            ct.c_int(dtype2scalar_type[grad.dtype]),
+            get_ptr(grad),
+            ct.c_int(dtype2scalar_type[self.residual.dtype]),
+            get_ptr(self.residual),
+            get_ptr(self.code) if self.quant_type == "8bit" else None,
+            get_ptr(absmax),
+            get_ptr(out),
+            ct.c_longlong(self.blocksize),
+            ct.c_longlong(n),
+        )
+        if self.quant_type == "8bit":
+            state = QuantState(absmax=absmax, code=self.code, blocksize=self.blocksize, dtype=grad.dtype)
+        else:
+            state = QuantState(
+                absmax=absmax,
+                shape=self.shape,
+                dtype=grad.dtype,
+                blocksize=self.blocksize,
+                code=self.code,
+                quant_type=self.quant_type,
+            )
+        return out, state
+
+
+def get_cpu_isa() -> str:
+    """
+    Returns the instruction set of the CPU kernels selected for this host.
+
+    One of `scalar`, `sse42`, `avx2` or `avx512`. The selection
+    happens when the library is loaded and can be capped with the `BNB_CPU_ISA`
+    environment variable. Otherwise the autotuner may pick a lower variant that is
+    faster on this host, see `autotune_cpu()`.
+    """
+    return lib.cget_cpu_isa().decode()
+
+
+def autotune_cpu(force: bool = False) -> Dict[str, Any]:
+    """
+    Tunes the parameters of the CPU kernels for this host and returns them, see `get_cpu_tuning()`.
+
+    A few candidates of each parameter are timed on typical shapes, which takes a few seconds. The
+    winners are applied to this process and stored in a cache file, one entry per CPU model, library
+    version and number of threads, from which later processes load them on the first use of the
+    kernels. Without `force`, an existing entry is applied instead of tuning again. Set
+    `BNB_CPU_AUTOTUNE=1` to tune automatically in processes that find no entry, and
+    `BNB_CPU_AUTOTUNE_CACHE` to change the path of the file, by default
+    `~/.cache/bitsandbytes/cpu_autotune.txt`. Must not be called while CPU kernels are running.
+    """
+    if not lib.cautotune_cpu(ct.c_bool(force)):
+        raise RuntimeError("cannot write the CPU autotuning cache, the parameters only apply to this process")
+    return get_cpu_tuning()
+
+
+def get_cpu_tuning() -> Dict[str, Any]:
+    """
+    Returns the parameters of the CPU kernels in effect.
+
+    `isa` is the instruction set of the kernels (see `get_cpu_isa()`), `task_values` the number of
+    values a thread processes at once in blockwise quantization and dequantization, and `gemm_rows`
+    and `gemm_panels` the rows of the activations and panels of 16 output features that
+    `gemm_4bit_prepacked()` multiplies in one task.
+    """
+    values = (ct.c_longlong * 4)()
+    lib.cget_cpu_tuning(values)
+    return {
+        "isa": get_cpu_isa(),
+        "task_values": values[1],
+        "gemm_rows": values[2],
+        "gemm_panels": values[3],
+    }
+
+
+def set_cpu_num_threads(num_threads: Optional[int] = None):
+    """
+    Sets the number of threads used by the native CPU kernels, including the calling thread.
+
+    By default this is the number of CPUs available to the process, taking the affinity mask and the
+    cgroup CPU quota into account, or `BNB_NUM_THREADS` if set. Passing `None` restores the default.
+    Kernels and jobs that are already running finish with the previous threads.
+    """
+    lib.cset_num_threads(ct.c_int(num_threads or 0))
+
+
+def get_cpu_num_threads() -> int:
+    return lib.cget_num_threads()
+
+
+def set_cpu_thread_affinity(enable: bool):
+    """
+    Pins the native CPU threads to one core each, filling one NUMA node before moving to the next.
+    """
+    lib.cset_thread_affinity(ct.c_bool(enable))
+
+
+def get_cpu_thread_affinity() -> bool:
+    return lib.cget_thread_affinity()
+
+
+def set_cpu_numa_local(enable: bool):
+    """
+    Assigns each native CPU thread the same contiguous part of every tensor on each call.
+
+    Together with `set_cpu_thread_affinity(True)` a buffer is processed by the threads that first
+    touched it, i.e. from memory on their own NUMA node.
+    """
+    lib.cset_numa_local(ct.c_bool(enable))
+
+
+def get_cpu_numa_local() -> bool:
+    return lib.cget_numa_local()
+
+
+def set_cpu_deterministic(enable: bool):
+    """
+    Makes the results of the native CPU kernels independent of the number of threads.
+
+    Reductions are always split into parts of a fixed size and added up in a fixed order;
+    this only affects the ones that otherwise split their input by the number of threads,
+    such as `histogram_scatter_add_2d` with few bins. Also enabled by `BNB_DETERMINISTIC=1`.
+    Results can still differ between instruction sets, see `get_cpu_isa`.
+    """
+    lib.cset_deterministic(ct.c_bool(enable))
+
+
+def get_cpu_deterministic() -> bool:
+    return lib.cget_deterministic()
+
+
+def set_cpu_weight_cache(max_bytes: int, admit_after: int = 2):
+    """
+    Sets the memory budget of the cache of dequantized CPU weights, 0 to disable it.
+
+    `dequantize_4bit(..., cache=True)`, as used by the CPU forward of `Linear4bit` for weights
+    that the 4-bit GEMM does not take, keeps dequantized weights in this cache and returns
+    them from there instead of dequantizing them again. For the other weights it keeps their
+    `prepack_4bit()` panels, 0.5 bytes per weight plus the absmax values in fp32, which are
+    otherwise packed again on every call. Weights are evicted least recently used first, and
+    only admitted after `admit_after` lookups so that layers that run rarely do not push out
+    the hot ones. The default budget is taken from `BNB_WEIGHT_CACHE_BYTES`, or 0.
+    """
+    lib.cset_weight_cache(ct.c_longlong(max_bytes), ct.c_int(admit_after))
+
+
+def clear_cpu_weight_cache():
+    """Drops all weights from the cache of dequantized CPU weights and resets its statistics."""
+    lib.cweight_cache_clear()
+
+
+def get_cpu_weight_cache_stats() -> Dict[str, int]:
+    stats = (ct.c_longlong * 5)()
+    lib.cget_weight_cache_stats(stats)
+    return dict(zip(("budget_bytes", "used_bytes", "entries", "hits", "misses"), stats))
+
+
+class _WeightCachePin:
+    """Keeps a cache entry alive for the tensor that shares its memory."""
+
+    def __init__(self, handle):
+        self.handle = ct.c_void_p(handle)
+
+    def __del__(self):
+        if lib is not None:
+            lib.cweight_cache_release(self.handle)
+
+
+# quantized buffers in the weight cache, dropped from it when their tensor is freed
+_weight_cache_owners: Dict[int, weakref.finalize] = {}
+
+
+def _weight_4bit_tag(A: Tensor, quant_state: QuantState) -> tuple:
+    # changes when the packed weight or its stored (and nested) absmax values are replaced
+    # or changed in place, which bumps their versions
+    tensors = [A, quant_state.absmax] + ([quant_state.state2.absmax] if quant_state.nested else [])
+    return tuple((t.data_ptr(), t._version) for t in tensors)
+
+
+def _dequantize_4bit_cached(A: Tensor, absmax: Tensor, quant_state: QuantState) -> Optional[Tensor]:
+    ptr = A.data_ptr()
+    dtype = quant_state.dtype
+    n = math.prod(quant_state.shape)
+    tag = hash((_weight_4bit_tag(A, quant_state), str(dtype), quant_state.quant_type, quant_state.blocksize, n))
+    out = ct.c_void_p()
+    handle = lib.cweight_cache_dequantize_4bit_cpu(
+        ct.c_void_p(ptr),
+        ct.c_longlong(tag),
+        ct.c_int(str2quant_type_cpu[quant_state.quant_type]),
+        ct.c_int(dtype2scalar_type[dtype]),
+        get_ptr(A),
+        get_ptr(absmax),
+        ct.c_longlong(quant_state.blocksize),
+        ct.c_longlong(n),
+        ct.byref(out),
+    )
+    if not handle:
+        return None
+    _track_cached_weight(A)
+
+    buffer = (ct.c_ubyte * (n * torch.finfo(dtype).bits // 8)).from_address(out.value)
+    # the tensor keeps the buffer, and with it the entry, alive
+    buffer._pin = _WeightCachePin(handle)
+    return torch.frombuffer(buffer, dtype=dtype).view(quant_state.shape)
+
+
+def _track_cached_weight(A: Tensor):
+    # drops the entry of A from the cache once the tensor that owns its memory is freed
+    ptr = A.data_ptr()
+    owner = A._base if A._base is not None else A
+    finalizer = _weight_cache_owners.get(ptr)
+    if finalizer is None or not finalizer.alive or finalizer.peek()[0] is not owner:
+        _weight_cache_owners[ptr] = weakref.finalize(owner, _forget_cached_weight, ptr)
+
+
+def _forget_cached_weight(ptr):
+    _weight_cache_owners.pop(ptr, None)
+    if lib is not None:
+        lib.cweight_cache_invalidate(ct.c_void_p(ptr))
+
+
+def get_4bit_type(typename, device=None, blocksize=64):
+    if device is None:
+        device = "cuda"
+    data = None
+    if typename == "nf4":
+        """ Implements the NF4 data type.
+
+            Constructs a quantization data type where each bin has equal area under a standard normal distribution N(0, 1) that
+            is normalized into the range [-1, 1].
+
+            For more information read the paper: QLoRA: Efficient Finetuning of Quantized LLMs (https://arxiv.org/abs/2305.14314)
+
+            Implementation of the NF4 data type in bitsandbytes can be found in the `create_normal_map` function in
+            the `functional.py` file: https://github.com/TimDettmers/bitsandbytes/blob/main/bitsandbytes/functional.py#L236.
+        """
+        data = [
+            -1.0,
+            -0.6961928009986877,
+            -0.5250730514526367,
+            -0.39491748809814453,
+            -0.28444138169288635,
+            -0.18477343022823334,
+            -0.09105003625154495,
+            0.0,
+            0.07958029955625534,
+            0.16093020141124725,
+            0.24611230194568634,
+            0.33791524171829224,
+            0.44070982933044434,
+            0.5626170039176941,
+            0.7229568362236023,
+            1.0,
+        ]
+    elif typename == "fp4":
+        # 0b000 = 0
+        # 0b001 = 0.0625
+        # 0b010 = 8
+        # 0b011 = 12
+        # 0b100 = 4
+        # 0b101 = 6
+        # 0b110 = 2
+        # 0b111 = 3
+        # can also be created with bnb.functional.create_fp8_map(signed=True, exponent_bits=2, precision_bits=1, total_bits=4)
+        data = [0, 0.0625, 8.0, 12.0, 4.0, 6.0, 2.0, 3.0, -0, -0.0625, -8.0, -12.0, -4.0, -6.0, -2.0, -3.0]
+    elif typename == "int4":
+        data = [7, 6, 5, 4, 3, 2, 1, 0, -0, -1, -2, -3, -4, -5, -6, -7]
+    elif typename == "af4":
+        # Taken from: NF4 Isn't Information Theoretically Optimal (and that's Good)
+        # https://arxiv.org/abs/2306.06965
+        if blocksize == 64:
+            data = [
+                -1.0,
+                -0.69441008,
+                -0.51243739,
+                -0.3736951,
+                -0.25607552,
+                -0.14982478,
+                -0.04934812,
+                0.0,
+                0.04273164,
+                0.12934483,
+                0.21961274,
+                0.31675666,
+                0.42563882,
+                0.55496234,
+                0.72424863,
+                1.0,
+            ][::-1]
+        else:
+            raise NotImplementedError("4-bit AbnormalFloats currently only support blocksize 64.")
+
+    if data is None:
+        raise NotImplementedError(f"Typename {typename} not supported")
+
+    data = torch.tensor(data, device=device)
+    data.div_(data.abs().max())
+
+    assert data.numel() == 16
+
+    return data
+
+
+def quantize_fp4(
+    A: Tensor,
+    absmax: Optional[torch.Tensor] = None,
+    out: Optional[torch.Tensor] = None,
+    blocksize=64,
+    compress_statistics=False,
+    quant_storage=torch.uint8,
+):
+    return quantize_4bit(A, absmax, out, blocksize, compress_statistics, "fp4", quant_storage)
+
+
+def quantize_nf4(
+    A: Tensor,
+    absmax: Optional[torch.Tensor] = None,
+    out: Optional[torch.Tensor] = None,
+    blocksize=64,
+    compress_statistics=False,
+    quant_storage=torch.uint8,
+):
+    return quantize_4bit(A, absmax, out, blocksize, compress_statistics, "nf4", quant_storage)
+
+
+def quantize_4bit(
+    A: Tensor,
+    absmax: Optional[torch.Tensor] = None,
+    out: Optional[torch.Tensor] = None,
+    blocksize=64,
+    compress_statistics=False,
+    quant_type="fp4",
+    quant_storage=torch.uint8,
+) -> Tuple[Tensor, QuantState]:
+    """
+    Quantize tensor A in blocks of 4-bit values.
+
+    Quantizes tensor A by dividing it into blocks which are independently quantized to FP4.
+
+    Parameters
+    ----------
+    A : torch.Tensor
+        The input tensor.
+    absmax : torch.Tensor
+        The absmax values.
+    out : torch.Tensor
+        The output tensor.
+    blocksize : int
+        The blocksize used in quantization.
+    quant_type : str
+        The 4-bit quantization data type {fp4, nf4}
+
+    Returns
+    -------
+    torch.Tensor:
+        Tensor with packed 4-bit values.
+    tuple(torch.Tensor, torch.Size, torch.dtype, int):
+        The quantization state to undo the quantization.
+    """
+    if A.device.type not in ("cuda", "cpu"):
+        raise NotImplementedError(f"Device type not supported for FP4 quantization: {A.device.type}")
+    if quant_type not in ["fp4", "nf4"]:
+        raise NotImplementedError(f"4-bit quantization data type {quant_type} is not implemented.")
+
+    n = A.numel()
+    input_shape = A.shape
+
+    if absmax is None:
+        blocks = n // blocksize
+        blocks += 1 if n % blocksize > 0 else 0
+        absmax = torch.zeros((blocks,), device=A.device, dtype=torch.float32)
+
+    if out is None:
+        mod = dtype2bytes[quant_storage] * 2
+        out = torch.zeros(((n + 1) // mod, 1), dtype=quant_storage, device=A.device)
+
+    assert blocksize in [4096, 2048, 1024, 512, 256, 128, 64]
+
+    if A.device.type == "cpu":
+        if A.dtype not in dtype2scalar_type:
+            raise ValueError(f"Blockwise quantization only supports 16/32-bit floats, but got {A.dtype}")
+        lib.cquantize_4bit_cpu(
+            ct.c_int(str2quant_type_cpu[quant_type]),
+            ct.c_int(dtype2scalar_type[A.dtype]),
+            get_ptr(A),
+            get_ptr(absmax),
+            get_ptr(out),
+            ct.c_longlong(blocksize),
+            ct.c_longlong(n),
+        )
+    else:
+        prev_device = pre_call(A.device)
+        is_on_gpu([A, out, absmax])
+
+        if A.dtype == torch.float32:
+            if quant_type == "fp4":
+                lib.cquantize_blockwise_fp32_fp4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int32(blocksize),
+                    ct.c_int(n),
+                )
+            else:
+                lib.cquantize_blockwise_fp32_nf4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int32(blocksize),
+                    ct.c_int(n),
+                )
+        elif A.dtype == torch.float16:
+            if quant_type == "fp4":
+                lib.cquantize_blockwise_fp16_fp4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int32(blocksize),
+                    ct.c_int(n),
+                )
+            else:
+                lib.cquantize_blockwise_fp16_nf4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int32(blocksize),
+                    ct.c_int(n),
+                )
+        elif A.dtype == torch.bfloat16:
+            if quant_type == "fp4":
+                lib.cquantize_blockwise_bf16_fp4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int32(blocksize),
+                    ct.c_int(n),
+                )
+            else:
+                lib.cquantize_blockwise_bf16_nf4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int32(blocksize),
+                    ct.c_int(n),
+                )
+        else:
+            raise ValueError(f"Blockwise quantization only supports 16/32-bit floats, but got {A.dtype}")
+        post_call(A.device)
+
+    code = get_4bit_type(quant_type, device=A.device)
+
+    if compress_statistics:
+        offset = absmax.mean()
+        absmax -= offset
         qabsmax, state2 = quantize_blockwise(absmax, blocksize=256)
         del absmax
         state = QuantState(
-            absmax=qabsmax,
-            shape=input_shape,
-            dtype=A.dtype,
+            absmax=qabsmax,
+            shape=input_shape,
+            dtype=A.dtype,
+            blocksize=blocksize,
+            code=code,
+            quant_type=quant_type,
+            offset=offset,
+            state2=state2,
+        )
+    else:
+        state = QuantState(
+            absmax=absmax,
+            shape=input_shape,
+            dtype=A.dtype,
+            blocksize=blocksize,
+            code=code,
+            quant_type=quant_type,
+        )
+
+    return out, state
+
+
+def dequantize_fp4(
+    A: Tensor,
+    quant_state: Optional[QuantState] = None,
+    absmax: Optional[torch.Tensor] = None,
+    out: Optional[torch.Tensor] = None,
+    blocksize: int = 64,
+) -> Tensor:
+    return dequantize_4bit(A, quant_state, absmax, out, blocksize, "fp4")
+
+
+def dequantize_nf4(
+    A: Tensor,
+    quant_state: Optional[QuantState] = None,
+    absmax: Optional[torch.Tensor] = None,
+    out: Optional[torch.Tensor] = None,
+    blocksize: int = 64,
+) -> Tensor:
+    return dequantize_4bit(A, quant_state, absmax, out, blocksize, "nf4")
+
+
+def dequantize_4bit(
+    A: Tensor,
+    quant_state: Optional[QuantState] = None,
+    absmax: Optional[torch.Tensor] = None,
+    out: Optional[torch.Tensor] = None,
+    blocksize: int = 64,
+    quant_type="fp4",
+    cache: bool = False,
+) -> Tensor:
+    """
+    Dequantizes FP4 blockwise quantized values.
+
+    Dequantizes the tensor A with maximum absolute values absmax in blocks of size blocksize.
+
+    Parameters
+    ----------
+    A : torch.Tensor
+        The input tensor (packed 4-bit values).
+    quant_state : QuantState
+        object with quantisation stats, incl. absmax values, original tensor shape and original dtype.
+    absmax : torch.Tensor
+        The absmax values.
+    out : torch.Tensor
+        Dequantized output tensor.
+    blocksize : int
+        The blocksize used in quantization.
+    quant_type : str
+        The 4-bit quantization data type {fp4, nf4}
+    cache : bool
+        Looks the dequantized CPU weight up in the weight cache (see `set_cpu_weight_cache`)
+        and adds it there. The result is then a view of the cache entry, shared with later
+        calls: writing to it changes what they return, so it must not be modified.
+
+
+    Returns
+    -------
+    torch.Tensor:
+        Dequantized tensor.
+    """
+    if blocksize not in [2048, 4096, 1024, 512, 256, 128, 64]:
+        raise ValueError(
+            f"The blockwise of {blocksize} is not supported. Supported values: [2048, 4096, 1024, 512, 256, 128, 64]",
+        )
+    if quant_type not in ["fp4", "nf4"]:
+        raise NotImplementedError(f"4-bit quantization data type {quant_type} is not implemented.")
+
+    if quant_state is None:
+        assert absmax is not None and out is not None
+
+        quant_state = QuantState(
+            absmax=absmax,
+            shape=out.shape,
+            dtype=out.dtype,
+            blocksize=blocksize,
+            quant_type=quant_type,
+        )
+
+    else:
+        absmax = quant_state.absmax
+
+    if quant_state.nested:
+        absmax = dequantize_blockwise(quant_state.absmax, quant_state.state2)
+        absmax += quant_state.offset
+        if absmax.dtype != torch.float32:
+            absmax = absmax.float()
+
+    if cache and out is None and A.device.type == "cpu" and quant_state.dtype in dtype2scalar_type:
+        cached = _dequantize_4bit_cached(A, absmax, quant_state)
+        if cached is not None:
+            return cached.t() if A.shape[0] == 1 else cached
+
+    if out is None:
+        out = torch.empty(quant_state.shape, dtype=quant_state.dtype, device=A.device)
+
+    n = out.numel()
+
+    if A.device.type == "cpu":
+        if out.dtype not in dtype2scalar_type:
+            raise ValueError(f"Blockwise quantization only supports 16/32-bit floats, but got {out.dtype}")
+        lib.cdequantize_4bit_cpu(
+            ct.c_int(str2quant_type_cpu[quant_state.quant_type]),
+            ct.c_int(dtype2scalar_type[out.dtype]),
+            get_ptr(A),
+            get_ptr(absmax),
+            get_ptr(out),
+            ct.c_longlong(quant_state.blocksize),
+            ct.c_longlong(n),
+        )
+    else:
+        device = pre_call(A.device)
+        is_on_gpu([A, absmax, out])
+        if out.dtype == torch.float32:
+            if quant_state.quant_type == "fp4":
+                lib.cdequantize_blockwise_fp32_fp4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int(quant_state.blocksize),
+                    ct.c_int(n),
+                )
+            else:
+                lib.cdequantize_blockwise_fp32_nf4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int(quant_state.blocksize),
+                    ct.c_int(n),
+                )
+        elif out.dtype == torch.float16:
+            if quant_state.quant_type == "fp4":
+                lib.cdequantize_blockwise_fp16_fp4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int(quant_state.blocksize),
+                    ct.c_int(n),
+                )
+            else:
+                lib.cdequantize_blockwise_fp16_nf4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int(quant_state.blocksize),
+                    ct.c_int(n),
+                )
+        elif out.dtype == torch.bfloat16:
+            if quant_state.quant_type == "fp4":
+                lib.cdequantize_blockwise_bf16_fp4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int(quant_state.blocksize),
+                    ct.c_int(n),
+                )
+            else:
+                lib.cdequantize_blockwise_bf16_nf4(
+                    get_ptr(None),
+                    get_ptr(A),
+                    get_ptr(absmax),
+                    get_ptr(out),
+                    ct.c_int(quant_state.blocksize),
+                    ct.c_int(n),
+                )
+        else:
+            raise ValueError(f"Blockwise quantization only supports 16/32-bit floats, but got {A.dtype}")
+        post_call(A.device)
+
+    is_transposed = True if A.shape[0] == 1 else False
+    if is_transposed:
+        return out.t()
+    else:
+        return out
+
+
+def requantize(
+    A: Tensor,
+    quant_state: QuantState,
+    quant_type: str = "nf4",
+    blocksize: int = 64,
+    compress_statistics: bool = False,
+    code: Optional[Tensor] = None,
+) -> Tuple[Tensor, QuantState]:
+    """
+    Converts a quantized CPU tensor to another format or blocksize without dequantizing it as a whole.
+
+    Blocks of A are decoded into a small buffer per thread and encoded into the new format
+    right away, so the conversion needs no memory beyond both quantized tensors, instead of
+    4 more bytes per value for a float32 copy. The result is the same as dequantizing A and
+    quantizing it again.
+
+    Parameters
+    ----------
+    A : torch.Tensor
+        The quantized tensor returned by `quantize_blockwise`, `quantize_fp8_blockwise` or `quantize_4bit`.
+    quant_state : QuantState
+        The quantization state of A, which may be nested.
+    quant_type : str
+        The new format: "fp4" or "nf4"; "dynamic" for the code of `quantize_blockwise`;
+        "fp8_e4m3", "fp8_e5m2" or any other "fp8_e<E>m<7 - E>" for the codes of
+        `quantize_fp8_blockwise`; or "8bit" with the 256 sorted values of code.
+    blocksize : int
+        The new blocksize, even for 4-bit formats.
+    compress_statistics : bool
+        Quantizes the new absmax values again, like `quantize_4bit(compress_statistics=True)`
+        and `quantize_blockwise(nested=True)`.
+    code : torch.Tensor
+        The code of quant_type "8bit".
+
+    Returns
+    -------
+    torch.Tensor:
+        The tensor in the new format, shaped like the result of `quantize_4bit` or `quantize_blockwise`.
+    QuantState:
+        The quantization state to undo the quantization.
+    """
+    if A.device.type != "cpu":
+        raise NotImplementedError(f"Requantization is only supported on the CPU, got {A.device.type}")
+    A = A.contiguous()
+    src_4bit = quant_state.quant_type in str2quant_type_cpu
+    shape = quant_state.shape if src_4bit else A.shape
+    n = prod(shape)
+    src_absmax = _unnested_absmax(quant_state)
+    src_code = None if src_4bit else quant_state.code.cpu().float().contiguous()
+
+    fp8_exponent_bits = 0
+    if quant_type in str2quant_type_cpu:
+        if blocksize % 2 != 0:
+            raise ValueError(f"4-bit formats need an even blocksize, got {blocksize}")
+        code = get_4bit_type(quant_type, device="cpu")
+        out = torch.zeros(((n + 1) // 2, 1), dtype=torch.uint8)
+    else:
+        if quant_type == "dynamic":
+            if "dynamic" not in name2qmap:
+                name2qmap["dynamic"] = create_dynamic_map()
+            code = name2qmap["dynamic"]
+        elif quant_type in {f"fp8_e{e}m{7 - e}" for e in range(1, 7)}:
+            fp8_exponent_bits = int(quant_type[5])
+            code = _fp8_code(fp8_exponent_bits)
+        elif quant_type != "8bit":
+            raise NotImplementedError(f"Requantization to {quant_type} is not implemented.")
+        elif code is None or code.numel() != 256:
+            raise ValueError("quant_type 8bit needs a code of 256 values")
+        code = code.cpu().float().contiguous()
+        out = torch.zeros(shape, dtype=torch.uint8)
+    absmax = torch.zeros(((n + blocksize - 1) // blocksize,), dtype=torch.float32)
+
+    if n > 0:
+        lib.crequantize_cpu(
+            ct.c_int(str2quant_type_cpu.get(quant_state.quant_type, 0)),
+            get_ptr(A),
+            get_ptr(src_absmax),
+            get_ptr(src_code),
+            ct.c_longlong(quant_state.blocksize),
+            ct.c_int(str2quant_type_cpu.get(quant_type, 0)),
+            get_ptr(out),
+            get_ptr(absmax),
+            get_ptr(code),
+            ct.c_longlong(blocksize),
+            ct.c_int(fp8_exponent_bits),
+            ct.c_longlong(n),
+        )
+
+    offset, state2 = None, None
+    if compress_statistics:
+        offset = absmax.mean()
+        absmax -= offset
+        absmax, state2 = quantize_blockwise(absmax, blocksize=256 if quant_type in str2quant_type_cpu else blocksize)
+    if quant_type in str2quant_type_cpu:
+        state = QuantState(
+            absmax=absmax,
+            shape=shape,
+            dtype=quant_state.dtype,
             blocksize=blocksize,
             code=code,
             quant_type=quant_type,
@@ -1256,171 +2460,703 @@ def quantize_4bit(
             state2=state2,
         )
     else:
+        state = QuantState(
+            absmax=absmax, code=code, blocksize=blocksize, dtype=quant_state.dtype, offset=offset, state2=state2
+        )
+    return out, state
+
+
+# PANEL_4BIT in csrc/cpu_ops.h
+PANEL_4BIT = 16
+
+
+# the header at the start of a checkpoint, see csrc/cpu_checkpoint.h
+_CHECKPOINT_HEADER = struct.Struct("<8sIIqq")
+_CHECKPOINT_MAGIC = b"BNBQCKPT"
+
+
+class QuantizedCheckpointWriter:
+    """
+    Writes quantized tensors to a checkpoint file from several native I/O threads.
+
+    Every tensor is written with `pwrite` to its own aligned offset as soon as it is added,
+    while Python moves on to the next one. `add_quantized_4bit` quantizes a weight like
+    `quantize_4bit` straight into the file, a few MB at a time, so the packed weight is
+    never held in memory as a whole. The index of the tensors is written last and the
+    file only replaces `path` once it is complete. Use `load_quantized_checkpoint` to read it.
+
+    Parameters
+    ----------
+    path : str
+        The checkpoint file.
+    direct : bool
+        Opens the file with O_DIRECT, bypassing the page cache, where the file system supports it.
+    num_threads : int
+        The number of I/O threads.
+    """
+
+    def __init__(self, path, direct=False, num_threads=4):
+        self.path = str(path)
+        handle = lib.ccheckpoint_writer_open(self.path.encode(), ct.c_bool(direct), ct.c_int(num_threads))
+        if not handle:
+            raise RuntimeError(f"Could not create the checkpoint {self.path}")
+        self._handle = ct.c_void_p(handle)
+        self._index = {}
+        # the native threads read the tensors until the writer is closed
+        self._tensors = []
+
+    def _check(self, name, offset):
+        if name in self._index:
+            raise ValueError(f"The checkpoint already has a tensor {name}")
+        if offset < 0:
+            raise RuntimeError(f"Writing {name} to the checkpoint {self.path} failed")
+
+    def add_tensor(self, name: str, A: Tensor):
+        """Writes a tensor of any dtype as it is."""
+        A = A.detach().cpu().contiguous()
+        nbytes = A.numel() * A.element_size()
+        offset = lib.ccheckpoint_writer_write(self._handle, get_ptr(A), ct.c_longlong(nbytes))
+        self._check(name, offset)
+        self._tensors.append(A)
+        self._index[name] = {"dtype": str(A.dtype)[6:], "shape": list(A.shape), "offset": offset, "nbytes": nbytes}
+
+    def add_quantized_4bit(self, name: str, A: Tensor, blocksize=64, quant_type="nf4") -> QuantState:
+        """
+        Quantizes A like `quantize_4bit` into the tensor `name` and writes its quant state as
+        the tensors `name.absmax` etc., like the state dict of `Linear4bit`. Returns the quant state.
+        """
+        if quant_type not in ("fp4", "nf4"):
+            raise ValueError(f"Unsupported quant_type {quant_type}, expected 'fp4' or 'nf4'")
+        if A.dtype not in dtype2scalar_type:
+            raise ValueError(f"Tensors of dtype {A.dtype} are not supported")
+        A = A.detach().cpu().contiguous()
+        n = A.numel()
+        absmax = torch.empty((n + blocksize - 1) // blocksize, dtype=torch.float32)
+        offset = lib.ccheckpoint_writer_quantize_4bit(
+            self._handle,
+            ct.c_int(str2quant_type_cpu[quant_type]),
+            ct.c_int(dtype2scalar_type[A.dtype]),
+            get_ptr(A),
+            get_ptr(absmax),
+            ct.c_longlong(blocksize),
+            ct.c_longlong(n),
+        )
+        self._check(name, offset)
+        nbytes = (n + 1) // 2
+        self._index[name] = {"dtype": "uint8", "shape": [nbytes, 1], "offset": offset, "nbytes": nbytes}
         state = QuantState(
             absmax=absmax,
-            shape=input_shape,
+            shape=A.shape,
             dtype=A.dtype,
             blocksize=blocksize,
-            code=code,
+            code=get_4bit_type(quant_type, device="cpu"),
             quant_type=quant_type,
         )
+        for key, value in state.as_dict(packed=True).items():
+            self.add_tensor(f"{name}.{key}", value)
+        return state
+
+    def close(self):
+        """Waits for all writes and moves the complete checkpoint to its path."""
+        if self._handle is None:
+            return
+        index = json.dumps({"tensors": self._index}).encode()
+        handle, self._handle = self._handle, None
+        ok = lib.ccheckpoint_writer_close(handle, index, ct.c_longlong(len(index)))
+        self._tensors = []
+        if not ok:
+            raise RuntimeError(f"Writing the checkpoint {self.path} failed")
+
+    def abort(self):
+        """Waits for all writes and removes the incomplete checkpoint."""
+        if self._handle is not None:
+            handle, self._handle = self._handle, None
+            lib.ccheckpoint_writer_close(handle, None, ct.c_longlong(0))
+            self._tensors = []
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        if exc_type is None:
+            self.close()
+        else:
+            self.abort()
+
+    def __del__(self):
+        if getattr(self, "_handle", None) is not None and lib is not None:
+            self.abort()
+
+
+def load_quantized_checkpoint(path) -> Dict[str, Tensor]:
+    """Reads all tensors of a checkpoint written by `QuantizedCheckpointWriter`."""
+    with open(path, "rb") as f:
+        magic, version, _, index_offset, index_bytes = _CHECKPOINT_HEADER.unpack(f.read(_CHECKPOINT_HEADER.size))
+        if magic != _CHECKPOINT_MAGIC or version != 1:
+            raise ValueError(f"{path} is not a complete bitsandbytes checkpoint")
+        f.seek(index_offset)
+        index = json.loads(f.read(index_bytes))["tensors"]
+        tensors = {}
+        for name, entry in index.items():
+            A = torch.empty(entry["shape"], dtype=getattr(torch, entry["dtype"]))
+            f.seek(entry["offset"])
+            f.readinto(memoryview(A.reshape(-1).view(torch.uint8).numpy()))
+            tensors[name] = A
+    return tensors
+
+
+class PrepackedWeight4bit:
+    """A 4-bit CPU weight reordered by `prepack_4bit` for `gemm_4bit_prepacked`."""
+
+    def __init__(self, data, scales, shape, quant_type, blocksize):
+        self.data = data
+        self.scales = scales
+        self.shape = shape
+        self.quant_type = quant_type
+        self.blocksize = blocksize
 
-    return out, state
 
+def _unnested_absmax(quant_state: QuantState) -> Tensor:
+    # the absmax of a quantization state as contiguous fp32 values, dequantized if nested
+    absmax = quant_state.absmax
+    if quant_state.nested:
+        absmax = dequantize_blockwise(quant_state.absmax, quant_state.state2)
+        absmax += quant_state.offset
+    return absmax.float().contiguous()
 
-def dequantize_fp4(
-    A: Tensor,
-    quant_state: Optional[QuantState] = None,
-    absmax: Optional[torch.Tensor] = None,
-    out: Optional[torch.Tensor] = None,
-    blocksize: int = 64,
-) -> Tensor:
-    return dequantize_4bit(A, quant_state, absmax, out, blocksize, "fp4")
 
+def prepack_4bit(B: Tensor, quant_state: QuantState) -> PrepackedWeight4bit:
+    """
+    Reorders a 4-bit CPU weight for `gemm_4bit_prepacked`.
 
-def dequantize_nf4(
+    The packed values and the absmax of every group of 16 output features are interleaved
+    into panels that the GEMM decodes a few hundred rows at a time into the L1 cache.
+    Nested absmax values are dequantized here, once, instead of on every call.
+
+    Parameters
+    ----------
+    B : torch.Tensor
+        The packed 4-bit weight returned by `quantize_4bit` for a tensor of shape (out_features, in_features).
+    quant_state : QuantState
+        The quantization state of B. in_features has to be a multiple of the blocksize.
+
+    Returns
+    -------
+    PrepackedWeight4bit:
+        The reordered weight.
+    """
+    N, K = quant_state.shape
+    if K % quant_state.blocksize != 0:
+        raise ValueError(f"in_features ({K}) has to be a multiple of the blocksize ({quant_state.blocksize})")
+
+    absmax = _unnested_absmax(quant_state)
+
+    num_panels = (N + PANEL_4BIT - 1) // PANEL_4BIT
+    data = torch.empty((num_panels * K * PANEL_4BIT // 2,), dtype=torch.uint8)
+    scales = torch.empty((num_panels * (K // quant_state.blocksize) * PANEL_4BIT,), dtype=torch.float32)
+    lib.cprepack_4bit_cpu(
+        get_ptr(B),
+        get_ptr(absmax),
+        get_ptr(data),
+        get_ptr(scales),
+        ct.c_longlong(N),
+        ct.c_longlong(K),
+        ct.c_longlong(quant_state.blocksize),
+    )
+    return PrepackedWeight4bit(data, scales, (N, K), quant_state.quant_type, quant_state.blocksize)
+
+
+def _prepack_4bit_cached(B: Tensor, quant_state: QuantState) -> PrepackedWeight4bit:
+    # the panels come from the weight cache (see set_cpu_weight_cache) when B is admitted to
+    # it, and are packed again when B or its absmax values change; otherwise they are packed
+    # for this call only
+    N, K = quant_state.shape
+    tag = hash((_weight_4bit_tag(B, quant_state), "prepacked", quant_state.blocksize, N, K))
+    absmax = _unnested_absmax(quant_state)
+    packed = ct.POINTER(ct.c_ubyte)()
+    scales = ct.POINTER(ct.c_float)()
+    handle = lib.cweight_cache_prepack_4bit_cpu(
+        ct.c_void_p(B.data_ptr()),
+        ct.c_longlong(tag),
+        get_ptr(B),
+        get_ptr(absmax),
+        ct.c_longlong(N),
+        ct.c_longlong(K),
+        ct.c_longlong(quant_state.blocksize),
+        ct.byref(packed),
+        ct.byref(scales),
+    )
+    if not handle:
+        return prepack_4bit(B, quant_state)
+    _track_cached_weight(B)
+
+    num_panels = (N + PANEL_4BIT - 1) // PANEL_4BIT
+    data = (ct.c_ubyte * (num_panels * K * PANEL_4BIT // 2)).from_address(ct.addressof(packed.contents))
+    scales = (ct.c_float * (num_panels * (K // quant_state.blocksize) * PANEL_4BIT)).from_address(
+        ct.addressof(scales.contents)
+    )
+    # both tensors keep the entry alive
+    data._pin = scales._pin = _WeightCachePin(handle)
+    return PrepackedWeight4bit(
+        torch.frombuffer(data, dtype=torch.uint8),
+        torch.frombuffer(scales, dtype=torch.float32),
+        (N, K),
+        quant_state.quant_type,
+        quant_state.blocksize,
+    )
+
+
+def gemm_4bit_prepacked(A: Tensor, B: PrepackedWeight4bit, out: Optional[torch.Tensor] = None) -> Tensor:
+    """
+    Multiplies CPU activations with a 4-bit weight prepacked by `prepack_4bit`: out = A @ W.t().
+
+    Parameters
+    ----------
+    A : torch.Tensor
+        The activations of shape (..., in_features), float32, float16 or bfloat16.
+    B : PrepackedWeight4bit
+        The prepacked weight W of shape (out_features, in_features).
+    out : torch.Tensor
+        Optional output of shape (..., out_features) with the dtype of A.
+
+    Returns
+    -------
+    torch.Tensor:
+        The product, accumulated in float32 and stored with the dtype of A.
+    """
+    N, K = B.shape
+    if A.shape[-1] != K:
+        raise ValueError(f"Expected A with {K} features in the last dimension, but got {tuple(A.shape)}")
+    if A.dtype not in dtype2scalar_type:
+        raise ValueError(f"4-bit GEMM only supports 16/32-bit floats, but got {A.dtype}")
+    A = A.contiguous()
+    if out is None:
+        out = torch.empty((*A.shape[:-1], N), dtype=A.dtype)
+
+    lib.cgemm_4bit_cpu(
+        ct.c_int(str2quant_type_cpu[B.quant_type]),
+        ct.c_int(dtype2scalar_type[A.dtype]),
+        get_ptr(A),
+        get_ptr(B.data),
+        get_ptr(B.scales),
+        get_ptr(out),
+        ct.c_longlong(A.numel() // K),
+        ct.c_longlong(N),
+        ct.c_longlong(K),
+        ct.c_longlong(B.blocksize),
+    )
+    return out
+
+
+def gemm_4bit_transposed(A: Tensor, B: Tensor, quant_state: QuantState, out: Optional[torch.Tensor] = None) -> Tensor:
+    """
+    Multiplies CPU activations with a 4-bit weight without transposing it first: out = A @ W.
+
+    This is the gradient of the input of a 4-bit linear layer, e.g. in the backward pass of
+    QLoRA. W is read in the layout of `quantize_4bit` and decoded a few columns at a time,
+    so neither the dequantized weight nor its transpose is materialized.
+
+    Parameters
+    ----------
+    A : torch.Tensor
+        The activations or output gradients of shape (..., out_features), float32, float16 or bfloat16.
+    B : torch.Tensor
+        The packed 4-bit weight W returned by `quantize_4bit` for a tensor of shape (out_features, in_features).
+    quant_state : QuantState
+        The quantization state of B.
+    out : torch.Tensor
+        Optional output of shape (..., in_features) with the dtype of A.
+
+    Returns
+    -------
+    torch.Tensor:
+        The product, accumulated in float32 and stored with the dtype of A.
+    """
+    N, K = quant_state.shape
+    if A.shape[-1] != N:
+        raise ValueError(f"Expected A with {N} features in the last dimension, but got {tuple(A.shape)}")
+    if A.dtype not in dtype2scalar_type:
+        raise ValueError(f"4-bit GEMM only supports 16/32-bit floats, but got {A.dtype}")
+    A = A.contiguous()
+    if out is None:
+        out = torch.empty((*A.shape[:-1], K), dtype=A.dtype)
+    if out.numel() == 0:
+        return out
+    absmax = _unnested_absmax(quant_state)
+
+    lib.cgemm_4bit_transposed_cpu(
+        ct.c_int(str2quant_type_cpu[quant_state.quant_type]),
+        ct.c_int(dtype2scalar_type[A.dtype]),
+        get_ptr(A),
+        get_ptr(B),
+        get_ptr(absmax),
+        get_ptr(out),
+        ct.c_longlong(A.numel() // max(N, 1)),
+        ct.c_longlong(N),
+        ct.c_longlong(K),
+        ct.c_longlong(quant_state.blocksize),
+    )
+    return out
+
+
+def gemv_4bit_lora(
     A: Tensor,
-    quant_state: Optional[QuantState] = None,
-    absmax: Optional[torch.Tensor] = None,
+    B: Tensor,
+    quant_state: QuantState,
+    lora_A: Tensor,
+    lora_B: Tensor,
+    scaling: Union[float, Sequence[float], Tensor] = 1.0,
+    adapter_ids: Optional[Tensor] = None,
     out: Optional[torch.Tensor] = None,
-    blocksize: int = 64,
 ) -> Tensor:
-    return dequantize_4bit(A, quant_state, absmax, out, blocksize, "nf4")
+    """
+    The forward of a 4-bit CPU linear layer with LoRA adapters, in one pass over A:
+    out = A @ W.t() + s * (A @ lora_A.t()) @ lora_B.t().
+
+    Decodes W on the fly like the CPU GEMV and adds the low-rank correction to every output
+    before it is stored, so neither the base product nor the adapter activations are
+    materialized as tensors. Several adapters can be served in one batch, each row of A
+    selecting its own. Meant for a few rows of A, such as decoding one token per sequence.
+
+    Parameters
+    ----------
+    A : torch.Tensor
+        The activations of shape (..., in_features), float32, float16 or bfloat16.
+    B : torch.Tensor
+        The packed 4-bit weight W returned by `quantize_4bit` for a tensor of shape (out_features, in_features).
+    quant_state : QuantState
+        The quantization state of B. in_features has to be a multiple of the blocksize.
+    lora_A : torch.Tensor
+        The down projections of shape (rank, in_features), or (num_adapters, rank, in_features).
+        Adapters of a smaller rank are padded with zeros.
+    lora_B : torch.Tensor
+        The up projections of shape (out_features, rank), or (num_adapters, out_features, rank).
+    scaling : float, sequence of floats or torch.Tensor
+        The scaling of the adapters, e.g. lora_alpha / r, one value or one per adapter.
+    adapter_ids : torch.Tensor
+        The adapter of each row of A, of shape A.shape[:-1]; -1 leaves a row without adapter.
+        By default, every row uses adapter 0.
+    out : torch.Tensor
+        Optional output of shape (..., out_features) with the dtype of A.
+
+    Returns
+    -------
+    torch.Tensor:
+        The output, accumulated in float32 and stored with the dtype of A.
+    """
+    N, K = quant_state.shape
+    if A.shape[-1] != K:
+        raise ValueError(f"Expected A with {K} features in the last dimension, but got {tuple(A.shape)}")
+    if A.dtype not in dtype2scalar_type:
+        raise ValueError(f"4-bit GEMV only supports 16/32-bit floats, but got {A.dtype}")
+    if K % quant_state.blocksize != 0:
+        raise ValueError(f"in_features ({K}) has to be a multiple of the blocksize ({quant_state.blocksize})")
+    if lora_A.dim() == 2:
+        lora_A = lora_A.unsqueeze(0)
+    if lora_B.dim() == 2:
+        lora_B = lora_B.unsqueeze(0)
+    num_adapters, rank = lora_A.shape[:2]
+    if lora_A.shape != (num_adapters, rank, K) or lora_B.shape != (num_adapters, N, rank):
+        raise ValueError(
+            f"Expected lora_A of shape ({num_adapters}, {rank}, {K}) and lora_B of shape ({num_adapters}, {N}, {rank}), "
+            f"but got {tuple(lora_A.shape)} and {tuple(lora_B.shape)}",
+        )
+    M = A.numel() // K
+    scales = torch.as_tensor(scaling, dtype=torch.float32).reshape(-1).expand(num_adapters).contiguous()
+    if adapter_ids is None:
+        adapter_ids = torch.zeros(M, dtype=torch.int64)
+    adapter_ids = adapter_ids.to(torch.int64).reshape(-1).contiguous()
+    if adapter_ids.numel() != M:
+        raise ValueError(f"Expected one adapter id for each of the {M} rows of A, but got {adapter_ids.numel()}")
+    if M > 0 and adapter_ids.max().item() >= num_adapters:
+        raise ValueError(f"adapter_ids select adapter {adapter_ids.max().item()} of {num_adapters}")
+
+    A = A.contiguous()
+    lora_A = lora_A.to(A.dtype).contiguous()
+    lora_B = lora_B.to(A.dtype).contiguous()
+    if out is None:
+        out = torch.empty((*A.shape[:-1], N), dtype=A.dtype)
+    if out.numel() == 0:
+        return out
+    absmax = _unnested_absmax(quant_state)
 
+    ok = lib.cgemv_lora_cpu(
+        ct.c_int(str2quant_type_cpu[quant_state.quant_type]),
+        ct.c_int(dtype2scalar_type[A.dtype]),
+        get_ptr(A),
+        get_ptr(B),
+        get_ptr(absmax),
+        get_ptr(None),
+        get_ptr(lora_A),
+        get_ptr(lora_B),
+        get_ptr(scales),
+        get_ptr(adapter_ids),
+        ct.c_longlong(num_adapters),
+        ct.c_longlong(rank),
+        get_ptr(out),
+        ct.c_longlong(M),
+        ct.c_longlong(N),
+        ct.c_longlong(K),
+        ct.c_longlong(quant_state.blocksize),
+    )
+    if not ok:
+        raise ValueError(f"adapter_ids select adapters outside of the {num_adapters} given")
+    return out
 
-def dequantize_4bit(
+
+def embedding_bag_quantized(
+    indices: Tensor,
     A: Tensor,
-    quant_state: Optional[QuantState] = None,
-    absmax: Optional[torch.Tensor] = None,
-    out: Optional[torch.Tensor] = None,
-    blocksize: int = 64,
-    quant_type="fp4",
+    quant_state: QuantState,
+    offsets: Optional[Tensor] = None,
+    per_sample_weights: Optional[Tensor] = None,
+    mode: str = "sum",
+    padding_idx: Optional[int] = None,
 ) -> Tensor:
     """
-    Dequantizes FP4 blockwise quantized values.
+    Pooled lookups in a quantized CPU embedding table, like `torch.nn.functional.embedding_bag`.
 
-    Dequantizes the tensor A with maximum absolute values absmax in blocks of size blocksize.
+    Only the rows that are looked up are dequantized, straight into the sums, so the table
+    can stay quantized in memory. Plain lookups are bags of a single index each.
 
     Parameters
     ----------
+    indices : torch.Tensor
+        The row indices: a 2D tensor with one bag per row, or a 1D tensor split into bags by offsets.
     A : torch.Tensor
-        The input tensor (packed 4-bit values).
+        The table of shape (num_embeddings, embedding_dim) quantized with `quantize_blockwise`,
+        or its packed 4-bit values from `quantize_4bit` (fp4 or nf4).
     quant_state : QuantState
-        object with quantisation stats, incl. absmax values, original tensor shape and original dtype.
-    absmax : torch.Tensor
-        The absmax values.
-    out : torch.Tensor
-        Dequantized output tensor.
-    blocksize : int
-        The blocksize used in quantization.
-    quant_type : str
-        The 4-bit quantization data type {fp4, nf4}
-
+        The quantization state of A. embedding_dim has to be a multiple of the blocksize, so that
+        every row starts a new block. Nested quantization states are not supported.
+    offsets : torch.Tensor
+        The start of each bag in a 1D indices tensor.
+    per_sample_weights : torch.Tensor
+        Optional weight of each index, only for mode "sum".
+    mode : str
+        "sum" or "mean".
+    padding_idx : int
+        Rows with this index are skipped and not counted by the mean.
 
     Returns
     -------
     torch.Tensor:
-        Dequantized tensor.
+        The pooled rows of shape (num_bags, embedding_dim) with the dtype of the quantization state.
     """
-    if blocksize not in [2048, 4096, 1024, 512, 256, 128, 64]:
-        raise ValueError(
-            f"The blockwise of {blocksize} is not supported. Supported values: [2048, 4096, 1024, 512, 256, 128, 64]",
-        )
-    if quant_type not in ["fp4", "nf4"]:
-        raise NotImplementedError(f"4-bit quantization data type {quant_type} is not implemented.")
-
-    if quant_state is None:
-        assert absmax is not None and out is not None
+    if quant_state.nested:
+        raise NotImplementedError("Quantized embedding lookups do not support nested quantization states")
+    if mode not in ("sum", "mean"):
+        raise ValueError(f"Unsupported mode {mode}, expected 'sum' or 'mean'")
+    if per_sample_weights is not None and mode != "sum":
+        raise ValueError("per_sample_weights are only supported for mode 'sum'")
+
+    if quant_state.quant_type in ("fp4", "nf4"):
+        num_rows, dim = quant_state.shape
+        quant_type = str2quant_type_cpu[quant_state.quant_type]
+        code = None
+    else:
+        num_rows, dim = A.shape
+        quant_type = 0
+        code = quant_state.code.cpu()
+    if dim % quant_state.blocksize != 0:
+        raise ValueError(f"embedding_dim ({dim}) has to be a multiple of the blocksize ({quant_state.blocksize})")
+
+    if indices.dim() == 2:
+        if offsets is not None:
+            raise ValueError("offsets have to be None if indices are 2D")
+        offsets = torch.arange(0, indices.numel(), indices.shape[1])
+        indices = indices.reshape(-1)
+    elif offsets is None:
+        raise ValueError("offsets are required for 1D indices")
+    indices = indices.long().contiguous()
+    offsets = offsets.long().contiguous()
+    if indices.numel() > 0 and (indices.min() < 0 or indices.max() >= num_rows):
+        raise IndexError(f"Embedding indices have to be in [0, {num_rows})")
+    if per_sample_weights is not None:
+        per_sample_weights = per_sample_weights.float().contiguous()
+    if padding_idx is not None and padding_idx < 0:
+        padding_idx += num_rows
+
+    out = torch.empty((offsets.numel(), dim), dtype=quant_state.dtype or torch.float32)
+    lib.cembedding_bag_cpu(
+        ct.c_int(quant_type),
+        get_ptr(A),
+        get_ptr(quant_state.absmax),
+        get_ptr(code),
+        ct.c_longlong(dim),
+        ct.c_longlong(quant_state.blocksize),
+        get_ptr(indices),
+        ct.c_longlong(indices.numel()),
+        get_ptr(offsets),
+        ct.c_longlong(offsets.numel()),
+        get_ptr(per_sample_weights),
+        ct.c_int(0 if mode == "sum" else 1),
+        ct.c_longlong(-1 if padding_idx is None else padding_idx),
+        ct.c_int(dtype2scalar_type[out.dtype]),
+        get_ptr(out),
+    )
+    return out
 
-        quant_state = QuantState(
-            absmax=absmax,
-            shape=out.shape,
-            dtype=out.dtype,
-            blocksize=blocksize,
-            quant_type=quant_type,
-        )
 
-    else:
-        absmax = quant_state.absmax
+class QuantizedKVCache:
+    """
+    The key or value cache of one attention layer for CPU generation, quantized row by row.
 
-    if quant_state.nested:
-        absmax = dequantize_blockwise(quant_state.absmax, quant_state.state2)
-        absmax += quant_state.offset
-        if absmax.dtype != torch.float32:
-            absmax = absmax.float()
+    The cache is a ring buffer of `capacity` positions per kv head. Every appended row of
+    head_dim values is quantized like `quantize_blockwise` ("8bit") or `quantize_4bit`
+    ("fp4", "nf4") with one absmax per blocksize values, by default one per head and token.
+    `scores` and `attend` dequantize the keys or values of the last `window` positions block
+    by block inside the dot products, so the cache is never expanded in memory.
 
-    if out is None:
-        out = torch.empty(quant_state.shape, dtype=quant_state.dtype, device=A.device)
+    Parameters
+    ----------
+    num_heads : int
+        The number of kv heads.
+    capacity : int
+        The number of positions kept; older ones are overwritten.
+    head_dim : int
+        The size of a row, a multiple of the blocksize.
+    quant_type : str
+        "8bit", "fp4" or "nf4".
+    blocksize : int
+        The number of values that share an absmax, head_dim if None.
+    code : torch.Tensor
+        The quantization map for "8bit", the dynamic map if None.
+    """
 
-    n = out.numel()
+    def __init__(self, num_heads, capacity, head_dim, quant_type="8bit", blocksize=None, code=None):
+        blocksize = blocksize or head_dim
+        if quant_type not in ("8bit", "fp4", "nf4"):
+            raise ValueError(f"Unsupported quant_type {quant_type}, expected '8bit', 'fp4' or 'nf4'")
+        if head_dim % blocksize != 0 or (quant_type != "8bit" and blocksize % 2 != 0):
+            raise ValueError(f"head_dim ({head_dim}) has to be a multiple of the blocksize ({blocksize})")
 
-    device = pre_call(A.device)
-    is_on_gpu([A, absmax, out])
-    if out.dtype == torch.float32:
-        if quant_state.quant_type == "fp4":
-            lib.cdequantize_blockwise_fp32_fp4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int(quant_state.blocksize),
-                ct.c_int(n),
-            )
-        else:
-            lib.cdequantize_blockwise_fp32_nf4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int(quant_state.blocksize),
-                ct.c_int(n),
-            )
-    elif out.dtype == torch.float16:
-        if quant_state.quant_type == "fp4":
-            lib.cdequantize_blockwise_fp16_fp4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int(quant_state.blocksize),
-                ct.c_int(n),
-            )
-        else:
-            lib.cdequantize_blockwise_fp16_nf4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int(quant_state.blocksize),
-                ct.c_int(n),
-            )
-    elif out.dtype == torch.bfloat16:
-        if quant_state.quant_type == "fp4":
-            lib.cdequantize_blockwise_bf16_fp4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int(quant_state.blocksize),
-                ct.c_int(n),
-            )
+        self.num_heads = num_heads
+        self.capacity = capacity
+        self.head_dim = head_dim
+        self.quant_type = quant_type
+        self.blocksize = blocksize
+        self.length = 0
+        if quant_type == "8bit":
+            self.code = (code if code is not None else create_dynamic_map()).float().cpu().contiguous()
+            row_bytes = head_dim
         else:
-            lib.cdequantize_blockwise_bf16_nf4(
-                get_ptr(None),
-                get_ptr(A),
-                get_ptr(absmax),
-                get_ptr(out),
-                ct.c_int(quant_state.blocksize),
-                ct.c_int(n),
-            )
-    else:
-        raise ValueError(f"Blockwise quantization only supports 16/32-bit floats, but got {A.dtype}")
-    post_call(A.device)
+            self.code = None
+            row_bytes = head_dim // 2
+        self.data = torch.zeros((num_heads, capacity, row_bytes), dtype=torch.uint8)
+        self.absmax = torch.zeros((num_heads, capacity, head_dim // blocksize), dtype=torch.float32)
+
+    @property
+    def window(self):
+        """The number of positions that can be read, min(length, capacity)."""
+        return min(self.length, self.capacity)
+
+    def _args(self):
+        quant_type = 0 if self.quant_type == "8bit" else str2quant_type_cpu[self.quant_type]
+        return ct.c_int(quant_type), get_ptr(self.data), get_ptr(self.absmax), get_ptr(self.code)
+
+    def append(self, rows: Tensor):
+        """Quantizes rows of shape (num_heads, num_tokens, head_dim) into the next positions."""
+        if rows.shape[0] != self.num_heads or rows.shape[-1] != self.head_dim:
+            raise ValueError(f"Expected rows of shape ({self.num_heads}, n, {self.head_dim}), got {tuple(rows.shape)}")
+        if rows.dtype not in dtype2scalar_type:
+            raise ValueError(f"Rows of dtype {rows.dtype} are not supported")
+        # only the last capacity rows survive
+        num_tokens = rows.shape[1]
+        skipped = max(0, num_tokens - self.capacity)
+        rows = rows[:, skipped:].contiguous()
+        quant_type, data, absmax, code = self._args()
+        lib.ckv_cache_append_cpu(
+            quant_type,
+            ct.c_int(dtype2scalar_type[rows.dtype]),
+            get_ptr(rows),
+            data,
+            absmax,
+            code,
+            ct.c_longlong(self.num_heads),
+            ct.c_longlong(self.capacity),
+            ct.c_longlong(self.head_dim),
+            ct.c_longlong(self.blocksize),
+            ct.c_longlong(self.length + skipped),
+            ct.c_longlong(num_tokens - skipped),
+        )
+        self.length += num_tokens
 
-    is_transposed = True if A.shape[0] == 1 else False
-    if is_transposed:
-        return out.t()
-    else:
+    def _check_heads(self, num_heads):
+        if num_heads % self.num_heads != 0:
+            raise ValueError(f"The query heads ({num_heads}) have to be a multiple of the kv heads ({self.num_heads})")
+
+    def scores(self, query: Tensor, scale: Optional[float] = None) -> Tensor:
+        """
+        Attention scores of query (num_q_heads, num_queries, head_dim) against the cached keys.
+
+        Query heads are assigned to the kv heads in groups of num_q_heads // num_heads. Returns
+        the float32 scores of shape (num_q_heads, num_queries, window), oldest position first,
+        scaled by 1 / sqrt(head_dim) unless a scale is given.
+        """
+        num_q_heads, num_queries, head_dim = query.shape
+        self._check_heads(num_q_heads)
+        if head_dim != self.head_dim:
+            raise ValueError(f"Expected queries with head_dim {self.head_dim}, got {head_dim}")
+        if query.dtype not in dtype2scalar_type:
+            raise ValueError(f"Queries of dtype {query.dtype} are not supported")
+        query = query.contiguous()
+        scale = head_dim**-0.5 if scale is None else scale
+        window = self.window
+
+        out = torch.empty((num_q_heads, num_queries, window), dtype=torch.float32)
+        quant_type, data, absmax, code = self._args()
+        lib.ckv_cache_scores_cpu(
+            quant_type,
+            ct.c_int(dtype2scalar_type[query.dtype]),
+            get_ptr(query),
+            data,
+            absmax,
+            code,
+            ct.c_longlong(num_q_heads),
+            ct.c_longlong(self.num_heads),
+            ct.c_longlong(num_queries),
+            ct.c_longlong(self.capacity),
+            ct.c_longlong(self.head_dim),
+            ct.c_longlong(self.blocksize),
+            ct.c_longlong(self.length - window),
+            ct.c_longlong(window),
+            ct.c_float(scale),
+            get_ptr(out),
+        )
+        return out
+
+    def attend(self, probs: Tensor) -> Tensor:
+        """
+        The cached values weighted by probs of shape (num_q_heads, num_queries, window).
+
+        Returns the float32 sums of shape (num_q_heads, num_queries, head_dim). Positions with a
+        probability of exactly 0 are skipped.
+        """
+        num_q_heads, num_queries, window = probs.shape
+        self._check_heads(num_q_heads)
+        if window != self.window:
+            raise ValueError(f"Expected probabilities for {self.window} positions, got {window}")
+        probs = probs.float().contiguous()
+
+        out = torch.empty((num_q_heads, num_queries, self.head_dim), dtype=torch.float32)
+        quant_type, data, absmax, code = self._args()
+        lib.ckv_cache_attend_cpu(
+            quant_type,
+            get_ptr(probs),
+            data,
+            absmax,
+            code,
+            ct.c_longlong(num_q_heads),
+            ct.c_longlong(self.num_heads),
+            ct.c_longlong(num_queries),
+            ct.c_longlong(self.capacity),
+            ct.c_longlong(self.head_dim),
+            ct.c_longlong(self.blocksize),
+            ct.c_longlong(self.length - window),
+            ct.c_longlong(window),
+            get_ptr(out),
+        )
         return out
 
 
@@ -1523,6 +3259,157 @@ def dequantize_no_absmax(A: Tensor, code: Tensor, out: Optional[torch.Tensor] =
     return out
 
 
+def _optimizer_32bit_cpu_args(
+    optimizer_name,
+    g,
+    p,
+    state1,
+    state2,
+    unorm_vec,
+    max_unorm,
+    param_norm,
+    beta1,
+    beta2,
+    eps,
+    weight_decay,
+    step,
+    lr,
+    gnorm_scale,
+    skip_zeros,
+    rounding_seed,
+):
+    if optimizer_name not in str2optimizer_cpu:
+        raise ValueError(f"Optimizer {optimizer_name} is not supported on the CPU")
+    if g.dtype not in dtype2scalar_type or p.dtype != g.dtype:
+        raise ValueError(f"Gradient+parameter data type combination not supported on the CPU: {g.dtype}, {p.dtype}")
+    if not all(t is None or (t.device.type == "cpu" and t.is_contiguous()) for t in [g, p, state1, state2, unorm_vec]):
+        raise ValueError("CPU optimizer updates require contiguous CPU tensors")
+    return (
+        ct.c_int(str2optimizer_cpu[optimizer_name]),
+        ct.c_int(dtype2scalar_type[g.dtype]),
+        get_ptr(g),
+        get_ptr(p),
+        get_ptr(state1),
+        get_ptr(state2),
+        get_ptr(unorm_vec),
+        ct.c_float(max_unorm),
+        ct.c_float(param_norm),
+        ct.c_float(beta1),
+        ct.c_float(beta2),
+        ct.c_float(eps),
+        ct.c_float(weight_decay),
+        ct.c_int32(step),
+        ct.c_float(lr),
+        ct.c_float(gnorm_scale),
+        ct.c_bool(skip_zeros),
+        ct.c_bool(rounding_seed is not None),
+        ct.c_uint64(rounding_seed or 0),
+        ct.c_longlong(g.numel()),
+    )
+
+
+class OptimizerTensorDesc(ct.Structure):
+    """Mirrors `optimizer_tensor_desc` in csrc/cpu_ops.h."""
+
+    _fields_ = [
+        ("g", ct.c_void_p),
+        ("p", ct.c_void_p),
+        ("state1", ct.c_void_p),
+        ("state2", ct.c_void_p),
+        ("unorm", ct.c_void_p),
+        ("n", ct.c_longlong),
+        ("dtype", ct.c_int),
+        ("rounding_seed", ct.c_ulonglong),
+    ]
+
+
+def optimizer_update_32bit_multi(
+    optimizer_name: str,
+    gs: List[Tensor],
+    ps: List[Tensor],
+    state1s: List[Tensor],
+    beta1: float,
+    eps: float,
+    step: int,
+    lr: float,
+    state2s: Optional[List[Tensor]] = None,
+    beta2: float = 0.0,
+    weight_decay: float = 0.0,
+    max_grad_norm: float = 0.0,
+    unorm_vecs: Optional[List[Tensor]] = None,
+    max_unorm: float = 0.0,
+    skip_zeros=False,
+    rounding_seeds: Optional[List[int]] = None,
+) -> float:
+    """
+    Performs an inplace optimizer update with 32-bit states for many CPU parameters in a single native call.
+
+    The gradients of all parameters are first reduced to their global norm. If `max_grad_norm` is positive,
+    they are then scaled like `torch.nn.utils.clip_grad_norm_` would before all parameters are updated.
+    The blocks of all parameters are spread over the thread pool together in both passes.
+
+    Parameters
+    ----------
+    optimizer_name : str
+        The name of the optimizer, see `optimizer_update_32bit`.
+    gs, ps, state1s, state2s : List[torch.Tensor]
+        Gradients, parameters and optimizer states, one entry per parameter. `state2s` is only used by Adam.
+    max_grad_norm : float
+        The maximum global gradient norm, or 0 to not clip the gradients.
+    unorm_vecs : List[torch.Tensor]
+        Per-parameter tensors receiving the squared update norm if `max_unorm` > 0.
+    max_unorm : float
+        The maximum update norm of each parameter relative to its weight norm.
+    rounding_seeds : List[int]
+        Per-parameter seeds to write bf16 parameters with stochastic rounding, see `optimizer_update_32bit`.
+
+    Returns
+    -------
+    float
+        The global gradient norm before clipping.
+    """
+    if optimizer_name not in str2optimizer_cpu:
+        raise ValueError(f"Optimizer {optimizer_name} is not supported on the CPU")
+    num_tensors = len(ps)
+    state2s = state2s if state2s is not None else [None] * num_tensors
+    unorm_vecs = unorm_vecs if unorm_vecs is not None else [None] * num_tensors
+    seeds = rounding_seeds if rounding_seeds is not None else [0] * num_tensors
+
+    descs = (OptimizerTensorDesc * num_tensors)()
+    for desc, g, p, state1, state2, unorm_vec, seed in zip(descs, gs, ps, state1s, state2s, unorm_vecs, seeds):
+        if g.dtype not in dtype2scalar_type or p.dtype != g.dtype:
+            raise ValueError(
+                f"Gradient+parameter data type combination not supported on the CPU: {g.dtype}, {p.dtype}"
+            )
+        tensors = [g, p, state1, state2, unorm_vec]
+        if not all(t is None or (t.device.type == "cpu" and t.is_contiguous()) for t in tensors):
+            raise ValueError("CPU optimizer updates require contiguous CPU tensors")
+        desc.g = g.data_ptr()
+        desc.p = p.data_ptr()
+        desc.state1 = state1.data_ptr()
+        desc.state2 = None if state2 is None else state2.data_ptr()
+        desc.unorm = None if unorm_vec is None else unorm_vec.data_ptr()
+        desc.n = g.numel()
+        desc.dtype = dtype2scalar_type[g.dtype]
+        desc.rounding_seed = seed
+
+    return lib.coptimizer_32bit_cpu_multi(
+        ct.c_int(str2optimizer_cpu[optimizer_name]),
+        descs,
+        ct.c_longlong(num_tensors),
+        ct.c_float(max_grad_norm),
+        ct.c_float(max_unorm),
+        ct.c_float(beta1),
+        ct.c_float(beta2),
+        ct.c_float(eps),
+        ct.c_float(weight_decay),
+        ct.c_int32(step),
+        ct.c_float(lr),
+        ct.c_bool(skip_zeros),
+        ct.c_bool(rounding_seeds is not None),
+    )
+
+
 def optimizer_update_32bit(
     optimizer_name: str,
     g: Tensor,
@@ -1539,6 +3426,7 @@ def optimizer_update_32bit(
     unorm_vec: Optional[torch.Tensor] = None,
     max_unorm: float = 0.0,
     skip_zeros=False,
+    rounding_seed: Optional[int] = None,
 ) -> None:
     """
     Performs an inplace optimizer update with one or two optimizer states.
@@ -1577,8 +3465,39 @@ def optimizer_update_32bit(
         The maximum update norm relative to the weight norm.
     skip_zeros : bool
         Whether to skip zero-valued gradients or not (default: False).
+    rounding_seed : int
+        CPU only: if set, bf16 parameters are written with stochastic rounding instead of rounding to
+        nearest, so that updates smaller than their precision are kept in expectation. The random bits
+        depend on the seed, the step and the position of each value only.
     """
 
+    if g.device.type == "cpu":
+        # a negative param_norm is computed natively, in the sweep that computes the update norm
+        lib.coptimizer_32bit_cpu(
+            *_optimizer_32bit_cpu_args(
+                optimizer_name,
+                g,
+                p,
+                state1,
+                state2,
+                unorm_vec,
+                max_unorm,
+                -1.0,
+                beta1,
+                beta2,
+                eps,
+                weight_decay,
+                step,
+                lr,
+                gnorm_scale,
+                skip_zeros,
+                rounding_seed,
+            ),
+        )
+        return
+    if rounding_seed is not None:
+        raise ValueError("Stochastic rounding of the parameters is only supported on the CPU")
+
     param_norm = 0.0
     if max_unorm > 0.0:
         param_norm = torch.norm(p.data.float())
@@ -1751,6 +3670,19 @@ def optimizer_update_8bit(
     post_call(prev_device)
 
 
+def _check_blockwise_cpu_args(optimizer_name, g, p, state1, tensors, unorm_vec, max_unorm):
+    if optimizer_name not in str2optimizer_cpu:
+        raise ValueError(f"Optimizer {optimizer_name} is not supported on the CPU")
+    if g.dtype not in dtype2scalar_type or p.dtype != g.dtype or state1.dtype != torch.uint8:
+        raise ValueError(
+            f"Gradient+optimizer bit data type combination not supported: grad {g.dtype}, optimizer {state1.dtype}",
+        )
+    if not all(t is None or (t.device.type == "cpu" and t.is_contiguous()) for t in [g, p, state1, *tensors]):
+        raise ValueError("CPU optimizer updates require contiguous CPU tensors")
+    if max_unorm > 0.0 and unorm_vec is None:
+        raise ValueError("max_unorm > 0 requires unorm_vec")
+
+
 def optimizer_update_8bit_blockwise(
     optimizer_name: str,
     g: Tensor,
@@ -1769,7 +3701,53 @@ def optimizer_update_8bit_blockwise(
     weight_decay: float = 0.0,
     gnorm_scale: float = 1.0,
     skip_zeros=False,
+    unorm_vec: Optional[torch.Tensor] = None,
+    max_unorm: float = 0.0,
+    rounding_seed: Optional[int] = None,
 ) -> None:
+    """
+    Performs an inplace optimizer update with 8-bit blockwise optimizer states.
+
+    On the CPU, `max_unorm` > 0 limits the update norm to `max_unorm` times the parameter
+    norm like `optimizer_update_32bit` does, which LAMB and LARS need; the norms are
+    computed natively and the squared update norm is written to `unorm_vec`. A
+    `rounding_seed` writes bf16 parameters with stochastic rounding, see
+    `optimizer_update_32bit`. The GPU kernels support neither.
+    """
+    if g.device.type == "cpu":
+        _check_blockwise_cpu_args(
+            optimizer_name, g, p, state1, [state2, qmap1, qmap2, absmax1, absmax2, unorm_vec], unorm_vec, max_unorm
+        )
+        lib.coptimizer_8bit_blockwise_cpu(
+            ct.c_int(str2optimizer_cpu[optimizer_name]),
+            ct.c_int(dtype2scalar_type[g.dtype]),
+            get_ptr(g),
+            get_ptr(p),
+            get_ptr(state1),
+            get_ptr(state2),
+            get_ptr(qmap1),
+            get_ptr(qmap2),
+            get_ptr(absmax1),
+            get_ptr(absmax2),
+            get_ptr(unorm_vec),
+            ct.c_float(max_unorm),
+            ct.c_float(-1.0),
+            ct.c_float(beta1),
+            ct.c_float(beta2),
+            ct.c_float(eps),
+            ct.c_float(weight_decay),
+            ct.c_int32(step),
+            ct.c_float(lr),
+            ct.c_float(gnorm_scale),
+            ct.c_bool(skip_zeros),
+            ct.c_bool(rounding_seed is not None),
+            ct.c_uint64(rounding_seed or 0),
+            ct.c_longlong(g.numel()),
+        )
+        return
+    if rounding_seed is not None:
+        raise ValueError("Stochastic rounding of the parameters is only supported on the CPU")
+
     optim_func = None
     prev_device = pre_call(g.device)
     is_on_gpu([g, p, state1, state2, qmap1, qmap2, absmax1, absmax2])
@@ -1814,6 +3792,82 @@ def optimizer_update_8bit_blockwise(
     post_call(prev_device)
 
 
+def optimizer_update_4bit_blockwise(
+    optimizer_name: str,
+    g: Tensor,
+    p: Tensor,
+    state1: Tensor,
+    state2: Optional[torch.Tensor],
+    beta1: float,
+    beta2: float,
+    eps: float,
+    step: int,
+    lr: float,
+    qmap1: Tensor,
+    qmap2: Optional[torch.Tensor],
+    absmax1: Tensor,
+    absmax2: Optional[torch.Tensor],
+    blocksize: int = 128,
+    weight_decay: float = 0.0,
+    gnorm_scale: float = 1.0,
+    skip_zeros=False,
+    unorm_vec: Optional[torch.Tensor] = None,
+    max_unorm: float = 0.0,
+    rounding_seed: Optional[int] = None,
+) -> None:
+    """
+    Performs an inplace optimizer update with 4-bit blockwise optimizer states on the CPU.
+
+    Like `optimizer_update_8bit_blockwise`, but every state value takes 4 bits: `state1` and
+    `state2` hold `(p.numel() + 1) // 2` bytes with two values per byte, the first one in the
+    high nibble, `qmap1` and `qmap2` the 16 values of their maps (see `create_dynamic_map_4bit`),
+    and `absmax1` and `absmax2` one scale per `blocksize` values, which must be an even
+    divisor of 16384. Each block of the states is dequantized, updated and quantized again
+    in one pass. With an unsigned `qmap2`, positive second moments never round to zero.
+    """
+    if g.device.type != "cpu":
+        raise NotImplementedError("4-bit optimizer states are only supported on the CPU")
+    _check_blockwise_cpu_args(
+        optimizer_name, g, p, state1, [state2, qmap1, qmap2, absmax1, absmax2, unorm_vec], unorm_vec, max_unorm
+    )
+    if blocksize < 2 or blocksize % 2 != 0 or 16384 % blocksize != 0:
+        raise ValueError(f"The blocksize of 4-bit optimizer states must be an even divisor of 16384, got {blocksize}")
+    if qmap1.numel() != 16 or (qmap2 is not None and qmap2.numel() != 16):
+        raise ValueError("4-bit optimizer states need maps of 16 values")
+    blocks = (g.numel() + blocksize - 1) // blocksize
+    if absmax1.numel() != blocks or (absmax2 is not None and absmax2.numel() != blocks):
+        raise ValueError(f"Expected {blocks} absmax values for blocks of {blocksize}, but got {absmax1.numel()}")
+    ok = lib.coptimizer_4bit_blockwise_cpu(
+        ct.c_int(str2optimizer_cpu[optimizer_name]),
+        ct.c_int(dtype2scalar_type[g.dtype]),
+        get_ptr(g),
+        get_ptr(p),
+        get_ptr(state1),
+        get_ptr(state2),
+        get_ptr(qmap1),
+        get_ptr(qmap2),
+        get_ptr(absmax1),
+        get_ptr(absmax2),
+        ct.c_longlong(blocksize),
+        get_ptr(unorm_vec),
+        ct.c_float(max_unorm),
+        ct.c_float(-1.0),
+        ct.c_float(beta1),
+        ct.c_float(beta2),
+        ct.c_float(eps),
+        ct.c_float(weight_decay),
+        ct.c_int32(step),
+        ct.c_float(lr),
+        ct.c_float(gnorm_scale),
+        ct.c_bool(skip_zeros),
+        ct.c_bool(rounding_seed is not None),
+        ct.c_uint64(rounding_seed or 0),
+        ct.c_longlong(g.numel()),
+    )
+    if not ok:
+        raise RuntimeError(f"The 4-bit optimizer update with a blocksize of {blocksize} failed")
+
+
 def percentile_clipping(grad: Tensor, gnorm_vec: Tensor, step: int, percentile: int = 5):
     """Applies percentile clipping
 
@@ -1863,6 +3917,20 @@ def histogram_scatter_add_2d(histogram: Tensor, index1: Tensor, index2: Tensor,
     assert index1.dtype == torch.int32
     assert index2.dtype == torch.int32
 
+    if histogram.device.type == "cpu":
+        assert index1.device.type == "cpu" and index2.device.type == "cpu" and source.device.type == "cpu"
+        assert all(t.is_contiguous() for t in [histogram, index1, index2, source])
+        lib.chistogram_scatter_add_2d_cpu(
+            get_ptr(histogram),
+            get_ptr(index1),
+            get_ptr(index2),
+            get_ptr(source),
+            ct.c_int32(histogram.shape[0]),
+            ct.c_longlong(histogram.numel()),
+            ct.c_longlong(index1.numel()),
+        )
+        return
+
     assert histogram.device.type == "cuda"
     assert index1.device.type == "cuda"
     assert index2.device.type == "cuda"
@@ -149,6 +149,25 @@ class Optimizer8bit(torch.optim.Optimizer):
     def fill_qmap(self):
         self.name2qmap["dynamic"] = F.create_dynamic_map(signed=True)
         self.name2qmap["udynamic"] = F.create_dynamic_map(signed=False)
+        self.name2qmap["dynamic4"] = F.create_dynamic_map_4bit(signed=True)
+        self.name2qmap["udynamic4"] = F.create_dynamic_map_4bit(signed=False)
+
+    def init_state_4bit(self, p, state, num_states, blocksize):
+        """4-bit blockwise states, two values per byte with one absmax per blocksize values (CPU only)."""
+        if p.device.type != "cpu":
+            raise NotImplementedError("4-bit optimizer states are only supported on the CPU")
+        if blocksize < 2 or blocksize % 2 != 0 or 16384 % blocksize != 0:
+            raise ValueError(
+                f"The blocksize of 4-bit optimizer states must be an even divisor of 16384, got {blocksize}"
+            )
+        if "dynamic4" not in self.name2qmap:
+            self.fill_qmap()
+        n = p.numel()
+        blocks = (n + blocksize - 1) // blocksize
+        for i, qmap in zip(range(1, num_states + 1), ["dynamic4", "udynamic4"]):
+            state[f"state{i}"] = torch.zeros(((n + 1) // 2,), dtype=torch.uint8, device=p.device)
+            state[f"qmap{i}"] = self.name2qmap[qmap]
+            state[f"absmax{i}"] = torch.zeros((blocks,), dtype=torch.float32, device=p.device)
 
     def __setstate__(self, state):
         super().__setstate__(state)
@@ -275,18 +294,27 @@ class Optimizer8bit(torch.optim.Optimizer):
             self.initialized = True
 
         # if self.is_paged: self.page_mng.prefetch_all()
-        for gindex, group in enumerate(self.param_groups):
-            for pindex, p in enumerate(group["params"]):
-                if p.grad is None:
-                    continue
-                state = self.state[p]
-                if len(state) == 0:
-                    self.init_state(group, p, gindex, pindex)
-
-                self.prefetch_state(p)
-                self.update_step(group, p, gindex, pindex)
+        params = [
+            (gindex, group, pindex, p)
+            for gindex, group in enumerate(self.param_groups)
+            for pindex, p in enumerate(group["params"])
+            if p.grad is not None
+        ]
+        params = self.update_fused_cpu(params)
+        for i, (gindex, group, pindex, p) in enumerate(params):
+            state = self.state[p]
+            if len(state) == 0:
+                self.init_state(group, p, gindex, pindex)
+
+            self.prefetch_state(p)
+            if i + 1 < len(params):
+                # paged CPU states of the next parameter are read from disk during this update
+                self.prefetch_state(params[i + 1][3], cpu_only=True)
+            self.update_step(group, p, gindex, pindex)
+            if p.device.type == "cuda":
                 torch.cuda.synchronize()
-        if self.is_paged:
+            self.writeback_state(p)
+        if self.is_paged and torch.cuda.is_initialized():
             # all paged operation are asynchronous, we need
             # to sync to make sure all tensors are in the right state
             torch.cuda.synchronize()
@@ -305,9 +333,15 @@ class Optimizer8bit(torch.optim.Optimizer):
         config["block_wise"] = self.args.block_wise
         config["max_unorm"] = self.args.max_unorm
         config["skip_zeros"] = self.args.skip_zeros
+        config["stochastic_rounding"] = getattr(self.args, "stochastic_rounding", False)
+        config["max_grad_norm"] = getattr(self.args, "max_grad_norm", 0.0)
+        config["blocksize_4bit"] = getattr(self.args, "blocksize_4bit", 128)
 
         if (gindex, pindex) in self.mng.index2config:
             config.update(self.mng.index2config[(gindex, pindex)])
+        # the CPU only implements blockwise 8-bit states, e.g. for LAMB8bit and LARS8bit
+        if group["params"][pindex].device.type == "cpu":
+            config["block_wise"] = True
         return config
 
     def init_state(self, group, p, gindex, pindex):
@@ -316,25 +350,101 @@ class Optimizer8bit(torch.optim.Optimizer):
     def update_step(self, group, p, gindex, pindex):
         raise NotImplementedError("The update_step method needs to be overridden")
 
+    def update_fused_cpu(self, params):
+        """
+        Updates CPU parameters with 32-bit states in one native call per set of equal hyperparameters,
+        instead of calling `update_step` for each of them. With `max_grad_norm`, the gradients of each
+        such set are clipped to that global norm first.
+
+        Returns the parameters that still need an `update_step`.
+        """
+        if getattr(self, "optimizer_name", None) not in F.str2optimizer_cpu:
+            return params
+
+        remaining = []
+        fused = {}
+        for gindex, group, pindex, p in params:
+            if p.device.type != "cpu" or not (p.is_contiguous() and p.grad.is_contiguous()):
+                remaining.append((gindex, group, pindex, p))
+                continue
+            state = self.state[p]
+            if len(state) == 0:
+                self.init_state(group, p, gindex, pindex)
+            config = self.get_config(gindex, pindex, group)
+            if (
+                state["state1"].dtype != torch.float32
+                or getattr(state["state1"], "is_paged", False)
+                or config["percentile_clipping"] < 100
+                or p.grad.dtype != p.dtype
+                or p.dtype not in F.dtype2scalar_type
+            ):
+                remaining.append((gindex, group, pindex, p))
+                continue
+
+            state["step"] += 1
+            key = (
+                state["step"],
+                tuple(config["betas"]),
+                config["eps"],
+                config["weight_decay"],
+                config["lr"],
+                config["max_unorm"],
+                config["skip_zeros"],
+                config["stochastic_rounding"],
+                config["max_grad_norm"],
+            )
+            fused.setdefault(key, []).append((p, state))
+
+        for key, entries in fused.items():
+            step, betas, eps, weight_decay, lr, max_unorm, skip_zeros, stochastic_rounding, max_grad_norm = key
+            F.optimizer_update_32bit_multi(
+                self.optimizer_name,
+                [p.grad for p, _ in entries],
+                [p for p, _ in entries],
+                [state["state1"] for _, state in entries],
+                betas[0],
+                eps,
+                step,
+                lr,
+                [state.get("state2") for _, state in entries],
+                betas[1],
+                weight_decay,
+                max_grad_norm=max_grad_norm,
+                unorm_vecs=[state["unorm_vec"] for _, state in entries] if max_unorm > 0.0 else None,
+                max_unorm=max_unorm,
+                skip_zeros=skip_zeros,
+                rounding_seeds=[state["rounding_seed"] for _, state in entries] if stochastic_rounding else None,
+            )
+        return remaining
+
     def get_state_buffer(self, p, dtype=torch.float32):
         if not self.is_paged or p.numel() < 1e5:
             return torch.zeros_like(p, dtype=dtype, device=p.device)
         else:
             # > 1 MB
             buff = F.get_paged(*p.shape, dtype=dtype, device=p.device)
-            F.fill(buff, 0)
+            # paged CPU buffers are file-backed and start out zeroed
+            if p.device.type != "cpu":
+                F.fill(buff, 0)
             self.page_mng.paged_tensors.append(buff)
             return buff
 
-    def prefetch_state(self, p):
-        if self.is_paged:
-            state = self.state[p]
-            s1 = state["state1"]
-            is_paged = getattr(s1, "is_paged", False)
-            if is_paged:
-                F.prefetch_tensor(state["state1"])
-                if "state2" in state:
-                    F.prefetch_tensor(state["state2"])
+    def paged_states(self, p):
+        state = self.state.get(p, {})
+        if not self.is_paged or not getattr(state.get("state1"), "is_paged", False):
+            return []
+        return [state["state1"]] + ([state["state2"]] if "state2" in state else [])
+
+    def prefetch_state(self, p, cpu_only=False):
+        for s in self.paged_states(p):
+            if not cpu_only or s.page_deviceid == -1:
+                F.prefetch_tensor(s)
+
+    def writeback_state(self, p):
+        # lets the kernel drop the pages of a paged CPU state once memory runs low
+        for s in self.paged_states(p):
+            if s.page_deviceid == -1:
+                F.writeback_tensor(s)
 
 
 class Optimizer2State(Optimizer8bit):
@@ -354,6 +464,9 @@ class Optimizer2State(Optimizer8bit):
         max_unorm=0.0,
         skip_zeros=False,
         is_paged=False,
+        stochastic_rounding=False,
+        blocksize_4bit=128,
+        max_grad_norm=0.0,
     ):
         """
         Base 2-state update optimizer class.
@@ -387,6 +500,12 @@ class Optimizer2State(Optimizer8bit):
                 Whether to skip zero values for sparse gradients and models to ensure correct updates.
             is_paged (`bool`, defaults to `False`):
                 Whether the optimizer is a paged optimizer or not.
+            stochastic_rounding (`bool`, defaults to `False`):
+                Whether to write bf16 CPU parameters with stochastic rounding, so that they can be trained without an fp32 master copy.
+            blocksize_4bit (`int`, defaults to 128):
+                The number of values per absmax of 4-bit states (`optim_bits=4`), an even divisor of 16384.
+            max_grad_norm (`float`, defaults to 0.0):
+                Clips the gradients to this global norm like `torch.nn.utils.clip_grad_norm_` before the update, 0 to not clip them. The norm is taken over the parameters updated together, i.e. the contiguous CPU parameters with 32-bit states and the same hyperparameters and step; it is not supported for other parameters.
         """
         if not 0.0 <= lr:
             raise ValueError(f"Invalid learning rate: {lr}")
@@ -413,6 +532,9 @@ class Optimizer2State(Optimizer8bit):
             args["block_wise"] = block_wise
             args["max_unorm"] = max_unorm
             args["skip_zeros"] = skip_zeros
+            args["stochastic_rounding"] = stochastic_rounding
+            args["blocksize_4bit"] = blocksize_4bit
+            args["max_grad_norm"] = max_grad_norm
 
             self.args = MockArgs(args)
         else:
@@ -426,7 +548,7 @@ class Optimizer2State(Optimizer8bit):
 
         if config["optim_bits"] == 32:
             dtype = torch.float32
-        elif config["optim_bits"] == 8:
+        elif config["optim_bits"] in (8, 4):
             dtype = torch.uint8
         else:
             raise NotImplementedError(f'Amount of optimizer bits not supported: {config["optim_bits"]}')
@@ -440,6 +562,8 @@ class Optimizer2State(Optimizer8bit):
         if dtype == torch.float32 or (dtype == torch.uint8 and p.numel() < 4096):
             state["state1"] = self.get_state_buffer(p, dtype=torch.float32)
             state["state2"] = self.get_state_buffer(p, dtype=torch.float32)
+        elif config["optim_bits"] == 4:
+            self.init_state_4bit(p, state, 2, config["blocksize_4bit"])
         elif dtype == torch.uint8:
             if state["step"] == 0:
                 if "dynamic" not in self.name2qmap:
@@ -471,6 +595,8 @@ class Optimizer2State(Optimizer8bit):
 
         if config["max_unorm"] > 0.0:
             state["unorm_vec"] = torch.zeros((1,), device=p.device)
+        if config["stochastic_rounding"]:
+            state["rounding_seed"] = int(torch.randint(0, 2**62, (1,)).item())
 
     @torch.no_grad()
     def update_step(self, group, p, gindex, pindex):
@@ -478,6 +604,10 @@ class Optimizer2State(Optimizer8bit):
         grad = p.grad
 
         config = self.get_config(gindex, pindex, group)
+        if config["max_grad_norm"] > 0.0:
+            raise NotImplementedError(
+                "max_grad_norm is only supported for contiguous CPU parameters with 32-bit states"
+            )
 
         state["step"] += 1
         step = state["step"]
@@ -509,8 +639,33 @@ class Optimizer2State(Optimizer8bit):
                 state["unorm_vec"] if config["max_unorm"] > 0.0 else None,
                 max_unorm=config["max_unorm"],
                 skip_zeros=config["skip_zeros"],
+                rounding_seed=state.get("rounding_seed"),
             )
 
+        elif state["state1"].dtype == torch.uint8 and config["optim_bits"] == 4:
+            F.optimizer_update_4bit_blockwise(
+                self.optimizer_name,
+                grad,
+                p,
+                state["state1"],
+                state["state2"],
+                config["betas"][0],
+                config["betas"][1],
+                config["eps"],
+                step,
+                config["lr"],
+                state["qmap1"],
+                state["qmap2"],
+                state["absmax1"],
+                state["absmax2"],
+                blocksize=config["blocksize_4bit"],
+                weight_decay=config["weight_decay"],
+                gnorm_scale=gnorm_scale,
+                skip_zeros=config["skip_zeros"],
+                unorm_vec=state["unorm_vec"] if config["max_unorm"] > 0.0 else None,
+                max_unorm=config["max_unorm"],
+                rounding_seed=state.get("rounding_seed"),
+            )
         elif state["state1"].dtype == torch.uint8 and not config["block_wise"]:
             F.optimizer_update_8bit(
                 self.optimizer_name,
@@ -557,6 +712,9 @@ class Optimizer2State(Optimizer8bit):
                 config["weight_decay"],
                 gnorm_scale=gnorm_scale,
                 skip_zeros=config["skip_zeros"],
+                unorm_vec=state["unorm_vec"] if config["max_unorm"] > 0.0 else None,
+                max_unorm=config["max_unorm"],
+                rounding_seed=state.get("rounding_seed"),
             )
 
 
@@ -577,6 +735,9 @@ class Optimizer1State(Optimizer8bit):
         max_unorm=0.0,
         skip_zeros=False,
         is_paged=False,
+        stochastic_rounding=False,
+        blocksize_4bit=128,
+        max_grad_norm=0.0,
     ):
         """
         Base 1-state update optimizer class.
@@ -610,6 +771,12 @@ class Optimizer1State(Optimizer8bit):
                 Whether to skip zero values for sparse gradients and models to ensure correct updates.
             is_paged (`bool`, defaults to `False`):
                 Whether the optimizer is a paged optimizer or not.
+            stochastic_rounding (`bool`, defaults to `False`):
+                Whether to write bf16 CPU parameters with stochastic rounding, so that they can be trained without an fp32 master copy.
+            blocksize_4bit (`int`, defaults to 128):
+                The number of values per absmax of 4-bit states (`optim_bits=4`), an even divisor of 16384.
+            max_grad_norm (`float`, defaults to 0.0):
+                Clips the gradients to this global norm like `torch.nn.utils.clip_grad_norm_` before the update, 0 to not clip them. The norm is taken over the parameters updated together, i.e. the contiguous CPU parameters with 32-bit states and the same hyperparameters and step; it is not supported for other parameters.
         """
         if not 0.0 <= lr:
             raise ValueError(f"Invalid learning rate: {lr}")
@@ -632,6 +799,9 @@ class Optimizer1State(Optimizer8bit):
             args["block_wise"] = block_wise
             args["max_unorm"] = max_unorm
             args["skip_zeros"] = skip_zeros
+            args["stochastic_rounding"] = stochastic_rounding
+            args["blocksize_4bit"] = blocksize_4bit
+            args["max_grad_norm"] = max_grad_norm
 
             self.args = MockArgs(args)
         else:
@@ -645,7 +815,7 @@ class Optimizer1State(Optimizer8bit):
 
         if config["optim_bits"] == 32:
             dtype = torch.float32
-        elif config["optim_bits"] == 8:
+        elif config["optim_bits"] in (8, 4):
             dtype = torch.uint8
         else:
             raise NotImplementedError(f'Amount of optimizer bits not supported: {config["optim_bits"]}')
@@ -658,6 +828,8 @@ class Optimizer1State(Optimizer8bit):
 
         if dtype == torch.float32 or (dtype == torch.uint8 and p.numel() < 4096):
             state["state1"] = self.get_state_buffer(p, dtype=torch.float32)
+        elif config["optim_bits"] == 4:
+            self.init_state_4bit(p, state, 1, config["blocksize_4bit"])
         elif dtype == torch.uint8:
             if state["step"] == 0:
                 if "dynamic" not in self.name2qmap:
@@ -682,6 +854,8 @@ class Optimizer1State(Optimizer8bit):
 
         if config["max_unorm"] > 0.0:
             state["unorm_vec"] = torch.zeros((1,), device=p.device)
+        if config["stochastic_rounding"]:
+            state["rounding_seed"] = int(torch.randint(0, 2**62, (1,)).item())
 
     @torch.no_grad()
     def update_step(self, group, p, gindex, pindex):
@@ -689,6 +863,10 @@ class Optimizer1State(Optimizer8bit):
         grad = p.grad
 
         config = self.get_config(gindex, pindex, group)
+        if config["max_grad_norm"] > 0.0:
+            raise NotImplementedError(
+                "max_grad_norm is only supported for contiguous CPU parameters with 32-bit states"
+            )
 
         state["step"] += 1
         step = state["step"]
@@ -720,8 +898,33 @@ class Optimizer1State(Optimizer8bit):
                 state["unorm_vec"] if config["max_unorm"] > 0.0 else None,
                 max_unorm=config["max_unorm"],
                 skip_zeros=config["skip_zeros"],
+                rounding_seed=state.get("rounding_seed"),
             )
 
+        elif state["state1"].dtype == torch.uint8 and config["optim_bits"] == 4:
+            F.optimizer_update_4bit_blockwise(
+                self.optimizer_name,
+                grad,
+                p,
+                state["state1"],
+                None,
+                config["betas"][0],
+                config["betas"][1],
+                config["eps"],
+                step,
+                config["lr"],
+                state["qmap1"],
+                None,
+                state["absmax1"],
+                None,
+                blocksize=config["blocksize_4bit"],
+                weight_decay=config["weight_decay"],
+                gnorm_scale=gnorm_scale,
+                skip_zeros=config["skip_zeros"],
+                unorm_vec=state["unorm_vec"] if config["max_unorm"] > 0.0 else None,
+                max_unorm=config["max_unorm"],
+                rounding_seed=state.get("rounding_seed"),
+            )
         elif state["state1"].dtype == torch.uint8 and not config["block_wise"]:
             F.optimizer_update_8bit(
                 self.optimizer_name,
@@ -766,4 +969,7 @@ class Optimizer1State(Optimizer8bit):
                 config["weight_decay"],
                 gnorm_scale=gnorm_scale,
                 skip_zeros=config["skip_zeros"],
+                unorm_vec=state["unorm_vec"] if config["max_unorm"] > 0.0 else None,
+                max_unorm=config["max_unorm"],
+                rounding_seed=state.get("rounding_seed"),
             )
@@ -1,14 +1,19 @@
-#include <BinSearch.h>
-
 #ifndef common
 #define common
 
-using namespace BinSearch;
+#include <stdint.h>
+#include <string.h>
 
 #define BLOCK_SIZE 16384
 
+typedef enum ScalarType_t
+{
+	Float32 = 0,
+	Float16 = 1,
+	BFloat16 = 2,
+} ScalarType_t;
+
 struct quantize_block_args {
-    BinAlgo<Scalar, float, Direct2> *bin_searcher;
     float *code;
     float *A;
     float *absmax;
@@ -22,4 +27,109 @@ struct quantize_block_args {
 
 void quantize_block(const quantize_block_args& args);
 
+// Scalar conversions for the 16-bit types on the host. They are only used by
+// the translation units built with the default flags (not by cpu_kernels.cpp).
+static inline float bits_to_float(uint32_t bits) { float f; memcpy(&f, &bits, sizeof(f)); return f; }
+static inline uint32_t float_to_bits(float f) { uint32_t bits; memcpy(&bits, &f, sizeof(bits)); return bits; }
+
+static inline float bf16_to_float(uint16_t h) { return bits_to_float((uint32_t)h << 16); }
+
+static inline uint16_t float_to_bf16(float f)
+{
+    uint32_t bits = float_to_bits(f);
+    if ((bits & 0x7fffffffu) > 0x7f800000u)
+        return (uint16_t)((bits >> 16) | 0x40); // quiet NaN
+    // round to nearest even
+    bits += 0x7fffu + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
+}
+
+// Counter-based random bits: a function of (key, counter) only, so that results do not
+// depend on how the work is split between threads. The mixing function is the finalizer
+// of SplitMix64.
+static inline uint64_t counter_random(uint64_t key, uint64_t counter)
+{
+    uint64_t z = key + (counter + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Rounds up with a probability equal to the distance from the value below, given 16
+// random bits, so that the rounding error is zero in expectation. bf16 values are kept.
+static inline uint16_t float_to_bf16_stochastic(float f, uint32_t random)
+{
+    const uint32_t bits = float_to_bits(f);
+    if ((bits & 0x7fffffffu) >= 0x7f800000u)
+        return float_to_bf16(f); // inf and NaN
+    return (uint16_t)((bits + (random & 0xffffu)) >> 16);
+}
+
+static inline float half_to_float(uint16_t h)
+{
+    const uint32_t w = (uint32_t)h << 16;
+    const uint32_t sign = w & 0x80000000u;
+    const uint32_t two_w = w + w;
+    // normals: rebias the exponent by shifting into place and scaling by 2^-112
+    const float normalized = bits_to_float((two_w >> 4) + (0xe0u << 23)) * 1.925929944e-34f;
+    // subnormals: use the magic number 0.5 to get the mantissa as a float
+    const float denormalized = bits_to_float((two_w >> 17) | (126u << 23)) - 0.5f;
+    const uint32_t result = sign | (two_w < (1u << 27) ? float_to_bits(denormalized) : float_to_bits(normalized));
+    return bits_to_float(result);
+}
+
+static inline uint16_t float_to_half(float f)
+{
+    // scale by 2^112 and 2^-110 to round the mantissa to nearest even with the FPU
+    float base = ((f < 0.0f ? -f : f) * 5.192296858534828e+33f) * 7.703719777548943e-34f;
+    const uint32_t w = float_to_bits(f);
+    const uint32_t shl1_w = w + w;
+    const uint32_t sign = w & 0x80000000u;
+    uint32_t bias = shl1_w & 0xff000000u;
+    if (bias < 0x71000000u)
+        bias = 0x71000000u;
+    base = bits_to_float((bias >> 1) + 0x07800000u) + base;
+    const uint32_t bits = float_to_bits(base);
+    const uint32_t nonsign = ((bits >> 13) & 0x00007c00u) + (bits & 0x00000fffu);
+    return (uint16_t)((sign >> 16) | (shl1_w > 0xff000000u ? 0x7e00u : nonsign));
+}
+
+// loads/stores n values of the given type from/to float
+static inline void load_as_float(const void *src, ScalarType_t dtype, long long offset, long long n, float *dst)
+{
+    if (dtype == Float32)
+        memcpy(dst, (const float *)src + offset, n * sizeof(float));
+    else if (dtype == BFloat16)
+        for (long long i = 0; i < n; i++)
+            dst[i] = bf16_to_float(((const uint16_t *)src)[offset + i]);
+    else
+        for (long long i = 0; i < n; i++)
+            dst[i] = half_to_float(((const uint16_t *)src)[offset + i]);
+}
+
+static inline void store_from_float(const float *src, ScalarType_t dtype, long long offset, long long n, void *dst)
+{
+    if (dtype == Float32)
+        memcpy((float *)dst + offset, src, n * sizeof(float));
+    else if (dtype == BFloat16)
+        for (long long i = 0; i < n; i++)
+            ((uint16_t *)dst)[offset + i] = float_to_bf16(src[i]);
+    else
+        for (long long i = 0; i < n; i++)
+            ((uint16_t *)dst)[offset + i] = float_to_half(src[i]);
+}
+
+// stores n values as bf16 with stochastic rounding; element offset + i draws its random
+// bits from counter_random(key, (offset + i) / 4)
+static inline void store_bf16_stochastic(const float *src, long long offset, long long n, void *dst, uint64_t key)
+{
+    uint64_t random = 0;
+    for (long long i = 0; i < n; i++) {
+        const long long index = offset + i;
+        if (i == 0 || index % 4 == 0)
+            random = counter_random(key, index / 4);
+        ((uint16_t *)dst)[index] = float_to_bf16_stochastic(src[i], (uint32_t)(random >> (16 * (index % 4))));
+    }
+}
+
 #endif
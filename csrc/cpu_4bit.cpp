@@ -0,0 +1,300 @@
+#include <common.h>
+#include <cpu_autotune.h>
+#include <cpu_kernels.h>
+#include <cpu_ops.h>
+#include <cpu_threads.h>
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+// The quantization below reproduces dQuantizeFP4/dQuantizeNF4 and the dequantization
+// dDequantizeFP4Tree/dDequantizeNF4 in kernels.cu, so that 4-bit weights move freely
+// between the CPU and the GPU.
+
+namespace {
+
+// values of the nibbles, normalized to [-1, 1]
+const float nf4_code[16] = {
+    -1.0f, -0.6961928009986877f, -0.5250730514526367f, -0.39491748809814453f,
+    -0.28444138169288635f, -0.18477343022823334f, -0.09105003625154495f, 0.0f,
+    0.07958029955625534f, 0.16093020141124725f, 0.24611230194568634f, 0.33791524171829224f,
+    0.44070982933044434f, 0.5626170039176941f, 0.7229568362236023f, 1.0f,
+};
+const float fp4_code[16] = {
+    0.0f, 5.208333333e-03f, 0.66666667f, 1.0f, 0.33333333f, 0.5f, 0.16666667f, 0.25f,
+    -0.0f, -5.208333333e-03f, -0.66666667f, -1.0f, -0.33333333f, -0.5f, -0.16666667f, -0.25f,
+};
+
+// midpoints between neighbouring values, the pivots of the search trees in kernels.cu
+const float nf4_pivots[15] = {
+    -0.8480964004993439f, -0.6106329262256622f, -0.4599952697753906f, -0.33967943489551544f,
+    -0.23460740596055984f, -0.13791173323988914f, -0.045525018125772476f, 0.03979014977812767f,
+    0.1202552504837513f, 0.2035212516784668f, 0.2920137718319893f, 0.3893125355243683f,
+    0.5016634166240692f, 0.6427869200706482f, 0.8614784181118011f,
+};
+const float fp4_pivots[7] = {0.00260417f, 0.0859375f, 0.20833333f, 0.29166667f, 0.4166667f, 0.583333f, 0.8333333f};
+// FP4 magnitudes are not sorted by their bits: the n-th smallest one
+const unsigned char fp4_rank_to_bits[8] = {0b000, 0b001, 0b110, 0b111, 0b100, 0b101, 0b010, 0b011};
+
+// counting the pivots below x instead of walking the tree keeps the loop branch free;
+// NaN compares false everywhere and ends up at the bottom like on the GPU
+inline unsigned char quantize_nf4(float x)
+{
+    unsigned char q = 0;
+    for (int i = 0; i < 15; i++)
+        q += x > nf4_pivots[i];
+    return q;
+}
+
+inline unsigned char quantize_fp4(float x)
+{
+    const unsigned char sign = x < 0.0f ? 0b1000 : 0b0000;
+    const float a = fabsf(x);
+    unsigned char rank = 0;
+    for (int i = 0; i < 7; i++)
+        rank += a > fp4_pivots[i];
+    return fp4_rank_to_bits[rank] + sign;
+}
+
+// quantizes n <= blocksize values into one block
+template <unsigned char (*quantize)(float)>
+void quantize_4bit_block(const float *x, long long n, float *absmax, unsigned char *out)
+{
+    float absmax_block = 0.0f;
+    for (long long i = 0; i < n; i++) {
+        float a = fabsf(x[i]);
+        absmax_block = a > absmax_block ? a : absmax_block;
+    }
+    *absmax = absmax_block;
+
+    // a missing last value of an odd sized tensor is quantized as 0, like the padding on the GPU
+    const float scale = 1.0f / absmax_block;
+    for (long long i = 0; i < n; i += 2) {
+        const float second = i + 1 < n ? x[i + 1] : 0.0f;
+        out[i / 2] = (unsigned char)((quantize(x[i] * scale) << 4) | quantize(second * scale));
+    }
+}
+
+template <unsigned char (*quantize)(float)>
+void quantize_4bit_blocks(ScalarType_t dtype, const void *A, float *absmax, unsigned char *out, long long blocksize,
+                          long long n)
+{
+    const long long num_blocks = (n + blocksize - 1) / blocksize;
+    parallel_for(num_blocks, blocks_per_task(blocksize), [&](long long first_block, long long last_block) {
+        std::vector<float> buffer(blocksize);
+        for (long long block = first_block; block < last_block; block++) {
+            const long long block_idx = block * blocksize;
+            const long long valid_items = std::min(blocksize, n - block_idx);
+            load_as_float(A, dtype, block_idx, valid_items, buffer.data());
+            quantize_4bit_block<quantize>(buffer.data(), valid_items, absmax + block, out + block_idx / 2);
+        }
+    });
+}
+
+} // namespace
+
+const float *cpu_4bit_code(int quant_type) { return quant_type == CPU_NF4 ? nf4_code : fp4_code; }
+
+void quantize_4bit_cpu(int quant_type, int dtype, void *A, float *absmax, unsigned char *out, long long blocksize, long long n)
+{
+    if (quant_type == CPU_NF4)
+        quantize_4bit_blocks<quantize_nf4>((ScalarType_t)dtype, A, absmax, out, blocksize, n);
+    else
+        quantize_4bit_blocks<quantize_fp4>((ScalarType_t)dtype, A, absmax, out, blocksize, n);
+}
+
+void quantize_4bit_values(int quant_type, const float *A, float *absmax, unsigned char *out, long long blocksize, long long n)
+{
+    for (long long block_idx = 0; block_idx < n; block_idx += blocksize) {
+        const long long valid_items = std::min(blocksize, n - block_idx);
+        if (quant_type == CPU_NF4)
+            quantize_4bit_block<quantize_nf4>(A + block_idx, valid_items, absmax + block_idx / blocksize, out + block_idx / 2);
+        else
+            quantize_4bit_block<quantize_fp4>(A + block_idx, valid_items, absmax + block_idx / blocksize, out + block_idx / 2);
+    }
+}
+
+void dequantize_4bit_cpu(int quant_type, int dtype, unsigned char *A, float *absmax, void *out, long long blocksize, long long n)
+{
+    const float *code = cpu_4bit_code(quant_type);
+    const long long num_blocks = (n + blocksize - 1) / blocksize;
+    parallel_for(num_blocks, blocks_per_task(blocksize), [&](long long first_block, long long last_block) {
+        std::vector<float> buffer(blocksize);
+        for (long long block = first_block; block < last_block; block++) {
+            const long long block_idx = block * blocksize;
+            const long long valid_items = std::min(blocksize, n - block_idx);
+            const float absmax_block = absmax[block];
+            for (long long i = 0; i < valid_items; i++) {
+                const unsigned char byte = A[(block_idx + i) / 2];
+                buffer[i] = code[i % 2 == 0 ? byte >> 4 : byte & 0x0f] * absmax_block;
+            }
+            store_from_float(buffer.data(), (ScalarType_t)dtype, block_idx, valid_items, out);
+        }
+    });
+}
+
+void prepack_4bit_cpu(unsigned char *B, float *absmax, unsigned char *packed, float *scales,
+                      long long N, long long K, long long blocksize)
+{
+    const long long num_panels = (N + PANEL_4BIT - 1) / PANEL_4BIT;
+    const long long k_blocks = K / blocksize;
+    parallel_for(num_panels, 1, [&](long long first_panel, long long last_panel) {
+        for (long long panel = first_panel; panel < last_panel; panel++) {
+            const long long n0 = panel * PANEL_4BIT;
+            auto nibble = [&](long long col, long long k) -> unsigned char {
+                if (col >= N)
+                    return 0;
+                const long long idx = col * K + k;
+                return idx % 2 == 0 ? B[idx / 2] >> 4 : B[idx / 2] & 0x0f;
+            };
+
+            unsigned char *dst = packed + panel * K * (PANEL_4BIT / 2);
+            for (long long k = 0; k < K; k++)
+                for (int j = 0; j < PANEL_4BIT / 2; j++)
+                    dst[k * (PANEL_4BIT / 2) + j] = (unsigned char)(nibble(n0 + j, k) | (nibble(n0 + j + PANEL_4BIT / 2, k) << 4));
+
+            float *panel_scales = scales + panel * k_blocks * PANEL_4BIT;
+            for (long long kb = 0; kb < k_blocks; kb++)
+                for (int j = 0; j < PANEL_4BIT; j++)
+                    panel_scales[kb * PANEL_4BIT + j] = n0 + j < N ? absmax[(n0 + j) * k_blocks + kb] : 0.0f;
+        }
+    });
+}
+
+// The GEMM is blocked for the caches: a task owns gemm_rows rows of A and gemm_panels
+// panels of the weight (see cpu_autotune.h). For each panel, GEMM_4BIT_KC rows are
+// decoded into a buffer that stays in L1 (16 KB of floats) and multiplied with the
+// matching columns of A by the register blocked gemm_panel kernel before the next rows
+// are decoded. The weight is never dequantized as a whole.
+static const long long GEMM_4BIT_KC = 256;
+
+// 16-bit activations of shape M x K are widened once instead of once per panel
+static const float *widen_activations(void *A, ScalarType_t type, long long M, long long K, std::vector<float> &buffer)
+{
+    if (type == Float32)
+        return (const float *)A;
+    buffer.resize(M * K);
+    parallel_for(M, std::max(1LL, BLOCK_SIZE / K), [&](long long first_row, long long last_row) {
+        load_as_float(A, type, first_row * K, (last_row - first_row) * K, buffer.data() + first_row * K);
+    });
+    return buffer.data();
+}
+
+void gemm_4bit_cpu(int quant_type, int dtype, void *A, unsigned char *packed, float *scales, void *out,
+                   long long M, long long N, long long K, long long blocksize)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const cpu_tuning tuning = get_cpu_tuning();
+    const float *code = cpu_4bit_code(quant_type);
+    const ScalarType_t type = (ScalarType_t)dtype;
+
+    std::vector<float> A_buffer;
+    const float *A_float = widen_activations(A, type, M, K, A_buffer);
+
+    const long long num_panels = (N + PANEL_4BIT - 1) / PANEL_4BIT;
+    const long long k_blocks = K / blocksize;
+    const long long row_blocks = (M + tuning.gemm_rows - 1) / tuning.gemm_rows;
+    const long long panel_groups = (num_panels + tuning.gemm_panels - 1) / tuning.gemm_panels;
+
+    parallel_for(row_blocks * panel_groups, 1, [&](long long first_task, long long last_task) {
+        alignas(64) float decoded[GEMM_4BIT_KC * PANEL_4BIT];
+        alignas(64) float tile[GEMM_4BIT_MAX_ROWS * PANEL_4BIT];
+        for (long long task = first_task; task < last_task; task++) {
+            const long long m0 = (task / panel_groups) * tuning.gemm_rows;
+            const long long rows = std::min(tuning.gemm_rows, M - m0);
+            const long long first_panel = (task % panel_groups) * tuning.gemm_panels;
+            const long long last_panel = std::min(num_panels, first_panel + tuning.gemm_panels);
+
+            for (long long panel = first_panel; panel < last_panel; panel++) {
+                const unsigned char *panel_data = packed + panel * K * (PANEL_4BIT / 2);
+                const float *panel_scales = scales + panel * k_blocks * PANEL_4BIT;
+                std::fill(tile, tile + rows * PANEL_4BIT, 0.0f);
+                for (long long k0 = 0; k0 < K; k0 += GEMM_4BIT_KC) {
+                    const long long kc = std::min(GEMM_4BIT_KC, K - k0);
+                    kernels->decode_4bit_panel(code, panel_data, panel_scales, decoded, k0, k0 + kc, blocksize);
+                    kernels->gemm_panel(A_float + m0 * K + k0, K, decoded, tile, rows, kc);
+                }
+
+                const long long n0 = panel * PANEL_4BIT;
+                const long long cols = std::min((long long)PANEL_4BIT, N - n0);
+                for (long long r = 0; r < rows; r++)
+                    store_from_float(tile + r * PANEL_4BIT, type, (m0 + r) * N + n0, cols, out);
+            }
+        }
+    });
+}
+
+// Decodes rows [n0, n0 + kc) and columns [k0, k0 + cols) of a quantize_4bit_cpu weight
+// of shape N x K into kc rows of PANEL_4BIT floats, the layout gemm_panel expects of B.
+// Walking the weight down its columns, value n * K + k has absmax (n * K + k) / blocksize.
+static void decode_4bit_columns(const float *code, const unsigned char *W, const float *absmax, float *out,
+                                long long n0, long long kc, long long k0, long long cols, long long K,
+                                long long blocksize)
+{
+    // the common case: the PANEL_4BIT values of a row start a byte and share one absmax
+    const bool aligned = cols == PANEL_4BIT && K % PANEL_4BIT == 0 && blocksize % PANEL_4BIT == 0;
+    for (long long r = 0; r < kc; r++) {
+        const long long idx = (n0 + r) * K + k0;
+        float *dst = out + r * PANEL_4BIT;
+        if (aligned) {
+            const float scale = absmax[idx / blocksize];
+            const unsigned char *bytes = W + idx / 2;
+            for (int j = 0; j < PANEL_4BIT / 2; j++) {
+                dst[2 * j] = code[bytes[j] >> 4] * scale;
+                dst[2 * j + 1] = code[bytes[j] & 0x0f] * scale;
+            }
+            continue;
+        }
+        for (long long j = 0; j < PANEL_4BIT; j++) {
+            if (j >= cols) {
+                dst[j] = 0.0f;
+                continue;
+            }
+            const long long i = idx + j;
+            dst[j] = code[i % 2 == 0 ? W[i / 2] >> 4 : W[i / 2] & 0x0f] * absmax[i / blocksize];
+        }
+    }
+}
+
+// Blocked like gemm_4bit_cpu, with the roles of the dimensions swapped: a task owns
+// gemm_rows rows of A and gemm_panels panels of PANEL_4BIT output columns, and decodes
+// GEMM_4BIT_KC rows of those columns of W at a time into L1.
+void gemm_4bit_transposed_cpu(int quant_type, int dtype, void *A, unsigned char *W, float *absmax, void *out,
+                              long long M, long long N, long long K, long long blocksize)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const cpu_tuning tuning = get_cpu_tuning();
+    const float *code = cpu_4bit_code(quant_type);
+    const ScalarType_t type = (ScalarType_t)dtype;
+
+    std::vector<float> A_buffer;
+    const float *A_float = widen_activations(A, type, M, N, A_buffer);
+
+    const long long num_panels = (K + PANEL_4BIT - 1) / PANEL_4BIT;
+    const long long row_blocks = (M + tuning.gemm_rows - 1) / tuning.gemm_rows;
+    const long long panel_groups = (num_panels + tuning.gemm_panels - 1) / tuning.gemm_panels;
+
+    parallel_for(row_blocks * panel_groups, 1, [&](long long first_task, long long last_task) {
+        alignas(64) float decoded[GEMM_4BIT_KC * PANEL_4BIT];
+        alignas(64) float tile[GEMM_4BIT_MAX_ROWS * PANEL_4BIT];
+        for (long long task = first_task; task < last_task; task++) {
+            const long long m0 = (task / panel_groups) * tuning.gemm_rows;
+            const long long rows = std::min(tuning.gemm_rows, M - m0);
+            const long long first_panel = (task % panel_groups) * tuning.gemm_panels;
+            const long long last_panel = std::min(num_panels, first_panel + tuning.gemm_panels);
+
+            for (long long panel = first_panel; panel < last_panel; panel++) {
+                const long long k0 = panel * PANEL_4BIT;
+                const long long cols = std::min((long long)PANEL_4BIT, K - k0);
+                std::fill(tile, tile + rows * PANEL_4BIT, 0.0f);
+                for (long long n0 = 0; n0 < N; n0 += GEMM_4BIT_KC) {
+                    const long long kc = std::min(GEMM_4BIT_KC, N - n0);
+                    decode_4bit_columns(code, W, absmax, decoded, n0, kc, k0, cols, K, blocksize);
+                    kernels->gemm_panel(A_float + m0 * N + n0, N, decoded, tile, rows, kc);
+                }
+                for (long long r = 0; r < rows; r++)
+                    store_from_float(tile + r * PANEL_4BIT, type, (m0 + r) * K + k0, cols, out);
+            }
+        }
+    });
+}
@@ -0,0 +1,303 @@
+// The public C++ API in include/bitsandbytes/bitsandbytes.h: checks the views and
+// forwards them to the ops of cpu_ops.h.
+
+#include <bitsandbytes/bitsandbytes.h>
+#include <common.h>
+#include <cpu_ops.h>
+#include <new>
+#include <stdarg.h>
+#include <stdio.h>
+#include <vector>
+
+namespace bnb {
+inline namespace v1 {
+
+namespace {
+
+thread_local char error_message[256] = "";
+
+status fail(status s, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error_message, sizeof(error_message), format, args);
+    va_end(args);
+    return s;
+}
+
+bool is_float(scalar_type dtype)
+{
+    return dtype == scalar_type::float32 || dtype == scalar_type::float16 || dtype == scalar_type::bfloat16;
+}
+
+int64_t shape_numel(int ndim, const int64_t *shape)
+{
+    int64_t n = 1;
+    for (int i = 0; i < ndim; i++)
+        n *= shape[i];
+    return n;
+}
+
+status check_view(const tensor_view &tensor, const char *name)
+{
+    if (tensor.ndim < 0 || tensor.ndim > BNB_MAX_DIMS)
+        return fail(status::invalid_shape, "%s has %d dimensions, at most %d are supported", name, tensor.ndim,
+                    BNB_MAX_DIMS);
+    for (int i = 0; i < tensor.ndim; i++)
+        if (tensor.shape[i] < 0)
+            return fail(status::invalid_shape, "%s has a negative size", name);
+    if (tensor.data == NULL && numel(tensor) > 0)
+        return fail(status::invalid_argument, "%s has no data", name);
+    if (!is_contiguous(tensor))
+        return fail(status::not_contiguous, "%s is not contiguous", name);
+    return status::ok;
+}
+
+status check_float_view(const tensor_view &tensor, const char *name)
+{
+    if (!is_float(tensor.dtype))
+        return fail(status::invalid_dtype, "%s must be float32, float16 or bfloat16", name);
+    return check_view(tensor, name);
+}
+
+status check_quantized(const quantized_tensor &tensor, const char *name)
+{
+    if (tensor.type != quant_type::blockwise_8bit && tensor.type != quant_type::fp4 && tensor.type != quant_type::nf4)
+        return fail(status::invalid_argument, "%s has an unknown quant_type %d", name, (int)tensor.type);
+    if (tensor.ndim < 0 || tensor.ndim > BNB_MAX_DIMS)
+        return fail(status::invalid_shape, "%s has %d dimensions, at most %d are supported", name, tensor.ndim,
+                    BNB_MAX_DIMS);
+    if (tensor.blocksize <= 0 || (tensor.type != quant_type::blockwise_8bit && tensor.blocksize % 2 != 0))
+        return fail(status::invalid_argument, "%s has an invalid blocksize of %lld", name, (long long)tensor.blocksize);
+    if (numel(tensor) == 0)
+        return status::ok;
+    if (tensor.data == NULL || tensor.absmax == NULL)
+        return fail(status::invalid_argument, "%s has no data or absmax", name);
+    if (tensor.type == quant_type::blockwise_8bit && tensor.code == NULL)
+        return fail(status::invalid_argument, "%s needs a code for blockwise_8bit", name);
+    if (tensor.nested &&
+        (tensor.nested_absmax == NULL || tensor.nested_code == NULL || tensor.nested_blocksize <= 0))
+        return fail(status::invalid_argument, "%s is nested but has no nested absmax, code or blocksize", name);
+    return status::ok;
+}
+
+// the fp32 scales of a nested tensor, or its absmax
+status unnested_absmax(const quantized_tensor &tensor, std::vector<float> &buffer, float *&absmax)
+{
+    if (!tensor.nested) {
+        absmax = (float *)tensor.absmax;
+        return status::ok;
+    }
+    try {
+        buffer.resize(num_blocks(tensor));
+    } catch (const std::bad_alloc &) {
+        return fail(status::out_of_memory, "cannot allocate %lld scales", (long long)num_blocks(tensor));
+    }
+    dequantize_cpu(tensor.nested_code, (unsigned char *)tensor.absmax, tensor.nested_absmax, buffer.data(),
+                   tensor.nested_blocksize, (long long)buffer.size());
+    for (float &value : buffer)
+        value += tensor.offset;
+    absmax = buffer.data();
+    return status::ok;
+}
+
+} // namespace
+
+const char *status_name(status s)
+{
+    switch (s) {
+    case status::ok:
+        return "ok";
+    case status::invalid_argument:
+        return "invalid_argument";
+    case status::invalid_dtype:
+        return "invalid_dtype";
+    case status::invalid_shape:
+        return "invalid_shape";
+    case status::not_contiguous:
+        return "not_contiguous";
+    case status::out_of_memory:
+        return "out_of_memory";
+    }
+    return "unknown";
+}
+
+const char *last_error_message() { return error_message; }
+
+int api_version_major() { return BNB_API_VERSION_MAJOR; }
+int api_version_minor() { return BNB_API_VERSION_MINOR; }
+
+tensor_view make_tensor_view(void *data, scalar_type dtype, int ndim, const int64_t *shape)
+{
+    tensor_view tensor = {};
+    tensor.data = data;
+    tensor.dtype = dtype;
+    tensor.ndim = ndim;
+    int64_t stride = 1;
+    for (int i = ndim - 1; i >= 0 && i < BNB_MAX_DIMS; i--) {
+        tensor.shape[i] = shape[i];
+        tensor.strides[i] = stride;
+        stride *= shape[i];
+    }
+    return tensor;
+}
+
+int64_t numel(const tensor_view &tensor) { return shape_numel(tensor.ndim, tensor.shape); }
+
+bool is_contiguous(const tensor_view &tensor)
+{
+    // like torch, the strides of dimensions of size 1 do not matter
+    int64_t stride = 1;
+    for (int i = tensor.ndim - 1; i >= 0; i--) {
+        if (tensor.shape[i] != 1 && tensor.strides[i] != stride)
+            return false;
+        stride *= tensor.shape[i];
+    }
+    return true;
+}
+
+int64_t numel(const quantized_tensor &tensor) { return shape_numel(tensor.ndim, tensor.shape); }
+
+int64_t num_blocks(const quantized_tensor &tensor) { return (numel(tensor) + tensor.blocksize - 1) / tensor.blocksize; }
+
+int64_t nested_num_blocks(const quantized_tensor &tensor)
+{
+    return tensor.nested ? (num_blocks(tensor) + tensor.nested_blocksize - 1) / tensor.nested_blocksize : 0;
+}
+
+int64_t quantized_bytes(const quantized_tensor &tensor)
+{
+    return tensor.type == quant_type::blockwise_8bit ? numel(tensor) : (numel(tensor) + 1) / 2;
+}
+
+status quantize(const tensor_view &input, quantized_tensor &qt)
+{
+    status s = check_float_view(input, "input");
+    if (s != status::ok)
+        return s;
+    qt.dtype = input.dtype;
+    qt.ndim = input.ndim;
+    for (int i = 0; i < input.ndim; i++)
+        qt.shape[i] = input.shape[i];
+    if ((s = check_quantized(qt, "qt")) != status::ok)
+        return s;
+    const long long n = numel(input);
+    if (n == 0)
+        return status::ok;
+
+    // nested scales are quantized from a temporary copy
+    std::vector<float> buffer;
+    float *absmax = (float *)qt.absmax;
+    if (qt.nested) {
+        try {
+            buffer.resize(num_blocks(qt));
+        } catch (const std::bad_alloc &) {
+            return fail(status::out_of_memory, "cannot allocate %lld scales", (long long)num_blocks(qt));
+        }
+        absmax = buffer.data();
+    }
+
+    if (qt.type == quant_type::blockwise_8bit) {
+        quantize_tensor_desc desc = {input.data, qt.data, absmax, qt.code, n, qt.blocksize, (int)input.dtype};
+        quantize_cpu_batched(&desc, 1);
+    } else {
+        quantize_4bit_cpu((int)qt.type, (int)input.dtype, input.data, absmax, qt.data, qt.blocksize, n);
+    }
+
+    if (qt.nested) {
+        // like quantize_4bit(compress_statistics=True): the scales minus their mean
+        double sum = 0.0;
+        for (float value : buffer)
+            sum += value;
+        qt.offset = (float)(sum / buffer.size());
+        for (float &value : buffer)
+            value -= qt.offset;
+        quantize_cpu(qt.nested_code, buffer.data(), qt.nested_absmax, (unsigned char *)qt.absmax,
+                     qt.nested_blocksize, (long long)buffer.size());
+    }
+    return status::ok;
+}
+
+status dequantize(const quantized_tensor &input, const tensor_view &out)
+{
+    status s = check_quantized(input, "input");
+    if (s != status::ok || (s = check_float_view(out, "out")) != status::ok)
+        return s;
+    const long long n = numel(input);
+    if (numel(out) != n)
+        return fail(status::invalid_shape, "out has %lld values instead of %lld", (long long)numel(out), n);
+    if (n == 0)
+        return status::ok;
+
+    std::vector<float> buffer;
+    float *absmax;
+    if ((s = unnested_absmax(input, buffer, absmax)) != status::ok)
+        return s;
+    if (input.type == quant_type::blockwise_8bit) {
+        quantize_tensor_desc desc = {out.data, input.data, absmax, input.code, n, input.blocksize, (int)out.dtype};
+        dequantize_cpu_batched(&desc, 1);
+    } else {
+        dequantize_4bit_cpu((int)input.type, (int)out.dtype, input.data, absmax, out.data, input.blocksize, n);
+    }
+    return status::ok;
+}
+
+status gemv(const tensor_view &x, const quantized_tensor &W, const tensor_view &out)
+{
+    status s = check_float_view(x, "x");
+    if (s != status::ok || (s = check_view(out, "out")) != status::ok || (s = check_quantized(W, "W")) != status::ok)
+        return s;
+    if (out.dtype != x.dtype)
+        return fail(status::invalid_dtype, "out must have the dtype of x");
+    if (W.ndim != 2 || x.ndim < 1 || out.ndim != x.ndim)
+        return fail(status::invalid_shape, "W must have 2 dimensions, x and out the same number");
+    const int64_t N = W.shape[0];
+    const int64_t K = W.shape[1];
+    const int64_t M = K > 0 ? numel(x) / K : 0;
+    if (x.shape[x.ndim - 1] != K || out.shape[out.ndim - 1] != N || numel(out) != M * N)
+        return fail(status::invalid_shape, "x must have shape (..., %lld) and out (..., %lld)", (long long)K,
+                    (long long)N);
+    if (K % W.blocksize != 0)
+        return fail(status::invalid_shape, "the %lld input features of W must be a multiple of its blocksize %lld",
+                    (long long)K, (long long)W.blocksize);
+    if (M * N == 0)
+        return status::ok;
+
+    std::vector<float> buffer;
+    float *absmax;
+    if ((s = unnested_absmax(W, buffer, absmax)) != status::ok)
+        return s;
+    gemv_blockwise_cpu((int)W.type, (int)x.dtype, x.data, W.data, absmax, W.code, out.data, M, N, K, W.blocksize);
+    return status::ok;
+}
+
+status optimizer_update_32bit(optimizer_type optimizer, const tensor_view &grad, const tensor_view &param,
+                              float *state1, float *state2, int step, const optimizer_config &config)
+{
+    status s = check_float_view(grad, "grad");
+    if (s != status::ok || (s = check_float_view(param, "param")) != status::ok)
+        return s;
+    if (grad.dtype != param.dtype)
+        return fail(status::invalid_dtype, "grad and param must have the same dtype");
+    const long long n = numel(param);
+    if (numel(grad) != n)
+        return fail(status::invalid_shape, "grad has %lld values and param %lld", (long long)numel(grad), n);
+    if ((int)optimizer < (int)optimizer_type::adam || (int)optimizer > (int)optimizer_type::lion)
+        return fail(status::invalid_argument, "unknown optimizer %d", (int)optimizer);
+    if (step < 1)
+        return fail(status::invalid_argument, "step counts from 1, got %d", step);
+    if (n > 0 && (state1 == NULL || (optimizer == optimizer_type::adam && state2 == NULL)))
+        return fail(status::invalid_argument, "the optimizer states are missing");
+    if (n == 0)
+        return status::ok;
+
+    float unorm = 0.0f;
+    optimizer_32bit_cpu((int)optimizer, (int)param.dtype, grad.data, param.data, state1,
+                        optimizer == optimizer_type::adam ? state2 : NULL, &unorm, config.max_unorm, config.param_norm,
+                        config.beta1, config.beta2, config.eps, config.weight_decay, step, config.lr,
+                        config.gnorm_scale, config.skip_zeros, false, 0, n);
+    return status::ok;
+}
+
+} // namespace v1
+} // namespace bnb
@@ -0,0 +1,387 @@
+#include <common.h>
+#include <cpu_autotune.h>
+#include <cpu_kernels.h>
+#include <cpu_ops.h>
+#include <cpu_threads.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// set by CMakeLists.txt from bitsandbytes/__init__.py
+#ifndef BNB_VERSION
+#define BNB_VERSION "unknown"
+#endif
+
+namespace {
+
+const long long DEFAULT_GEMM_ROWS = 64;
+const long long DEFAULT_GEMM_PANELS = 4;
+
+std::atomic<long long> task_values(BLOCK_SIZE);
+std::atomic<long long> gemm_rows(DEFAULT_GEMM_ROWS);
+std::atomic<long long> gemm_panels(DEFAULT_GEMM_PANELS);
+
+// 0 before the first use, 1 while loading or tuning, 2 afterwards
+std::atomic<int> tuning_state(0);
+std::mutex tuning_mutex;
+
+// a candidate has to be this much faster than the default to replace it, so that
+// timing noise does not flip parameters between runs
+const double TUNING_MARGIN = 0.03;
+
+void apply(const cpu_tuning &tuning)
+{
+    set_cpu_isa((CPU_ISA)tuning.isa);
+    task_values.store(tuning.task_values, std::memory_order_relaxed);
+    gemm_rows.store(tuning.gemm_rows, std::memory_order_relaxed);
+    gemm_panels.store(tuning.gemm_panels, std::memory_order_relaxed);
+}
+
+cpu_tuning current_tuning()
+{
+    cpu_tuning tuning;
+    tuning.isa = cpu_isa();
+    tuning.task_values = task_values.load(std::memory_order_relaxed);
+    tuning.gemm_rows = gemm_rows.load(std::memory_order_relaxed);
+    tuning.gemm_panels = gemm_panels.load(std::memory_order_relaxed);
+    return tuning;
+}
+
+bool env_enabled(const char *name)
+{
+    const char *value = getenv(name);
+    return value != NULL && atoi(value) != 0;
+}
+
+std::string cache_path()
+{
+    const char *path = getenv("BNB_CPU_AUTOTUNE_CACHE");
+    if (path != NULL && path[0] != '\0')
+        return path;
+    const char *dir = getenv("XDG_CACHE_HOME");
+    if (dir != NULL && dir[0] != '\0')
+        return std::string(dir) + "/bitsandbytes/cpu_autotune.txt";
+#if defined(_WIN32)
+    dir = getenv("LOCALAPPDATA");
+    if (dir != NULL && dir[0] != '\0')
+        return std::string(dir) + "/bitsandbytes/cpu_autotune.txt";
+#endif
+    dir = getenv("HOME");
+    if (dir != NULL && dir[0] != '\0')
+        return std::string(dir) + "/.cache/bitsandbytes/cpu_autotune.txt";
+    return "";
+}
+
+// tuned parameters only carry over to the same CPU, kernels and thread count
+std::string cache_key()
+{
+    return std::string(cpu_model_name()) + ";" + BNB_VERSION + ";" + std::to_string(get_num_threads()) + " threads";
+}
+
+// Entries are "<key>\t<isa> <task_values> <gemm_rows> <gemm_panels>" lines. An entry
+// from a damaged file or for a variant this process may not use is ignored.
+bool parse_entry(const char *values, cpu_tuning &tuning)
+{
+    char isa_name[32];
+    long long task, rows, panels;
+    if (sscanf(values, "%31s %lld %lld %lld", isa_name, &task, &rows, &panels) != 4)
+        return false;
+    int isa = cpu_isa_from_name(isa_name);
+    if (isa < 0 || isa > cpu_isa_default())
+        return false;
+    if (!cpu_isa_tunable())
+        isa = cpu_isa_default();
+    if (task < 1024 || task > (1LL << 24) || rows < 1 || rows > GEMM_4BIT_MAX_ROWS || panels < 1 || panels > 64)
+        return false;
+    tuning = cpu_tuning{isa, task, rows, panels};
+    return true;
+}
+
+// the lines of the cache file, without their newlines
+std::vector<std::string> read_cache(const std::string &path)
+{
+    std::vector<std::string> lines;
+    FILE *f = path.empty() ? NULL : fopen(path.c_str(), "r");
+    if (f == NULL)
+        return lines;
+    std::string line;
+    char buffer[512];
+    while (fgets(buffer, sizeof(buffer), f) != NULL) {
+        line += buffer;
+        if (line.back() == '\n') {
+            line.pop_back();
+            lines.push_back(line);
+            line.clear();
+        }
+    }
+    if (!line.empty())
+        lines.push_back(line);
+    fclose(f);
+    return lines;
+}
+
+bool load_entry(cpu_tuning &tuning)
+{
+    const std::string prefix = cache_key() + "\t";
+    for (const std::string &line : read_cache(cache_path()))
+        if (line.compare(0, prefix.size(), prefix) == 0 && parse_entry(line.c_str() + prefix.size(), tuning))
+            return true;
+    return false;
+}
+
+void make_parent_dirs(const std::string &path)
+{
+    for (size_t slash = path.find_first_of("/\\", 1); slash != std::string::npos;
+         slash = path.find_first_of("/\\", slash + 1)) {
+#if defined(_WIN32)
+        _mkdir(path.substr(0, slash).c_str());
+#else
+        mkdir(path.substr(0, slash).c_str(), 0755);
+#endif
+    }
+}
+
+// Replaces the entry of this host and keeps those of others, e.g. when the home
+// directory is shared between different machines. The file is replaced by a rename,
+// so that processes starting meanwhile read either the old or the new entries.
+bool store_entry(const cpu_tuning &tuning)
+{
+    const std::string path = cache_path();
+    if (path.empty()) {
+        fprintf(stderr, "bitsandbytes: no path for the CPU autotuning cache, set BNB_CPU_AUTOTUNE_CACHE\n");
+        return false;
+    }
+    const std::string key = cache_key();
+    std::vector<std::string> lines = read_cache(path);
+    if (lines.empty())
+        lines.push_back("# bitsandbytes CPU kernel parameters: <cpu>;<version>;<threads>\t<isa> <task_values> "
+                        "<gemm_rows> <gemm_panels>");
+    lines.erase(std::remove_if(lines.begin(), lines.end(),
+                               [&](const std::string &line) { return line.compare(0, key.size() + 1, key + "\t") == 0; }),
+                lines.end());
+    char values[128];
+    snprintf(values, sizeof(values), "\t%s %lld %lld %lld", cpu_isa_to_name((CPU_ISA)tuning.isa), tuning.task_values,
+             tuning.gemm_rows, tuning.gemm_panels);
+    lines.push_back(key + values);
+
+    make_parent_dirs(path);
+#if defined(_WIN32)
+    const std::string tmp_path = path + "." + std::to_string(_getpid()) + ".tmp";
+#else
+    const std::string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+#endif
+    FILE *f = fopen(tmp_path.c_str(), "w");
+    bool ok = f != NULL;
+    for (size_t i = 0; ok && i < lines.size(); i++)
+        ok = fprintf(f, "%s\n", lines[i].c_str()) >= 0;
+    if (f != NULL)
+        ok = fclose(f) == 0 && ok;
+#if defined(_WIN32)
+    // rename does not replace files on Windows
+    if (ok)
+        remove(path.c_str());
+#endif
+    ok = ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        remove(tmp_path.c_str());
+        fprintf(stderr, "bitsandbytes: cannot write the CPU autotuning cache %s\n", path.c_str());
+    }
+    return ok;
+}
+
+// Inputs of the workloads the candidates are timed on. The values do not matter for
+// the speed of the kernels, except that they must not be denormal.
+struct tuning_workloads {
+    std::vector<float> code;
+    std::vector<float> values;
+    std::vector<float> out;
+    std::vector<float> absmax;
+    std::vector<unsigned char> quantized;
+    std::vector<unsigned char> packed;
+    std::vector<float> scales;
+
+    static const long long LARGE = 1 << 20;
+    static const long long SMALL = 1 << 16;
+    static const long long GEMM_K = 2048;
+    static const long long GEMM_N = 4096;
+    static const long long GEMM_BLOCKSIZE = 64;
+
+    tuning_workloads()
+        : code(256), values(LARGE), out(LARGE), absmax(LARGE / 64), quantized(LARGE),
+          packed(GEMM_N * GEMM_K / 2), scales(GEMM_N * GEMM_K / GEMM_BLOCKSIZE, 1.0f)
+    {
+        for (int i = 0; i < 256; i++)
+            code[i] = -1.0f + 2.0f * i / 255.0f;
+        unsigned int state = 12345;
+        for (long long i = 0; i < LARGE; i++) {
+            state = state * 1664525u + 1013904223u;
+            values[i] = (float)(state >> 8) / (float)(1 << 24) - 0.5f;
+            quantized[i] = (unsigned char)(state >> 24);
+        }
+        for (size_t i = 0; i < packed.size(); i++)
+            packed[i] = quantized[i % LARGE];
+    }
+
+    void quantize_8bit(long long n) { quantize_cpu(code.data(), values.data(), absmax.data(), quantized.data(), 4096, n); }
+    void dequantize_8bit(long long n, long long blocksize)
+    {
+        dequantize_cpu(code.data(), quantized.data(), absmax.data(), out.data(), blocksize, n);
+    }
+    void quantize_nf4(long long n)
+    {
+        quantize_4bit_cpu(CPU_NF4, Float32, values.data(), absmax.data(), quantized.data(), 64, n);
+    }
+    void dequantize_nf4(long long n) { dequantize_4bit_cpu(CPU_NF4, Float32, quantized.data(), absmax.data(), out.data(), 64, n); }
+    // M x N = (M x K) * (K x N), the activations taken from values
+    void gemm_nf4(long long M, long long N)
+    {
+        gemm_4bit_cpu(CPU_NF4, Float32, values.data(), packed.data(), scales.data(), out.data(), M, N, GEMM_K,
+                      GEMM_BLOCKSIZE);
+    }
+};
+
+// the fastest of a few runs after a warm-up, in seconds
+double time_run(const std::function<void()> &run)
+{
+    run();
+    double best = 1e30;
+    for (int i = 0; i < 3; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// Applies each candidate in turn and returns the one whose times, relative to those
+// of the default on each workload, add up to the least.
+size_t pick_fastest(size_t num_candidates, size_t default_candidate, const std::function<void(size_t)> &apply_candidate,
+                    const std::vector<std::function<void()>> &workloads)
+{
+    std::vector<std::vector<double>> times(num_candidates);
+    for (size_t c = 0; c < num_candidates; c++) {
+        apply_candidate(c);
+        for (const std::function<void()> &workload : workloads)
+            times[c].push_back(time_run(workload));
+    }
+
+    size_t best = default_candidate;
+    double best_score = (double)workloads.size() * (1.0 - TUNING_MARGIN);
+    for (size_t c = 0; c < num_candidates; c++) {
+        double score = 0.0;
+        for (size_t w = 0; w < workloads.size(); w++)
+            score += times[c][w] / std::max(times[default_candidate][w], 1e-9);
+        if (score < best_score) {
+            best = c;
+            best_score = score;
+        }
+    }
+    apply_candidate(best);
+    return best;
+}
+
+// Tunes one parameter after the other, each with the winners of the previous ones.
+cpu_tuning tune()
+{
+    tuning_workloads data;
+    typedef tuning_workloads W;
+    cpu_tuning tuning = {cpu_isa_default(), BLOCK_SIZE, DEFAULT_GEMM_ROWS, DEFAULT_GEMM_PANELS};
+    apply(tuning);
+
+    // a lower variant can win where the wider vectors lower the clock
+    if (cpu_isa_tunable()) {
+        const size_t num_isas = (size_t)cpu_isa_default() + 1;
+        const size_t isa = pick_fastest(
+            num_isas, num_isas - 1, [&](size_t c) { set_cpu_isa((CPU_ISA)c); },
+            {[&] { data.quantize_8bit(W::LARGE); }, [&] { data.dequantize_8bit(W::LARGE, 4096); },
+             [&] { data.quantize_nf4(W::LARGE); }, [&] { data.gemm_nf4(16, W::GEMM_N); }});
+        tuning.isa = (int)isa;
+    }
+
+    // with a single thread the tasks all run on the calling thread anyway
+    const long long task_candidates[] = {4096, BLOCK_SIZE, 65536, 262144};
+    const size_t task = get_num_threads() == 1 ? 1 : pick_fastest(
+        4, 1, [&](size_t c) { task_values.store(task_candidates[c], std::memory_order_relaxed); },
+        {[&] { data.quantize_8bit(W::LARGE); }, [&] { data.dequantize_8bit(W::LARGE, 4096); },
+         [&] { data.dequantize_8bit(W::SMALL, 64); }, [&] { data.quantize_nf4(W::SMALL); },
+         [&] { data.dequantize_nf4(W::LARGE); }, [&] { data.dequantize_nf4(W::SMALL); }});
+    tuning.task_values = task_candidates[task];
+
+    const long long row_candidates[] = {32, 64, GEMM_4BIT_MAX_ROWS};
+    const long long panel_candidates[] = {1, 2, 4, 8};
+    const size_t gemm = pick_fastest(
+        12, 1 * 4 + 2,
+        [&](size_t c) {
+            gemm_rows.store(row_candidates[c / 4], std::memory_order_relaxed);
+            gemm_panels.store(panel_candidates[c % 4], std::memory_order_relaxed);
+        },
+        {[&] { data.gemm_nf4(16, W::GEMM_N); }, [&] { data.gemm_nf4(256, 1024); }});
+    tuning.gemm_rows = row_candidates[gemm / 4];
+    tuning.gemm_panels = panel_candidates[gemm % 4];
+    return tuning;
+}
+
+} // namespace
+
+void ensure_cpu_tuning()
+{
+    if (tuning_state.load(std::memory_order_acquire) == 2)
+        return;
+    int expected = 0;
+    // the tuner's own ops, and those of other threads meanwhile, run with the current parameters
+    if (!tuning_state.compare_exchange_strong(expected, 1))
+        return;
+    std::lock_guard<std::mutex> lock(tuning_mutex);
+    cpu_tuning tuning;
+    if (load_entry(tuning)) {
+        apply(tuning);
+    } else if (env_enabled("BNB_CPU_AUTOTUNE")) {
+        tuning = tune();
+        store_entry(tuning);
+    }
+    tuning_state.store(2, std::memory_order_release);
+}
+
+cpu_tuning get_cpu_tuning()
+{
+    ensure_cpu_tuning();
+    return current_tuning();
+}
+
+bool autotune_cpu(bool force)
+{
+    ensure_cpu_tuning();
+    std::lock_guard<std::mutex> lock(tuning_mutex);
+    tuning_state.store(1, std::memory_order_release);
+    cpu_tuning tuning;
+    bool ok = true;
+    if (force || !load_entry(tuning)) {
+        tuning = tune();
+        ok = store_entry(tuning);
+    }
+    apply(tuning);
+    tuning_state.store(2, std::memory_order_release);
+    return ok;
+}
+
+long long blocks_per_task(long long blocksize)
+{
+    const long long values = get_cpu_tuning().task_values;
+    return blocksize >= values ? 1 : values / blocksize;
+}
@@ -0,0 +1,48 @@
+#ifndef BITSANDBYTES_CPU_AUTOTUNE_H
+#define BITSANDBYTES_CPU_AUTOTUNE_H
+
+// Host-specific parameters of the CPU kernels. The defaults suit most hosts; the
+// autotuner times a few candidates of each parameter on typical shapes (blockwise
+// quantization of 64K to 1M values, 4-bit GEMMs of 16 and 256 rows) and keeps the
+// fastest, but only moves away from a default that is beaten by a clear margin.
+//
+// The results are stored in a text file with one line per CPU model, library version
+// and number of threads, and are applied on the first use of the kernels by every later
+// process with the same key. BNB_CPU_AUTOTUNE_CACHE overrides the path of the file, by
+// default bitsandbytes/cpu_autotune.txt under $XDG_CACHE_HOME or ~/.cache. A process
+// that finds no entry keeps the defaults, or tunes on the first use of the kernels if
+// BNB_CPU_AUTOTUNE=1 is set.
+
+// the largest cpu_tuning::gemm_rows, which sizes the output tile of gemm_4bit_cpu
+#define GEMM_4BIT_MAX_ROWS 128
+
+struct cpu_tuning {
+    // CPU_ISA of the kernel table, see cpu_kernels.h
+    int isa;
+    // values per thread pool task of the blockwise kernels; tensors of fewer than
+    // num_threads * task_values values also use fewer threads
+    long long task_values;
+    // rows of A and prepacked weight panels per task of gemm_4bit_cpu
+    long long gemm_rows;
+    long long gemm_panels;
+};
+
+// The parameters in effect. Applies the cache entry of this host first, if any.
+cpu_tuning get_cpu_tuning();
+
+// Loads the cache entry, or tunes with BNB_CPU_AUTOTUNE=1, once per process. Calls
+// made while the parameters are being tuned return right away and run with whatever
+// parameters are set, so that the tuner can time the ops themselves.
+void ensure_cpu_tuning();
+
+// Tunes the parameters for this host, unless the cache file has an entry for it and
+// force is not set, applies them and stores them in the cache file. Must not be called
+// while ops are running. Returns false if the cache file cannot be written, in which
+// case the parameters are still applied to this process.
+bool autotune_cpu(bool force);
+
+// blocks of blocksize values that the blockwise kernels hand to a thread at once, so
+// that small blocksizes still amortize the scheduling overhead
+long long blocks_per_task(long long blocksize);
+
+#endif
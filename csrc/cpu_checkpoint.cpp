@@ -0,0 +1,335 @@
+#include <common.h>
+#include <cpu_checkpoint.h>
+#include <cpu_ops.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#endif
+
+#if !defined(_WIN32)
+
+namespace {
+
+const char CHECKPOINT_MAGIC[8] = {'B', 'N', 'B', 'Q', 'C', 'K', 'P', 'T'};
+const unsigned int CHECKPOINT_VERSION = 1;
+
+// the first bytes of the file, mirrored by load_quantized_checkpoint in functional.py
+struct checkpoint_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int reserved;
+    long long index_offset;
+    long long index_bytes;
+};
+
+// a contiguous range of the file; staging is the staging buffer that holds the data, if any
+struct write_piece {
+    const unsigned char *data;
+    long long num_bytes;
+    long long offset;
+    unsigned char *staging;
+};
+
+long long align_up(long long x) { return (x + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT; }
+
+unsigned char *alloc_staging()
+{
+    void *ptr = NULL;
+    return posix_memalign(&ptr, CHECKPOINT_ALIGNMENT, CHECKPOINT_PIECE) == 0 ? (unsigned char *)ptr : NULL;
+}
+
+bool pwrite_all(int fd, const unsigned char *data, long long num_bytes, long long offset)
+{
+    while (num_bytes > 0) {
+        const ssize_t written = pwrite(fd, data, (size_t)num_bytes, (off_t)offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        offset += written;
+        num_bytes -= written;
+    }
+    return true;
+}
+
+} // namespace
+
+struct checkpoint_writer {
+    std::string path;
+    std::string tmp_path;
+    int fd = -1;
+    bool direct = false;
+    // the next free aligned offset, the header comes first
+    long long end = CHECKPOINT_ALIGNMENT;
+
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::deque<write_piece> queue;
+    long long pending = 0;
+    bool stopping = false;
+    bool failed = false;
+    std::vector<std::thread> threads;
+
+    // staging buffers of CHECKPOINT_PIECE bytes for quantized pieces, at most max_staging
+    std::condition_variable staging_cv;
+    std::vector<unsigned char *> free_staging;
+    int num_staging = 0;
+    int max_staging = 0;
+
+    long long reserve(long long num_bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const long long offset = end;
+        end = align_up(end + num_bytes);
+        return offset;
+    }
+
+    unsigned char *acquire_staging()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        staging_cv.wait(lock, [&] { return !free_staging.empty() || num_staging < max_staging; });
+        if (!free_staging.empty()) {
+            unsigned char *buffer = free_staging.back();
+            free_staging.pop_back();
+            return buffer;
+        }
+        unsigned char *buffer = alloc_staging();
+        if (buffer != NULL)
+            num_staging++;
+        return buffer;
+    }
+
+    void enqueue(const write_piece &piece)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(piece);
+            pending++;
+        }
+        work_cv.notify_one();
+    }
+
+    // splits data into pieces that the I/O threads write independently
+    void enqueue_range(const unsigned char *data, long long num_bytes, long long offset)
+    {
+        for (long long i = 0; i < num_bytes; i += CHECKPOINT_PIECE)
+            enqueue(write_piece{data + i, std::min((long long)CHECKPOINT_PIECE, num_bytes - i), offset + i, NULL});
+    }
+
+    void wait_idle()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&] { return pending == 0; });
+    }
+
+    void io_thread()
+    {
+        // O_DIRECT needs aligned buffers, lengths and offsets: other data is copied into
+        // a buffer of this thread and padded with zeros into the reserved space
+        unsigned char *bounce = NULL;
+        while (true) {
+            write_piece piece;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_cv.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    break;
+                piece = queue.front();
+                queue.pop_front();
+            }
+
+            const unsigned char *data = piece.data;
+            long long num_bytes = piece.num_bytes;
+            bool ok = true;
+            if (direct) {
+                unsigned char *buffer = piece.staging;
+                if (buffer == NULL) {
+                    if (bounce == NULL)
+                        bounce = alloc_staging();
+                    buffer = bounce;
+                    if (buffer != NULL)
+                        memcpy(buffer, data, num_bytes);
+                }
+                ok = buffer != NULL;
+                if (ok) {
+                    const long long padded = align_up(num_bytes);
+                    memset(buffer + num_bytes, 0, padded - num_bytes);
+                    data = buffer;
+                    num_bytes = padded;
+                }
+            }
+            ok = ok && pwrite_all(fd, data, num_bytes, piece.offset);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!ok && !failed) {
+                    failed = true;
+                    fprintf(stderr, "bitsandbytes: cannot write to checkpoint %s\n", tmp_path.c_str());
+                }
+                if (piece.staging != NULL)
+                    free_staging.push_back(piece.staging);
+                pending--;
+            }
+            staging_cv.notify_one();
+            done_cv.notify_all();
+        }
+        free(bounce);
+    }
+
+    bool has_failed()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return failed;
+    }
+};
+
+checkpoint_writer *checkpoint_writer_open(const char *path, bool direct, int num_threads)
+{
+    checkpoint_writer *writer = new checkpoint_writer();
+    writer->path = path;
+    writer->tmp_path = writer->path + ".tmp";
+    const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if defined(O_DIRECT)
+    if (direct) {
+        writer->fd = open(writer->tmp_path.c_str(), flags | O_DIRECT, 0644);
+        // e.g. tmpfs does not support O_DIRECT
+        writer->direct = writer->fd >= 0;
+    }
+#endif
+    if (writer->fd < 0)
+        writer->fd = open(writer->tmp_path.c_str(), flags, 0644);
+    if (writer->fd < 0) {
+        fprintf(stderr, "bitsandbytes: cannot create checkpoint %s\n", writer->tmp_path.c_str());
+        delete writer;
+        return NULL;
+    }
+
+    num_threads = std::max(1, num_threads);
+    // two pieces per thread keep every thread busy while the next piece is quantized
+    writer->max_staging = 2 * num_threads;
+    for (int i = 0; i < num_threads; i++)
+        writer->threads.emplace_back([writer] { writer->io_thread(); });
+    return writer;
+}
+
+long long checkpoint_writer_write(checkpoint_writer *writer, const void *data, long long num_bytes)
+{
+    if (writer->has_failed())
+        return -1;
+    const long long offset = writer->reserve(num_bytes);
+    writer->enqueue_range((const unsigned char *)data, num_bytes, offset);
+    return offset;
+}
+
+long long checkpoint_writer_quantize_4bit(checkpoint_writer *writer, int quant_type, int dtype, void *A, float *absmax,
+                                          long long blocksize, long long n)
+{
+    if (blocksize % 2 != 0 || blocksize / 2 > CHECKPOINT_PIECE) {
+        fprintf(stderr, "bitsandbytes: cannot write 4-bit blocks of %lld values to a checkpoint\n", blocksize);
+        return -1;
+    }
+    // pieces hold whole blocks and, for O_DIRECT, start at aligned offsets
+    long long unit = blocksize;
+    while ((unit / 2) % CHECKPOINT_ALIGNMENT != 0 && unit / 2 < CHECKPOINT_PIECE)
+        unit += blocksize;
+    if (writer->has_failed())
+        return -1;
+
+    const long long piece_values = CHECKPOINT_PIECE * 2 / unit * unit;
+    const long long element_bytes = dtype == Float32 ? 4 : 2;
+    const long long offset = writer->reserve((n + 1) / 2);
+    for (long long start = 0; start < n; start += piece_values) {
+        const long long count = std::min(piece_values, n - start);
+        unsigned char *staging = writer->acquire_staging();
+        if (staging == NULL) {
+            fprintf(stderr, "bitsandbytes: cannot allocate a checkpoint staging buffer\n");
+            return -1;
+        }
+        // quantizing uses the thread pool, writing the I/O threads
+        quantize_4bit_cpu(quant_type, dtype, (char *)A + start * element_bytes, absmax + start / blocksize, staging,
+                          blocksize, count);
+        writer->enqueue(write_piece{staging, (count + 1) / 2, offset + start / 2, staging});
+    }
+    return writer->has_failed() ? -1 : offset;
+}
+
+bool checkpoint_writer_close(checkpoint_writer *writer, const void *index, long long index_bytes)
+{
+    writer->wait_idle();
+    bool ok = index != NULL && !writer->has_failed();
+    checkpoint_header header = {};
+    if (ok) {
+        // the index and the header each only after everything before them is on disk
+        header.index_offset = checkpoint_writer_write(writer, index, index_bytes);
+        header.index_bytes = index_bytes;
+        writer->wait_idle();
+        ok = !writer->has_failed() && fdatasync(writer->fd) == 0;
+    }
+    if (ok) {
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+        header.version = CHECKPOINT_VERSION;
+        writer->enqueue(write_piece{(const unsigned char *)&header, sizeof(header), 0, NULL});
+        writer->wait_idle();
+        // O_DIRECT padded the last piece
+        ok = !writer->has_failed() && ftruncate(writer->fd, (off_t)(header.index_offset + index_bytes)) == 0 &&
+             fsync(writer->fd) == 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(writer->mutex);
+        writer->stopping = true;
+    }
+    writer->work_cv.notify_all();
+    for (std::thread &thread : writer->threads)
+        thread.join();
+    for (unsigned char *buffer : writer->free_staging)
+        free(buffer);
+    ok = close(writer->fd) == 0 && ok;
+
+    if (ok && rename(writer->tmp_path.c_str(), writer->path.c_str()) != 0) {
+        fprintf(stderr, "bitsandbytes: cannot move checkpoint to %s\n", writer->path.c_str());
+        ok = false;
+    }
+    if (ok) {
+        // the rename itself only survives a crash once the directory is synced
+        std::vector<char> path_buffer(writer->path.begin(), writer->path.end());
+        path_buffer.push_back('\0');
+        int dir_fd = open(dirname(path_buffer.data()), O_RDONLY);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    } else {
+        unlink(writer->tmp_path.c_str());
+    }
+    delete writer;
+    return ok;
+}
+
+#else
+
+// checkpoints are written with pwrite, which Windows does not have
+checkpoint_writer *checkpoint_writer_open(const char *path, bool direct, int num_threads) { return NULL; }
+long long checkpoint_writer_write(checkpoint_writer *writer, const void *data, long long num_bytes) { return -1; }
+long long checkpoint_writer_quantize_4bit(checkpoint_writer *writer, int quant_type, int dtype, void *A, float *absmax,
+                                          long long blocksize, long long n)
+{
+    return -1;
+}
+bool checkpoint_writer_close(checkpoint_writer *writer, const void *index, long long index_bytes) { return false; }
+
+#endif
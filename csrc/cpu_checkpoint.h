@@ -0,0 +1,37 @@
+#ifndef BITSANDBYTES_CPU_CHECKPOINT_H
+#define BITSANDBYTES_CPU_CHECKPOINT_H
+
+// Parallel writer for checkpoints of quantized tensors. A checkpoint file starts with
+// a header of CHECKPOINT_ALIGNMENT bytes, followed by the tensors at aligned offsets
+// and an index supplied by the caller (the JSON of save_quantized_checkpoint in
+// bitsandbytes/functional.py). The data is written with pwrite by a few I/O threads of
+// the writer, in pieces of up to CHECKPOINT_PIECE bytes, in any order. The header,
+// which points at the index, is written last and the file only replaces path after
+// that, so a crash never leaves a checkpoint that looks complete.
+
+#define CHECKPOINT_ALIGNMENT 4096
+#define CHECKPOINT_PIECE (8 << 20)
+
+struct checkpoint_writer;
+
+// Creates path + ".tmp". With direct set, the file is opened with O_DIRECT if the file
+// system supports it, and the data goes through aligned staging buffers. Returns NULL
+// on failure.
+checkpoint_writer *checkpoint_writer_open(const char *path, bool direct, int num_threads);
+
+// Queues num_bytes of data for writing and returns its offset in the file, or -1 if a
+// write already failed. data must stay alive until checkpoint_writer_close.
+long long checkpoint_writer_write(checkpoint_writer *writer, const void *data, long long num_bytes);
+
+// Quantizes n values of the given dtype (a ScalarType_t) like quantize_4bit_cpu straight
+// into the file, one piece at a time, so that a piece is written while the next one is
+// quantized. absmax receives the scales. Returns the offset of the (n + 1) / 2 bytes, or -1.
+long long checkpoint_writer_quantize_4bit(checkpoint_writer *writer, int quant_type, int dtype, void *A, float *absmax,
+                                          long long blocksize, long long n);
+
+// Waits for all writes, appends the index, writes the header and moves the file to its
+// path. With index NULL, or if a write failed, the file is removed instead and false is
+// returned. Frees the writer.
+bool checkpoint_writer_close(checkpoint_writer *writer, const void *index, long long index_bytes);
+
+#endif
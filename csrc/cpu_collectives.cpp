@@ -0,0 +1,423 @@
+#include <cpu_collectives.h>
+#include <cpu_kernels.h>
+#include <cpu_threads.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#define BNB_CPU_RELAX() _mm_pause()
+#else
+#define BNB_CPU_RELAX() ((void)0)
+#endif
+
+namespace {
+
+// one counter per cache line, so that ranks polling different counters do not contend
+struct alignas(64) shm_counter {
+    std::atomic<long long> value;
+};
+
+// number of spins before a waiting rank starts yielding the CPU
+const int SPINS_BEFORE_YIELD = 4096;
+
+#if !defined(_WIN32)
+
+const unsigned long long SHM_MAGIC = 0x626e622d636f6c6cULL; // "bnb-coll"
+
+// Start of the segment. The counters only ever grow: chunk seq uses ring slot
+// seq % ring for the (seq / ring)-th time, and its payloads from rank r are there once
+// posted[slot][phase][r] > seq / ring. The slot can be reused when released[slot][r]
+// of every rank reached the number of its uses so far.
+struct shm_header {
+    std::atomic<unsigned long long> magic;
+    int world_size;
+    int ring;
+    long long payload_stride;
+    long long segment_bytes;
+    std::atomic<int> attached;
+};
+
+class shm_transport : public collective_transport {
+public:
+    shm_transport(int rank, int world_size, int ring, long long max_payload_bytes, long long timeout_ms,
+                  unsigned char *segment, size_t segment_bytes)
+        : rank_(rank), world_size_(world_size), ring_(ring), max_payload_bytes_(max_payload_bytes),
+          payload_stride_(payload_stride(max_payload_bytes)), timeout_ms_(timeout_ms), segment_(segment),
+          segment_bytes_(segment_bytes)
+    {
+    }
+
+    ~shm_transport() override { munmap(segment_, segment_bytes_); }
+
+    static long long payload_stride(long long max_payload_bytes) { return (max_payload_bytes + 63) / 64 * 64; }
+
+    static size_t counters_offset() { return (sizeof(shm_header) + 63) / 64 * 64; }
+
+    static size_t payloads_offset(int world_size, int ring)
+    {
+        return counters_offset() + (size_t)ring * 3 * world_size * sizeof(shm_counter);
+    }
+
+    static size_t segment_size(int world_size, int ring, long long max_payload_bytes)
+    {
+        const size_t payloads_per_slot = (size_t)world_size * world_size + world_size;
+        return payloads_offset(world_size, ring) + (size_t)ring * payloads_per_slot * payload_stride(max_payload_bytes);
+    }
+
+    int rank() const override { return rank_; }
+    int world_size() const override { return world_size_; }
+    long long max_payload_bytes() const override { return max_payload_bytes_; }
+
+    unsigned char *send_buffer(long long seq, phase_t phase, int peer) override
+    {
+        const int slot = (int)(seq % ring_);
+        const long long uses = seq / ring_;
+        // the first buffer of a chunk waits for every rank to be done with the slot
+        if (phase == REDUCE_SCATTER && peer == 0)
+            for (int r = 0; r < world_size_; r++)
+                if (!wait_for(released(slot, r), uses))
+                    return NULL;
+        return payload(slot, phase, rank_, phase == REDUCE_SCATTER ? peer : 0);
+    }
+
+    void post(long long seq, phase_t phase) override
+    {
+        posted(seq % ring_, phase, rank_).store(seq / ring_ + 1, std::memory_order_release);
+    }
+
+    const unsigned char *receive(long long seq, phase_t phase, int peer) override
+    {
+        const int slot = (int)(seq % ring_);
+        if (!wait_for(posted(slot, phase, peer), seq / ring_ + 1))
+            return NULL;
+        return payload(slot, phase, peer, phase == REDUCE_SCATTER ? rank_ : 0);
+    }
+
+    void release(long long seq) override
+    {
+        released(seq % ring_, rank_).store(seq / ring_ + 1, std::memory_order_release);
+    }
+
+private:
+    shm_counter *counters() const { return (shm_counter *)(segment_ + counters_offset()); }
+
+    std::atomic<long long> &posted(long long slot, int phase, int r) const
+    {
+        return counters()[(slot * 3 + phase) * world_size_ + r].value;
+    }
+
+    std::atomic<long long> &released(long long slot, int r) const { return counters()[(slot * 3 + 2) * world_size_ + r].value; }
+
+    // REDUCE_SCATTER payloads of a slot are stored by [sender][receiver], followed by
+    // the ALL_GATHER payloads by [sender]
+    unsigned char *payload(int slot, phase_t phase, int sender, int receiver) const
+    {
+        const long long per_slot = (long long)world_size_ * world_size_ + world_size_;
+        const long long index = phase == REDUCE_SCATTER ? sender * world_size_ + receiver
+                                                        : (long long)world_size_ * world_size_ + sender;
+        return segment_ + payloads_offset(world_size_, ring_) + (slot * per_slot + index) * payload_stride_;
+    }
+
+    bool wait_for(const std::atomic<long long> &counter, long long target) const
+    {
+        for (int spin = 0; spin < SPINS_BEFORE_YIELD; spin++) {
+            if (counter.load(std::memory_order_acquire) >= target)
+                return true;
+            BNB_CPU_RELAX();
+        }
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms_);
+        while (counter.load(std::memory_order_acquire) < target) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                fprintf(stderr, "bitsandbytes: rank %d timed out waiting for a peer\n", rank_);
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    int rank_;
+    int world_size_;
+    int ring_;
+    long long max_payload_bytes_;
+    long long payload_stride_;
+    long long timeout_ms_;
+    unsigned char *segment_;
+    size_t segment_bytes_;
+};
+
+#endif
+
+// The values of a chunk are split into one shard per rank, each a whole number of
+// blocks. A payload holds the absmax of the blocks of a shard followed by its bytes.
+struct shard_layout {
+    long long blocksize;
+    long long shard_values;
+    long long chunk_values;
+
+    shard_layout(int world_size, long long blocksize, long long chunk_size)
+        : blocksize(blocksize),
+          shard_values(std::max(1LL, (chunk_size / world_size + blocksize - 1) / blocksize) * blocksize),
+          chunk_values(shard_values * world_size)
+    {
+    }
+
+    long long payload_bytes() const { return shard_values / blocksize * (long long)sizeof(float) + shard_values; }
+
+    // first value and number of values of shard peer of chunk k, which may be empty at the end
+    long long shard_start(long long k, int peer) const { return k * chunk_values + peer * shard_values; }
+
+    long long shard_size(long long k, int peer, long long n) const
+    {
+        return std::max(0LL, std::min(shard_values, n - shard_start(k, peer)));
+    }
+
+    float *absmax(unsigned char *payload) const { return (float *)payload; }
+    const float *absmax(const unsigned char *payload) const { return (const float *)payload; }
+    unsigned char *bytes(unsigned char *payload) const { return payload + shard_values / blocksize * sizeof(float); }
+    const unsigned char *bytes(const unsigned char *payload) const
+    {
+        return payload + shard_values / blocksize * sizeof(float);
+    }
+};
+
+// quantizes or dequantizes the blocks of a shard of `size` values in parallel
+template <typename Fn> void for_blocks(const shard_layout &layout, long long size, const Fn &fn)
+{
+    const long long num_blocks = (size + layout.blocksize - 1) / layout.blocksize;
+    const long long grain = std::max(1LL, 4096 / layout.blocksize);
+    parallel_for(num_blocks, grain, [&](long long first_block, long long last_block) {
+        for (long long block = first_block; block < last_block; block++) {
+            const long long block_idx = block * layout.blocksize;
+            fn(block_idx, std::min(size, block_idx + layout.blocksize));
+        }
+    });
+}
+
+} // namespace
+
+#if !defined(_WIN32)
+
+collective_transport *shm_transport_create(const char *name, int rank, int world_size, long long max_payload_bytes,
+                                           int ring, long long timeout_ms)
+{
+    if (world_size < 1 || rank < 0 || rank >= world_size || ring < 3 || max_payload_bytes < 1) {
+        fprintf(stderr, "bitsandbytes: invalid shared memory transport parameters\n");
+        return NULL;
+    }
+    const size_t segment_bytes = shm_transport::segment_size(world_size, ring, max_payload_bytes);
+
+    // rank 0 creates the segment, which starts out zero filled; the others wait for it
+    // to appear with its full size
+    int fd = -1;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    if (rank == 0) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            fprintf(stderr, "bitsandbytes: cannot create shared memory segment %s\n", name);
+            return NULL;
+        }
+        if (ftruncate(fd, (off_t)segment_bytes) != 0) {
+            fprintf(stderr, "bitsandbytes: cannot size shared memory segment %s\n", name);
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+    } else {
+        struct stat info;
+        while (true) {
+            if (fd < 0)
+                fd = shm_open(name, O_RDWR, 0600);
+            if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0)
+                break;
+            if (std::chrono::steady_clock::now() > deadline) {
+                fprintf(stderr, "bitsandbytes: shared memory segment %s was not created\n", name);
+                if (fd >= 0)
+                    close(fd);
+                return NULL;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if ((size_t)info.st_size != segment_bytes) {
+            fprintf(stderr, "bitsandbytes: mismatching parameters for shared memory segment %s\n", name);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    void *segment = mmap(NULL, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "bitsandbytes: cannot map shared memory segment %s\n", name);
+        if (rank == 0)
+            shm_unlink(name);
+        return NULL;
+    }
+
+    shm_header *header = (shm_header *)segment;
+    auto fail = [&](const char *message) -> collective_transport * {
+        fprintf(stderr, "bitsandbytes: %s %s\n", message, name);
+        munmap(segment, segment_bytes);
+        if (rank == 0)
+            shm_unlink(name);
+        return NULL;
+    };
+    if (rank == 0) {
+        header->world_size = world_size;
+        header->ring = ring;
+        header->payload_stride = shm_transport::payload_stride(max_payload_bytes);
+        header->segment_bytes = (long long)segment_bytes;
+        header->magic.store(SHM_MAGIC, std::memory_order_release);
+    } else {
+        while (header->magic.load(std::memory_order_acquire) != SHM_MAGIC) {
+            if (std::chrono::steady_clock::now() > deadline)
+                return fail("no header in shared memory segment");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (header->world_size != world_size || header->ring != ring)
+            return fail("mismatching parameters for shared memory segment");
+    }
+
+    // the name is freed as soon as everybody is attached, the memory when the last rank unmaps it
+    header->attached.fetch_add(1);
+    if (rank == 0) {
+        while (header->attached.load() < world_size) {
+            if (std::chrono::steady_clock::now() > deadline)
+                return fail("not all ranks attached to shared memory segment");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        shm_unlink(name);
+    }
+    return new shm_transport(rank, world_size, ring, max_payload_bytes, timeout_ms, (unsigned char *)segment, segment_bytes);
+}
+
+#else
+
+collective_transport *shm_transport_create(const char *name, int rank, int world_size, long long max_payload_bytes,
+                                           int ring, long long timeout_ms)
+{
+    fprintf(stderr, "bitsandbytes: shared memory collectives are not supported on this platform\n");
+    return NULL;
+}
+
+#endif
+
+void transport_destroy(collective_transport *transport) { delete transport; }
+
+long long quantized_all_reduce_payload_bytes(int world_size, long long blocksize, long long chunk_size)
+{
+    return shard_layout(world_size, blocksize, chunk_size).payload_bytes();
+}
+
+bool quantized_all_reduce_cpu(collective_transport *transport, float *code, float *data, long long n,
+                              long long blocksize, long long chunk_size, bool average)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const int rank = transport->rank();
+    const int world_size = transport->world_size();
+    const shard_layout layout(world_size, blocksize, chunk_size);
+    if (layout.payload_bytes() > transport->max_payload_bytes()) {
+        fprintf(stderr, "bitsandbytes: the chunks do not fit into the transport buffers\n");
+        return false;
+    }
+    // see quantize_cpu
+    code[0] = -1.0f;
+
+    const long long num_chunks = (n + layout.chunk_values - 1) / layout.chunk_values;
+    const long long first_seq = transport->next_seq;
+    transport->next_seq += num_chunks;
+    std::vector<float> reduced(layout.shard_values);
+    const float inverse_world_size = 1.0f / world_size;
+
+    // stage 1: quantizes shard p of chunk k for rank p
+    auto send_chunk = [&](long long k) {
+        for (int peer = 0; peer < world_size; peer++) {
+            unsigned char *payload = transport->send_buffer(first_seq + k, collective_transport::REDUCE_SCATTER, peer);
+            if (payload == NULL)
+                return false;
+            const float *values = data + layout.shard_start(k, peer);
+            float *absmax = layout.absmax(payload);
+            unsigned char *bytes = layout.bytes(payload);
+            for_blocks(layout, layout.shard_size(k, peer, n), [&](long long block_idx, long long block_end) {
+                kernels->quantize_block(code, values, absmax, bytes, block_idx, block_end, blocksize);
+            });
+        }
+        transport->post(first_seq + k, collective_transport::REDUCE_SCATTER);
+        return true;
+    };
+
+    // stage 2: sums up the shard of this rank over all ranks in rank order, so that the
+    // result does not depend on which rank arrived first, and quantizes it for everybody
+    auto reduce_chunk = [&](long long k) {
+        const long long size = layout.shard_size(k, rank, n);
+        std::fill(reduced.begin(), reduced.begin() + size, 0.0f);
+        for (int peer = 0; peer < world_size; peer++) {
+            const unsigned char *payload = transport->receive(first_seq + k, collective_transport::REDUCE_SCATTER, peer);
+            if (payload == NULL)
+                return false;
+            const float *absmax = layout.absmax(payload);
+            const unsigned char *bytes = layout.bytes(payload);
+            for_blocks(layout, size, [&](long long block_idx, long long block_end) {
+                kernels->accumulate_8bit(code, bytes + block_idx, absmax[block_idx / blocksize], reduced.data() + block_idx,
+                                         block_end - block_idx);
+            });
+        }
+        if (average)
+            for_blocks(layout, size, [&](long long block_idx, long long block_end) {
+                for (long long i = block_idx; i < block_end; i++)
+                    reduced[i] *= inverse_world_size;
+            });
+
+        unsigned char *payload = transport->send_buffer(first_seq + k, collective_transport::ALL_GATHER, 0);
+        float *absmax = layout.absmax(payload);
+        unsigned char *bytes = layout.bytes(payload);
+        for_blocks(layout, size, [&](long long block_idx, long long block_end) {
+            kernels->quantize_block(code, reduced.data(), absmax, bytes, block_idx, block_end, blocksize);
+        });
+        transport->post(first_seq + k, collective_transport::ALL_GATHER);
+        return true;
+    };
+
+    // stage 3: dequantizes the reduced shards of all ranks, including the own one, so
+    // that every rank ends up with the same values
+    auto gather_chunk = [&](long long k) {
+        for (int peer = 0; peer < world_size; peer++) {
+            const unsigned char *payload = transport->receive(first_seq + k, collective_transport::ALL_GATHER, peer);
+            if (payload == NULL)
+                return false;
+            float *values = data + layout.shard_start(k, peer);
+            const float *absmax = layout.absmax(payload);
+            const unsigned char *bytes = layout.bytes(payload);
+            for_blocks(layout, layout.shard_size(k, peer, n), [&](long long block_idx, long long block_end) {
+                kernels->dequantize_block(code, bytes, absmax, values, block_idx, block_end, blocksize);
+            });
+        }
+        transport->release(first_seq + k);
+        return true;
+    };
+
+    // Chunk k + 1 is posted before this rank waits for the shards of chunk k, and chunk
+    // k is reduced before this rank waits for the reduced shards of chunk k - 1. The
+    // slowest rank never has to wait for a buffer, so a ring of 3 chunks cannot deadlock.
+    for (long long k = 0; k < num_chunks + 2; k++) {
+        if (k < num_chunks && !send_chunk(k))
+            return false;
+        if (k >= 1 && k - 1 < num_chunks && !reduce_chunk(k - 1))
+            return false;
+        if (k >= 2 && !gather_chunk(k - 2))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef BITSANDBYTES_CPU_COLLECTIVES_H
+#define BITSANDBYTES_CPU_COLLECTIVES_H
+
+// Collectives between the processes of a data-parallel CPU job. Gradients travel as
+// 8-bit blockwise chunks in the format of quantize_blockwise; how the bytes get from
+// one rank to another is left to a transport.
+
+// Moves the payloads of the collectives between ranks. Chunks are numbered by a
+// sequence that continues across calls, so that a transport can recycle a ring of
+// buffers. In the REDUCE_SCATTER phase of a chunk every rank sends a different payload
+// to every rank, in the ALL_GATHER phase one payload to all ranks. A transport between
+// hosts would implement the same interface with sockets.
+class collective_transport {
+public:
+    enum phase_t { REDUCE_SCATTER = 0, ALL_GATHER = 1 };
+
+    virtual ~collective_transport() {}
+    virtual int rank() const = 0;
+    virtual int world_size() const = 0;
+    virtual long long max_payload_bytes() const = 0;
+
+    // The buffer for the payload of this rank to peer (ignored for ALL_GATHER), valid
+    // until post. May wait for the peers to release an older chunk; NULL on timeout.
+    virtual unsigned char *send_buffer(long long seq, phase_t phase, int peer) = 0;
+    // Hands all payloads of this rank for the chunk and phase to the peers.
+    virtual void post(long long seq, phase_t phase) = 0;
+    // Waits for the payload of peer to this rank and returns it, valid until release.
+    // NULL on timeout.
+    virtual const unsigned char *receive(long long seq, phase_t phase, int peer) = 0;
+    // This rank has read all payloads of the chunk.
+    virtual void release(long long seq) = 0;
+
+    // the sequence number of the next chunk, advanced by the collectives
+    long long next_seq = 0;
+};
+
+// Maps the POSIX shared memory segment name (e.g. "/bnb-job-1234") into this process.
+// Every rank calls it with the same arguments: rank 0 creates the segment, the others
+// wait up to timeout_ms for it, and it is unlinked once all ranks are attached. The
+// segment holds ring chunks of world_size^2 + world_size payloads of max_payload_bytes.
+// Returns NULL on failure, e.g. if the name is still taken by a previous job.
+collective_transport *shm_transport_create(const char *name, int rank, int world_size, long long max_payload_bytes,
+                                           int ring, long long timeout_ms);
+void transport_destroy(collective_transport *transport);
+
+// The payload size that quantized_all_reduce_cpu needs for the given parameters.
+long long quantized_all_reduce_payload_bytes(int world_size, long long blocksize, long long chunk_size);
+
+// Sums the n fp32 values of data over all ranks, in place, and divides them by the
+// number of ranks if average is set. Every chunk of chunk_size values is split into one
+// shard per rank. Each rank quantizes its chunk with the code in blocks of blocksize,
+// sums up its shard of all ranks in fp32 in rank order, quantizes that again and
+// gathers the reduced shards of all other ranks, so that all ranks end up with the same
+// values. Chunk k + 1 is quantized and posted before chunk k is reduced, so ranks that
+// are ahead keep producing while they wait. Returns false if a peer timed out.
+bool quantized_all_reduce_cpu(collective_transport *transport, float *code, float *data, long long n,
+                              long long blocksize, long long chunk_size, bool average);
+
+#endif
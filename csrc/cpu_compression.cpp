@@ -0,0 +1,49 @@
+#include <common.h>
+#include <cpu_autotune.h>
+#include <cpu_kernels.h>
+#include <cpu_ops.h>
+#include <cpu_threads.h>
+#include <algorithm>
+#include <vector>
+
+void error_feedback_compress_cpu(int quant_type, int dtype, void *g, int residual_dtype, void *residual, float *code,
+                                 float *absmax, unsigned char *out, long long blocksize, long long n)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const bool four_bit = quant_type != CPU_GENERAL_8BIT;
+    const float *code_4bit = four_bit ? cpu_4bit_code(quant_type) : NULL;
+    // see quantize_cpu
+    if (!four_bit)
+        code[0] = -1.0f;
+
+    const long long num_blocks = (n + blocksize - 1) / blocksize;
+    parallel_for(num_blocks, blocks_per_task(blocksize), [&](long long first_block, long long last_block) {
+        // the corrected gradient and its dequantized value never leave these buffers
+        std::vector<float> corrected(blocksize);
+        std::vector<float> decoded(blocksize);
+        for (long long block = first_block; block < last_block; block++) {
+            const long long block_idx = block * blocksize;
+            const long long valid_items = std::min(blocksize, n - block_idx);
+            load_as_float(g, (ScalarType_t)dtype, block_idx, valid_items, corrected.data());
+            load_as_float(residual, (ScalarType_t)residual_dtype, block_idx, valid_items, decoded.data());
+            for (long long i = 0; i < valid_items; i++)
+                corrected[i] += decoded[i];
+
+            if (four_bit) {
+                unsigned char *q = out + block_idx / 2;
+                quantize_4bit_values(quant_type, corrected.data(), absmax + block, q, blocksize, valid_items);
+                for (long long i = 0; i < valid_items; i++)
+                    decoded[i] = code_4bit[i % 2 == 0 ? q[i / 2] >> 4 : q[i / 2] & 0x0f] * absmax[block];
+            } else {
+                unsigned char *q = out + block_idx;
+                kernels->quantize_block(code, corrected.data(), absmax + block, q, 0, valid_items, blocksize);
+                kernels->dequantize_block(code, q, absmax + block, decoded.data(), 0, valid_items, blocksize);
+            }
+
+            // what the payload lost is sent with the next gradient
+            for (long long i = 0; i < valid_items; i++)
+                decoded[i] = corrected[i] - decoded[i];
+            store_from_float(decoded.data(), (ScalarType_t)residual_dtype, block_idx, valid_items, residual);
+        }
+    });
+}
@@ -0,0 +1,204 @@
+#include <cpu_autotune.h>
+#include <cpu_kernels.h>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#if BNB_CPU_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// The kernel variant is selected once, the first time a CPU kernel is used.
+// BNB_CPU_ISA=<scalar|sse42|avx2|avx512> caps the selection, e.g.
+// to reproduce results of an older host; asking for an instruction set the
+// host does not support falls back to the best supported variant below it.
+// Without BNB_CPU_ISA, the autotuner (cpu_autotune.h) may pick a lower variant
+// that turns out to be faster on this host.
+
+static const char *cpu_isa_names[CPU_ISA_COUNT] = {"scalar", "sse42", "avx2", "avx512"};
+
+#if BNB_CPU_X86
+static void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+    for (int i = 0; i < 4; i++)
+        regs[i] = (unsigned int)info[i];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long xgetbv0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+static CPU_ISA detect_cpu_isa()
+{
+    unsigned int regs[4];
+    cpuid(0, 0, regs);
+    const unsigned int max_leaf = regs[0];
+
+    cpuid(1, 0, regs);
+    const unsigned int ecx1 = regs[2];
+    const bool sse42 = (ecx1 >> 20) & 1 && (ecx1 >> 23) & 1; // SSE4.2 + POPCNT
+    if (!sse42)
+        return CPU_ISA_SCALAR;
+
+    // the OS has to save the wider registers on context switches
+    const bool osxsave = (ecx1 >> 27) & 1;
+    const unsigned long long xcr0 = osxsave ? xgetbv0() : 0;
+    const bool os_avx = (xcr0 & 0x6) == 0x6;
+    const bool os_avx512 = (xcr0 & 0xe6) == 0xe6;
+
+    const bool avx = (ecx1 >> 28) & 1;
+    const bool fma = (ecx1 >> 12) & 1;
+    const bool f16c = (ecx1 >> 29) & 1;
+    if (max_leaf < 7 || !os_avx || !avx || !fma || !f16c)
+        return CPU_ISA_SSE42;
+
+    cpuid(7, 0, regs);
+    const unsigned int ebx7 = regs[1];
+    if (!((ebx7 >> 5) & 1))
+        return CPU_ISA_SSE42;
+
+    // F, DQ, BW, VL
+    const bool avx512 = (ebx7 >> 16) & 1 && (ebx7 >> 17) & 1 && (ebx7 >> 30) & 1 && (ebx7 >> 31) & 1;
+    if (!os_avx512 || !avx512)
+        return CPU_ISA_AVX2;
+
+    // The kernels only use float arithmetic, so AVX-512 VNNI and BF16 (int8 and bf16
+    // dot products) would not speed them up; such hosts run the AVX-512 variant.
+    return CPU_ISA_AVX512;
+}
+#else
+static CPU_ISA detect_cpu_isa() { return CPU_ISA_SCALAR; }
+#endif
+
+static bool cpu_isa_requested()
+{
+    const char *requested = getenv("BNB_CPU_ISA");
+    return requested != NULL && requested[0] != '\0' && strcmp(requested, "auto") != 0;
+}
+
+static CPU_ISA select_cpu_isa()
+{
+    CPU_ISA isa = detect_cpu_isa();
+
+    if (cpu_isa_requested()) {
+        const char *requested = getenv("BNB_CPU_ISA");
+        const int match = cpu_isa_from_name(requested);
+        if (match < 0)
+            fprintf(stderr, "bitsandbytes: ignoring unknown BNB_CPU_ISA=%s, using %s\n", requested, cpu_isa_names[isa]);
+        else if (match > isa)
+            fprintf(stderr, "bitsandbytes: BNB_CPU_ISA=%s is not supported by this CPU, using %s\n", requested, cpu_isa_names[isa]);
+        else
+            isa = (CPU_ISA)match;
+    }
+
+    return isa;
+}
+
+CPU_ISA cpu_isa_default()
+{
+    static const CPU_ISA isa = select_cpu_isa();
+    return isa;
+}
+
+bool cpu_isa_tunable() { return !cpu_isa_requested(); }
+
+// -1 until the autotuner sets a variant
+static std::atomic<int> tuned_isa(-1);
+
+void set_cpu_isa(CPU_ISA isa)
+{
+    if (cpu_isa_tunable() && isa <= cpu_isa_default())
+        tuned_isa.store(isa, std::memory_order_relaxed);
+}
+
+CPU_ISA cpu_isa()
+{
+    const int isa = tuned_isa.load(std::memory_order_relaxed);
+    return isa >= 0 ? (CPU_ISA)isa : cpu_isa_default();
+}
+
+const char *cpu_isa_to_name(CPU_ISA isa) { return cpu_isa_names[isa]; }
+
+int cpu_isa_from_name(const char *name)
+{
+    for (int i = 0; i < CPU_ISA_COUNT; i++)
+        if (strcmp(name, cpu_isa_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+static std::string read_cpu_model()
+{
+    std::string model;
+#if BNB_CPU_X86
+    // the brand string, e.g. "Intel(R) Xeon(R) Platinum 8480+"
+    unsigned int regs[4];
+    cpuid(0x80000000, 0, regs);
+    if (regs[0] >= 0x80000004) {
+        char brand[49] = {};
+        for (int leaf = 0; leaf < 3; leaf++) {
+            cpuid(0x80000002 + leaf, 0, regs);
+            memcpy(brand + 16 * leaf, regs, 16);
+        }
+        model = brand;
+    }
+#elif defined(__linux__)
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (cpuinfo != NULL) {
+        char line[256];
+        while (model.empty() && fgets(line, sizeof(line), cpuinfo) != NULL) {
+            const char *colon = strchr(line, ':');
+            if (colon != NULL && (strncmp(line, "model name", 10) == 0 || strncmp(line, "CPU part", 8) == 0))
+                model = colon + 1;
+        }
+        fclose(cpuinfo);
+    }
+#endif
+    // the brand string is padded with spaces, /proc/cpuinfo ends lines with a newline
+    const size_t first = model.find_first_not_of(" \t");
+    const size_t last = model.find_last_not_of(" \t\n");
+    return first == std::string::npos ? "unknown" : model.substr(first, last - first + 1);
+}
+
+const char *cpu_model_name()
+{
+    static const std::string model = read_cpu_model();
+    return model.c_str();
+}
+
+const cpu_kernel_table *cpu_kernels()
+{
+    // applies the autotuned variant before the first kernel runs
+    ensure_cpu_tuning();
+#if BNB_CPU_X86
+    static const cpu_kernel_table *tables[CPU_ISA_COUNT] = {
+        &cpu_kernels_scalar, &cpu_kernels_sse42, &cpu_kernels_avx2, &cpu_kernels_avx512,
+    };
+    return tables[cpu_isa()];
+#else
+    return &cpu_kernels_scalar;
+#endif
+}
+
+// resolve the variant while the library is loaded, so that a bad
+// BNB_CPU_ISA value is reported on import rather than on first use
+static const CPU_ISA cpu_isa_at_load = cpu_isa_default();
@@ -0,0 +1,65 @@
+#include <common.h>
+#include <cpu_kernels.h>
+#include <cpu_ops.h>
+#include <cpu_threads.h>
+#include <algorithm>
+#include <vector>
+
+// Rows of large tables are almost never cached, so the next row of a bag is requested
+// while the current one is summed up.
+static inline void prefetch_row(const unsigned char *row, long long num_bytes)
+{
+#if defined(__GNUC__)
+    for (long long i = 0; i < num_bytes; i += 64)
+        __builtin_prefetch(row + i);
+#else
+    (void)row;
+    (void)num_bytes;
+#endif
+}
+
+void embedding_bag_cpu(int quant_type, unsigned char *table, float *absmax, float *code, long long dim,
+                       long long blocksize, long long *indices, long long num_indices, long long *offsets,
+                       long long num_bags, float *per_sample_weights, int mode, long long padding_idx,
+                       int dtype, void *out)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const bool four_bit = quant_type != CPU_GENERAL_8BIT;
+    const float *values = four_bit ? cpu_4bit_code(quant_type) : code;
+    const accumulate_dequantized_fn accumulate = four_bit ? kernels->accumulate_4bit : kernels->accumulate_8bit;
+    const long long row_bytes = four_bit ? dim / 2 : dim;
+    const long long block_bytes = four_bit ? blocksize / 2 : blocksize;
+    const long long blocks_per_row = dim / blocksize;
+
+    // bags with a few short rows are batched into one task
+    const long long values_per_bag = std::max(1LL, (num_indices + num_bags - 1) / std::max(1LL, num_bags) * dim);
+    parallel_for(num_bags, std::max(1LL, BLOCK_SIZE / values_per_bag), [&](long long first_bag, long long last_bag) {
+        std::vector<float> acc(dim);
+        for (long long bag = first_bag; bag < last_bag; bag++) {
+            const long long begin = offsets[bag];
+            const long long end = bag + 1 < num_bags ? offsets[bag + 1] : num_indices;
+            std::fill(acc.begin(), acc.end(), 0.0f);
+
+            long long count = 0;
+            for (long long i = begin; i < end; i++) {
+                const long long row = indices[i];
+                if (row == padding_idx)
+                    continue;
+                if (i + 1 < end)
+                    prefetch_row(table + indices[i + 1] * row_bytes, row_bytes);
+
+                const float weight = per_sample_weights != NULL ? per_sample_weights[i] : 1.0f;
+                const unsigned char *q = table + row * row_bytes;
+                const float *row_absmax = absmax + row * blocks_per_row;
+                for (long long b = 0; b < blocks_per_row; b++)
+                    accumulate(values, q + b * block_bytes, row_absmax[b] * weight, acc.data() + b * blocksize, blocksize);
+                count++;
+            }
+
+            if (mode == 1 && count > 0)
+                for (long long j = 0; j < dim; j++)
+                    acc[j] /= (float)count;
+            store_from_float(acc.data(), (ScalarType_t)dtype, bag * dim, dim, out);
+        }
+    });
+}
@@ -0,0 +1,96 @@
+#include <cpu_jobs.h>
+#include <cpu_threads.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+struct cpu_job {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool completed = false; // the op has returned
+    bool done = false;      // the callback has returned too, waiters are released
+    job_callback_fn callback = nullptr;
+    void *user_data = nullptr;
+    // one reference for the caller and one for the pool task
+    std::atomic<int> refs{2};
+};
+
+static void job_unref(cpu_job *job)
+{
+    if (job->refs.fetch_sub(1) == 1)
+        delete job;
+}
+
+// the job whose callback runs on this thread: its op has completed, but its waiters
+// are only released once the callback returns
+static thread_local cpu_job *running_callback = nullptr;
+
+cpu_job *job_submit(std::function<void()> fn)
+{
+    cpu_job *job = new cpu_job();
+    pool_submit([job, fn] {
+        fn();
+
+        job_callback_fn callback;
+        void *user_data;
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->completed = true;
+            callback = job->callback;
+            user_data = job->user_data;
+        }
+        // waiters are released after the callback returns, so that whoever waits for the
+        // job before releasing it and whatever the callback uses cannot free it while it runs
+        if (callback != nullptr) {
+            running_callback = job;
+            callback(user_data);
+            running_callback = nullptr;
+        }
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->done = true;
+        }
+        job->cv.notify_all();
+        job_unref(job);
+    });
+    return job;
+}
+
+bool job_poll(cpu_job *job)
+{
+    std::lock_guard<std::mutex> lock(job->mutex);
+    return job->completed;
+}
+
+void job_wait(cpu_job *job)
+{
+    // a callback may wait on its own job, whose op has completed
+    if (job == running_callback)
+        return;
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->cv.wait(lock, [job] { return job->done; });
+}
+
+bool job_wait_for(cpu_job *job, long long timeout_ms)
+{
+    if (job == running_callback)
+        return true;
+    std::unique_lock<std::mutex> lock(job->mutex);
+    return job->cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [job] { return job->done; });
+}
+
+void job_set_callback(cpu_job *job, job_callback_fn callback, void *user_data)
+{
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        if (!job->completed) {
+            job->callback = callback;
+            job->user_data = user_data;
+            return;
+        }
+    }
+    callback(user_data);
+}
+
+void job_release(cpu_job *job) { job_unref(job); }
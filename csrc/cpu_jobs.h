@@ -0,0 +1,28 @@
+#ifndef BITSANDBYTES_CPU_JOBS_H
+#define BITSANDBYTES_CPU_JOBS_H
+
+#include <functional>
+
+// Asynchronous CPU ops. A job runs one op as a task of the thread pool (see
+// cpu_threads.h) and the returned handle tracks its completion. Handles are
+// reference counted: the caller owns one reference and releases it with
+// job_release, the running task owns another, so a handle may be released
+// before the job finished. Buffers passed to the op must stay alive until then.
+
+struct cpu_job;
+
+// called once on the thread that completed the job, or on the registering
+// thread if the job had already completed. job_wait returns once the callback
+// has returned, except within the callback itself.
+typedef void (*job_callback_fn)(void *user_data);
+
+cpu_job *job_submit(std::function<void()> fn);
+
+bool job_poll(cpu_job *job);
+void job_wait(cpu_job *job);
+// returns false if the job did not complete within timeout_ms milliseconds
+bool job_wait_for(cpu_job *job, long long timeout_ms);
+void job_set_callback(cpu_job *job, job_callback_fn callback, void *user_data);
+void job_release(cpu_job *job);
+
+#endif
@@ -0,0 +1,614 @@
+// This file is compiled once per instruction set. CMake defines BNB_CPU_ISA
+// (scalar, sse42, avx2, avx512) together with the matching
+// compiler flags; everything below lives in a namespace named after the
+// variant so that the copies never collide at link time.
+//
+// Keep this file free of calls into inline library code (std::max, std::abs,
+// ...): such functions would be emitted once per variant with different
+// instruction sets and the linker may pick any of them for the whole library.
+
+#include <cpu_kernels.h>
+
+#if defined(__SSE4_2__) || defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#ifndef BNB_CPU_ISA
+#error "BNB_CPU_ISA must be defined when compiling cpu_kernels.cpp"
+#endif
+
+#define BNB_CONCAT_(a, b) a##b
+#define BNB_CONCAT(a, b) BNB_CONCAT_(a, b)
+#define BNB_STRINGIFY_(a) #a
+#define BNB_STRINGIFY(a) BNB_STRINGIFY_(a)
+
+namespace BNB_CONCAT(cpu_isa_, BNB_CPU_ISA) {
+
+static inline float abs_f32(float x) { return x < 0.0f ? -x : x; }
+
+// Returns the index of the closest entry in the sorted 256 value code.
+// This is a branchless binary search for the last value <= x followed by
+// a check against the right neighbour, which is what the SIMD paths do per lane.
+static inline unsigned char search_code(const float *code, float x)
+{
+    int idx = 0;
+    for (int step = 128; step > 0; step >>= 1)
+        idx = code[idx + step] <= x ? idx + step : idx;
+
+    // The search always returns the value to the left, which might not be the closest value
+    if (idx < 255) {
+        float dist_left = abs_f32(x - code[idx]);
+        float dist_right = abs_f32(x - code[idx + 1]);
+        if (dist_right < dist_left) { idx += 1; }
+    }
+    return (unsigned char)idx;
+}
+
+static float block_absmax(const float *A, long long block_idx, long long block_end)
+{
+    float absmax_block = 0.0f;
+    long long i = block_idx;
+#if defined(__AVX512F__)
+    // max(new, running) keeps the running max when the new value is NaN, like fmax
+    __m512 vmax = _mm512_setzero_ps();
+    for (; i + 16 <= block_end; i += 16)
+        vmax = _mm512_max_ps(_mm512_abs_ps(_mm512_loadu_ps(A + i)), vmax);
+    float lanes[16];
+    _mm512_storeu_ps(lanes, vmax);
+    for (int j = 0; j < 16; j++)
+        absmax_block = lanes[j] > absmax_block ? lanes[j] : absmax_block;
+#elif defined(__AVX2__)
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    __m256 vmax = _mm256_setzero_ps();
+    for (; i + 8 <= block_end; i += 8)
+        vmax = _mm256_max_ps(_mm256_andnot_ps(sign_mask, _mm256_loadu_ps(A + i)), vmax);
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vmax);
+    for (int j = 0; j < 8; j++)
+        absmax_block = lanes[j] > absmax_block ? lanes[j] : absmax_block;
+#endif
+    for (; i < block_end; i++) {
+        float a = abs_f32(A[i]);
+        absmax_block = a > absmax_block ? a : absmax_block;
+    }
+    return absmax_block;
+}
+
+static void quantize_block(const float *code, const float *A, float *absmax, unsigned char *out,
+                           long long block_idx, long long block_end, long long blocksize)
+{
+    // 1. find absmax in block
+    // 2. divide input value by absmax to normalize into [-1.0, 1.0]
+    // 3. search the closest value in the code
+    // 4. store index
+    const float absmax_block = block_absmax(A, block_idx, block_end);
+    absmax[block_idx / blocksize] = absmax_block;
+
+    long long i = block_idx;
+#if defined(__AVX512F__)
+    const __m512 vabsmax = _mm512_set1_ps(absmax_block);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i last = _mm512_set1_epi32(255);
+    for (; i + 16 <= block_end; i += 16) {
+        __m512 x = _mm512_div_ps(_mm512_loadu_ps(A + i), vabsmax);
+        __m512i idx = _mm512_setzero_si512();
+        for (int step = 128; step > 0; step >>= 1) {
+            __m512i probe = _mm512_add_epi32(idx, _mm512_set1_epi32(step));
+            __mmask16 le = _mm512_cmp_ps_mask(_mm512_i32gather_ps(probe, code, 4), x, _CMP_LE_OQ);
+            idx = _mm512_mask_mov_epi32(idx, le, probe);
+        }
+        __m512i right = _mm512_min_epi32(_mm512_add_epi32(idx, one), last);
+        __m512 dist_left = _mm512_abs_ps(_mm512_sub_ps(x, _mm512_i32gather_ps(idx, code, 4)));
+        __m512 dist_right = _mm512_abs_ps(_mm512_sub_ps(x, _mm512_i32gather_ps(right, code, 4)));
+        idx = _mm512_mask_mov_epi32(idx, _mm512_cmp_ps_mask(dist_right, dist_left, _CMP_LT_OQ), right);
+        _mm_storeu_si128((__m128i *)(out + i), _mm512_cvtepi32_epi8(idx));
+    }
+#elif defined(__AVX2__)
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    const __m256 vabsmax = _mm256_set1_ps(absmax_block);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i last = _mm256_set1_epi32(255);
+    for (; i + 8 <= block_end; i += 8) {
+        __m256 x = _mm256_div_ps(_mm256_loadu_ps(A + i), vabsmax);
+        __m256i idx = _mm256_setzero_si256();
+        for (int step = 128; step > 0; step >>= 1) {
+            __m256i probe = _mm256_add_epi32(idx, _mm256_set1_epi32(step));
+            __m256 le = _mm256_cmp_ps(_mm256_i32gather_ps(code, probe, 4), x, _CMP_LE_OQ);
+            idx = _mm256_blendv_epi8(idx, probe, _mm256_castps_si256(le));
+        }
+        __m256i right = _mm256_min_epi32(_mm256_add_epi32(idx, one), last);
+        __m256 dist_left = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(x, _mm256_i32gather_ps(code, idx, 4)));
+        __m256 dist_right = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(x, _mm256_i32gather_ps(code, right, 4)));
+        __m256 closer = _mm256_cmp_ps(dist_right, dist_left, _CMP_LT_OQ);
+        idx = _mm256_blendv_epi8(idx, right, _mm256_castps_si256(closer));
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(idx), _mm256_extracti128_si256(idx, 1));
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(words, words));
+    }
+#endif
+    for (; i < block_end; i++)
+        out[i] = search_code(code, A[i] / absmax_block);
+}
+
+// The signed FP8 codes of create_fp8_map are not IEEE formats: with e exponent and
+// p = 7 - e mantissa bits and bias = 2^(e-1), the subnormals are m * 2^-(bias+p) and the
+// normals (1 + m/2^p) * 2^E for E in [2 - bias, bias], all divided by the largest value.
+// The 128 magnitudes sit sorted in code[128..255] (code[128] is -0.0) and their negatives
+// mirrored in code[127..0]. Scaled back by the largest value, the float bits of |x| give
+// the rank of its magnitude up to one step of rounding; one compare with the neighbours in
+// the code fixes that, and a second picks the closer of the two values the way search_code
+// does, including its ties towards the left.
+struct fp8_format {
+    int shift;            // 23 - p: float bits >> shift are exponent and mantissa of the format
+    int normal_offset;    // (128 - bias) << p: subtracted from those, the rank of a normal
+    int first_normal;     // 2^p: the rank of the smallest normal
+    float scale;          // the largest value, (2 - 2^-p) * 2^bias
+    float subnormal_scale; // 2^(bias + p): times a subnormal, its rank
+};
+
+static fp8_format make_fp8_format(int exponent_bits)
+{
+    const int p = 7 - exponent_bits;
+    const int bias = 1 << (exponent_bits - 1);
+    fp8_format format;
+    format.shift = 23 - p;
+    format.normal_offset = (128 - bias) << p;
+    format.first_normal = 1 << p;
+    format.scale = 2.0f - 1.0f / (float)(1 << p);
+    format.subnormal_scale = (float)(1 << p);
+    for (int i = 0; i < bias; i++) {
+        format.scale *= 2.0f;
+        format.subnormal_scale *= 2.0f;
+    }
+    return format;
+}
+
+static inline unsigned int float_bits(float x)
+{
+    union {
+        float f;
+        unsigned int u;
+    } bits;
+    bits.f = x;
+    return bits.u;
+}
+
+static inline unsigned char encode_fp8(const float *code, const fp8_format &format, float x)
+{
+    // NaN compares false everywhere and ends up at index 0, like in search_code
+    if (!(x == x))
+        return 0;
+    const float *magnitudes = code + 128;
+    const float a = abs_f32(x);
+    const float scaled = a * format.scale;
+
+    // abs_f32 keeps the sign of -0.0
+    int rank = (int)((float_bits(scaled) & 0x7fffffffu) >> format.shift) - format.normal_offset;
+    if (rank < format.first_normal) {
+        // below the smallest normal; the gap up to it rounds down to the largest subnormal
+        const float sub = scaled * format.subnormal_scale;
+        rank = sub < (float)(format.first_normal - 1) ? (int)sub : format.first_normal - 1;
+    }
+    rank = rank < 127 ? rank : 127;
+    if (magnitudes[rank] > a)
+        rank--;
+    else if (rank < 127 && magnitudes[rank + 1] <= a)
+        rank++;
+
+    const float below = a - magnitudes[rank];
+    const float above = magnitudes[rank < 127 ? rank + 1 : 127] - a;
+    if (x >= 0.0f)
+        return (unsigned char)(128 + rank + (above < below ? 1 : 0));
+    const int idx = below < above ? 127 - rank : 126 - rank;
+    return (unsigned char)(idx > 0 ? idx : 0);
+}
+
+static void quantize_fp8_block(const float *code, const float *A, float *absmax, unsigned char *out,
+                               long long block_idx, long long block_end, long long blocksize, int exponent_bits)
+{
+    const fp8_format format = make_fp8_format(exponent_bits);
+    const float absmax_block = block_absmax(A, block_idx, block_end);
+    absmax[block_idx / blocksize] = absmax_block;
+
+    long long i = block_idx;
+#if defined(__AVX512F__)
+    const float *magnitudes = code + 128;
+    const __m512 vabsmax = _mm512_set1_ps(absmax_block);
+    const __m512 vscale = _mm512_set1_ps(format.scale);
+    const __m512 vsubnormal_scale = _mm512_set1_ps(format.subnormal_scale);
+    const __m128i shift = _mm_cvtsi32_si128(format.shift);
+    const __m512i normal_offset = _mm512_set1_epi32(format.normal_offset);
+    const __m512i first_normal = _mm512_set1_epi32(format.first_normal);
+    const __m512i last_subnormal = _mm512_set1_epi32(format.first_normal - 1);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i last = _mm512_set1_epi32(127);
+    const __m512i zero = _mm512_setzero_si512();
+    for (; i + 16 <= block_end; i += 16) {
+        __m512 x = _mm512_div_ps(_mm512_loadu_ps(A + i), vabsmax);
+        __m512 a = _mm512_abs_ps(x);
+        __m512 scaled = _mm512_mul_ps(a, vscale);
+
+        __m512i normal = _mm512_sub_epi32(_mm512_srl_epi32(_mm512_castps_si512(scaled), shift), normal_offset);
+        __m512i subnormal = _mm512_min_epi32(_mm512_cvttps_epi32(_mm512_mul_ps(scaled, vsubnormal_scale)), last_subnormal);
+        __mmask16 is_normal = _mm512_cmpge_epi32_mask(normal, first_normal);
+        __m512i rank = _mm512_mask_mov_epi32(subnormal, is_normal, _mm512_min_epi32(normal, last));
+
+        __m512i next = _mm512_min_epi32(_mm512_add_epi32(rank, one), last);
+        __mmask16 too_high = _mm512_cmp_ps_mask(_mm512_i32gather_ps(rank, magnitudes, 4), a, _CMP_GT_OQ);
+        __mmask16 too_low = _mm512_cmp_ps_mask(_mm512_i32gather_ps(next, magnitudes, 4), a, _CMP_LE_OQ) &
+                            _mm512_cmplt_epi32_mask(rank, last);
+        rank = _mm512_mask_sub_epi32(rank, too_high, rank, one);
+        rank = _mm512_mask_add_epi32(rank, too_low, rank, one);
+
+        next = _mm512_min_epi32(_mm512_add_epi32(rank, one), last);
+        __m512 below = _mm512_sub_ps(a, _mm512_i32gather_ps(rank, magnitudes, 4));
+        __m512 above = _mm512_sub_ps(_mm512_i32gather_ps(next, magnitudes, 4), a);
+        __mmask16 round_up = _mm512_cmp_ps_mask(above, below, _CMP_LT_OQ);
+        __mmask16 round_down = _mm512_cmp_ps_mask(below, above, _CMP_LT_OQ);
+
+        __m512i positive = _mm512_mask_add_epi32(_mm512_add_epi32(rank, _mm512_set1_epi32(128)), round_up,
+                                                 _mm512_add_epi32(rank, _mm512_set1_epi32(128)), one);
+        __m512i negative = _mm512_sub_epi32(_mm512_set1_epi32(126), rank);
+        negative = _mm512_max_epi32(_mm512_mask_add_epi32(negative, round_down, negative, one), zero);
+        __m512i idx = _mm512_mask_mov_epi32(negative, _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_GE_OQ), positive);
+        idx = _mm512_maskz_mov_epi32(_mm512_cmp_ps_mask(x, x, _CMP_ORD_Q), idx);
+        _mm_storeu_si128((__m128i *)(out + i), _mm512_cvtepi32_epi8(idx));
+    }
+#elif defined(__AVX2__)
+    const float *magnitudes = code + 128;
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    const __m256 vabsmax = _mm256_set1_ps(absmax_block);
+    const __m256 vscale = _mm256_set1_ps(format.scale);
+    const __m256 vsubnormal_scale = _mm256_set1_ps(format.subnormal_scale);
+    const __m128i shift = _mm_cvtsi32_si128(format.shift);
+    const __m256i normal_offset = _mm256_set1_epi32(format.normal_offset);
+    const __m256i last_subnormal = _mm256_set1_epi32(format.first_normal - 1);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i last = _mm256_set1_epi32(127);
+    for (; i + 8 <= block_end; i += 8) {
+        __m256 x = _mm256_div_ps(_mm256_loadu_ps(A + i), vabsmax);
+        __m256 a = _mm256_andnot_ps(sign_mask, x);
+        __m256 scaled = _mm256_mul_ps(a, vscale);
+
+        __m256i normal = _mm256_sub_epi32(_mm256_srl_epi32(_mm256_castps_si256(scaled), shift), normal_offset);
+        __m256i subnormal = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(scaled, vsubnormal_scale)), last_subnormal);
+        __m256i is_normal = _mm256_cmpgt_epi32(normal, last_subnormal);
+        __m256i rank = _mm256_blendv_epi8(subnormal, _mm256_min_epi32(normal, last), is_normal);
+
+        // masks are all ones (-1) per lane, so adding or subtracting them steps the rank
+        __m256i next = _mm256_min_epi32(_mm256_add_epi32(rank, one), last);
+        __m256 too_high = _mm256_cmp_ps(_mm256_i32gather_ps(magnitudes, rank, 4), a, _CMP_GT_OQ);
+        __m256 too_low = _mm256_cmp_ps(_mm256_i32gather_ps(magnitudes, next, 4), a, _CMP_LE_OQ);
+        __m256i below_last = _mm256_cmpgt_epi32(last, rank);
+        rank = _mm256_add_epi32(rank, _mm256_castps_si256(too_high));
+        rank = _mm256_sub_epi32(rank, _mm256_and_si256(_mm256_castps_si256(too_low), below_last));
+
+        next = _mm256_min_epi32(_mm256_add_epi32(rank, one), last);
+        __m256 below = _mm256_sub_ps(a, _mm256_i32gather_ps(magnitudes, rank, 4));
+        __m256 above = _mm256_sub_ps(_mm256_i32gather_ps(magnitudes, next, 4), a);
+        __m256i round_up = _mm256_castps_si256(_mm256_cmp_ps(above, below, _CMP_LT_OQ));
+        __m256i round_down = _mm256_castps_si256(_mm256_cmp_ps(below, above, _CMP_LT_OQ));
+
+        __m256i positive = _mm256_sub_epi32(_mm256_add_epi32(rank, _mm256_set1_epi32(128)), round_up);
+        __m256i negative = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_set1_epi32(126), rank), round_down);
+        negative = _mm256_max_epi32(negative, _mm256_setzero_si256());
+        __m256 non_negative = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GE_OQ);
+        __m256i idx = _mm256_blendv_epi8(negative, positive, _mm256_castps_si256(non_negative));
+        idx = _mm256_and_si256(idx, _mm256_castps_si256(_mm256_cmp_ps(x, x, _CMP_ORD_Q)));
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(idx), _mm256_extracti128_si256(idx, 1));
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(words, words));
+    }
+#endif
+    for (; i < block_end; i++)
+        out[i] = encode_fp8(code, format, A[i] / absmax_block);
+}
+
+static void dequantize_block(const float *code, const unsigned char *A, const float *absmax, float *out,
+                             long long block_idx, long long block_end, long long blocksize)
+{
+    const float absmax_block = absmax[block_idx / blocksize];
+    long long i = block_idx;
+#if defined(__AVX512F__)
+    const __m512 vabsmax = _mm512_set1_ps(absmax_block);
+    for (; i + 16 <= block_end; i += 16) {
+        __m512i qvals = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(A + i)));
+        _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_i32gather_ps(qvals, code, 4), vabsmax));
+    }
+#elif defined(__AVX2__)
+    const __m256 vabsmax = _mm256_set1_ps(absmax_block);
+    for (; i + 8 <= block_end; i += 8) {
+        __m256i qvals = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(A + i)));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_i32gather_ps(code, qvals, 4), vabsmax));
+    }
+#endif
+    for (; i < block_end; i++)
+        out[i] = code[A[i]] * absmax_block;
+}
+
+// Each packed row holds the 16 columns of a panel in 8 bytes, column j in the low
+// and column j + 8 in the high nibble, so one 64-bit load, a mask and a shift give
+// the 16 table indices of a row in column order.
+static void decode_4bit_panel(const float *code, const unsigned char *packed, const float *scales, float *out,
+                              long long k_begin, long long k_end, long long blocksize)
+{
+#if defined(__AVX512F__)
+    const __m512 vcode = _mm512_loadu_ps(code);
+    const __m128i low_nibbles = _mm_set1_epi8(0x0f);
+#elif defined(__AVX2__)
+    // permutevar8x32 looks up 8 entries, bit 3 of the index picks the half of the table
+    const __m256 code_low = _mm256_loadu_ps(code);
+    const __m256 code_high = _mm256_loadu_ps(code + 8);
+    const __m128i low_nibbles = _mm_set1_epi8(0x0f);
+#endif
+    for (long long k = k_begin; k < k_end;) {
+        // the scales change once every blocksize rows
+        const float *scale = scales + (k / blocksize) * 16;
+        const long long block_end = (k / blocksize + 1) * blocksize;
+        const long long end = block_end < k_end ? block_end : k_end;
+        for (; k < end; k++) {
+            const unsigned char *bytes = packed + k * 8;
+            float *dst = out + (k - k_begin) * 16;
+#if defined(__AVX512F__)
+            __m128i b = _mm_loadl_epi64((const __m128i *)bytes);
+            __m128i idx = _mm_and_si128(_mm_unpacklo_epi64(b, _mm_srli_epi16(b, 4)), low_nibbles);
+            __m512 vals = _mm512_permutexvar_ps(_mm512_cvtepu8_epi32(idx), vcode);
+            _mm512_storeu_ps(dst, _mm512_mul_ps(vals, _mm512_loadu_ps(scale)));
+#elif defined(__AVX2__)
+            __m128i b = _mm_loadl_epi64((const __m128i *)bytes);
+            __m128i nibbles[2] = {_mm_and_si128(b, low_nibbles), _mm_and_si128(_mm_srli_epi16(b, 4), low_nibbles)};
+            for (int half = 0; half < 2; half++) {
+                __m256i idx = _mm256_cvtepu8_epi32(nibbles[half]);
+                __m256 high = _mm256_castsi256_ps(_mm256_slli_epi32(idx, 28));
+                __m256 vals = _mm256_blendv_ps(_mm256_permutevar8x32_ps(code_low, idx),
+                                               _mm256_permutevar8x32_ps(code_high, idx), high);
+                _mm256_storeu_ps(dst + 8 * half, _mm256_mul_ps(vals, _mm256_loadu_ps(scale + 8 * half)));
+            }
+#else
+            for (int j = 0; j < 8; j++) {
+                dst[j] = code[bytes[j] & 0x0f] * scale[j];
+                dst[j + 8] = code[bytes[j] >> 4] * scale[j + 8];
+            }
+#endif
+        }
+    }
+}
+
+// Register blocked micro-kernel: each row of C is one (AVX-512), two (AVX2) or four
+// (SSE) vectors held in registers over the whole kc loop, B rows are loaded once per
+// block of rows.
+static void gemm_panel(const float *A, long long lda, const float *B, float *C, long long rows, long long kc)
+{
+    long long r = 0;
+#if defined(__AVX512F__)
+    for (; r + 8 <= rows; r += 8) {
+        __m512 acc[8];
+        for (int i = 0; i < 8; i++)
+            acc[i] = _mm512_loadu_ps(C + (r + i) * 16);
+        for (long long k = 0; k < kc; k++) {
+            __m512 b = _mm512_loadu_ps(B + k * 16);
+            for (int i = 0; i < 8; i++)
+                acc[i] = _mm512_fmadd_ps(_mm512_set1_ps(A[(r + i) * lda + k]), b, acc[i]);
+        }
+        for (int i = 0; i < 8; i++)
+            _mm512_storeu_ps(C + (r + i) * 16, acc[i]);
+    }
+    for (; r < rows; r++) {
+        __m512 acc = _mm512_loadu_ps(C + r * 16);
+        for (long long k = 0; k < kc; k++)
+            acc = _mm512_fmadd_ps(_mm512_set1_ps(A[r * lda + k]), _mm512_loadu_ps(B + k * 16), acc);
+        _mm512_storeu_ps(C + r * 16, acc);
+    }
+#elif defined(__AVX2__)
+    for (; r + 4 <= rows; r += 4) {
+        __m256 acc[4][2];
+        for (int i = 0; i < 4; i++) {
+            acc[i][0] = _mm256_loadu_ps(C + (r + i) * 16);
+            acc[i][1] = _mm256_loadu_ps(C + (r + i) * 16 + 8);
+        }
+        for (long long k = 0; k < kc; k++) {
+            __m256 b0 = _mm256_loadu_ps(B + k * 16);
+            __m256 b1 = _mm256_loadu_ps(B + k * 16 + 8);
+            for (int i = 0; i < 4; i++) {
+                __m256 a = _mm256_set1_ps(A[(r + i) * lda + k]);
+                acc[i][0] = _mm256_fmadd_ps(a, b0, acc[i][0]);
+                acc[i][1] = _mm256_fmadd_ps(a, b1, acc[i][1]);
+            }
+        }
+        for (int i = 0; i < 4; i++) {
+            _mm256_storeu_ps(C + (r + i) * 16, acc[i][0]);
+            _mm256_storeu_ps(C + (r + i) * 16 + 8, acc[i][1]);
+        }
+    }
+    for (; r < rows; r++) {
+        __m256 acc0 = _mm256_loadu_ps(C + r * 16);
+        __m256 acc1 = _mm256_loadu_ps(C + r * 16 + 8);
+        for (long long k = 0; k < kc; k++) {
+            __m256 a = _mm256_set1_ps(A[r * lda + k]);
+            acc0 = _mm256_fmadd_ps(a, _mm256_loadu_ps(B + k * 16), acc0);
+            acc1 = _mm256_fmadd_ps(a, _mm256_loadu_ps(B + k * 16 + 8), acc1);
+        }
+        _mm256_storeu_ps(C + r * 16, acc0);
+        _mm256_storeu_ps(C + r * 16 + 8, acc1);
+    }
+#elif defined(__SSE4_2__)
+    for (; r + 2 <= rows; r += 2) {
+        __m128 acc[2][4];
+        for (int i = 0; i < 2; i++)
+            for (int q = 0; q < 4; q++)
+                acc[i][q] = _mm_loadu_ps(C + (r + i) * 16 + 4 * q);
+        for (long long k = 0; k < kc; k++) {
+            __m128 b[4];
+            for (int q = 0; q < 4; q++)
+                b[q] = _mm_loadu_ps(B + k * 16 + 4 * q);
+            for (int i = 0; i < 2; i++) {
+                __m128 a = _mm_set1_ps(A[(r + i) * lda + k]);
+                for (int q = 0; q < 4; q++)
+                    acc[i][q] = _mm_add_ps(acc[i][q], _mm_mul_ps(a, b[q]));
+            }
+        }
+        for (int i = 0; i < 2; i++)
+            for (int q = 0; q < 4; q++)
+                _mm_storeu_ps(C + (r + i) * 16 + 4 * q, acc[i][q]);
+    }
+#endif
+    for (; r < rows; r++) {
+        float acc[16];
+        for (int j = 0; j < 16; j++)
+            acc[j] = C[r * 16 + j];
+        for (long long k = 0; k < kc; k++) {
+            const float a = A[r * lda + k];
+            for (int j = 0; j < 16; j++)
+                acc[j] += a * B[k * 16 + j];
+        }
+        for (int j = 0; j < 16; j++)
+            C[r * 16 + j] = acc[j];
+    }
+}
+
+// Used to sum gathered rows of quantized tables, so only the rows that are looked up
+// are ever dequantized and they go straight into the accumulator.
+static void accumulate_8bit(const float *code, const unsigned char *q, float scale, float *acc, long long n)
+{
+    long long i = 0;
+#if defined(__AVX512F__)
+    const __m512 vscale = _mm512_set1_ps(scale);
+    for (; i + 16 <= n; i += 16) {
+        __m512i idx = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(q + i)));
+        __m512 vals = _mm512_i32gather_ps(idx, code, 4);
+        _mm512_storeu_ps(acc + i, _mm512_fmadd_ps(vals, vscale, _mm512_loadu_ps(acc + i)));
+    }
+#elif defined(__AVX2__)
+    const __m256 vscale = _mm256_set1_ps(scale);
+    for (; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(q + i)));
+        __m256 vals = _mm256_i32gather_ps(code, idx, 4);
+        _mm256_storeu_ps(acc + i, _mm256_fmadd_ps(vals, vscale, _mm256_loadu_ps(acc + i)));
+    }
+#endif
+    for (; i < n; i++)
+        acc[i] += code[q[i]] * scale;
+}
+
+static void accumulate_4bit(const float *code, const unsigned char *q, float scale, float *acc, long long n)
+{
+    long long i = 0;
+#if defined(__AVX512F__) || defined(__AVX2__)
+    const __m128i low_nibbles = _mm_set1_epi8(0x0f);
+#endif
+#if defined(__AVX512F__)
+    const __m512 vcode = _mm512_loadu_ps(code);
+    const __m512 vscale = _mm512_set1_ps(scale);
+    for (; i + 16 <= n; i += 16) {
+        __m128i b = _mm_loadl_epi64((const __m128i *)(q + i / 2));
+        __m128i idx = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(b, 4), low_nibbles), _mm_and_si128(b, low_nibbles));
+        __m512 vals = _mm512_permutexvar_ps(_mm512_cvtepu8_epi32(idx), vcode);
+        _mm512_storeu_ps(acc + i, _mm512_fmadd_ps(vals, vscale, _mm512_loadu_ps(acc + i)));
+    }
+#elif defined(__AVX2__)
+    // see decode_4bit_panel
+    const __m256 code_low = _mm256_loadu_ps(code);
+    const __m256 code_high = _mm256_loadu_ps(code + 8);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    for (; i + 16 <= n; i += 16) {
+        __m128i b = _mm_loadl_epi64((const __m128i *)(q + i / 2));
+        __m128i nibbles = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(b, 4), low_nibbles), _mm_and_si128(b, low_nibbles));
+        __m256i idx[2] = {_mm256_cvtepu8_epi32(nibbles), _mm256_cvtepu8_epi32(_mm_srli_si128(nibbles, 8))};
+        for (int half = 0; half < 2; half++) {
+            __m256 high = _mm256_castsi256_ps(_mm256_slli_epi32(idx[half], 28));
+            __m256 vals = _mm256_blendv_ps(_mm256_permutevar8x32_ps(code_low, idx[half]),
+                                           _mm256_permutevar8x32_ps(code_high, idx[half]), high);
+            float *dst = acc + i + 8 * half;
+            _mm256_storeu_ps(dst, _mm256_fmadd_ps(vals, vscale, _mm256_loadu_ps(dst)));
+        }
+    }
+#endif
+    for (; i < n; i += 2) {
+        acc[i] += code[q[i / 2] >> 4] * scale;
+        acc[i + 1] += code[q[i / 2] & 0x0f] * scale;
+    }
+}
+
+// Dot products with quantized rows, e.g. of a query with cached keys; the caller
+// multiplies by the absmax once per block.
+static float dot_8bit(const float *code, const unsigned char *q, const float *x, long long n)
+{
+    long long i = 0;
+    float sum = 0.0f;
+#if defined(__AVX512F__)
+    __m512 vsum = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        __m512i idx = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(q + i)));
+        vsum = _mm512_fmadd_ps(_mm512_i32gather_ps(idx, code, 4), _mm512_loadu_ps(x + i), vsum);
+    }
+    sum = _mm512_reduce_add_ps(vsum);
+#elif defined(__AVX2__)
+    __m256 vsum = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(q + i)));
+        vsum = _mm256_fmadd_ps(_mm256_i32gather_ps(code, idx, 4), _mm256_loadu_ps(x + i), vsum);
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vsum);
+    for (int j = 0; j < 8; j++)
+        sum += lanes[j];
+#endif
+    for (; i < n; i++)
+        sum += code[q[i]] * x[i];
+    return sum;
+}
+
+static float dot_4bit(const float *code, const unsigned char *q, const float *x, long long n)
+{
+    long long i = 0;
+    float sum = 0.0f;
+#if defined(__AVX512F__) || defined(__AVX2__)
+    const __m128i low_nibbles = _mm_set1_epi8(0x0f);
+#endif
+#if defined(__AVX512F__)
+    const __m512 vcode = _mm512_loadu_ps(code);
+    __m512 vsum = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        __m128i b = _mm_loadl_epi64((const __m128i *)(q + i / 2));
+        __m128i idx = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(b, 4), low_nibbles), _mm_and_si128(b, low_nibbles));
+        __m512 vals = _mm512_permutexvar_ps(_mm512_cvtepu8_epi32(idx), vcode);
+        vsum = _mm512_fmadd_ps(vals, _mm512_loadu_ps(x + i), vsum);
+    }
+    sum = _mm512_reduce_add_ps(vsum);
+#elif defined(__AVX2__)
+    const __m256 code_low = _mm256_loadu_ps(code);
+    const __m256 code_high = _mm256_loadu_ps(code + 8);
+    __m256 vsum = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        __m128i b = _mm_loadl_epi64((const __m128i *)(q + i / 2));
+        __m128i nibbles = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(b, 4), low_nibbles), _mm_and_si128(b, low_nibbles));
+        __m256i idx[2] = {_mm256_cvtepu8_epi32(nibbles), _mm256_cvtepu8_epi32(_mm_srli_si128(nibbles, 8))};
+        for (int half = 0; half < 2; half++) {
+            __m256 high = _mm256_castsi256_ps(_mm256_slli_epi32(idx[half], 28));
+            __m256 vals = _mm256_blendv_ps(_mm256_permutevar8x32_ps(code_low, idx[half]),
+                                           _mm256_permutevar8x32_ps(code_high, idx[half]), high);
+            vsum = _mm256_fmadd_ps(vals, _mm256_loadu_ps(x + i + 8 * half), vsum);
+        }
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vsum);
+    for (int j = 0; j < 8; j++)
+        sum += lanes[j];
+#endif
+    for (; i < n; i += 2)
+        sum += code[q[i / 2] >> 4] * x[i] + code[q[i / 2] & 0x0f] * x[i + 1];
+    return sum;
+}
+
+} // namespace
+
+extern const cpu_kernel_table BNB_CONCAT(cpu_kernels_, BNB_CPU_ISA) = {
+    BNB_STRINGIFY(BNB_CPU_ISA),
+    BNB_CONCAT(cpu_isa_, BNB_CPU_ISA)::quantize_block,
+    BNB_CONCAT(cpu_isa_, BNB_CPU_ISA)::dequantize_block,
+    BNB_CONCAT(cpu_isa_, BNB_CPU_ISA)::quantize_fp8_block,
+    BNB_CONCAT(cpu_isa_, BNB_CPU_ISA)::decode_4bit_panel,
+    BNB_CONCAT(cpu_isa_, BNB_CPU_ISA)::gemm_panel,
+    BNB_CONCAT(cpu_isa_, BNB_CPU_ISA)::accumulate_8bit,
+    BNB_CONCAT(cpu_isa_, BNB_CPU_ISA)::accumulate_4bit,
+    BNB_CONCAT(cpu_isa_, BNB_CPU_ISA)::dot_8bit,
+    BNB_CONCAT(cpu_isa_, BNB_CPU_ISA)::dot_4bit,
+};
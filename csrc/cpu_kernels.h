@@ -0,0 +1,79 @@
+#ifndef BITSANDBYTES_CPU_KERNELS_H
+#define BITSANDBYTES_CPU_KERNELS_H
+
+// The hot CPU kernels live in cpu_kernels.cpp, which is compiled once per
+// instruction set (see CMakeLists.txt). Every variant exports a table of
+// function pointers and cpu_dispatch.cpp picks one of them at load time.
+//
+// Nothing in this header may define inline functions: it is included by
+// translation units built with different -m flags, and the linker is free
+// to keep any one of the resulting copies.
+
+typedef void (*quantize_block_fn)(const float *code, const float *A, float *absmax, unsigned char *out,
+                                  long long block_idx, long long block_end, long long blocksize);
+typedef void (*dequantize_block_fn)(const float *code, const unsigned char *A, const float *absmax, float *out,
+                                    long long block_idx, long long block_end, long long blocksize);
+// quantize_block for the signed FP8 code of create_fp8_map(True, exponent_bits, 7 - exponent_bits):
+// the same indices, computed from the float bits instead of searching the code
+typedef void (*quantize_fp8_block_fn)(const float *code, const float *A, float *absmax, unsigned char *out,
+                                      long long block_idx, long long block_end, long long blocksize, int exponent_bits);
+// Decodes rows [k_begin, k_end) of one prepacked 4-bit panel (see prepack_4bit_cpu in
+// cpu_ops.h) into (k_end - k_begin) x 16 floats: code[nibble] * scale of the column.
+typedef void (*decode_4bit_panel_fn)(const float *code, const unsigned char *packed, const float *scales, float *out,
+                                     long long k_begin, long long k_end, long long blocksize);
+// C[rows x 16] += A[rows x kc] * B[kc x 16]; A has a row stride of lda, B and C of 16.
+typedef void (*gemm_panel_fn)(const float *A, long long lda, const float *B, float *C, long long rows, long long kc);
+// acc[i] += code[q_i] * scale for n values, with one byte per value (8-bit) or two values
+// per byte and the first one in the high nibble (4-bit, n even).
+typedef void (*accumulate_dequantized_fn)(const float *code, const unsigned char *q, float scale, float *acc, long long n);
+// Returns sum(code[q_i] * x[i]) for n values stored like for accumulate_dequantized_fn.
+typedef float (*dot_dequantized_fn)(const float *code, const unsigned char *q, const float *x, long long n);
+
+struct cpu_kernel_table {
+    const char *name;
+    quantize_block_fn quantize_block;
+    dequantize_block_fn dequantize_block;
+    quantize_fp8_block_fn quantize_fp8_block;
+    decode_4bit_panel_fn decode_4bit_panel;
+    gemm_panel_fn gemm_panel;
+    accumulate_dequantized_fn accumulate_8bit;
+    accumulate_dequantized_fn accumulate_4bit;
+    dot_dequantized_fn dot_8bit;
+    dot_dequantized_fn dot_4bit;
+};
+
+// ordered from the most portable to the most specialized variant
+typedef enum CPU_ISA
+{
+    CPU_ISA_SCALAR = 0,
+    CPU_ISA_SSE42 = 1,
+    CPU_ISA_AVX2 = 2,
+    CPU_ISA_AVX512 = 3,
+    CPU_ISA_COUNT = 4,
+} CPU_ISA;
+
+extern const cpu_kernel_table cpu_kernels_scalar;
+#if BNB_CPU_X86
+extern const cpu_kernel_table cpu_kernels_sse42;
+extern const cpu_kernel_table cpu_kernels_avx2;
+extern const cpu_kernel_table cpu_kernels_avx512;
+#endif
+
+// the table selected for this process; resolved once on first use
+const cpu_kernel_table *cpu_kernels();
+CPU_ISA cpu_isa();
+
+// The best variant the host supports, capped by BNB_CPU_ISA. Unless BNB_CPU_ISA is
+// set, the autotuner may select any variant up to it with set_cpu_isa.
+CPU_ISA cpu_isa_default();
+bool cpu_isa_tunable();
+void set_cpu_isa(CPU_ISA isa);
+
+// the names accepted by BNB_CPU_ISA; cpu_isa_from_name returns -1 for unknown names
+const char *cpu_isa_to_name(CPU_ISA isa);
+int cpu_isa_from_name(const char *name);
+
+// e.g. the cpuid brand string, or "unknown"
+const char *cpu_model_name();
+
+#endif
@@ -0,0 +1,129 @@
+#include <common.h>
+#include <cpu_kernels.h>
+#include <cpu_ops.h>
+#include <cpu_threads.h>
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+// byte and absmax layout of one cache, see cpu_ops.h
+struct kv_cache_layout {
+    bool four_bit;
+    const float *values;
+    long long capacity;
+    long long head_dim;
+    long long blocksize;
+    long long row_bytes;
+    long long block_bytes;
+    long long blocks_per_row;
+
+    kv_cache_layout(int quant_type, const float *code, long long capacity, long long head_dim, long long blocksize)
+        : four_bit(quant_type != CPU_GENERAL_8BIT), values(four_bit ? cpu_4bit_code(quant_type) : code),
+          capacity(capacity), head_dim(head_dim), blocksize(blocksize), row_bytes(four_bit ? head_dim / 2 : head_dim),
+          block_bytes(four_bit ? blocksize / 2 : blocksize), blocks_per_row(head_dim / blocksize)
+    {
+    }
+
+    long long row(long long kv_head, long long position) const { return kv_head * capacity + position % capacity; }
+};
+
+} // namespace
+
+void kv_cache_append_cpu(int quant_type, int dtype, void *rows, unsigned char *cache, float *absmax, float *code,
+                         long long num_kv_heads, long long capacity, long long head_dim, long long blocksize,
+                         long long start, long long num_tokens)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const kv_cache_layout layout(quant_type, code, capacity, head_dim, blocksize);
+    // see quantize_cpu
+    if (!layout.four_bit)
+        code[0] = -1.0f;
+
+    parallel_for(num_kv_heads * num_tokens, std::max(1LL, BLOCK_SIZE / head_dim), [&](long long first, long long last) {
+        std::vector<float> buffer(head_dim);
+        for (long long item = first; item < last; item++) {
+            const long long kv_head = item / num_tokens;
+            const long long row = layout.row(kv_head, start + item % num_tokens);
+            load_as_float(rows, (ScalarType_t)dtype, item * head_dim, head_dim, buffer.data());
+            unsigned char *q = cache + row * layout.row_bytes;
+            float *row_absmax = absmax + row * layout.blocks_per_row;
+            if (layout.four_bit) {
+                quantize_4bit_values(quant_type, buffer.data(), row_absmax, q, blocksize, head_dim);
+            } else {
+                for (long long block_idx = 0; block_idx < head_dim; block_idx += blocksize)
+                    kernels->quantize_block(code, buffer.data(), row_absmax, q, block_idx, block_idx + blocksize, blocksize);
+            }
+        }
+    });
+}
+
+void kv_cache_scores_cpu(int quant_type, int dtype, void *query, unsigned char *cache, float *absmax, float *code,
+                         long long num_heads, long long num_kv_heads, long long num_queries, long long capacity,
+                         long long head_dim, long long blocksize, long long start, long long window, float scale,
+                         float *scores)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const kv_cache_layout layout(quant_type, code, capacity, head_dim, blocksize);
+    const dot_dequantized_fn dot = layout.four_bit ? kernels->dot_4bit : kernels->dot_8bit;
+    const long long group = num_heads / num_kv_heads;
+
+    std::vector<float> queries(num_heads * num_queries * head_dim);
+    load_as_float(query, (ScalarType_t)dtype, 0, queries.size(), queries.data());
+
+    // every key row is read once and multiplied with all queries of its kv head
+    const long long values_per_key = group * num_queries * head_dim;
+    parallel_for(num_kv_heads * window, std::max(1LL, BLOCK_SIZE / values_per_key), [&](long long first, long long last) {
+        for (long long item = first; item < last; item++) {
+            const long long kv_head = item / window;
+            const long long t = item % window;
+            const long long row = layout.row(kv_head, start + t);
+            const unsigned char *q = cache + row * layout.row_bytes;
+            const float *row_absmax = absmax + row * layout.blocks_per_row;
+            for (long long h = kv_head * group; h < (kv_head + 1) * group; h++) {
+                for (long long i = 0; i < num_queries; i++) {
+                    const float *x = queries.data() + (h * num_queries + i) * head_dim;
+                    float sum = 0.0f;
+                    for (long long b = 0; b < layout.blocks_per_row; b++)
+                        sum += row_absmax[b] * dot(layout.values, q + b * layout.block_bytes, x + b * blocksize, blocksize);
+                    scores[(h * num_queries + i) * window + t] = scale * sum;
+                }
+            }
+        }
+    });
+}
+
+void kv_cache_attend_cpu(int quant_type, float *probs, unsigned char *cache, float *absmax, float *code,
+                         long long num_heads, long long num_kv_heads, long long num_queries, long long capacity,
+                         long long head_dim, long long blocksize, long long start, long long window, float *out)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const kv_cache_layout layout(quant_type, code, capacity, head_dim, blocksize);
+    const accumulate_dequantized_fn accumulate = layout.four_bit ? kernels->accumulate_4bit : kernels->accumulate_8bit;
+    const long long group = num_heads / num_kv_heads;
+
+    // a task sums up all query heads of one kv head, so that each value row is read once per query
+    parallel_for(num_kv_heads * num_queries, 1, [&](long long first, long long last) {
+        for (long long item = first; item < last; item++) {
+            const long long kv_head = item / num_queries;
+            const long long i = item % num_queries;
+            for (long long h = kv_head * group; h < (kv_head + 1) * group; h++)
+                std::fill(out + (h * num_queries + i) * head_dim, out + (h * num_queries + i + 1) * head_dim, 0.0f);
+
+            for (long long t = 0; t < window; t++) {
+                const long long row = layout.row(kv_head, start + t);
+                const unsigned char *q = cache + row * layout.row_bytes;
+                const float *row_absmax = absmax + row * layout.blocks_per_row;
+                for (long long h = kv_head * group; h < (kv_head + 1) * group; h++) {
+                    const float p = probs[(h * num_queries + i) * window + t];
+                    // masked positions cost nothing
+                    if (p == 0.0f)
+                        continue;
+                    float *acc = out + (h * num_queries + i) * head_dim;
+                    for (long long b = 0; b < layout.blocks_per_row; b++)
+                        accumulate(layout.values, q + b * layout.block_bytes, row_absmax[b] * p, acc + b * blocksize, blocksize);
+                }
+            }
+        }
+    });
+}
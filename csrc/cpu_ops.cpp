@@ -1,16 +1,25 @@
-#include <BinSearch.h>
 #include <common.h>
-#include <thread>
-
-using namespace BinSearch;
+#include <cpu_autotune.h>
+#include <cpu_kernels.h>
+#include <cpu_ops.h>
+#include <cpu_threads.h>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
 
 void dequantize_cpu(float *code, unsigned char *A, float *absmax, float *out, long long blocksize, long long n) {
-    for (long long block_idx = 0; block_idx < n; block_idx += blocksize) {
-        long long valid_items = n - block_idx >= blocksize ? blocksize : n - block_idx;
-        long long block_end = block_idx + valid_items;
-        for (long long i = block_idx; i < block_end; i++)
-            out[i] = code[A[i]] * absmax[block_idx / blocksize];
-    }
+    const cpu_kernel_table *kernels = cpu_kernels();
+    long long num_blocks = n / blocksize;
+    num_blocks += n % blocksize == 0 ? 0 : 1;
+
+    parallel_for(num_blocks, blocks_per_task(blocksize), [&](long long first_block, long long last_block) {
+        for (long long block_idx = first_block * blocksize; block_idx < last_block * blocksize && block_idx < n; block_idx += blocksize) {
+            long long valid_items = n - block_idx >= blocksize ? blocksize : n - block_idx;
+            long long block_end = block_idx + valid_items;
+            kernels->dequantize_block(code, A, absmax, out, block_idx, block_end, blocksize);
+        }
+    });
 }
 
 void quantize_cpu(float *code, float *A, float *absmax, unsigned char *out, long long blocksize, long long n)
@@ -22,42 +31,413 @@ void quantize_cpu(float *code, float *A, float *absmax, unsigned char *out, long
     long long num_blocks = n / blocksize;
     num_blocks += n % blocksize == 0 ? 0 : 1;
 
-    const uint32 elements_code = 256;
-    BinAlgo<Scalar, float, Direct2> bin_searcher(code, elements_code);
-
-    int thread_wave_size = 256;
-    // we chunk the threads into waves of 256 since the max limit is
-    // between 16k and 64k on Linux (we reach this when running BLOOM-176B with a large batch size)
-    for(long long offset = 0; offset < num_blocks; offset+=thread_wave_size)
-    {
-      long long valid_chunks = num_blocks - offset >= thread_wave_size ? thread_wave_size : num_blocks - offset;
-      std::vector<std::thread> threads(valid_chunks);
-      std::vector<quantize_block_args> args(valid_chunks);
-
-      int chunks_processed = 0;
-      for(long long block_idx = offset*blocksize; block_idx < n; block_idx += blocksize)
-      {
-          long long valid_items = n - block_idx >= blocksize ? blocksize : n - block_idx;
-          long long block_end = block_idx + valid_items;
-
-          struct quantize_block_args& arg = args[chunks_processed];
-          arg.bin_searcher = &bin_searcher;
-          arg.code = code;
-          arg.A = A;
-          arg.absmax = absmax;
-          arg.out = out;
-          arg.block_end = block_end;
-          arg.block_idx = block_idx;
-          arg.threadidx = block_idx / blocksize;
-          arg.blocksize = blocksize;
-
-          threads[chunks_processed] = std::thread([arg] { quantize_block(arg); });
-          chunks_processed += 1;
-          if(chunks_processed == valid_chunks){ break; }
-      }
-
-      for (int i = 0; i < valid_chunks; i++)
-          threads[i].join();
+    // blocks are spread over the persistent thread pool (see cpu_threads.h)
+    parallel_for(num_blocks, blocks_per_task(blocksize), [&](long long first_block, long long last_block) {
+        for (long long block_idx = first_block * blocksize; block_idx < last_block * blocksize && block_idx < n; block_idx += blocksize) {
+            long long valid_items = n - block_idx >= blocksize ? blocksize : n - block_idx;
+
+            quantize_block_args arg;
+            arg.code = code;
+            arg.A = A;
+            arg.absmax = absmax;
+            arg.out = out;
+            arg.block_end = block_idx + valid_items;
+            arg.block_idx = block_idx;
+            arg.threadidx = block_idx / blocksize;
+            arg.blocksize = blocksize;
+            quantize_block(arg);
+        }
+    });
+}
+
+void quantize_fp8_cpu(float *code, int exponent_bits, int dtype, void *A, float *absmax, unsigned char *out,
+                      long long blocksize, long long n)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const long long num_blocks = (n + blocksize - 1) / blocksize;
+    parallel_for(num_blocks, blocks_per_task(blocksize), [&](long long first_block, long long last_block) {
+        std::vector<float> buffer;
+        for (long long block = first_block; block < last_block; block++) {
+            long long block_idx = block * blocksize;
+            long long valid_items = std::min(blocksize, n - block_idx);
+            if (dtype == Float32) {
+                kernels->quantize_fp8_block(code, (const float *)A, absmax, out, block_idx, block_idx + valid_items,
+                                            blocksize, exponent_bits);
+            } else {
+                // see quantize_cpu_batched
+                buffer.resize(valid_items);
+                load_as_float(A, (ScalarType_t)dtype, block_idx, valid_items, buffer.data());
+                kernels->quantize_fp8_block(code, buffer.data(), absmax + block, out + block_idx, 0, valid_items,
+                                            blocksize, exponent_bits);
+            }
+        }
+    });
+}
+
+// Spreads the blocks of many tensors over the thread pool. Work is counted in
+// tasks of about task_values values (see cpu_autotune.h), so a bias of 64 values
+// and a weight of 100M values are both split or packed into units of similar cost.
+// fn(tensor, first_block, last_block) is called with ranges inside one tensor.
+template <typename F>
+static void for_each_block_batched(const quantize_tensor_desc *tensors, long long num_tensors, F fn) {
+    // first task of each tensor, with the total at the end
+    std::vector<long long> task_offsets(num_tensors + 1, 0);
+    for (long long t = 0; t < num_tensors; t++) {
+        long long num_blocks = (tensors[t].n + tensors[t].blocksize - 1) / tensors[t].blocksize;
+        long long per_task = blocks_per_task(tensors[t].blocksize);
+        task_offsets[t + 1] = task_offsets[t] + (num_blocks + per_task - 1) / per_task;
+    }
+
+    parallel_for(task_offsets[num_tensors], 1, [&](long long first_task, long long last_task) {
+        long long t = std::upper_bound(task_offsets.begin(), task_offsets.end(), first_task) - task_offsets.begin() - 1;
+        for (long long task = first_task; task < last_task; task++) {
+            while (task >= task_offsets[t + 1])
+                t++;
+            const quantize_tensor_desc &tensor = tensors[t];
+            long long num_blocks = (tensor.n + tensor.blocksize - 1) / tensor.blocksize;
+            long long per_task = blocks_per_task(tensor.blocksize);
+            long long first_block = (task - task_offsets[t]) * per_task;
+            fn(tensor, first_block, std::min(num_blocks, first_block + per_task));
+        }
+    });
+}
+
+void quantize_cpu_batched(quantize_tensor_desc *tensors, long long num_tensors) {
+    // see quantize_cpu
+    for (long long t = 0; t < num_tensors; t++)
+        tensors[t].code[0] = -1.0f;
+
+    const cpu_kernel_table *kernels = cpu_kernels();
+    for_each_block_batched(tensors, num_tensors, [kernels](const quantize_tensor_desc &tensor, long long first_block, long long last_block) {
+        std::vector<float> buffer;
+        for (long long block = first_block; block < last_block; block++) {
+            long long block_idx = block * tensor.blocksize;
+            long long valid_items = std::min(tensor.blocksize, tensor.n - block_idx);
+            if (tensor.dtype == Float32) {
+                kernels->quantize_block(tensor.code, (const float *)tensor.A, tensor.absmax, tensor.out,
+                                        block_idx, block_idx + valid_items, tensor.blocksize);
+            } else {
+                // 16-bit inputs are widened one block at a time
+                buffer.resize(valid_items);
+                load_as_float(tensor.A, (ScalarType_t)tensor.dtype, block_idx, valid_items, buffer.data());
+                kernels->quantize_block(tensor.code, buffer.data(), tensor.absmax + block, tensor.out + block_idx,
+                                        0, valid_items, tensor.blocksize);
+            }
+        }
+    });
+}
+
+void dequantize_cpu_batched(quantize_tensor_desc *tensors, long long num_tensors) {
+    const cpu_kernel_table *kernels = cpu_kernels();
+    for_each_block_batched(tensors, num_tensors, [kernels](const quantize_tensor_desc &tensor, long long first_block, long long last_block) {
+        std::vector<float> buffer;
+        for (long long block = first_block; block < last_block; block++) {
+            long long block_idx = block * tensor.blocksize;
+            long long valid_items = std::min(tensor.blocksize, tensor.n - block_idx);
+            if (tensor.dtype == Float32) {
+                kernels->dequantize_block(tensor.code, tensor.out, tensor.absmax, (float *)tensor.A,
+                                          block_idx, block_idx + valid_items, tensor.blocksize);
+            } else {
+                buffer.resize(valid_items);
+                kernels->dequantize_block(tensor.code, tensor.out + block_idx, tensor.absmax + block, buffer.data(),
+                                          0, valid_items, tensor.blocksize);
+                store_from_float(buffer.data(), (ScalarType_t)tensor.dtype, block_idx, valid_items, tensor.A);
+            }
+        }
+    });
+}
+
+static long long gcd(long long a, long long b) { return b == 0 ? a : gcd(b, a % b); }
+
+void requantize_cpu(int src_type, unsigned char *src, float *src_absmax, float *src_code, long long src_blocksize,
+                    int dst_type, unsigned char *dst, float *dst_absmax, float *dst_code, long long dst_blocksize,
+                    int dst_fp8_exponent_bits, long long n)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const bool src_4bit = src_type != CPU_GENERAL_8BIT;
+    const bool dst_4bit = dst_type != CPU_GENERAL_8BIT;
+    const float *src_values = src_4bit ? cpu_4bit_code(src_type) : src_code;
+    if (!dst_4bit && dst_fp8_exponent_bits <= 0)
+        // see quantize_cpu
+        dst_code[0] = -1.0f;
+
+    // chunks hold whole blocks of both formats, so that every chunk starts a byte of
+    // packed 4-bit values and is converted independently
+    const long long block_multiple = src_blocksize / gcd(src_blocksize, dst_blocksize) * dst_blocksize;
+    const long long chunk_size = block_multiple * std::max(1LL, BLOCK_SIZE / block_multiple);
+    const long long num_chunks = (n + chunk_size - 1) / chunk_size;
+
+    parallel_for(num_chunks, 1, [&](long long first_chunk, long long last_chunk) {
+        std::vector<float> buffer(chunk_size);
+        for (long long chunk = first_chunk; chunk < last_chunk; chunk++) {
+            const long long chunk_idx = chunk * chunk_size;
+            const long long chunk_items = std::min(chunk_size, n - chunk_idx);
+
+            const float *absmax = src_absmax + chunk_idx / src_blocksize;
+            for (long long i = 0; i < chunk_items; i += src_blocksize) {
+                const long long valid_items = std::min(src_blocksize, chunk_items - i);
+                if (!src_4bit) {
+                    kernels->dequantize_block(src_values, src + chunk_idx, absmax, buffer.data(), i, i + valid_items,
+                                              src_blocksize);
+                    continue;
+                }
+                const float scale = absmax[i / src_blocksize];
+                const unsigned char *q = src + (chunk_idx + i) / 2;
+                const long long pairs = valid_items / 2;
+                std::fill(buffer.begin() + i, buffer.begin() + i + 2 * pairs, 0.0f);
+                kernels->accumulate_4bit(src_values, q, scale, buffer.data() + i, 2 * pairs);
+                if (valid_items % 2 != 0)
+                    buffer[i + valid_items - 1] = src_values[q[pairs] >> 4] * scale;
+            }
+
+            float *out_absmax = dst_absmax + chunk_idx / dst_blocksize;
+            if (dst_4bit) {
+                quantize_4bit_values(dst_type, buffer.data(), out_absmax, dst + chunk_idx / 2, dst_blocksize,
+                                     chunk_items);
+                continue;
+            }
+            for (long long i = 0; i < chunk_items; i += dst_blocksize) {
+                const long long valid_items = std::min(dst_blocksize, chunk_items - i);
+                if (dst_fp8_exponent_bits > 0)
+                    kernels->quantize_fp8_block(dst_code, buffer.data(), out_absmax, dst + chunk_idx, i,
+                                                i + valid_items, dst_blocksize, dst_fp8_exponent_bits);
+                else
+                    kernels->quantize_block(dst_code, buffer.data(), out_absmax, dst + chunk_idx, i, i + valid_items,
+                                            dst_blocksize);
+            }
+        }
+    });
+}
+
+// Histograms up to this many bins are privatized: each partition of the input
+// accumulates into its own copy (1 MB of floats, which stays in L2), and the
+// copies are added up at the end. Larger histograms would thrash the caches
+// and need too much memory per thread, so the updates are sorted by bin instead.
+static const long long HISTOGRAM_PRIVATE_MAX_BINS = 1 << 18;
+// In deterministic mode the input is split into at most this many parts, whatever the
+// number of threads, which bounds the copies to 16 MB.
+static const long long HISTOGRAM_DETERMINISTIC_PARTS = 16;
+
+static void histogram_scatter_add_2d_private(float *histogram, const int *index1, const int *index2, const float *src,
+                                             int maxidx1, long long num_bins, long long n) {
+    // enough work per partition to pay for merging its copy of the histogram
+    const long long max_parts = get_deterministic() ? HISTOGRAM_DETERMINISTIC_PARTS : get_num_threads();
+    const long long num_parts = std::max(1LL, std::min(max_parts, n / std::max(num_bins, (long long)BLOCK_SIZE)));
+    if (num_parts == 1) {
+        for (long long i = 0; i < n; i++)
+            histogram[(long long)index1[i] * maxidx1 + index2[i]] += src[i];
+        return;
     }
 
+    // copies start on separate cache lines so that partitions never share one
+    const long long stride = (num_bins + 15) / 16 * 16;
+    std::vector<float> tiles(num_parts * stride + 16, 0.0f);
+    float *tiles_base = tiles.data() + (16 - ((uintptr_t)tiles.data() / sizeof(float)) % 16) % 16;
+
+    parallel_for(num_parts, 1, [&](long long first_part, long long last_part) {
+        for (long long part = first_part; part < last_part; part++) {
+            float *tile = tiles_base + part * stride;
+            for (long long i = part * n / num_parts; i < (part + 1) * n / num_parts; i++)
+                tile[(long long)index1[i] * maxidx1 + index2[i]] += src[i];
+        }
+    });
+
+    // bins are split between threads, each adds up all copies of its bins pairwise, in a
+    // tree that only depends on num_parts
+    parallel_for(num_bins, BLOCK_SIZE, [&](long long first_bin, long long last_bin) {
+        for (long long step = 1; step < num_parts; step *= 2) {
+            for (long long part = 0; part + step < num_parts; part += 2 * step) {
+                float *tile = tiles_base + part * stride;
+                const float *other = tiles_base + (part + step) * stride;
+                for (long long bin = first_bin; bin < last_bin; bin++)
+                    tile[bin] += other[bin];
+            }
+        }
+        for (long long bin = first_bin; bin < last_bin; bin++)
+            histogram[bin] += tiles_base[bin];
+    });
+}
+
+static void histogram_scatter_add_2d_sorted(float *histogram, const int *index1, const int *index2, const float *src,
+                                            int maxidx1, long long num_bins, long long n) {
+    // The bins are split into ranges of equal width. Updates are bucketed by range
+    // (stable, like one pass of a radix sort), then each range is sorted by bin and
+    // reduced into the histogram by one task, so no two tasks write the same bin. Every
+    // bin sums its updates in input order, for any number of threads.
+    const long long num_chunks = std::max(1LL, std::min<long long>(get_num_threads(), n / BLOCK_SIZE));
+    const long long num_ranges = std::min<long long>(4LL * get_num_threads(), num_bins);
+    auto range_of = [num_bins, num_ranges](long long bin) { return bin * num_ranges / num_bins; };
+    auto bin_of = [&](long long i) { return (long long)index1[i] * maxidx1 + index2[i]; };
+
+    // counts[chunk * num_ranges + range], then turned into scatter offsets
+    std::vector<long long> counts(num_chunks * num_ranges, 0);
+    parallel_for(num_chunks, 1, [&](long long first_chunk, long long last_chunk) {
+        for (long long chunk = first_chunk; chunk < last_chunk; chunk++)
+            for (long long i = chunk * n / num_chunks; i < (chunk + 1) * n / num_chunks; i++)
+                counts[chunk * num_ranges + range_of(bin_of(i))]++;
+    });
+    std::vector<long long> range_offsets(num_ranges + 1, 0);
+    long long offset = 0;
+    for (long long range = 0; range < num_ranges; range++) {
+        range_offsets[range] = offset;
+        for (long long chunk = 0; chunk < num_chunks; chunk++) {
+            long long count = counts[chunk * num_ranges + range];
+            counts[chunk * num_ranges + range] = offset;
+            offset += count;
+        }
+    }
+    range_offsets[num_ranges] = offset;
+
+    std::vector<std::pair<long long, float>> updates(n);
+    parallel_for(num_chunks, 1, [&](long long first_chunk, long long last_chunk) {
+        for (long long chunk = first_chunk; chunk < last_chunk; chunk++) {
+            long long *next = counts.data() + chunk * num_ranges;
+            for (long long i = chunk * n / num_chunks; i < (chunk + 1) * n / num_chunks; i++) {
+                long long bin = bin_of(i);
+                updates[next[range_of(bin)]++] = std::make_pair(bin, src[i]);
+            }
+        }
+    });
+
+    parallel_for(num_ranges, 1, [&](long long first_range, long long last_range) {
+        for (long long range = first_range; range < last_range; range++) {
+            auto first = updates.begin() + range_offsets[range];
+            auto last = updates.begin() + range_offsets[range + 1];
+            // stable, so every bin sums its updates in input order
+            std::stable_sort(first, last, [](const std::pair<long long, float> &a, const std::pair<long long, float> &b) {
+                return a.first < b.first;
+            });
+            for (auto it = first; it != last;) {
+                const long long bin = it->first;
+                float sum = 0.0f;
+                for (; it != last && it->first == bin; ++it)
+                    sum += it->second;
+                histogram[bin] += sum;
+            }
+        }
+    });
 }
+
+void histogram_scatter_add_2d_cpu(float *histogram, int *index1, int *index2, float *src, int maxidx1, long long num_bins, long long n) {
+    if (num_bins <= HISTOGRAM_PRIVATE_MAX_BINS)
+        histogram_scatter_add_2d_private(histogram, index1, index2, src, maxidx1, num_bins, n);
+    else
+        histogram_scatter_add_2d_sorted(histogram, index1, index2, src, maxidx1, num_bins, n);
+}
+
+// sums[m * (last_row - first_row) + n - first_row] += x[m] . W[n] for the rows
+// [first_row, last_row) of a weight quantized like gemv_blockwise_cpu expects. Every row
+// of W starts a block, so the rows are independent.
+static void gemv_blockwise_rows(int quant_type, const float *x, const unsigned char *W, const float *absmax,
+                                const float *code, long long M, long long K, long long blocksize,
+                                long long first_row, long long last_row, float *sums)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const bool four_bit = quant_type != CPU_GENERAL_8BIT;
+    const float *values = four_bit ? cpu_4bit_code(quant_type) : code;
+    const long long rows = last_row - first_row;
+    const long long k_blocks = K / blocksize;
+    for (long long n = first_row; n < last_row; n++) {
+        for (long long kb = 0; kb < k_blocks; kb++) {
+            const long long idx = n * K + kb * blocksize;
+            const float scale = absmax[n * k_blocks + kb];
+            for (long long m = 0; m < M; m++) {
+                const float *xb = x + m * K + kb * blocksize;
+                const float dot = four_bit ? kernels->dot_4bit(values, W + idx / 2, xb, blocksize)
+                                           : kernels->dot_8bit(values, W + idx, xb, blocksize);
+                sums[m * rows + n - first_row] += dot * scale;
+            }
+        }
+    }
+}
+
+static const float *widen_rows(void *x, ScalarType_t type, long long n, std::vector<float> &buffer)
+{
+    if (type == Float32)
+        return (const float *)x;
+    buffer.resize(n);
+    load_as_float(x, type, 0, n, buffer.data());
+    return buffer.data();
+}
+
+void gemv_blockwise_cpu(int quant_type, int dtype, void *x, unsigned char *W, float *absmax, float *code, void *out,
+                        long long M, long long N, long long K, long long blocksize)
+{
+    const ScalarType_t type = (ScalarType_t)dtype;
+    std::vector<float> x_buffer;
+    const float *x_float = widen_rows(x, type, M * K, x_buffer);
+
+    parallel_for(N, std::max(1LL, get_cpu_tuning().task_values / K), [&](long long first_row, long long last_row) {
+        const long long rows = last_row - first_row;
+        std::vector<float> sums(M * rows, 0.0f);
+        gemv_blockwise_rows(quant_type, x_float, W, absmax, code, M, K, blocksize, first_row, last_row, sums.data());
+        for (long long m = 0; m < M; m++)
+            store_from_float(sums.data() + m * rows, type, m * N + first_row, rows, out);
+    });
+}
+
+bool gemv_lora_cpu(int quant_type, int dtype, void *x, unsigned char *W, float *absmax, float *code, void *lora_A,
+                   void *lora_B, float *scales, long long *adapter_ids, long long num_adapters, long long rank,
+                   void *out, long long M, long long N, long long K, long long blocksize)
+{
+    for (long long m = 0; m < M; m++) {
+        if (adapter_ids[m] >= num_adapters) {
+            fprintf(stderr, "bitsandbytes: row %lld selects adapter %lld of %lld\n", m, adapter_ids[m], num_adapters);
+            memset(out, 0, M * N * (dtype == Float32 ? 4 : 2));
+            return false;
+        }
+    }
+    const ScalarType_t type = (ScalarType_t)dtype;
+    std::vector<float> x_buffer;
+    const float *x_float = widen_rows(x, type, M * K, x_buffer);
+
+    // the down projections h[m] = scale * x[m] A^T of the rank of each adapter, from the
+    // same widened rows of x as the base product
+    std::vector<float> h(M * rank, 0.0f);
+    parallel_for(M * rank, std::max(1LL, get_cpu_tuning().task_values / K), [&](long long first, long long last) {
+        std::vector<float> a_row(K);
+        for (long long i = first; i < last; i++) {
+            const long long m = i / rank;
+            const long long adapter = adapter_ids[m];
+            if (adapter < 0)
+                continue;
+            load_as_float(lora_A, type, (adapter * rank + i % rank) * K, K, a_row.data());
+            float dot = 0.0f;
+            for (long long k = 0; k < K; k++)
+                dot += x_float[m * K + k] * a_row[k];
+            h[i] = dot * scales[adapter];
+        }
+    });
+
+    // the up projections h[m] B^T are added to the base sums of each task's outputs
+    // before they are stored, so out is written once
+    parallel_for(N, std::max(1LL, get_cpu_tuning().task_values / K), [&](long long first_row, long long last_row) {
+        const long long rows = last_row - first_row;
+        std::vector<float> sums(M * rows, 0.0f);
+        gemv_blockwise_rows(quant_type, x_float, W, absmax, code, M, K, blocksize, first_row, last_row, sums.data());
+
+        // rows of B of the last adapter, as consecutive tokens often share one
+        std::vector<float> b_rows(rows * rank);
+        long long loaded = -1;
+        for (long long m = 0; m < M; m++) {
+            const long long adapter = adapter_ids[m];
+            if (adapter >= 0) {
+                if (adapter != loaded) {
+                    load_as_float(lora_B, type, (adapter * N + first_row) * rank, rows * rank, b_rows.data());
+                    loaded = adapter;
+                }
+                const float *hm = h.data() + m * rank;
+                for (long long n = 0; n < rows; n++) {
+                    float dot = 0.0f;
+                    for (long long r = 0; r < rank; r++)
+                        dot += hm[r] * b_rows[n * rank + r];
+                    sums[m * rows + n] += dot;
+                }
+            }
+            store_from_float(sums.data() + m * rows, type, m * N + first_row, rows, out);
+        }
+    });
+    return true;
+}
+
+const char *cpu_isa_name() { return cpu_kernels()->name; }
@@ -4,7 +4,245 @@
 #include <iostream>
 #include <stdio.h>
 
+#include <common.h>
+
 void quantize_cpu(float *code, float *A, float *absmax, unsigned char *out, long long blocksize, long long n);
 void dequantize_cpu(float *code, unsigned char *A, float *absmax, float *out, long long blocksize, long long n);
+// quantize_cpu for the signed FP8 code of create_fp8_map(True, exponent_bits, 7 - exponent_bits)
+// and inputs of the given dtype (a ScalarType_t), without searching the code
+void quantize_fp8_cpu(float *code, int exponent_bits, int dtype, void *A, float *absmax, unsigned char *out,
+                      long long blocksize, long long n);
+
+// One tensor of a batched blockwise (de)quantization. The layout is mirrored by
+// QuantizeTensorDesc in bitsandbytes/functional.py.
+struct quantize_tensor_desc {
+    void *A;                // unquantized values (input of quantize, output of dequantize)
+    unsigned char *out;     // 8-bit values (output of quantize, input of dequantize)
+    float *absmax;
+    float *code;
+    long long n;
+    long long blocksize;
+    int dtype;              // ScalarType_t of A
+};
+
+// (De)quantizes all blocks of all tensors in one parallel region.
+void quantize_cpu_batched(quantize_tensor_desc *tensors, long long num_tensors);
+void dequantize_cpu_batched(quantize_tensor_desc *tensors, long long num_tensors);
+
+// Converts n blockwise quantized values to another format or blocksize without
+// dequantizing the whole tensor: chunks of whole blocks of both formats are decoded into
+// a buffer of about BLOCK_SIZE floats per thread and encoded right away. Either side holds
+// one byte per value looked up in its code (CPU_GENERAL_8BIT, e.g. the dynamic or an FP8
+// map) or packed CPU_FP4/CPU_NF4 values, with fp32 absmax values. With
+// dst_fp8_exponent_bits > 0, dst_code is the signed FP8 code of quantize_fp8_cpu and is
+// not searched. The blocksizes of 4-bit sides must be even.
+void requantize_cpu(int src_type, unsigned char *src, float *src_absmax, float *src_code, long long src_blocksize,
+                    int dst_type, unsigned char *dst, float *dst_absmax, float *dst_code, long long dst_blocksize,
+                    int dst_fp8_exponent_bits, long long n);
+
+// One candidate format of quantization_error_cpu. The layout is mirrored by
+// QuantErrorConfig in bitsandbytes/functional.py.
+struct quant_error_config {
+    int quant_type;          // CpuDataType_t
+    long long blocksize;
+    float *code;             // the code of CPU_GENERAL_8BIT
+    float *nested_code;      // if not NULL, the absmax values are quantized with this code after
+                             // subtracting their mean, like compress_statistics / nested
+    long long nested_blocksize;
+    int *saturated;          // per block, the values quantized to the largest magnitude of the code, or NULL
+    unsigned char *out;      // the quantized values, or NULL
+    float *absmax;           // the absmax of each block before nesting, or NULL
+    // results
+    double sum_squared_error;
+    float max_abs_error;
+    float offset;            // the mean subtracted from the absmax values before nesting
+};
+
+// Quantizes n values of the given dtype (a ScalarType_t) under every config and measures the
+// errors of the dequantized values. The input is read once, chunk by chunk, for all configs
+// (twice if a config is nested). sum_squared receives the sum of the squared inputs.
+void quantization_error_cpu(int dtype, void *A, long long n, quant_error_config *configs, long long num_configs,
+                            double *sum_squared);
+
+// histogram[index1[i] * maxidx1 + index2[i]] += src[i] for all i < n, like
+// histogramScatterAdd2D in ops.cu. num_bins is the size of the histogram.
+void histogram_scatter_add_2d_cpu(float *histogram, int *index1, int *index2, float *src, int maxidx1, long long num_bins, long long n);
+
+// Optimizer ids of the CPU update; the values match Optimizer_t in ops.cuh,
+// which is not available to CPU-only builds.
+typedef enum CpuOptimizer_t
+{
+    CPU_ADAM = 0,
+    CPU_MOMENTUM = 1,
+    CPU_RMSPROP = 2,
+    CPU_LARS = 3,
+    CPU_ADAGRAD = 4,
+    CPU_LION = 5,
+} CpuOptimizer_t;
+
+// Host version of optimizer32bit in ops.cu: one optimizer step with 32-bit states
+// for fp32/fp16/bf16 (dtype, a ScalarType_t) gradients and parameters. With
+// max_unorm > 0 (LAMB, LARS) the update norm is computed first and written to
+// unorm[0]; a param_norm < 0 is computed in the same sweep. With stochastic_rounding,
+// bf16 parameters are rounded up or down at random instead of to nearest, so that
+// updates below their precision survive in expectation without an fp32 master copy;
+// the random bits depend on rounding_seed, step and the position of each value only.
+void optimizer_32bit_cpu(int optimizer, int dtype, void *g, void *p, float *state1, float *state2, float *unorm,
+                         float max_unorm, float param_norm, float beta1, float beta2, float eps, float weight_decay,
+                         int step, float lr, float gnorm_scale, bool skip_zeros, bool stochastic_rounding,
+                         unsigned long long rounding_seed, long long n);
+
+// values per absmax of the 8-bit blockwise optimizer states, as in ops.cu
+#define OPTIMIZER_8BIT_BLOCKSIZE 2048
+
+// Host version of optimizerStatic8bitBlockwise in ops.cu, with the update norm clipping
+// of optimizer_32bit_cpu: the states are quantized with qmap1/qmap2 (256 sorted values)
+// and one absmax per OPTIMIZER_8BIT_BLOCKSIZE values.
+void optimizer_8bit_blockwise_cpu(int optimizer, int dtype, void *g, void *p, unsigned char *state1,
+                                  unsigned char *state2, float *qmap1, float *qmap2, float *absmax1, float *absmax2,
+                                  float *unorm, float max_unorm, float param_norm, float beta1, float beta2, float eps,
+                                  float weight_decay, int step, float lr, float gnorm_scale, bool skip_zeros,
+                                  bool stochastic_rounding, unsigned long long rounding_seed, long long n);
+
+// optimizer_8bit_blockwise_cpu with 4-bit states: qmap1/qmap2 hold 16 sorted values,
+// e.g. a signed dynamic map for the first and an unsigned one for the second moment,
+// with one absmax per blocksize values (an even divisor of BLOCK_SIZE). The states are
+// packed like quantize_4bit_cpu, two values per byte with the first in the high nibble.
+// Returns false, without touching any tensor, for an invalid blocksize.
+bool optimizer_4bit_blockwise_cpu(int optimizer, int dtype, void *g, void *p, unsigned char *state1,
+                                  unsigned char *state2, float *qmap1, float *qmap2, float *absmax1, float *absmax2,
+                                  long long blocksize, float *unorm, float max_unorm, float param_norm, float beta1,
+                                  float beta2, float eps, float weight_decay, int step, float lr, float gnorm_scale,
+                                  bool skip_zeros, bool stochastic_rounding, unsigned long long rounding_seed,
+                                  long long n);
+
+// One parameter of a multi-tensor optimizer update. The layout is mirrored by
+// OptimizerTensorDesc in bitsandbytes/functional.py.
+struct optimizer_tensor_desc {
+    void *g;
+    void *p;
+    float *state1;
+    float *state2;          // NULL for 1-state optimizers
+    float *unorm;           // receives the squared update norm if max_unorm > 0, may be NULL
+    long long n;
+    int dtype;              // ScalarType_t of g and p
+    unsigned long long rounding_seed; // for stochastic_rounding, see optimizer_32bit_cpu
+};
+
+// Updates all tensors in one call: the global gradient norm is reduced over all
+// tensors first, then all tensors are updated with the gradients scaled so that
+// their norm is at most max_grad_norm (if > 0). Both passes spread the blocks of
+// all tensors over the thread pool together. Returns the unclipped gradient norm.
+float optimizer_32bit_cpu_multi(int optimizer, optimizer_tensor_desc *tensors, long long num_tensors,
+                                float max_grad_norm, float max_unorm, float beta1, float beta2, float eps,
+                                float weight_decay, int step, float lr, bool skip_zeros, bool stochastic_rounding);
+
+// quantized data types; the values match DataType_t in ops.cuh
+typedef enum CpuDataType_t
+{
+    CPU_GENERAL_8BIT = 0,
+    CPU_FP4 = 1,
+    CPU_NF4 = 2,
+} CpuDataType_t;
+
+// Blockwise FP4/NF4 (de)quantization of fp32/fp16/bf16 values (dtype, a ScalarType_t)
+// with the layout of kQuantizeBlockwise: two values per byte, the first one in the
+// high nibble. blocksize must be even.
+void quantize_4bit_cpu(int quant_type, int dtype, void *A, float *absmax, unsigned char *out, long long blocksize, long long n);
+void dequantize_4bit_cpu(int quant_type, int dtype, unsigned char *A, float *absmax, void *out, long long blocksize, long long n);
+
+// Serial quantize_4bit_cpu of float values, for ops that already run on the thread pool.
+void quantize_4bit_values(int quant_type, const float *A, float *absmax, unsigned char *out, long long blocksize, long long n);
+
+// the 16 values of CPU_FP4 or CPU_NF4 in the order of their nibbles, normalized to [-1, 1]
+const float *cpu_4bit_code(int quant_type);
+
+// Columns of a prepacked 4-bit weight that are decoded together by gemm_4bit_cpu.
+#define PANEL_4BIT 16
+
+// Reorders a quantize_4bit_cpu weight B of shape N x K (K a multiple of blocksize)
+// into ceil(N / PANEL_4BIT) panels for gemm_4bit_cpu. Each panel has K rows of 8
+// bytes (column j in the low nibble, column j + 8 in the high nibble) in packed and
+// K / blocksize rows of PANEL_4BIT absmax values in scales. Columns past N are zero.
+void prepack_4bit_cpu(unsigned char *B, float *absmax, unsigned char *packed, float *scales,
+                      long long N, long long K, long long blocksize);
+
+// out[M x N] = A[M x K] * B^T for a weight prepacked by prepack_4bit_cpu. A and out
+// have the same dtype (a ScalarType_t), the products are accumulated in fp32.
+void gemm_4bit_cpu(int quant_type, int dtype, void *A, unsigned char *packed, float *scales, void *out,
+                   long long M, long long N, long long K, long long blocksize);
+
+// out[M x K] = A[M x N] * W for a quantize_4bit_cpu weight W of shape N x K, e.g. the
+// gradient of the input of a 4-bit linear layer (grad_output @ W). W is decoded on the
+// fly a few hundred rows of a few columns at a time; any K and even blocksize work.
+// A and out have the same dtype, the products are accumulated in fp32.
+void gemm_4bit_transposed_cpu(int quant_type, int dtype, void *A, unsigned char *W, float *absmax, void *out,
+                              long long M, long long N, long long K, long long blocksize);
+
+// out[M x N] = x[M x K] * W^T for a weight W of shape N x K quantized in place, without
+// prepacking: one byte per value looked up in code (CPU_GENERAL_8BIT) or packed CPU_FP4/
+// CPU_NF4 values, with K a multiple of blocksize. Meant for small M, such as a single
+// token; every block of W is decoded once per row of x. x and out have the given dtype.
+void gemv_blockwise_cpu(int quant_type, int dtype, void *x, unsigned char *W, float *absmax, float *code, void *out,
+                        long long M, long long N, long long K, long long blocksize);
+
+// gemv_blockwise_cpu plus the low-rank adapters of QLoRA-style serving in the same pass:
+// out[m] = x[m] W^T + scales[a] * (x[m] A_a^T) B_a^T with a = adapter_ids[m], or only the
+// base product for a negative id. lora_A holds num_adapters x rank x K values and lora_B
+// num_adapters x N x rank values, both of the dtype of x. Adapters of a smaller rank are
+// padded with zeros. Returns false, with out zeroed, if an id selects a missing adapter.
+bool gemv_lora_cpu(int quant_type, int dtype, void *x, unsigned char *W, float *absmax, float *code, void *lora_A,
+                   void *lora_B, float *scales, long long *adapter_ids, long long num_adapters, long long rank,
+                   void *out, long long M, long long N, long long K, long long blocksize);
+
+// Pooled lookups in a blockwise quantized table of num_rows x dim values, like
+// torch.nn.functional.embedding_bag: bag b sums (mode 0) or averages (mode 1) the rows
+// indices[offsets[b]:offsets[b + 1]], each scaled by per_sample_weights[i] if not NULL.
+// The table holds one byte per value looked up in the 256 entry code (CPU_GENERAL_8BIT)
+// or packed CPU_FP4/CPU_NF4 values; dim must be a multiple of blocksize, so that every
+// row starts a block. Only the gathered rows are dequantized, directly into the sums.
+// Rows equal to padding_idx (if >= 0) are skipped and not counted by the mean.
+// out holds num_bags x dim values of the given dtype (a ScalarType_t).
+void embedding_bag_cpu(int quant_type, unsigned char *table, float *absmax, float *code, long long dim,
+                       long long blocksize, long long *indices, long long num_indices, long long *offsets,
+                       long long num_bags, float *per_sample_weights, int mode, long long padding_idx,
+                       int dtype, void *out);
+
+// Blockwise quantized KV cache of one layer: a ring buffer of capacity token rows of
+// head_dim values per kv head, stored like quantize_blockwise (CPU_GENERAL_8BIT, one byte
+// per value looked up in code) or quantize_4bit (CPU_FP4/CPU_NF4, head_dim / 2 bytes),
+// with head_dim / blocksize absmax values per row. Position p lives in slot p % capacity.
+
+// Quantizes rows [num_kv_heads x num_tokens x head_dim] of the given dtype (a ScalarType_t)
+// into the slots of positions start .. start + num_tokens - 1, num_tokens <= capacity.
+void kv_cache_append_cpu(int quant_type, int dtype, void *rows, unsigned char *cache, float *absmax, float *code,
+                         long long num_kv_heads, long long capacity, long long head_dim, long long blocksize,
+                         long long start, long long num_tokens);
+
+// scores[h, i, t] = scale * dot(query[h, i], key at position start + t) for t < window,
+// for queries [num_heads x num_queries x head_dim] of the given dtype. Query heads are
+// split evenly over the kv heads (grouped-query attention). The keys are dequantized
+// block by block inside the dot products and never written out.
+void kv_cache_scores_cpu(int quant_type, int dtype, void *query, unsigned char *cache, float *absmax, float *code,
+                         long long num_heads, long long num_kv_heads, long long num_queries, long long capacity,
+                         long long head_dim, long long blocksize, long long start, long long window, float scale,
+                         float *scores);
+
+// out[h, i] = sum over t < window of probs[h, i, t] * value at position start + t, the
+// counterpart of kv_cache_scores_cpu for the values. probs and out are fp32.
+void kv_cache_attend_cpu(int quant_type, float *probs, unsigned char *cache, float *absmax, float *code,
+                         long long num_heads, long long num_kv_heads, long long num_queries, long long capacity,
+                         long long head_dim, long long blocksize, long long start, long long window, float *out);
+
+// Error-feedback compression of the n gradient values g of the given dtype (a ScalarType_t).
+// Every block of g + residual is quantized into out and absmax like quantize_blockwise
+// (CPU_GENERAL_8BIT, with code) or quantize_4bit (CPU_FP4/CPU_NF4), and residual, of
+// residual_dtype, receives what the quantization lost, to be added to the next gradient.
+// Each block is read, quantized, dequantized and written back in one pass.
+void error_feedback_compress_cpu(int quant_type, int dtype, void *g, int residual_dtype, void *residual, float *code,
+                                 float *absmax, unsigned char *out, long long blocksize, long long n);
+
+// name of the kernel variant selected for this host, e.g. "avx2"
+const char *cpu_isa_name();
 
 #endif
@@ -0,0 +1,541 @@
+#include <common.h>
+#include <cpu_kernels.h>
+#include <cpu_ops.h>
+#include <cpu_threads.h>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+// The update rules below follow the 32-bit kernels in kernels.cu
+// (kPreconditionOptimizer32bit*State and kOptimizer32bit*State) value by value;
+// 8-bit blockwise states are updated with the same rules in fp32.
+
+static_assert(BLOCK_SIZE % OPTIMIZER_8BIT_BLOCKSIZE == 0, "optimizer blocks must hold whole 8-bit state blocks");
+
+static inline float sgn(float x) { return x > 0.0f ? 1.0f : (x < 0.0f ? -1.0f : 0.0f); }
+
+static long long num_optimizer_blocks(long long n) { return (n + BLOCK_SIZE - 1) / BLOCK_SIZE; }
+
+namespace {
+
+// hyperparameters shared by all tensors of an update
+struct optimizer_params {
+    int optimizer;
+    float beta1;
+    float beta2;
+    float eps;
+    float weight_decay;
+    int step;
+    float lr;
+    float gnorm_scale;
+    bool skip_zeros;
+    // writes bf16 parameters with stochastic rounding, see rounding_key
+    bool stochastic_rounding;
+};
+
+// the key of the random bits of a tensor in one step, so that every step rounds differently
+uint64_t rounding_key(unsigned long long seed, int step) { return counter_random(seed, (uint64_t)step); }
+
+void store_params(const optimizer_params &params, uint64_t key, const float *vals, int dtype, long long offset,
+                  long long n, void *p)
+{
+    if (params.stochastic_rounding && dtype == BFloat16)
+        store_bf16_stochastic(vals, offset, n, p, key);
+    else
+        store_from_float(vals, (ScalarType_t)dtype, offset, n, p);
+}
+
+// squared norm of the update that the step would apply to a block, used to clip it to max_unorm
+float update_norm_block(const optimizer_params &params, const float *g, const float *state1, const float *state2,
+                        long long n)
+{
+    const float beta1 = params.beta1, beta2 = params.beta2, eps = params.eps;
+    const float correction1 = 1.0f / (1.0f - powf(beta1, params.step));
+    const float correction2 = 1.0f / (1.0f - powf(beta2, params.step));
+
+    float sum = 0.0f;
+    for (long long j = 0; j < n; j++) {
+        const float gj = params.gnorm_scale * g[j];
+        const float s1 = state1[j];
+        float u = 0.0f;
+        switch (params.optimizer) {
+            case CPU_ADAM: {
+                float m = (s1 * beta1 + (1.0f - beta1) * gj) * correction1;
+                float v = (state2[j] * beta2 + (1.0f - beta2) * gj * gj) * correction2;
+                u = m / (sqrtf(v) + eps);
+                u *= u;
+                break;
+            }
+            case CPU_MOMENTUM:
+            case CPU_LARS:
+                u = params.step == 1 ? gj : s1 * beta1 + gj;
+                u *= u;
+                break;
+            case CPU_LION:
+                u = s1 * beta2 + (1.0f - beta2) * gj;
+                break;
+            case CPU_RMSPROP:
+                u = gj / (sqrtf(s1 * beta1 + (1.0f - beta1) * gj * gj) + eps);
+                u *= u;
+                break;
+            case CPU_ADAGRAD:
+                u = gj / (sqrtf(s1 + gj * gj) + eps);
+                u *= u;
+                break;
+        }
+        sum += u;
+    }
+    return sum;
+}
+
+// factor that limits the update norm to max_unorm times the parameter norm
+float update_scale(const optimizer_params &params, float unorm, float max_unorm, float param_norm)
+{
+    if (max_unorm <= 0.0f)
+        return 1.0f;
+    // the 1-state kernels add eps to the bound, the 2-state kernel does not
+    const float max_norm = max_unorm * param_norm + (params.optimizer == CPU_ADAM ? 0.0f : params.eps);
+    const float norm = sqrtf(unorm);
+    return norm > max_norm ? max_norm / norm : 1.0f;
+}
+
+void update_block(const optimizer_params &params, float update_scale, const float *g, float *p, float *s1, float *s2,
+                  long long n)
+{
+    const float beta1 = params.beta1, beta2 = params.beta2, eps = params.eps, lr = params.lr;
+    const float weight_decay = params.weight_decay;
+    const bool two_state = params.optimizer == CPU_ADAM;
+    const float correction1 = 1.0f - powf(beta1, params.step);
+    const float correction2 = sqrtf(1.0f - powf(beta2, params.step));
+    const float step_size = -lr * correction2 / correction1;
+
+    for (long long j = 0; j < n; j++) {
+        float gj = params.gnorm_scale * g[j];
+        float pj = p[j];
+        // decoupled weight decay for Adam, L2 penalty on the gradient for the 1-state optimizers
+        if (!two_state && weight_decay > 0.0f)
+            gj += pj * weight_decay;
+        if (params.skip_zeros && gj == 0.0f)
+            continue;
+
+        switch (params.optimizer) {
+            case CPU_ADAM:
+                s1[j] = s1[j] * beta1 + (1.0f - beta1) * gj;
+                s2[j] = s2[j] * beta2 + (1.0f - beta2) * gj * gj;
+                pj += update_scale * step_size * (s1[j] / (sqrtf(s2[j]) + eps * correction2));
+                if (weight_decay > 0.0f)
+                    pj *= 1.0f - lr * weight_decay;
+                break;
+            case CPU_MOMENTUM:
+            case CPU_LARS:
+                s1[j] = params.step == 1 ? gj : s1[j] * beta1 + gj;
+                pj += update_scale * (-lr * s1[j]);
+                break;
+            case CPU_LION:
+                pj -= update_scale * (lr * sgn(s1[j] * beta1 + (1.0f - beta1) * gj));
+                s1[j] = s1[j] * beta2 + (1.0f - beta2) * gj;
+                break;
+            case CPU_RMSPROP:
+                s1[j] = s1[j] * beta1 + (1.0f - beta1) * gj * gj;
+                pj -= update_scale * (lr * (gj / (sqrtf(s1[j]) + eps)));
+                break;
+            case CPU_ADAGRAD:
+                s1[j] = s1[j] + gj * gj;
+                pj -= lr * (gj / (sqrtf(s1[j]) + eps));
+                break;
+        }
+        p[j] = pj;
+    }
+}
+
+// 32-bit states, updated in place
+struct states_32bit {
+    float *state1;
+    float *state2;
+
+    void load(long long offset, long long, float *, float *, float *&s1, float *&s2) const
+    {
+        s1 = state1 + offset;
+        s2 = state2 != nullptr ? state2 + offset : nullptr;
+    }
+    void store(long long, long long, const float *, const float *) const {}
+};
+
+// 8-bit states with one absmax per OPTIMIZER_8BIT_BLOCKSIZE values, like the blockwise
+// kernels in kernels.cu. A block of states is dequantized into the buffers, updated in
+// fp32 and quantized again.
+struct states_8bit_blockwise {
+    const cpu_kernel_table *kernels;
+    unsigned char *state1;
+    unsigned char *state2;
+    const float *qmap1;
+    const float *qmap2;
+    float *absmax1;
+    float *absmax2;
+    // the maps for quantize_block: a signed map starts at -1, see quantize_cpu
+    float search1[256];
+    float search2[256];
+
+    states_8bit_blockwise(unsigned char *state1, unsigned char *state2, const float *qmap1, const float *qmap2,
+                          float *absmax1, float *absmax2)
+        : kernels(cpu_kernels()), state1(state1), state2(state2), qmap1(qmap1), qmap2(qmap2), absmax1(absmax1),
+          absmax2(absmax2)
+    {
+        std::copy(qmap1, qmap1 + 256, search1);
+        if (search1[0] < 0.0f)
+            search1[0] = -1.0f;
+        if (state2 != nullptr) {
+            std::copy(qmap2, qmap2 + 256, search2);
+            if (search2[0] < 0.0f)
+                search2[0] = -1.0f;
+        }
+    }
+
+    void dequantize(const float *qmap, const unsigned char *state, const float *absmax, float *out, long long offset,
+                    long long n) const
+    {
+        // offset is a multiple of OPTIMIZER_8BIT_BLOCKSIZE, so the blocks start at 0 of the buffer
+        for (long long block_idx = 0; block_idx < n; block_idx += OPTIMIZER_8BIT_BLOCKSIZE)
+            kernels->dequantize_block(qmap, state + offset, absmax + offset / OPTIMIZER_8BIT_BLOCKSIZE, out,
+                                      block_idx, std::min(block_idx + OPTIMIZER_8BIT_BLOCKSIZE, n),
+                                      OPTIMIZER_8BIT_BLOCKSIZE);
+    }
+
+    void quantize(const float *search, const float *values, float *absmax, unsigned char *state, long long offset,
+                  long long n) const
+    {
+        for (long long block_idx = 0; block_idx < n; block_idx += OPTIMIZER_8BIT_BLOCKSIZE)
+            kernels->quantize_block(search, values, absmax + offset / OPTIMIZER_8BIT_BLOCKSIZE, state + offset,
+                                    block_idx, std::min(block_idx + OPTIMIZER_8BIT_BLOCKSIZE, n),
+                                    OPTIMIZER_8BIT_BLOCKSIZE);
+    }
+
+    void load(long long offset, long long n, float *buffer1, float *buffer2, float *&s1, float *&s2) const
+    {
+        dequantize(qmap1, state1, absmax1, buffer1, offset, n);
+        s1 = buffer1;
+        s2 = nullptr;
+        if (state2 != nullptr) {
+            dequantize(qmap2, state2, absmax2, buffer2, offset, n);
+            s2 = buffer2;
+        }
+    }
+    void store(long long offset, long long n, const float *s1, const float *s2) const
+    {
+        quantize(search1, s1, absmax1, state1, offset, n);
+        if (state2 != nullptr)
+            quantize(search2, s2, absmax2, state2, offset, n);
+    }
+};
+
+// 4-bit states with one absmax per blocksize values, quantized with a sorted code of 16
+// values and stored like quantize_4bit_cpu: two values per byte, the first one in the
+// high nibble. blocksize divides BLOCK_SIZE, so blocks and bytes start at 0 of a buffer.
+struct states_4bit_blockwise {
+    unsigned char *state1;
+    unsigned char *state2;
+    const float *qmap1;
+    const float *qmap2;
+    float *absmax1;
+    float *absmax2;
+    long long blocksize;
+
+    // index of the code value closest to x. With an unsigned code, positive values never
+    // round to 0, which would turn the second moment of Adam into an update of g / eps.
+    static unsigned char nearest(const float *code, float x)
+    {
+        int idx = 0;
+        for (int step = 8; step > 0; step >>= 1)
+            if (code[idx + step] <= x)
+                idx += step;
+        if (idx < 15 && code[idx + 1] - x < x - code[idx])
+            idx++;
+        if (idx < 15 && code[0] >= 0.0f && code[idx] == 0.0f && x > 0.0f)
+            idx++;
+        return (unsigned char)idx;
+    }
+
+    void dequantize(const float *code, const unsigned char *state, const float *absmax, float *out, long long offset,
+                    long long n) const
+    {
+        state += offset / 2;
+        absmax += offset / blocksize;
+        for (long long i = 0; i < n; i++) {
+            const unsigned char byte = state[i / 2];
+            out[i] = code[i % 2 == 0 ? byte >> 4 : byte & 0xf] * absmax[i / blocksize];
+        }
+    }
+
+    void quantize(const float *code, const float *values, float *absmax, unsigned char *state, long long offset,
+                  long long n) const
+    {
+        state += offset / 2;
+        absmax += offset / blocksize;
+        for (long long block_idx = 0; block_idx < n; block_idx += blocksize) {
+            const long long block_end = std::min(block_idx + blocksize, n);
+            float absmax_block = 0.0f;
+            for (long long i = block_idx; i < block_end; i++)
+                absmax_block = std::max(absmax_block, fabsf(values[i]));
+            absmax[block_idx / blocksize] = absmax_block;
+            const float scale = absmax_block > 0.0f ? 1.0f / absmax_block : 0.0f;
+            for (long long i = block_idx; i < block_end; i += 2) {
+                const unsigned char high = nearest(code, values[i] * scale);
+                const unsigned char low = i + 1 < block_end ? nearest(code, values[i + 1] * scale) : 0;
+                state[i / 2] = (unsigned char)(high << 4 | low);
+            }
+        }
+    }
+
+    void load(long long offset, long long n, float *buffer1, float *buffer2, float *&s1, float *&s2) const
+    {
+        dequantize(qmap1, state1, absmax1, buffer1, offset, n);
+        s1 = buffer1;
+        s2 = nullptr;
+        if (state2 != nullptr) {
+            dequantize(qmap2, state2, absmax2, buffer2, offset, n);
+            s2 = buffer2;
+        }
+    }
+    void store(long long offset, long long n, const float *s1, const float *s2) const
+    {
+        quantize(qmap1, s1, absmax1, state1, offset, n);
+        if (state2 != nullptr)
+            quantize(qmap2, s2, absmax2, state2, offset, n);
+    }
+};
+
+// One step for a single tensor. With max_unorm > 0 (LAMB, LARS) a first sweep computes
+// the update norm and, if param_norm < 0, the parameter norm together, so that the
+// second sweep can apply the trust ratio while it updates the parameters.
+template <typename States>
+void update_tensor(const optimizer_params &params, int dtype, void *g, void *p, const States &states, float *unorm,
+                   float max_unorm, float param_norm, unsigned long long rounding_seed, long long n)
+{
+    const uint64_t key = rounding_key(rounding_seed, params.step);
+    const long long num_blocks = num_optimizer_blocks(n);
+
+    float scale = 1.0f;
+    if (max_unorm > 0.0f) {
+        // one partial sum per block, added up in order so the result does not depend on the thread count
+        const bool norm_params = param_norm < 0.0f;
+        std::vector<float> update_sq(num_blocks, 0.0f);
+        std::vector<float> param_sq(norm_params ? num_blocks : 0, 0.0f);
+        parallel_for(num_blocks, 1, [&](long long first_block, long long last_block) {
+            std::vector<float> vals(BLOCK_SIZE);
+            std::vector<float> buffer1(BLOCK_SIZE);
+            std::vector<float> buffer2(BLOCK_SIZE);
+            for (long long block = first_block; block < last_block; block++) {
+                const long long offset = block * BLOCK_SIZE;
+                const long long valid_items = n - offset >= BLOCK_SIZE ? BLOCK_SIZE : n - offset;
+                float *s1, *s2;
+                states.load(offset, valid_items, buffer1.data(), buffer2.data(), s1, s2);
+                load_as_float(g, (ScalarType_t)dtype, offset, valid_items, vals.data());
+                update_sq[block] = update_norm_block(params, vals.data(), s1, s2, valid_items);
+                if (norm_params) {
+                    load_as_float(p, (ScalarType_t)dtype, offset, valid_items, vals.data());
+                    float sum = 0.0f;
+                    for (long long j = 0; j < valid_items; j++)
+                        sum += vals[j] * vals[j];
+                    param_sq[block] = sum;
+                }
+            }
+        });
+        const float total = (float)tree_sum(update_sq.data(), num_blocks);
+        unorm[0] = total;
+        if (norm_params)
+            param_norm = (float)sqrt(tree_sum(param_sq.data(), num_blocks));
+        scale = update_scale(params, total, max_unorm, param_norm);
+    }
+
+    parallel_for(num_blocks, 1, [&](long long first_block, long long last_block) {
+        std::vector<float> g_vals(BLOCK_SIZE);
+        std::vector<float> p_vals(BLOCK_SIZE);
+        std::vector<float> buffer1(BLOCK_SIZE);
+        std::vector<float> buffer2(BLOCK_SIZE);
+        for (long long block = first_block; block < last_block; block++) {
+            const long long offset = block * BLOCK_SIZE;
+            const long long valid_items = n - offset >= BLOCK_SIZE ? BLOCK_SIZE : n - offset;
+            float *s1, *s2;
+            states.load(offset, valid_items, buffer1.data(), buffer2.data(), s1, s2);
+            load_as_float(g, (ScalarType_t)dtype, offset, valid_items, g_vals.data());
+            load_as_float(p, (ScalarType_t)dtype, offset, valid_items, p_vals.data());
+            update_block(params, scale, g_vals.data(), p_vals.data(), s1, s2, valid_items);
+            store_params(params, key, p_vals.data(), dtype, offset, valid_items, p);
+            states.store(offset, valid_items, s1, s2);
+        }
+    });
+}
+
+// Runs fn(tensor, block, offset, valid_items, vals1, vals2) for every block of every tensor,
+// with the blocks of all tensors spread over the thread pool together. vals1 and vals2 are
+// BLOCK_SIZE floats of scratch per worker, kept off the pool threads' stacks.
+template <typename F> void for_each_optimizer_block(const optimizer_tensor_desc *tensors, long long num_tensors, F fn)
+{
+    // first block of each tensor, with the total at the end
+    std::vector<long long> block_offsets(num_tensors + 1, 0);
+    for (long long t = 0; t < num_tensors; t++)
+        block_offsets[t + 1] = block_offsets[t] + num_optimizer_blocks(tensors[t].n);
+
+    parallel_for(block_offsets[num_tensors], 1, [&](long long first_block, long long last_block) {
+        std::vector<float> vals1(BLOCK_SIZE);
+        std::vector<float> vals2(BLOCK_SIZE);
+        long long t = std::upper_bound(block_offsets.begin(), block_offsets.end(), first_block) - block_offsets.begin() - 1;
+        for (long long block = first_block; block < last_block; block++) {
+            while (block >= block_offsets[t + 1])
+                t++;
+            const long long offset = (block - block_offsets[t]) * BLOCK_SIZE;
+            const long long valid_items = std::min<long long>(BLOCK_SIZE, tensors[t].n - offset);
+            fn(t, block, offset, valid_items, vals1.data(), vals2.data());
+        }
+    });
+}
+
+// sums the per block values of each tensor, see tree_sum
+std::vector<double> sum_per_tensor(const std::vector<float> &partial, const optimizer_tensor_desc *tensors,
+                                   long long num_tensors)
+{
+    std::vector<double> sums(num_tensors, 0.0);
+    long long block = 0;
+    for (long long t = 0; t < num_tensors; t++) {
+        const long long num_blocks = num_optimizer_blocks(tensors[t].n);
+        sums[t] = tree_sum(partial.data() + block, num_blocks);
+        block += num_blocks;
+    }
+    return sums;
+}
+
+float global_norm(const std::vector<float> &partial, const optimizer_tensor_desc *tensors, long long num_tensors)
+{
+    const std::vector<double> sums = sum_per_tensor(partial, tensors, num_tensors);
+    return (float)sqrt(tree_sum(sums.data(), num_tensors));
+}
+
+} // namespace
+
+void optimizer_32bit_cpu(int optimizer, int dtype, void *g, void *p, float *state1, float *state2, float *unorm,
+                         float max_unorm, float param_norm, float beta1, float beta2, float eps, float weight_decay,
+                         int step, float lr, float gnorm_scale, bool skip_zeros, bool stochastic_rounding,
+                         unsigned long long rounding_seed, long long n)
+{
+    const optimizer_params params = {optimizer, beta1, beta2, eps, weight_decay, step,
+                                     lr, gnorm_scale, skip_zeros, stochastic_rounding};
+    update_tensor(params, dtype, g, p, states_32bit{state1, state2}, unorm, max_unorm, param_norm, rounding_seed, n);
+}
+
+void optimizer_8bit_blockwise_cpu(int optimizer, int dtype, void *g, void *p, unsigned char *state1,
+                                  unsigned char *state2, float *qmap1, float *qmap2, float *absmax1, float *absmax2,
+                                  float *unorm, float max_unorm, float param_norm, float beta1, float beta2, float eps,
+                                  float weight_decay, int step, float lr, float gnorm_scale, bool skip_zeros,
+                                  bool stochastic_rounding, unsigned long long rounding_seed, long long n)
+{
+    const optimizer_params params = {optimizer, beta1, beta2, eps, weight_decay, step,
+                                     lr, gnorm_scale, skip_zeros, stochastic_rounding};
+    const states_8bit_blockwise states(state1, state2, qmap1, qmap2, absmax1, absmax2);
+    update_tensor(params, dtype, g, p, states, unorm, max_unorm, param_norm, rounding_seed, n);
+}
+
+bool optimizer_4bit_blockwise_cpu(int optimizer, int dtype, void *g, void *p, unsigned char *state1,
+                                  unsigned char *state2, float *qmap1, float *qmap2, float *absmax1, float *absmax2,
+                                  long long blocksize, float *unorm, float max_unorm, float param_norm, float beta1,
+                                  float beta2, float eps, float weight_decay, int step, float lr, float gnorm_scale,
+                                  bool skip_zeros, bool stochastic_rounding, unsigned long long rounding_seed,
+                                  long long n)
+{
+    if (blocksize < 2 || blocksize % 2 != 0 || BLOCK_SIZE % blocksize != 0) {
+        fprintf(stderr, "bitsandbytes: the blocksize of 4-bit optimizer states must divide %d and be even, got %lld\n",
+                BLOCK_SIZE, blocksize);
+        return false;
+    }
+    const optimizer_params params = {optimizer, beta1, beta2, eps, weight_decay, step,
+                                     lr, gnorm_scale, skip_zeros, stochastic_rounding};
+    const states_4bit_blockwise states = {state1, state2, qmap1, qmap2, absmax1, absmax2, blocksize};
+    update_tensor(params, dtype, g, p, states, unorm, max_unorm, param_norm, rounding_seed, n);
+    return true;
+}
+
+float optimizer_32bit_cpu_multi(int optimizer, optimizer_tensor_desc *tensors, long long num_tensors,
+                                float max_grad_norm, float max_unorm, float beta1, float beta2, float eps,
+                                float weight_decay, int step, float lr, bool skip_zeros, bool stochastic_rounding)
+{
+    optimizer_params params = {optimizer, beta1, beta2, eps, weight_decay, step, lr, 1.0f, skip_zeros, stochastic_rounding};
+    long long total_blocks = 0;
+    for (long long t = 0; t < num_tensors; t++)
+        total_blocks += num_optimizer_blocks(tensors[t].n);
+
+    // Phase 1: squared gradient norm and, for update clipping, squared parameter norm of
+    // every block. Without clipping the gradient norm is computed during the update instead,
+    // and without gradient clipping the update norms are computed in the same sweep.
+    const bool clip = max_grad_norm > 0.0f || max_unorm > 0.0f;
+    const bool fuse_update_norms = max_unorm > 0.0f && max_grad_norm <= 0.0f;
+    std::vector<float> grad_sq(total_blocks, 0.0f);
+    std::vector<float> param_sq(max_unorm > 0.0f ? total_blocks : 0, 0.0f);
+    std::vector<float> update_sq(max_unorm > 0.0f ? total_blocks : 0, 0.0f);
+    if (clip) {
+        for_each_optimizer_block(tensors, num_tensors,
+                                 [&](long long t, long long block, long long offset, long long n, float *vals, float *) {
+            const optimizer_tensor_desc &tensor = tensors[t];
+            load_as_float(tensor.g, (ScalarType_t)tensor.dtype, offset, n, vals);
+            float sum = 0.0f;
+            for (long long j = 0; j < n; j++)
+                sum += vals[j] * vals[j];
+            grad_sq[block] = sum;
+            if (fuse_update_norms)
+                update_sq[block] = update_norm_block(params, vals, tensor.state1 + offset,
+                                                     tensor.state2 != nullptr ? tensor.state2 + offset : nullptr, n);
+            if (max_unorm > 0.0f) {
+                load_as_float(tensor.p, (ScalarType_t)tensor.dtype, offset, n, vals);
+                sum = 0.0f;
+                for (long long j = 0; j < n; j++)
+                    sum += vals[j] * vals[j];
+                param_sq[block] = sum;
+            }
+        });
+    }
+
+    float grad_norm = global_norm(grad_sq, tensors, num_tensors);
+    // same clip coefficient as torch.nn.utils.clip_grad_norm_
+    if (max_grad_norm > 0.0f && grad_norm > max_grad_norm)
+        params.gnorm_scale = max_grad_norm / (grad_norm + 1e-6f);
+
+    // phase 1b: norms of the clipped updates, which need the gradient scale
+    std::vector<float> scales(num_tensors, 1.0f);
+    if (max_unorm > 0.0f) {
+        if (!fuse_update_norms) {
+            for_each_optimizer_block(tensors, num_tensors,
+                                     [&](long long t, long long block, long long offset, long long n, float *g_vals,
+                                         float *) {
+                const optimizer_tensor_desc &tensor = tensors[t];
+                load_as_float(tensor.g, (ScalarType_t)tensor.dtype, offset, n, g_vals);
+                update_sq[block] = update_norm_block(params, g_vals, tensor.state1 + offset,
+                                                     tensor.state2 != nullptr ? tensor.state2 + offset : nullptr, n);
+            });
+        }
+        std::vector<double> unorms = sum_per_tensor(update_sq, tensors, num_tensors);
+        std::vector<double> param_norms = sum_per_tensor(param_sq, tensors, num_tensors);
+        for (long long t = 0; t < num_tensors; t++) {
+            if (tensors[t].unorm != nullptr)
+                tensors[t].unorm[0] = (float)unorms[t];
+            scales[t] = update_scale(params, (float)unorms[t], max_unorm, (float)sqrt(param_norms[t]));
+        }
+    }
+
+    // phase 2: the update of all tensors
+    for_each_optimizer_block(tensors, num_tensors, [&](long long t, long long block, long long offset, long long n,
+                                                       float *g_vals, float *p_vals) {
+        const optimizer_tensor_desc &tensor = tensors[t];
+        load_as_float(tensor.g, (ScalarType_t)tensor.dtype, offset, n, g_vals);
+        load_as_float(tensor.p, (ScalarType_t)tensor.dtype, offset, n, p_vals);
+        if (!clip) {
+            float sum = 0.0f;
+            for (long long j = 0; j < n; j++)
+                sum += g_vals[j] * g_vals[j];
+            grad_sq[block] = sum;
+        }
+        update_block(params, scales[t], g_vals, p_vals, tensor.state1 + offset,
+                     tensor.state2 != nullptr ? tensor.state2 + offset : nullptr, n);
+        store_params(params, rounding_key(tensor.rounding_seed, step), p_vals, tensor.dtype, offset, n, tensor.p);
+    });
+
+    return clip ? grad_norm : global_norm(grad_sq, tensors, num_tensors);
+}
@@ -0,0 +1,146 @@
+#include <cpu_paging.h>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct paged_mapping {
+    int fd;
+    size_t num_bytes;
+};
+
+std::mutex paging_mutex;
+// mappings by start address, to find the file of any pointer into them
+std::map<uintptr_t, paged_mapping> mappings;
+std::string paged_dir;
+
+std::string get_paged_dir()
+{
+    if (!paged_dir.empty())
+        return paged_dir;
+    const char *dir = getenv("BNB_PAGED_DIR");
+    if (dir == NULL || dir[0] == '\0')
+        dir = getenv("TMPDIR");
+    return dir != NULL && dir[0] != '\0' ? dir : "/var/tmp";
+}
+
+#if !defined(_WIN32)
+// the mapping containing [ptr, ptr + num_bytes) and the offset of ptr in it; paging_mutex must be held
+const paged_mapping *find_mapping(uintptr_t ptr, size_t num_bytes, size_t &offset)
+{
+    auto it = mappings.upper_bound(ptr);
+    if (it == mappings.begin())
+        return nullptr;
+    --it;
+    offset = ptr - it->first;
+    if (offset + num_bytes > it->second.num_bytes)
+        return nullptr;
+    return &it->second;
+}
+
+// the whole pages covering [ptr, ptr + num_bytes)
+void page_range(void *ptr, size_t num_bytes, uintptr_t &start, size_t &length)
+{
+    const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    start = (uintptr_t)ptr & ~(page_size - 1);
+    length = (uintptr_t)ptr + num_bytes - start;
+}
+#endif
+
+} // namespace
+
+#if !defined(_WIN32)
+
+void *paged_alloc_cpu(size_t num_bytes)
+{
+    std::lock_guard<std::mutex> lock(paging_mutex);
+    std::string path = get_paged_dir() + "/bitsandbytes-paged-XXXXXX";
+    std::vector<char> path_buffer(path.begin(), path.end());
+    path_buffer.push_back('\0');
+
+    int fd = mkstemp(path_buffer.data());
+    if (fd < 0) {
+        fprintf(stderr, "bitsandbytes: cannot create a paged buffer in %s\n", get_paged_dir().c_str());
+        return NULL;
+    }
+    // the file lives on as long as it is mapped or open
+    unlink(path_buffer.data());
+
+    // extending the file leaves a sparse, zero filled region
+    void *ptr = MAP_FAILED;
+    if (ftruncate(fd, (off_t)num_bytes) == 0)
+        ptr = mmap(NULL, num_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "bitsandbytes: cannot map a paged buffer of %zu bytes\n", num_bytes);
+        close(fd);
+        return NULL;
+    }
+
+    mappings[(uintptr_t)ptr] = paged_mapping{fd, num_bytes};
+    return ptr;
+}
+
+void paged_free_cpu(void *ptr)
+{
+    std::lock_guard<std::mutex> lock(paging_mutex);
+    auto it = mappings.find((uintptr_t)ptr);
+    if (it == mappings.end())
+        return;
+    munmap(ptr, it->second.num_bytes);
+    close(it->second.fd);
+    mappings.erase(it);
+}
+
+void paged_prefetch_cpu(void *ptr, size_t num_bytes)
+{
+    uintptr_t start;
+    size_t length;
+    page_range(ptr, num_bytes, start, length);
+    // for shared file mappings this queues readahead and returns
+    madvise((void *)start, length, MADV_WILLNEED);
+}
+
+void paged_writeback_cpu(void *ptr, size_t num_bytes)
+{
+#if defined(__linux__)
+    std::lock_guard<std::mutex> lock(paging_mutex);
+    size_t offset;
+    const paged_mapping *mapping = find_mapping((uintptr_t)ptr, num_bytes, offset);
+    if (mapping != nullptr) {
+        // msync(MS_ASYNC) does not start any I/O on Linux
+        sync_file_range(mapping->fd, (off64_t)offset, (off64_t)num_bytes, SYNC_FILE_RANGE_WRITE);
+        return;
+    }
+#endif
+    uintptr_t start;
+    size_t length;
+    page_range(ptr, num_bytes, start, length);
+    msync((void *)start, length, MS_ASYNC);
+}
+
+#else
+
+// file backed paging is not implemented on Windows
+void *paged_alloc_cpu(size_t num_bytes) { return NULL; }
+void paged_free_cpu(void *ptr) {}
+void paged_prefetch_cpu(void *ptr, size_t num_bytes) {}
+void paged_writeback_cpu(void *ptr, size_t num_bytes) {}
+
+#endif
+
+void set_paged_dir(const char *dir)
+{
+    std::lock_guard<std::mutex> lock(paging_mutex);
+    paged_dir = dir != NULL ? dir : "";
+}
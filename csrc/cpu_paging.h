@@ -0,0 +1,25 @@
+#ifndef BITSANDBYTES_CPU_PAGING_H
+#define BITSANDBYTES_CPU_PAGING_H
+
+#include <stddef.h>
+
+// Paged CPU memory for optimizer states larger than host RAM. Buffers are
+// shared mappings of unlinked files in the paging directory (BNB_PAGED_DIR,
+// else TMPDIR, else /var/tmp), so the kernel can evict them to disk and the
+// files disappear with the process. The directory should be on a fast local
+// disk; a tmpfs directory like /tmp would keep the pages in RAM.
+
+// Returns a zero filled buffer of num_bytes, or NULL on failure.
+void *paged_alloc_cpu(size_t num_bytes);
+void paged_free_cpu(void *ptr);
+
+// Asks the kernel to start reading the range back from disk, without waiting.
+void paged_prefetch_cpu(void *ptr, size_t num_bytes);
+// Starts writing the dirty pages of the range to disk, without waiting, so
+// that they can be dropped cheaply once memory runs low.
+void paged_writeback_cpu(void *ptr, size_t num_bytes);
+
+// NULL restores the default directory. Only affects later allocations.
+void set_paged_dir(const char *dir);
+
+#endif
@@ -0,0 +1,163 @@
+#include <common.h>
+#include <cpu_kernels.h>
+#include <cpu_ops.h>
+#include <cpu_threads.h>
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+namespace {
+
+long long gcd(long long a, long long b) { return b == 0 ? a : gcd(b, a % b); }
+
+struct block_error {
+    double sum_squared_error;
+    float max_abs_error;
+};
+
+// dequantizes one block with the given absmax and compares it to the input
+template <bool four_bit>
+block_error measure_block(const float *x, long long n, const unsigned char *q, const float *values, float absmax,
+                          float max_value, int *saturated)
+{
+    block_error error = {0.0, 0.0f};
+    int count = 0;
+    for (long long i = 0; i < n; i++) {
+        const unsigned char idx = four_bit ? (i % 2 == 0 ? q[i / 2] >> 4 : q[i / 2] & 0x0f) : q[i];
+        const float e = fabsf(x[i] - values[idx] * absmax);
+        error.sum_squared_error += (double)e * e;
+        error.max_abs_error = e > error.max_abs_error ? e : error.max_abs_error;
+        count += fabsf(values[idx]) == max_value;
+    }
+    if (saturated != NULL)
+        *saturated = count;
+    return error;
+}
+
+// the absmax values a nested config dequantizes with, computed in a first pass over the input
+std::vector<float> nested_absmax(const cpu_kernel_table *kernels, quant_error_config &config, ScalarType_t dtype,
+                                 const void *A, long long n)
+{
+    const long long num_blocks = (n + config.blocksize - 1) / config.blocksize;
+    std::vector<float> absmax(num_blocks);
+    parallel_for(num_blocks, std::max(1LL, BLOCK_SIZE / config.blocksize), [&](long long first_block, long long last_block) {
+        std::vector<float> buffer(config.blocksize);
+        for (long long block = first_block; block < last_block; block++) {
+            const long long block_idx = block * config.blocksize;
+            const long long valid_items = std::min(config.blocksize, n - block_idx);
+            load_as_float(A, dtype, block_idx, valid_items, buffer.data());
+            float absmax_block = 0.0f;
+            for (long long i = 0; i < valid_items; i++)
+                absmax_block = fabsf(buffer[i]) > absmax_block ? fabsf(buffer[i]) : absmax_block;
+            absmax[block] = absmax_block;
+        }
+    });
+
+    double sum = 0.0;
+    for (float a : absmax)
+        sum += a;
+    config.offset = (float)(sum / (double)num_blocks);
+    for (float &a : absmax)
+        a -= config.offset;
+
+    // see quantize_cpu
+    config.nested_code[0] = -1.0f;
+    std::vector<unsigned char> q(num_blocks);
+    std::vector<float> nested(num_blocks);
+    for (long long block_idx = 0; block_idx < num_blocks; block_idx += config.nested_blocksize) {
+        const long long block_end = std::min(num_blocks, block_idx + config.nested_blocksize);
+        kernels->quantize_block(config.nested_code, absmax.data(), nested.data(), q.data(), block_idx, block_end, config.nested_blocksize);
+        kernels->dequantize_block(config.nested_code, q.data(), nested.data(), absmax.data(), block_idx, block_end, config.nested_blocksize);
+    }
+    for (float &a : absmax)
+        a += config.offset;
+    return absmax;
+}
+
+} // namespace
+
+void quantization_error_cpu(int dtype, void *A, long long n, quant_error_config *configs, long long num_configs,
+                            double *sum_squared)
+{
+    const cpu_kernel_table *kernels = cpu_kernels();
+    const ScalarType_t type = (ScalarType_t)dtype;
+
+    // chunks hold whole blocks of every config
+    long long block_multiple = 1;
+    std::vector<float> max_values(num_configs);
+    std::vector<std::vector<float>> nested(num_configs);
+    for (long long c = 0; c < num_configs; c++) {
+        quant_error_config &config = configs[c];
+        block_multiple = block_multiple / gcd(block_multiple, config.blocksize) * config.blocksize;
+        if (config.quant_type == CPU_GENERAL_8BIT)
+            // see quantize_cpu
+            config.code[0] = -1.0f;
+        const float *values = config.quant_type == CPU_GENERAL_8BIT ? config.code : cpu_4bit_code(config.quant_type);
+        const int num_values = config.quant_type == CPU_GENERAL_8BIT ? 256 : 16;
+        for (int i = 0; i < num_values; i++)
+            max_values[c] = std::max(max_values[c], fabsf(values[i]));
+        config.offset = 0.0f;
+        if (config.nested_code != NULL)
+            nested[c] = nested_absmax(kernels, config, type, A, n);
+    }
+    const long long chunk_size = block_multiple * std::max(1LL, BLOCK_SIZE / block_multiple);
+    const long long num_chunks = (n + chunk_size - 1) / chunk_size;
+
+    // per chunk results, summed up by tree_sum afterwards so that the result does not
+    // depend on the number of threads
+    std::vector<double> chunk_squared(num_chunks);
+    std::vector<block_error> chunk_errors(num_chunks * num_configs);
+    parallel_for(num_chunks, 1, [&](long long first_chunk, long long last_chunk) {
+        std::vector<float> buffer(chunk_size);
+        std::vector<unsigned char> scratch(chunk_size);
+        for (long long chunk = first_chunk; chunk < last_chunk; chunk++) {
+            const long long chunk_idx = chunk * chunk_size;
+            const long long chunk_items = std::min(chunk_size, n - chunk_idx);
+            load_as_float(A, type, chunk_idx, chunk_items, buffer.data());
+            double squared = 0.0;
+            for (long long i = 0; i < chunk_items; i++)
+                squared += (double)buffer[i] * buffer[i];
+            chunk_squared[chunk] = squared;
+
+            for (long long c = 0; c < num_configs; c++) {
+                const quant_error_config &config = configs[c];
+                const bool four_bit = config.quant_type != CPU_GENERAL_8BIT;
+                const float *values = four_bit ? cpu_4bit_code(config.quant_type) : config.code;
+                block_error &total = chunk_errors[chunk * num_configs + c];
+                total = {0.0, 0.0f};
+                for (long long i = 0; i < chunk_items; i += config.blocksize) {
+                    const long long block = (chunk_idx + i) / config.blocksize;
+                    const long long valid_items = std::min(config.blocksize, chunk_items - i);
+                    const float *x = buffer.data() + i;
+                    unsigned char *q = config.out != NULL ? config.out + (four_bit ? (chunk_idx + i) / 2 : chunk_idx + i)
+                                                          : scratch.data();
+                    float absmax;
+                    if (four_bit)
+                        quantize_4bit_values(config.quant_type, x, &absmax, q, valid_items, valid_items);
+                    else
+                        kernels->quantize_block(config.code, x, &absmax, q, 0, valid_items, valid_items);
+                    if (config.absmax != NULL)
+                        config.absmax[block] = absmax;
+
+                    const float scale = config.nested_code != NULL ? nested[c][block] : absmax;
+                    int *saturated = config.saturated != NULL ? config.saturated + block : NULL;
+                    const block_error error = four_bit
+                        ? measure_block<true>(x, valid_items, q, values, scale, max_values[c], saturated)
+                        : measure_block<false>(x, valid_items, q, values, scale, max_values[c], saturated);
+                    total.sum_squared_error += error.sum_squared_error;
+                    total.max_abs_error = std::max(total.max_abs_error, error.max_abs_error);
+                }
+            }
+        }
+    });
+
+    *sum_squared = tree_sum(chunk_squared.data(), num_chunks);
+    for (long long c = 0; c < num_configs; c++) {
+        configs[c].max_abs_error = 0.0f;
+        for (long long chunk = 0; chunk < num_chunks; chunk++) {
+            chunk_squared[chunk] = chunk_errors[chunk * num_configs + c].sum_squared_error;
+            configs[c].max_abs_error = std::max(configs[c].max_abs_error, chunk_errors[chunk * num_configs + c].max_abs_error);
+        }
+        configs[c].sum_squared_error = tree_sum(chunk_squared.data(), num_chunks);
+    }
+}
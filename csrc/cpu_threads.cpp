@@ -0,0 +1,423 @@
+#include <cpu_threads.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace {
+
+// index of the pool thread running the current code, 0 for threads outside the pool
+thread_local int worker_index = 0;
+// set while a parallel_for chunk runs on this thread; nested calls run serially
+thread_local bool in_parallel_region = false;
+
+class ThreadPool
+{
+public:
+    ThreadPool(int num_threads, const std::vector<int> &cpus) : num_threads_(num_threads)
+    {
+        // the thread calling into the library is the first of num_threads participants;
+        // a single threaded pool still gets one worker to run tasks queued by pool_submit
+        for (int i = 1; i < std::max(num_threads, 2); i++) {
+            int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+            workers_.emplace_back([this, i, cpu] { worker_loop(i, cpu); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (std::thread &worker : workers_)
+            worker.join();
+    }
+
+    void submit(std::function<void()> fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(std::move(fn));
+        }
+        cv_.notify_one();
+    }
+
+    int num_threads() const { return num_threads_; }
+
+private:
+    void worker_loop(int index, int cpu)
+    {
+        worker_index = index;
+#if defined(__linux__)
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+#else
+        (void)cpu;
+#endif
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                // drain the queue before shutting down so that submitted jobs always complete
+                if (queue_.empty())
+                    return;
+                task = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            task();
+        }
+    }
+
+    const int num_threads_;
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> queue_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+};
+
+// A pool is destroyed by whoever drops the last reference to it: reconfigure_pool, or
+// a parallel_for or pool_submit that still ran on it. Its own workers cannot join
+// themselves, e.g. in a job that changed the number of threads, so they leave that to
+// a new thread.
+void destroy_pool(ThreadPool *p)
+{
+    if (worker_index != 0)
+        std::thread([p] { delete p; }).detach();
+    else
+        delete p;
+}
+
+std::mutex pool_mutex;
+// never destroyed, so that exiting does not wait for the workers
+std::shared_ptr<ThreadPool> &pool = *new std::shared_ptr<ThreadPool>();
+int requested_num_threads = 0;
+bool pin_threads = false;
+std::atomic<bool> numa_local(false);
+
+bool env_enabled(const char *name)
+{
+    const char *value = getenv(name);
+    return value != NULL && atoi(value) != 0;
+}
+
+std::atomic<bool> deterministic(env_enabled("BNB_DETERMINISTIC"));
+
+#if defined(__linux__)
+bool read_file(const std::string &path, std::string &contents)
+{
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == NULL)
+        return false;
+    char buffer[4096];
+    size_t len = fread(buffer, 1, sizeof(buffer) - 1, f);
+    fclose(f);
+    buffer[len] = '\0';
+    contents = buffer;
+    return true;
+}
+
+// parses kernel cpu lists like "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    const char *s = list.c_str();
+    while (*s != '\0' && *s != '\n') {
+        char *end;
+        long first = strtol(s, &end, 10);
+        if (end == s)
+            break;
+        long last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last; cpu++)
+            cpus.push_back((int)cpu);
+        s = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+}
+
+// CPU quota of the cgroup of this process rounded up, or 0 if there is none
+int cgroup_cpu_limit()
+{
+    std::string contents;
+    std::string cgroup_path;
+    if (read_file("/proc/self/cgroup", contents)) {
+        // cgroup v2 has a single hierarchy listed as "0::<path>"
+        size_t pos = contents.find("0::");
+        if (pos != std::string::npos && (pos == 0 || contents[pos - 1] == '\n'))
+            cgroup_path = contents.substr(pos + 3, contents.find('\n', pos) - pos - 3);
+    }
+
+    // cgroup v2: "<quota> <period>" or "max <period>"
+    if (read_file("/sys/fs/cgroup" + cgroup_path + "/cpu.max", contents) ||
+        read_file("/sys/fs/cgroup/cpu.max", contents)) {
+        long long quota = 0, period = 0;
+        if (sscanf(contents.c_str(), "%lld %lld", &quota, &period) == 2 && quota > 0 && period > 0)
+            return (int)((quota + period - 1) / period);
+        return 0;
+    }
+
+    // cgroup v1: a quota of -1 means unlimited
+    std::string quota_str, period_str;
+    if (read_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", quota_str) &&
+        read_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us", period_str)) {
+        long long quota = atoll(quota_str.c_str());
+        long long period = atoll(period_str.c_str());
+        if (quota > 0 && period > 0)
+            return (int)((quota + period - 1) / period);
+    }
+    return 0;
+}
+
+// CPUs in the affinity mask of the process, grouped by NUMA node
+std::vector<int> affinity_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return cpus;
+
+    std::vector<bool> seen(CPU_SETSIZE, false);
+    for (int node = 0;; node++) {
+        std::string list;
+        if (!read_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", list))
+            break;
+        for (int cpu : parse_cpu_list(list))
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set) && !seen[cpu]) {
+                cpus.push_back(cpu);
+                seen[cpu] = true;
+            }
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set) && !seen[cpu])
+            cpus.push_back(cpu);
+    return cpus;
+}
+#endif
+
+#if !defined(_WIN32)
+// A forked child only inherits the calling thread, so the pool of the parent is
+// abandoned (not destroyed, its threads do not exist) and recreated on demand.
+void lock_pool_before_fork() { pool_mutex.lock(); }
+void unlock_pool_after_fork() { pool_mutex.unlock(); }
+void reset_pool_in_child()
+{
+    new std::shared_ptr<ThreadPool>(std::move(pool)); // leaked
+    pool_mutex.unlock();
+}
+#endif
+
+std::shared_ptr<ThreadPool> get_pool()
+{
+    static std::once_flag atfork_registered;
+    std::call_once(atfork_registered, [] {
+#if !defined(_WIN32)
+        pthread_atfork(lock_pool_before_fork, unlock_pool_after_fork, reset_pool_in_child);
+#endif
+    });
+
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (pool == nullptr) {
+        int num_threads = requested_num_threads;
+        const char *env = getenv("BNB_NUM_THREADS");
+        if (num_threads <= 0 && env != NULL)
+            num_threads = atoi(env);
+        if (num_threads <= 0)
+            num_threads = default_num_threads();
+
+        std::vector<int> cpus;
+#if defined(__linux__)
+        if (pin_threads)
+            cpus = affinity_cpus();
+#endif
+        pool = std::shared_ptr<ThreadPool>(new ThreadPool(num_threads, cpus), destroy_pool);
+    }
+    return pool;
+}
+
+// Applies new pool settings. The old pool is released outside of the lock, its
+// remaining tasks may still need to look up the pool.
+template <typename F> void reconfigure_pool(F update)
+{
+    std::shared_ptr<ThreadPool> old;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        update();
+        old = std::move(pool);
+    }
+}
+
+struct ParallelForState {
+    const std::function<void(long long, long long)> *fn;
+    long long n;
+    long long chunk_size;
+    long long num_chunks;
+    // dynamic schedule: next chunk to hand out
+    std::atomic<long long> next{0};
+    // numa local schedule: one partition per thread, claimed once
+    std::unique_ptr<std::atomic<bool>[]> claimed;
+    std::atomic<long long> done{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    long long claim(int participant)
+    {
+        if (!claimed)
+        {
+            long long chunk = next.fetch_add(1);
+            return chunk < num_chunks ? chunk : -1;
+        }
+
+        long long home = participant % num_chunks;
+        if (!claimed[home].exchange(true))
+            return home;
+        for (long long chunk = 0; chunk < num_chunks; chunk++)
+            if (!claimed[chunk].load(std::memory_order_relaxed) && !claimed[chunk].exchange(true))
+                return chunk;
+        return -1;
+    }
+
+    void run(int participant)
+    {
+        bool outer = in_parallel_region;
+        in_parallel_region = true;
+        for (long long chunk = claim(participant); chunk >= 0; chunk = claim(participant)) {
+            long long begin = chunk * chunk_size;
+            (*fn)(begin, std::min(n, begin + chunk_size));
+            if (done.fetch_add(1) + 1 == num_chunks) {
+                std::lock_guard<std::mutex> lock(mutex);
+                cv.notify_all();
+            }
+        }
+        in_parallel_region = outer;
+    }
+};
+
+} // namespace
+
+void parallel_for(long long n, long long grain, const std::function<void(long long, long long)> &fn)
+{
+    if (n <= 0)
+        return;
+    grain = std::max(grain, 1LL);
+
+    std::shared_ptr<ThreadPool> p = in_parallel_region ? nullptr : get_pool();
+    const int num_threads = p != nullptr ? p->num_threads() : 1;
+    if (num_threads == 1 || n <= grain) {
+        bool outer = in_parallel_region;
+        in_parallel_region = true;
+        fn(0, n);
+        in_parallel_region = outer;
+        return;
+    }
+
+    auto state = std::make_shared<ParallelForState>();
+    state->fn = &fn;
+    state->n = n;
+    const long long max_chunks = (n + grain - 1) / grain;
+    if (numa_local.load()) {
+        long long parts = std::min<long long>(num_threads, max_chunks);
+        state->chunk_size = ((n + parts - 1) / parts + grain - 1) / grain * grain;
+        state->num_chunks = (n + state->chunk_size - 1) / state->chunk_size;
+        state->claimed.reset(new std::atomic<bool>[state->num_chunks]);
+        for (long long i = 0; i < state->num_chunks; i++)
+            state->claimed[i] = false;
+    } else {
+        // a few chunks per thread balance uneven progress without much scheduling overhead
+        long long chunks = std::min<long long>(4LL * num_threads, max_chunks);
+        state->chunk_size = ((n + chunks - 1) / chunks + grain - 1) / grain * grain;
+        state->num_chunks = (n + state->chunk_size - 1) / state->chunk_size;
+    }
+
+    // Helpers that start after the work is gone return immediately. The caller never
+    // waits for a helper to start, only for claimed chunks to finish.
+    const long long helpers = std::min<long long>(num_threads - 1, state->num_chunks - 1);
+    for (long long i = 0; i < helpers; i++)
+        p->submit([state] { state->run(worker_index); });
+
+    state->run(worker_index);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock, [&state] { return state->done.load() == state->num_chunks; });
+}
+
+void pool_submit(std::function<void()> fn) { get_pool()->submit(std::move(fn)); }
+
+int default_num_threads()
+{
+    int num_threads = (int)std::thread::hardware_concurrency();
+#if defined(__linux__)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        num_threads = CPU_COUNT(&set);
+    int limit = cgroup_cpu_limit();
+    if (limit > 0)
+        num_threads = std::min(num_threads, limit);
+#endif
+    return std::max(num_threads, 1);
+}
+
+void set_num_threads(int num_threads)
+{
+    reconfigure_pool([num_threads] { requested_num_threads = num_threads; });
+}
+
+int get_num_threads() { return get_pool()->num_threads(); }
+
+void set_thread_affinity(bool enable)
+{
+    reconfigure_pool([enable] { pin_threads = enable; });
+}
+
+bool get_thread_affinity()
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    return pin_threads;
+}
+
+void set_numa_local(bool enable) { numa_local = enable; }
+
+bool get_numa_local() { return numa_local.load(); }
+
+void set_deterministic(bool enable) { deterministic = enable; }
+
+bool get_deterministic() { return deterministic.load(); }
+
+template <typename T> static double tree_sum_impl(const T *values, long long n)
+{
+    if (n <= 8) {
+        double sum = 0.0;
+        for (long long i = 0; i < n; i++)
+            sum += values[i];
+        return sum;
+    }
+    const long long half = n / 2;
+    return tree_sum_impl(values, half) + tree_sum_impl(values + half, n - half);
+}
+
+double tree_sum(const float *values, long long n) { return tree_sum_impl(values, n); }
+
+double tree_sum(const double *values, long long n) { return tree_sum_impl(values, n); }
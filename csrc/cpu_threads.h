@@ -0,0 +1,50 @@
+#ifndef BITSANDBYTES_CPU_THREADS_H
+#define BITSANDBYTES_CPU_THREADS_H
+
+#include <functional>
+
+// Persistent thread pool used by all CPU ops. It is created on first use with
+// default_num_threads() threads, counting the calling thread, which always takes
+// part in the work.
+
+// Calls fn(begin, end) for disjoint chunks covering [0, n). Chunks hold at least
+// `grain` items except for the last one. Calls made from inside a pool task run
+// serially on the current thread, so ops can be composed freely.
+void parallel_for(long long n, long long grain, const std::function<void(long long, long long)> &fn);
+
+// Queues fn on the pool without waiting for it, also when the pool only has a single
+// thread. The task may itself use parallel_for.
+void pool_submit(std::function<void()> fn);
+
+// CPUs available to this process: the affinity mask, capped by the cgroup CPU quota.
+int default_num_threads();
+
+// num_threads <= 0 restores the default. Ops and jobs that are running finish on the
+// previous threads, which exit afterwards.
+void set_num_threads(int num_threads);
+int get_num_threads();
+
+// Pins pool thread i to the i-th CPU of the process affinity mask, with the CPUs
+// ordered by NUMA node so that neighbouring threads share a node.
+void set_thread_affinity(bool enable);
+bool get_thread_affinity();
+
+// Splits parallel_for ranges into one contiguous partition per thread that is
+// always handed to the same thread, so that a buffer is processed by the thread
+// that first touched it. Idle threads still pick up partitions left unclaimed.
+void set_numa_local(bool enable);
+bool get_numa_local();
+
+// Makes reductions whose shape would otherwise follow the number of threads (the
+// privatized histogram) split their input into a fixed number of parts instead, so
+// that results are bitwise identical for any thread count. Off by default, or on if
+// BNB_DETERMINISTIC=1 is set.
+void set_deterministic(bool enable);
+bool get_deterministic();
+
+// Sums partial results pairwise in a tree whose shape only depends on n, so that the
+// result depends neither on which thread computed which partial nor, much, on n.
+double tree_sum(const float *values, long long n);
+double tree_sum(const double *values, long long n);
+
+#endif
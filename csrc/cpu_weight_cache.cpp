@@ -0,0 +1,166 @@
+#include <common.h>
+#include <cpu_ops.h>
+#include <cpu_weight_cache.h>
+#include <list>
+#include <mutex>
+#include <new>
+#include <stdlib.h>
+#include <unordered_map>
+
+namespace {
+
+struct cache_entry {
+    const void *key;
+    long long tag;
+    std::shared_ptr<void> values;
+    long long num_bytes;
+};
+
+// lookups of keys that are not cached, for admission; forgotten when it grows too large
+const size_t MAX_TRACKED_KEYS = 4096;
+
+std::mutex cache_mutex;
+// most recently used first
+std::list<cache_entry> lru;
+std::unordered_map<const void *, std::list<cache_entry>::iterator> entries;
+std::unordered_map<const void *, int> uses;
+long long budget = -1;
+int admit_after = 2;
+long long used_bytes = 0;
+long long hits = 0;
+long long misses = 0;
+
+// the budget from BNB_WEIGHT_CACHE_BYTES on first use; cache_mutex must be held
+long long get_budget()
+{
+    if (budget < 0) {
+        const char *env = getenv("BNB_WEIGHT_CACHE_BYTES");
+        budget = env != NULL ? atoll(env) : 0;
+    }
+    return budget;
+}
+
+// cache_mutex must be held
+void erase(std::unordered_map<const void *, std::list<cache_entry>::iterator>::iterator it)
+{
+    used_bytes -= it->second->num_bytes;
+    lru.erase(it->second);
+    entries.erase(it);
+}
+
+// cache_mutex must be held
+void evict_to(long long max_bytes)
+{
+    while (used_bytes > max_bytes && !lru.empty())
+        erase(entries.find(lru.back().key));
+}
+
+} // namespace
+
+std::shared_ptr<void> weight_cache_get(const void *key, long long tag, long long num_bytes,
+                                       const std::function<void(void *)> &fill)
+{
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (num_bytes > get_budget())
+            return nullptr;
+        auto it = entries.find(key);
+        if (it != entries.end() && it->second->tag == tag && it->second->num_bytes == num_bytes) {
+            lru.splice(lru.begin(), lru, it->second);
+            hits++;
+            return it->second->values;
+        }
+        misses++;
+        if (uses.size() >= MAX_TRACKED_KEYS)
+            uses.clear();
+        if (++uses[key] < admit_after)
+            return nullptr;
+    }
+
+    // dequantized without holding the lock; a concurrent miss on the same key does it too
+    unsigned char *buffer = new (std::nothrow) unsigned char[num_bytes];
+    if (buffer == nullptr)
+        return nullptr;
+    std::shared_ptr<void> values(buffer, std::default_delete<unsigned char[]>());
+    fill(buffer);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    uses.erase(key);
+    auto it = entries.find(key);
+    if (it != entries.end())
+        erase(it);
+    if (num_bytes <= get_budget()) {
+        evict_to(get_budget() - num_bytes);
+        lru.push_front(cache_entry{key, tag, values, num_bytes});
+        entries[key] = lru.begin();
+        used_bytes += num_bytes;
+    }
+    return values;
+}
+
+void weight_cache_invalidate(const void *key)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    uses.erase(key);
+    auto it = entries.find(key);
+    if (it != entries.end())
+        erase(it);
+}
+
+void set_weight_cache(long long budget_bytes, int admit)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    budget = budget_bytes > 0 ? budget_bytes : 0;
+    admit_after = admit > 1 ? admit : 1;
+    evict_to(budget);
+    if (budget == 0)
+        uses.clear();
+}
+
+void weight_cache_clear()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    evict_to(0);
+    uses.clear();
+    hits = 0;
+    misses = 0;
+}
+
+weight_cache_stats get_weight_cache_stats()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return weight_cache_stats{get_budget(), used_bytes, (long long)entries.size(), hits, misses};
+}
+
+void *weight_cache_dequantize_4bit_cpu(const void *key, long long tag, int quant_type, int dtype, unsigned char *A,
+                                       float *absmax, long long blocksize, long long n, void **out)
+{
+    const long long num_bytes = n * (dtype == Float32 ? 4 : 2);
+    std::shared_ptr<void> values = weight_cache_get(key, tag, num_bytes, [&](void *buffer) {
+        dequantize_4bit_cpu(quant_type, dtype, A, absmax, buffer, blocksize, n);
+    });
+    if (!values)
+        return NULL;
+    *out = values.get();
+    return new std::shared_ptr<void>(values);
+}
+
+void *weight_cache_prepack_4bit_cpu(const void *key, long long tag, unsigned char *B, float *absmax, long long N,
+                                    long long K, long long blocksize, unsigned char **packed, float **scales)
+{
+    // the packed values of all panels, followed by their absmax values
+    const long long num_panels = (N + PANEL_4BIT - 1) / PANEL_4BIT;
+    const long long packed_bytes = num_panels * K * PANEL_4BIT / 2;
+    const long long num_bytes = packed_bytes + num_panels * (K / blocksize) * PANEL_4BIT * 4;
+    std::shared_ptr<void> values = weight_cache_get(key, tag, num_bytes, [&](void *buffer) {
+        prepack_4bit_cpu(B, absmax, (unsigned char *)buffer, (float *)((unsigned char *)buffer + packed_bytes), N, K,
+                         blocksize);
+    });
+    if (!values)
+        return NULL;
+    *packed = (unsigned char *)values.get();
+    *scales = (float *)(*packed + packed_bytes);
+    return new std::shared_ptr<void>(values);
+}
+
+void weight_cache_release(void *handle) { delete (std::shared_ptr<void> *)handle; }
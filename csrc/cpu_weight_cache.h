@@ -0,0 +1,52 @@
+#ifndef BITSANDBYTES_CPU_WEIGHT_CACHE_H
+#define BITSANDBYTES_CPU_WEIGHT_CACHE_H
+
+#include <functional>
+#include <memory>
+
+// Byte-budgeted cache of dequantized weights for the hottest layers. Entries are keyed
+// by the address of the quantized buffer they were dequantized from, plus a tag that
+// changes with anything else that affects the result (the caller hashes the version of
+// the buffer, the dtype, ...), and are evicted least recently used first. A weight is
+// only admitted once it was looked up admit_after times, so that layers that run once
+// do not push out the hot ones. Lookups from several threads are safe; an evicted
+// entry stays alive as long as a caller holds it. The cache is disabled (a budget of 0)
+// unless BNB_WEIGHT_CACHE_BYTES is set.
+
+// Returns the num_bytes of the entry for key and tag, calling fill to dequantize them
+// into a new entry on a miss. Returns an empty pointer if the weight is not admitted
+// (yet) or larger than the budget, in which case the caller dequantizes it itself.
+std::shared_ptr<void> weight_cache_get(const void *key, long long tag, long long num_bytes,
+                                       const std::function<void(void *)> &fill);
+
+// Drops the entry of a quantized buffer that is about to be freed.
+void weight_cache_invalidate(const void *key);
+
+// Evicts entries down to the new budget. budget_bytes <= 0 disables and clears the cache.
+void set_weight_cache(long long budget_bytes, int admit_after);
+// Drops all entries and resets the statistics.
+void weight_cache_clear();
+
+struct weight_cache_stats {
+    long long budget_bytes;
+    long long used_bytes;
+    long long entries;
+    long long hits;
+    long long misses;
+};
+weight_cache_stats get_weight_cache_stats();
+
+// dequantize_4bit_cpu through the cache: returns a handle that keeps the entry alive
+// until weight_cache_release and points *out at the dequantized values, or NULL if the
+// weight is not cached, leaving *out alone.
+void *weight_cache_dequantize_4bit_cpu(const void *key, long long tag, int quant_type, int dtype, unsigned char *A,
+                                       float *absmax, long long blocksize, long long n, void **out);
+// prepack_4bit_cpu through the cache, for the panels of a weight multiplied with
+// gemm_4bit_cpu: like weight_cache_dequantize_4bit_cpu, but points *packed and *scales
+// at the panels. A weight is cached either dequantized or prepacked, in the form it was
+// last looked up in.
+void *weight_cache_prepack_4bit_cpu(const void *key, long long tag, unsigned char *B, float *absmax, long long N,
+                                    long long K, long long blocksize, unsigned char **packed, float **scales);
+void weight_cache_release(void *handle);
+
+#endif
@@ -9,7 +9,15 @@
 #if BUILD_MPS
 // #include <mps_ops.h>
 #endif
+#include <cpu_autotune.h>
+#include <cpu_checkpoint.h>
+#include <cpu_collectives.h>
 #include <cpu_ops.h>
+#include <cpu_jobs.h>
+#include <cpu_paging.h>
+#include <cpu_threads.h>
+#include <cpu_weight_cache.h>
+#include <vector>
 
 // We cannot call templated code from C, so we wrap the template in a C compatible call here if necessary.
 // We use macro functions to expand all the different optimizers. Looks ugly, and is ugly, but its better than to
@@ -418,4 +426,124 @@ extern "C"
 
 	void cquantize_blockwise_cpu_fp32(float *code, float *A, float *absmax, unsigned char *out, long long blocksize, long long n){ quantize_cpu(code, A, absmax, out, blocksize, n); }
 	void cdequantize_blockwise_cpu_fp32(float *code, unsigned char *A, float *absmax, float *out, long long blocksize, long long n){ dequantize_cpu(code, A, absmax, out, blocksize, n); }
+	void cquantize_fp8_cpu(float *code, int exponent_bits, int dtype, void *A, float *absmax, unsigned char *out, long long blocksize, long long n){ quantize_fp8_cpu(code, exponent_bits, dtype, A, absmax, out, blocksize, n); }
+	void crequantize_cpu(int src_type, unsigned char *src, float *src_absmax, float *src_code, long long src_blocksize, int dst_type, unsigned char *dst, float *dst_absmax, float *dst_code, long long dst_blocksize, int dst_fp8_exponent_bits, long long n){ requantize_cpu(src_type, src, src_absmax, src_code, src_blocksize, dst_type, dst, dst_absmax, dst_code, dst_blocksize, dst_fp8_exponent_bits, n); }
+	void cquantize_blockwise_cpu_batched(quantize_tensor_desc *tensors, long long num_tensors){ quantize_cpu_batched(tensors, num_tensors); }
+	void cdequantize_blockwise_cpu_batched(quantize_tensor_desc *tensors, long long num_tensors){ dequantize_cpu_batched(tensors, num_tensors); }
+	void cquantize_4bit_cpu(int quant_type, int dtype, void *A, float *absmax, unsigned char *out, long long blocksize, long long n){ quantize_4bit_cpu(quant_type, dtype, A, absmax, out, blocksize, n); }
+	void cdequantize_4bit_cpu(int quant_type, int dtype, unsigned char *A, float *absmax, void *out, long long blocksize, long long n){ dequantize_4bit_cpu(quant_type, dtype, A, absmax, out, blocksize, n); }
+	void cprepack_4bit_cpu(unsigned char *B, float *absmax, unsigned char *packed, float *scales, long long N, long long K, long long blocksize){ prepack_4bit_cpu(B, absmax, packed, scales, N, K, blocksize); }
+	void cgemm_4bit_cpu(int quant_type, int dtype, void *A, unsigned char *packed, float *scales, void *out, long long M, long long N, long long K, long long blocksize)
+	{ gemm_4bit_cpu(quant_type, dtype, A, packed, scales, out, M, N, K, blocksize); }
+
+	void cgemm_4bit_transposed_cpu(int quant_type, int dtype, void *A, unsigned char *W, float *absmax, void *out, long long M, long long N, long long K, long long blocksize)
+	{ gemm_4bit_transposed_cpu(quant_type, dtype, A, W, absmax, out, M, N, K, blocksize); }
+
+	bool cgemv_lora_cpu(int quant_type, int dtype, void *x, unsigned char *W, float *absmax, float *code, void *lora_A, void *lora_B, float *scales, long long *adapter_ids, long long num_adapters, long long rank, void *out, long long M, long long N, long long K, long long blocksize)
+	{ return gemv_lora_cpu(quant_type, dtype, x, W, absmax, code, lora_A, lora_B, scales, adapter_ids, num_adapters, rank, out, M, N, K, blocksize); }
+	void cembedding_bag_cpu(int quant_type, unsigned char *table, float *absmax, float *code, long long dim, long long blocksize, long long *indices, long long num_indices,
+		long long *offsets, long long num_bags, float *per_sample_weights, int mode, long long padding_idx, int dtype, void *out)
+	{ embedding_bag_cpu(quant_type, table, absmax, code, dim, blocksize, indices, num_indices, offsets, num_bags, per_sample_weights, mode, padding_idx, dtype, out); }
+	void ckv_cache_append_cpu(int quant_type, int dtype, void *rows, unsigned char *cache, float *absmax, float *code, long long num_kv_heads, long long capacity,
+		long long head_dim, long long blocksize, long long start, long long num_tokens)
+	{ kv_cache_append_cpu(quant_type, dtype, rows, cache, absmax, code, num_kv_heads, capacity, head_dim, blocksize, start, num_tokens); }
+	void ckv_cache_scores_cpu(int quant_type, int dtype, void *query, unsigned char *cache, float *absmax, float *code, long long num_heads, long long num_kv_heads,
+		long long num_queries, long long capacity, long long head_dim, long long blocksize, long long start, long long window, float scale, float *scores)
+	{ kv_cache_scores_cpu(quant_type, dtype, query, cache, absmax, code, num_heads, num_kv_heads, num_queries, capacity, head_dim, blocksize, start, window, scale, scores); }
+	void ckv_cache_attend_cpu(int quant_type, float *probs, unsigned char *cache, float *absmax, float *code, long long num_heads, long long num_kv_heads,
+		long long num_queries, long long capacity, long long head_dim, long long blocksize, long long start, long long window, float *out)
+	{ kv_cache_attend_cpu(quant_type, probs, cache, absmax, code, num_heads, num_kv_heads, num_queries, capacity, head_dim, blocksize, start, window, out); }
+	void cquantization_error_cpu(int dtype, void *A, long long n, quant_error_config *configs, long long num_configs, double *sum_squared)
+	{ quantization_error_cpu(dtype, A, n, configs, num_configs, sum_squared); }
+	void cerror_feedback_compress_cpu(int quant_type, int dtype, void *g, int residual_dtype, void *residual, float *code, float *absmax, unsigned char *out,
+		long long blocksize, long long n)
+	{ error_feedback_compress_cpu(quant_type, dtype, g, residual_dtype, residual, code, absmax, out, blocksize, n); }
+	void chistogram_scatter_add_2d_cpu(float* histogram, int *index1, int *index2, float *src, int maxidx1, long long num_bins, long long n){ histogram_scatter_add_2d_cpu(histogram, index1, index2, src, maxidx1, num_bins, n); }
+	const char *cget_cpu_isa(){ return cpu_isa_name(); }
+	void cset_num_threads(int num_threads){ set_num_threads(num_threads); }
+	int cget_num_threads(){ return get_num_threads(); }
+	int cget_default_num_threads(){ return default_num_threads(); }
+	void cset_thread_affinity(bool enable){ set_thread_affinity(enable); }
+	bool cget_thread_affinity(){ return get_thread_affinity(); }
+	void cset_numa_local(bool enable){ set_numa_local(enable); }
+	bool cget_numa_local(){ return get_numa_local(); }
+	void cset_weight_cache(long long budget_bytes, int admit_after){ set_weight_cache(budget_bytes, admit_after); }
+	void cweight_cache_clear(){ weight_cache_clear(); }
+	void cweight_cache_invalidate(void *key){ weight_cache_invalidate(key); }
+	void *cweight_cache_dequantize_4bit_cpu(void *key, long long tag, int quant_type, int dtype, unsigned char *A, float *absmax, long long blocksize, long long n, void **out)
+	{ return weight_cache_dequantize_4bit_cpu(key, tag, quant_type, dtype, A, absmax, blocksize, n, out); }
+	void *cweight_cache_prepack_4bit_cpu(void *key, long long tag, unsigned char *B, float *absmax, long long N, long long K, long long blocksize, unsigned char **packed, float **scales)
+	{ return weight_cache_prepack_4bit_cpu(key, tag, B, absmax, N, K, blocksize, packed, scales); }
+	void cweight_cache_release(void *handle){ weight_cache_release(handle); }
+	void cget_weight_cache_stats(long long *stats)
+	{
+		const weight_cache_stats s = get_weight_cache_stats();
+		stats[0] = s.budget_bytes; stats[1] = s.used_bytes; stats[2] = s.entries; stats[3] = s.hits; stats[4] = s.misses;
+	}
+	void cset_deterministic(bool enable){ set_deterministic(enable); }
+	bool cget_deterministic(){ return get_deterministic(); }
+	bool cautotune_cpu(bool force){ return autotune_cpu(force); }
+	void cget_cpu_tuning(long long *values)
+	{
+		const cpu_tuning t = get_cpu_tuning();
+		values[0] = t.isa; values[1] = t.task_values; values[2] = t.gemm_rows; values[3] = t.gemm_panels;
+	}
+
+	void coptimizer_32bit_cpu(int optimizer, int dtype, void *g, void *p, float *state1, float *state2, float *unorm, float max_unorm, float param_norm,
+														float beta1, float beta2, float eps, float weight_decay, int step, float lr, float gnorm_scale, bool skip_zeros, bool stochastic_rounding, unsigned long long rounding_seed, long long n)
+	{ optimizer_32bit_cpu(optimizer, dtype, g, p, state1, state2, unorm, max_unorm, param_norm, beta1, beta2, eps, weight_decay, step, lr, gnorm_scale, skip_zeros, stochastic_rounding, rounding_seed, n); }
+
+	void coptimizer_8bit_blockwise_cpu(int optimizer, int dtype, void *g, void *p, unsigned char *state1, unsigned char *state2, float *qmap1, float *qmap2,
+																		float *absmax1, float *absmax2, float *unorm, float max_unorm, float param_norm, float beta1, float beta2, float eps,
+																		float weight_decay, int step, float lr, float gnorm_scale, bool skip_zeros, bool stochastic_rounding, unsigned long long rounding_seed, long long n)
+	{ optimizer_8bit_blockwise_cpu(optimizer, dtype, g, p, state1, state2, qmap1, qmap2, absmax1, absmax2, unorm, max_unorm, param_norm, beta1, beta2, eps, weight_decay, step, lr, gnorm_scale, skip_zeros, stochastic_rounding, rounding_seed, n); }
+
+	bool coptimizer_4bit_blockwise_cpu(int optimizer, int dtype, void *g, void *p, unsigned char *state1, unsigned char *state2, float *qmap1, float *qmap2,
+																		float *absmax1, float *absmax2, long long blocksize, float *unorm, float max_unorm, float param_norm, float beta1, float beta2, float eps,
+																		float weight_decay, int step, float lr, float gnorm_scale, bool skip_zeros, bool stochastic_rounding, unsigned long long rounding_seed, long long n)
+	{ return optimizer_4bit_blockwise_cpu(optimizer, dtype, g, p, state1, state2, qmap1, qmap2, absmax1, absmax2, blocksize, unorm, max_unorm, param_norm, beta1, beta2, eps, weight_decay, step, lr, gnorm_scale, skip_zeros, stochastic_rounding, rounding_seed, n); }
+
+	float coptimizer_32bit_cpu_multi(int optimizer, optimizer_tensor_desc *tensors, long long num_tensors, float max_grad_norm, float max_unorm,
+																	 float beta1, float beta2, float eps, float weight_decay, int step, float lr, bool skip_zeros, bool stochastic_rounding)
+	{ return optimizer_32bit_cpu_multi(optimizer, tensors, num_tensors, max_grad_norm, max_unorm, beta1, beta2, eps, weight_decay, step, lr, skip_zeros, stochastic_rounding); }
+
+	// asynchronous versions of the CPU ops above; the descriptors are copied, the tensors are not
+	cpu_job *csubmit_quantize_blockwise_cpu_batched(quantize_tensor_desc *tensors, long long num_tensors)
+	{
+		std::vector<quantize_tensor_desc> descs(tensors, tensors + num_tensors);
+		return job_submit([descs]() mutable { quantize_cpu_batched(descs.data(), descs.size()); });
+	}
+	cpu_job *csubmit_dequantize_blockwise_cpu_batched(quantize_tensor_desc *tensors, long long num_tensors)
+	{
+		std::vector<quantize_tensor_desc> descs(tensors, tensors + num_tensors);
+		return job_submit([descs]() mutable { dequantize_cpu_batched(descs.data(), descs.size()); });
+	}
+	cpu_job *csubmit_optimizer_32bit_cpu(int optimizer, int dtype, void *g, void *p, float *state1, float *state2, float *unorm, float max_unorm, float param_norm,
+																			 float beta1, float beta2, float eps, float weight_decay, int step, float lr, float gnorm_scale, bool skip_zeros, bool stochastic_rounding, unsigned long long rounding_seed, long long n)
+	{
+		return job_submit([=] { optimizer_32bit_cpu(optimizer, dtype, g, p, state1, state2, unorm, max_unorm, param_norm, beta1, beta2, eps, weight_decay, step, lr, gnorm_scale, skip_zeros, stochastic_rounding, rounding_seed, n); });
+	}
+	void *cpaged_alloc_cpu(size_t num_bytes){ return paged_alloc_cpu(num_bytes); }
+	void cpaged_free_cpu(void *ptr){ paged_free_cpu(ptr); }
+	void cprefetch_cpu(void *ptr, size_t num_bytes){ paged_prefetch_cpu(ptr, num_bytes); }
+	void cwriteback_cpu(void *ptr, size_t num_bytes){ paged_writeback_cpu(ptr, num_bytes); }
+	void cset_paged_dir(const char *dir){ set_paged_dir(dir); }
+	void *ccheckpoint_writer_open(const char *path, bool direct, int num_threads){ return checkpoint_writer_open(path, direct, num_threads); }
+	long long ccheckpoint_writer_write(void *writer, void *data, long long num_bytes){ return checkpoint_writer_write((checkpoint_writer *)writer, data, num_bytes); }
+	long long ccheckpoint_writer_quantize_4bit(void *writer, int quant_type, int dtype, void *A, float *absmax, long long blocksize, long long n)
+	{ return checkpoint_writer_quantize_4bit((checkpoint_writer *)writer, quant_type, dtype, A, absmax, blocksize, n); }
+	bool ccheckpoint_writer_close(void *writer, void *index, long long index_bytes){ return checkpoint_writer_close((checkpoint_writer *)writer, index, index_bytes); }
+	void *cshm_transport_create(const char *name, int rank, int world_size, long long max_payload_bytes, int ring, long long timeout_ms)
+	{ return shm_transport_create(name, rank, world_size, max_payload_bytes, ring, timeout_ms); }
+	void ctransport_destroy(void *transport){ transport_destroy((collective_transport *)transport); }
+	long long cquantized_all_reduce_payload_bytes(int world_size, long long blocksize, long long chunk_size)
+	{ return quantized_all_reduce_payload_bytes(world_size, blocksize, chunk_size); }
+	bool cquantized_all_reduce_cpu(void *transport, float *code, float *data, long long n, long long blocksize, long long chunk_size, bool average)
+	{ return quantized_all_reduce_cpu((collective_transport *)transport, code, data, n, blocksize, chunk_size, average); }
+
+	bool cjob_poll(cpu_job *job){ return job_poll(job); }
+	void cjob_wait(cpu_job *job){ job_wait(job); }
+	bool cjob_wait_for(cpu_job *job, long long timeout_ms){ return job_wait_for(job, timeout_ms); }
+	void cjob_set_callback(cpu_job *job, job_callback_fn callback, void *user_data){ job_set_callback(job, callback, user_data); }
+	void cjob_release(cpu_job *job){ job_release(job); }
 }
@@ -0,0 +1,150 @@
+#ifndef BITSANDBYTES_BITSANDBYTES_H
+#define BITSANDBYTES_BITSANDBYTES_H
+
+// Public C++ API of the bitsandbytes CPU kernels, for native programs that link the
+// library directly instead of going through Python:
+//
+//     find_package(bitsandbytes REQUIRED)
+//     target_link_libraries(server PRIVATE bitsandbytes::bitsandbytes)
+//
+// Tensors are passed as views of memory owned by the caller; no function allocates
+// its outputs. Functions return a status instead of printing or aborting, and
+// last_error_message() describes the last failure of the calling thread. The kernels
+// run on the thread pool of the library (see BNB_NUM_THREADS) and may be called from
+// several threads at once.
+//
+// BNB_API_VERSION_MINOR grows with additions. An incompatible change bumps
+// BNB_API_VERSION_MAJOR and the inline namespace below, so that a program built for
+// another major version fails to link instead of misbehaving.
+
+#include <stdint.h>
+
+#define BNB_API_VERSION_MAJOR 1
+#define BNB_API_VERSION_MINOR 0
+
+#define BNB_MAX_DIMS 8
+
+namespace bnb {
+inline namespace v1 {
+
+enum class status : int {
+    ok = 0,
+    invalid_argument = 1, // a NULL pointer, or a size, blocksize or option out of range
+    invalid_dtype = 2,
+    invalid_shape = 3,    // shapes that do not fit together
+    not_contiguous = 4,   // the kernels only read and write contiguous memory
+    out_of_memory = 5,
+};
+
+// "ok", "invalid_argument", ...
+const char *status_name(status s);
+// the message of the last failed call of this thread, "" if there was none
+const char *last_error_message();
+
+// the API version of the library, to compare with BNB_API_VERSION_MAJOR/MINOR at runtime
+int api_version_major();
+int api_version_minor();
+
+// the values match ScalarType_t of the library
+enum class scalar_type : int {
+    float32 = 0,
+    float16 = 1,
+    bfloat16 = 2,
+    uint8 = 3,
+};
+
+struct tensor_view {
+    void *data;
+    scalar_type dtype;
+    int ndim;
+    int64_t shape[BNB_MAX_DIMS];
+    int64_t strides[BNB_MAX_DIMS]; // in elements
+};
+
+// a view of a contiguous, row-major tensor
+tensor_view make_tensor_view(void *data, scalar_type dtype, int ndim, const int64_t *shape);
+int64_t numel(const tensor_view &tensor);
+bool is_contiguous(const tensor_view &tensor);
+
+// the values match CpuDataType_t of the library and the quant_type of QuantState
+enum class quant_type : int {
+    blockwise_8bit = 0, // one byte per value, looked up in a code of 256 values
+    fp4 = 1,            // two values per byte, the first one in the high nibble
+    nf4 = 2,
+};
+
+// A quantized tensor, laid out like the tensors of quantize_blockwise and quantize_4bit
+// and their QuantState in bitsandbytes/functional.py, so that weights can move between
+// Python and native code. All buffers belong to the caller.
+struct quantized_tensor {
+    uint8_t *data;          // quantized_bytes() bytes
+    quant_type type;
+    scalar_type dtype;      // of the tensor before quantization
+    int ndim;
+    int64_t shape[BNB_MAX_DIMS];
+    int64_t blocksize;
+    float *code;            // the 256 sorted values of blockwise_8bit, unused for fp4 and nf4
+    // num_blocks() fp32 scales or, if nested, the uint8 values they are quantized to
+    void *absmax;
+
+    // compress_statistics / nested: absmax holds the scales minus offset, quantized with
+    // nested_code in blocks of nested_blocksize (QuantState.offset and QuantState.state2)
+    bool nested;
+    float offset;
+    float *nested_absmax;   // nested_num_blocks() values
+    float *nested_code;     // 256 sorted values, e.g. create_dynamic_map()
+    int64_t nested_blocksize;
+};
+
+int64_t numel(const quantized_tensor &tensor);
+int64_t num_blocks(const quantized_tensor &tensor);
+int64_t nested_num_blocks(const quantized_tensor &tensor);
+int64_t quantized_bytes(const quantized_tensor &tensor);
+
+// Quantizes a float32, float16 or bfloat16 tensor into qt. The caller sets type,
+// blocksize, the buffers and, for blockwise_8bit, the code (whose first value is set to
+// -1 like quantize_blockwise does); shape and dtype are taken from input.
+status quantize(const tensor_view &input, quantized_tensor &qt);
+
+// Dequantizes into a tensor of the same number of values, of any float type.
+status dequantize(const quantized_tensor &input, const tensor_view &out);
+
+// out = x @ W.t() for x of shape (..., K), a weight W of shape (N, K) with K a multiple
+// of its blocksize, and out of shape (..., N) with the dtype of x. Decodes W on the fly,
+// which suits a few rows of x, e.g. generating one token at a time.
+status gemv(const tensor_view &x, const quantized_tensor &W, const tensor_view &out);
+
+// the values match CpuOptimizer_t of the library
+enum class optimizer_type : int {
+    adam = 0,
+    momentum = 1,
+    rmsprop = 2,
+    lars = 3,
+    adagrad = 4,
+    lion = 5,
+};
+
+struct optimizer_config {
+    float lr = 1e-3f;
+    float beta1 = 0.9f;
+    float beta2 = 0.999f;
+    float eps = 1e-8f;
+    float weight_decay = 0.0f;
+    float gnorm_scale = 1.0f;
+    // with max_unorm > 0 (LAMB, LARS), updates are scaled to a norm of at most
+    // max_unorm * param_norm; a negative param_norm is computed from param
+    float max_unorm = 0.0f;
+    float param_norm = -1.0f;
+    bool skip_zeros = false;
+};
+
+// One step of the optimizer with 32-bit states for a float32, float16 or bfloat16 param
+// and grad of the same shape and dtype. state1 and state2 hold numel(param) values each,
+// state2 only for adam; step counts from 1.
+status optimizer_update_32bit(optimizer_type optimizer, const tensor_view &grad, const tensor_view &param,
+                              float *state1, float *state2, int step, const optimizer_config &config);
+
+} // namespace v1
+} // namespace bnb
+
+#endif
@@ -0,0 +1,233 @@
+// Tests of the public C++ API: round trips through quantize and dequantize, the GEMV and
+// the optimizer update against references computed here, and the status and message of
+// calls with invalid arguments. Exits with 1 if a check failed.
+
+#include <bitsandbytes/bitsandbytes.h>
+#include <math.h>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace bnb;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                                                               \
+    do {                                                                                                               \
+        if (!(condition)) {                                                                                            \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                             \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+// a call that fails with the expected status and a message containing the given text
+#define CHECK_ERROR(call, expected, text)                                                                              \
+    do {                                                                                                               \
+        const status s_ = (call);                                                                                      \
+        if (s_ != (expected) || strstr(last_error_message(), (text)) == NULL) {                                        \
+            fprintf(stderr, "%s:%d: expected %s with \"%s\", got %s with \"%s\"\n", __FILE__, __LINE__,               \
+                    status_name(expected), (text), status_name(s_), last_error_message());                             \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+const char *quant_type_name(quant_type type)
+{
+    return type == quant_type::blockwise_8bit ? "blockwise_8bit" : type == quant_type::fp4 ? "fp4" : "nf4";
+}
+
+// 256 evenly spaced values in [-1, 1], enough to check the layout of blockwise_8bit
+std::vector<float> linear_code()
+{
+    std::vector<float> code(256);
+    for (int i = 0; i < 256; i++)
+        code[i] = -1.0f + 2.0f * i / 255.0f;
+    return code;
+}
+
+std::vector<float> random_values(int64_t n, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> normal;
+    std::vector<float> values(n);
+    for (float &value : values)
+        value = normal(rng);
+    return values;
+}
+
+// a quantized tensor of shape (N, K) with its buffers
+struct quantized_weight {
+    std::vector<uint8_t> data;
+    std::vector<float> absmax;
+    std::vector<uint8_t> nested_values;
+    std::vector<float> nested_absmax;
+    quantized_tensor tensor;
+
+    quantized_weight(quant_type type, bool nested, int64_t N, int64_t K, int64_t blocksize, float *code)
+    {
+        tensor = {};
+        tensor.type = type;
+        tensor.ndim = 2;
+        tensor.shape[0] = N;
+        tensor.shape[1] = K;
+        tensor.blocksize = blocksize;
+        tensor.code = code;
+        tensor.nested = nested;
+        tensor.nested_code = code;
+        tensor.nested_blocksize = 256;
+        data.resize(quantized_bytes(tensor));
+        absmax.resize(num_blocks(tensor));
+        nested_values.resize(num_blocks(tensor));
+        nested_absmax.resize(nested_num_blocks(tensor));
+        tensor.data = data.data();
+        tensor.absmax = nested ? (void *)nested_values.data() : (void *)absmax.data();
+        tensor.nested_absmax = nested_absmax.data();
+    }
+};
+
+void test_round_trip(quant_type type, bool nested)
+{
+    const int64_t N = 70, K = 256, blocksize = 64;
+    std::vector<float> code = linear_code();
+    std::vector<float> W = random_values(N * K, 1);
+    const int64_t shape[2] = {N, K};
+    quantized_weight qW(type, nested, N, K, blocksize, code.data());
+    CHECK(quantize(make_tensor_view(W.data(), scalar_type::float32, 2, shape), qW.tensor) == status::ok);
+    CHECK(qW.tensor.dtype == scalar_type::float32 && qW.tensor.shape[0] == N && qW.tensor.shape[1] == K);
+
+    std::vector<float> W2(N * K);
+    CHECK(dequantize(qW.tensor, make_tensor_view(W2.data(), scalar_type::float32, 2, shape)) == status::ok);
+    // every value is within the largest gap of the code, relative to the absmax of its block
+    const float max_error = type == quant_type::blockwise_8bit ? 0.01f : 0.2f;
+    int errors = 0;
+    for (int64_t block = 0; block < N * K / blocksize; block++) {
+        float block_absmax = 0.0f;
+        for (int64_t i = block * blocksize; i < (block + 1) * blocksize; i++)
+            block_absmax = fmaxf(block_absmax, fabsf(W[i]));
+        for (int64_t i = block * blocksize; i < (block + 1) * blocksize; i++)
+            errors += fabsf(W2[i] - W[i]) > max_error * block_absmax * (nested ? 1.05f : 1.0f);
+    }
+    if (errors > 0)
+        fprintf(stderr, "%s nested=%d: %d values off after a round trip\n", quant_type_name(type), (int)nested, errors);
+    CHECK(errors == 0);
+
+    // the GEMV matches the product with the dequantized weight
+    const int64_t M = 3;
+    std::vector<float> x = random_values(M * K, 2);
+    std::vector<float> out(M * N);
+    const int64_t x_shape[2] = {M, K};
+    const int64_t out_shape[2] = {M, N};
+    CHECK(gemv(make_tensor_view(x.data(), scalar_type::float32, 2, x_shape), qW.tensor,
+               make_tensor_view(out.data(), scalar_type::float32, 2, out_shape)) == status::ok);
+    double max_diff = 0.0;
+    for (int64_t m = 0; m < M; m++) {
+        for (int64_t n = 0; n < N; n++) {
+            double expected = 0.0;
+            for (int64_t k = 0; k < K; k++)
+                expected += (double)x[m * K + k] * W2[n * K + k];
+            max_diff = fmax(max_diff, fabs(expected - out[m * N + n]));
+        }
+    }
+    CHECK(max_diff < 1e-3);
+}
+
+void test_optimizer_update()
+{
+    // the first Adam step moves every value by lr against the sign of its gradient
+    const int64_t shape[2] = {4, 4};
+    std::vector<float> p(16, 1.0f), g(16, 0.5f), state1(16, 0.0f), state2(16, 0.0f);
+    optimizer_config config;
+    config.lr = 0.1f;
+    CHECK(optimizer_update_32bit(optimizer_type::adam, make_tensor_view(g.data(), scalar_type::float32, 2, shape),
+                                 make_tensor_view(p.data(), scalar_type::float32, 2, shape), state1.data(),
+                                 state2.data(), 1, config) == status::ok);
+    for (float value : p)
+        CHECK(fabsf(value - 0.9f) < 1e-5f);
+}
+
+void test_errors()
+{
+    const int64_t shape[2] = {4, 64};
+    std::vector<float> code = linear_code();
+    std::vector<float> values(4 * 64, 1.0f);
+    const tensor_view input = make_tensor_view(values.data(), scalar_type::float32, 2, shape);
+
+    quantized_weight qW(quant_type::nf4, false, 4, 64, 64, code.data());
+    qW.tensor.blocksize = 0;
+    CHECK_ERROR(quantize(input, qW.tensor), status::invalid_argument, "qt has an invalid blocksize of 0");
+    qW.tensor.blocksize = 63;
+    CHECK_ERROR(quantize(input, qW.tensor), status::invalid_argument, "qt has an invalid blocksize of 63");
+    qW.tensor.blocksize = 64;
+    qW.tensor.absmax = NULL;
+    CHECK_ERROR(quantize(input, qW.tensor), status::invalid_argument, "qt has no data or absmax");
+    qW.tensor.absmax = qW.absmax.data();
+
+    tensor_view transposed = input;
+    transposed.shape[0] = 64;
+    transposed.shape[1] = 4;
+    transposed.strides[0] = 1;
+    transposed.strides[1] = 64;
+    CHECK_ERROR(quantize(transposed, qW.tensor), status::not_contiguous, "input is not contiguous");
+    tensor_view bytes = input;
+    bytes.dtype = scalar_type::uint8;
+    CHECK_ERROR(quantize(bytes, qW.tensor), status::invalid_dtype, "input must be float32");
+
+    // a valid call does not fail, and leaves the message of the last failure
+    CHECK(quantize(input, qW.tensor) == status::ok);
+    CHECK(strstr(last_error_message(), "input must be float32") != NULL);
+
+    std::vector<float> small(100);
+    const int64_t small_shape[1] = {100};
+    CHECK_ERROR(dequantize(qW.tensor, make_tensor_view(small.data(), scalar_type::float32, 1, small_shape)),
+                status::invalid_shape, "out has 100 values instead of 256");
+
+    std::vector<float> x(2 * 64), out(2 * 4);
+    const int64_t x_shape[2] = {2, 64};
+    const int64_t out_shape[2] = {2, 4};
+    const int64_t wrong_shape[2] = {2, 5};
+    CHECK_ERROR(gemv(make_tensor_view(x.data(), scalar_type::float32, 2, x_shape), qW.tensor,
+                     make_tensor_view(out.data(), scalar_type::float32, 2, wrong_shape)),
+                status::invalid_shape, "x must have shape (..., 64) and out (..., 4)");
+    CHECK_ERROR(gemv(make_tensor_view(x.data(), scalar_type::float32, 2, x_shape), qW.tensor,
+                     make_tensor_view(out.data(), scalar_type::bfloat16, 2, out_shape)),
+                status::invalid_dtype, "out must have the dtype of x");
+
+    const int64_t p_shape[1] = {16};
+    std::vector<float> p(16), g(16), state1(16);
+    const tensor_view grad = make_tensor_view(g.data(), scalar_type::float32, 1, p_shape);
+    const tensor_view param = make_tensor_view(p.data(), scalar_type::float32, 1, p_shape);
+    optimizer_config config;
+    CHECK_ERROR(optimizer_update_32bit(optimizer_type::adam, grad, param, state1.data(), NULL, 1, config),
+                status::invalid_argument, "the optimizer states are missing");
+    CHECK_ERROR(optimizer_update_32bit(optimizer_type::momentum, grad, param, state1.data(), NULL, 0, config),
+                status::invalid_argument, "step counts from 1, got 0");
+    CHECK_ERROR(optimizer_update_32bit((optimizer_type)42, grad, param, state1.data(), NULL, 1, config),
+                status::invalid_argument, "unknown optimizer 42");
+}
+
+} // namespace
+
+int main()
+{
+    CHECK(api_version_major() == BNB_API_VERSION_MAJOR && api_version_minor() >= BNB_API_VERSION_MINOR);
+    CHECK(strcmp(status_name(status::not_contiguous), "not_contiguous") == 0);
+    CHECK(strcmp(last_error_message(), "") == 0);
+
+    const quant_type types[] = {quant_type::blockwise_8bit, quant_type::fp4, quant_type::nf4};
+    for (quant_type type : types) {
+        test_round_trip(type, false);
+        test_round_trip(type, true);
+    }
+    test_optimizer_update();
+    test_errors();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -1,7 +1,11 @@
 from itertools import product
 import math
+import multiprocessing
+import os
 import random
+import threading
 import time
+import weakref
 
 import einops
 import numpy as np
@@ -1778,6 +1782,703 @@ def test_blockwise_cpu_large():
             # print(sum(reldiffs)/len(reldiffs))
 
 
+def test_cpu_isa():
+    assert F.get_cpu_isa() in ["scalar", "sse42", "avx2", "avx512"]
+
+    # the SIMD kernels have to agree with the scalar reference for odd sizes as well
+    A1 = torch.randn(1000, 77, device="cpu")
+    C, S = F.quantize_blockwise(A1, blocksize=333)
+    absmax = torch.stack([A1.flatten()[i : i + 333].abs().max() for i in range(0, A1.numel(), 333)])
+    torch.testing.assert_close(S.absmax, absmax)
+    A2 = F.dequantize_blockwise(C, S)
+    assert (A1 - A2).abs().mean() < 0.011
+
+
+def test_cpu_autotune(tmp_path, monkeypatch):
+    cache = tmp_path / "cpu_autotune.txt"
+    monkeypatch.setenv("BNB_CPU_AUTOTUNE_CACHE", str(cache))
+    tuned = F.autotune_cpu(force=True)
+    assert tuned == F.get_cpu_tuning()
+    (line,) = [line for line in cache.read_text().splitlines() if not line.startswith("#")]
+    key, values = line.split("\t")
+    assert values.split() == [tuned["isa"]] + [str(tuned[k]) for k in ("task_values", "gemm_rows", "gemm_panels")]
+
+    # an existing entry is loaded instead of tuning again, and any valid one gives the same results
+    A = torch.randn(300, 256, device="cpu")
+    W = torch.randn(70, 256, device="cpu")
+    C_ref, S_ref = F.quantize_blockwise(A, blocksize=64)
+    packed = F.prepack_4bit(*F.quantize_4bit(W, blocksize=64, quant_type="nf4"))
+    out_ref = F.gemm_4bit_prepacked(A, packed)
+    try:
+        cache.write_text(f"{key}\t{tuned['isa']} 4096 32 1\n")
+        assert F.autotune_cpu() == dict(tuned, task_values=4096, gemm_rows=32, gemm_panels=1)
+        C, S = F.quantize_blockwise(A, blocksize=64)
+        torch.testing.assert_close(C, C_ref, rtol=0, atol=0)
+        torch.testing.assert_close(F.dequantize_blockwise(C, S), F.dequantize_blockwise(C_ref, S_ref))
+        torch.testing.assert_close(F.gemm_4bit_prepacked(A, packed), out_ref)
+    finally:
+        cache.write_text(line + "\n")
+        F.autotune_cpu()
+
+
+@pytest.mark.parametrize("num_threads", [1, 3], ids=id_formatter("threads"))
+@pytest.mark.parametrize("pinned", TRUE_FALSE, ids=id_formatter("pinned"))
+@pytest.mark.parametrize("numa_local", TRUE_FALSE, ids=id_formatter("numa_local"))
+def test_cpu_thread_controls(num_threads, pinned, numa_local):
+    A1 = torch.randn(1024, 1037, device="cpu")
+    C1, S1 = F.quantize_blockwise(A1, blocksize=256)
+    try:
+        F.set_cpu_num_threads(num_threads)
+        F.set_cpu_thread_affinity(pinned)
+        F.set_cpu_numa_local(numa_local)
+        assert F.get_cpu_num_threads() == num_threads
+        assert F.get_cpu_thread_affinity() == pinned
+        assert F.get_cpu_numa_local() == numa_local
+
+        # results must not depend on how the blocks are spread over threads
+        C2, S2 = F.quantize_blockwise(A1, blocksize=256)
+        torch.testing.assert_close(C1, C2)
+        torch.testing.assert_close(S1.absmax, S2.absmax)
+        torch.testing.assert_close(F.dequantize_blockwise(C1, S1), F.dequantize_blockwise(C2, S2))
+    finally:
+        F.set_cpu_num_threads(None)
+        F.set_cpu_thread_affinity(False)
+        F.set_cpu_numa_local(False)
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, torch.float16, torch.bfloat16], ids=describe_dtype)
+def test_blockwise_cpu_batched(dtype):
+    shapes = [(1,), (7,), (64,), (4096,), (333, 77), (1024, 1024), (3, 5, 64)]
+    blocksizes = [64, 256, 4096, 128, 64, 4096, 256]
+    As = [torch.randn(shape, dtype=dtype) for shape in shapes]
+
+    results = F.quantize_blockwise_batched(As, blocksize=blocksizes)
+    for A, (C, S), blocksize in zip(As, results, blocksizes):
+        C1, S1 = F.quantize_blockwise(A.float(), blocksize=blocksize)
+        # 16-bit inputs are widened exactly, so they match the fp32 path
+        torch.testing.assert_close(C, C1)
+        torch.testing.assert_close(S.absmax, S1.absmax)
+        assert S.dtype == dtype
+
+    outs = F.dequantize_blockwise_batched([C for C, _ in results], [S for _, S in results])
+    for A, out, (C, S) in zip(As, outs, results):
+        assert out.dtype == dtype and out.shape == A.shape
+        ref = F.dequantize_blockwise(C, absmax=S.absmax, code=S.code, blocksize=S.blocksize)
+        torch.testing.assert_close(out, ref.to(dtype))
+
+    # inputs the native call cannot read are rejected before it runs
+    with pytest.raises(ValueError):
+        F.quantize_blockwise_batched(As, blocksize=blocksizes[:-1])
+    with pytest.raises(ValueError):
+        F.dequantize_blockwise_batched([C for C, _ in results], [S for _, S in results][:-1])
+    if torch.cuda.is_available():
+        with pytest.raises(ValueError):
+            F.quantize_blockwise_batched([As[0], As[1].cuda()], blocksize=64)
+
+
+@pytest.mark.parametrize("optim_name", ["adam", "momentum", "rmsprop"])
+@pytest.mark.parametrize("dtype", [torch.float32, torch.bfloat16], ids=describe_dtype)
+def test_optimizer_update_32bit_cpu(optim_name, dtype):
+    p1 = torch.randn(1037, 999)
+    p2 = p1.clone().to(dtype)
+    s1 = torch.zeros_like(p1)
+    s2 = torch.zeros_like(p1)
+    if optim_name == "adam":
+        torch_optim = torch.optim.Adam([p1], lr=1e-3, betas=(0.9, 0.999), eps=1e-8)
+    elif optim_name == "momentum":
+        torch_optim = torch.optim.SGD([p1], lr=1e-3, momentum=0.9)
+    else:
+        torch_optim = torch.optim.RMSprop([p1], lr=1e-3, alpha=0.9, eps=1e-8)
+
+    for step in range(1, 6):
+        g = torch.randn_like(p1) * 0.1
+        p1.grad = g.clone()
+        torch_optim.step()
+        F.optimizer_update_32bit(optim_name, g.to(dtype), p2, s1, 0.9, 1e-8, step, 1e-3, s2, 0.999)
+
+    atol, rtol = (1e-5, 1e-4) if dtype == torch.float32 else (1e-2, 1e-2)
+    torch.testing.assert_close(p2.float(), p1, atol=atol, rtol=rtol)
+
+
+@pytest.mark.parametrize("optim_name", ["adam", "momentum", "lamb"])
+@pytest.mark.parametrize("max_grad_norm", [0.0, 1.0], ids=id_formatter("max_grad_norm"))
+def test_optimizer_update_32bit_multi_cpu(optim_name, max_grad_norm):
+    shapes = [(1,), (7, 3), (4096, 17), (64,), (333, 77)]
+    ps1 = [torch.randn(shape) for shape in shapes]
+    ps2 = [p.clone() for p in ps1]
+    gs = [torch.randn(shape) * 0.3 for shape in shapes]
+    states1 = [[torch.zeros_like(p) for p in ps1] for _ in range(2)]
+    states2 = [[torch.zeros_like(p) for p in ps1] for _ in range(2)]
+    unorms = [[torch.zeros(1) for _ in ps1] for _ in range(2)]
+    max_unorm = 1.0 if optim_name == "lamb" else 0.0
+
+    for step in range(1, 4):
+        grad_norm = F.optimizer_update_32bit_multi(
+            optim_name,
+            gs,
+            ps1,
+            states1[0],
+            0.9,
+            1e-8,
+            step,
+            1e-2,
+            states2[0],
+            0.999,
+            max_grad_norm=max_grad_norm,
+            unorm_vecs=unorms[0],
+            max_unorm=max_unorm,
+        )
+
+        # reference: clip_grad_norm_ followed by one update per tensor
+        gs2 = [g.clone() for g in gs]
+        for p, g in zip(ps2, gs2):
+            p.grad = g
+        ref_norm = torch.nn.utils.clip_grad_norm_(ps2, max_grad_norm if max_grad_norm > 0 else float("inf"))
+        torch.testing.assert_close(torch.tensor(grad_norm), ref_norm)
+        for p, g, s1, s2, unorm in zip(ps2, gs2, states1[1], states2[1], unorms[1]):
+            F.optimizer_update_32bit(
+                optim_name, g, p, s1, 0.9, 1e-8, step, 1e-2, s2, 0.999, unorm_vec=unorm, max_unorm=max_unorm
+            )
+
+        for p1, p2 in zip(ps1, ps2):
+            torch.testing.assert_close(p1, p2, atol=1e-6, rtol=1e-5)
+        if max_unorm > 0.0:
+            torch.testing.assert_close(torch.cat(unorms[0]), torch.cat(unorms[1]), atol=1e-6, rtol=1e-4)
+
+
+@pytest.mark.parametrize("optim_name", ["lamb", "lars"])
+@pytest.mark.parametrize("state_bits", [32, 8], ids=id_formatter("state_bits"))
+def test_optimizer_lamb_lars_cpu(optim_name, state_bits):
+    beta1, beta2, eps, lr = 0.9, 0.999, 1e-8, 1e-2
+    max_unorm = 0.5 if optim_name == "lamb" else 0.02
+    two_state = optim_name == "lamb"
+    p1 = torch.randn(333, 777)
+    p2 = p1.clone()
+    m = torch.zeros_like(p1)
+    v = torch.zeros_like(p1)
+    unorm = torch.zeros(1)
+    if state_bits == 32:
+        s1 = torch.zeros_like(p1)
+        s2 = torch.zeros_like(p1) if two_state else None
+    else:
+        s1 = torch.zeros_like(p1, dtype=torch.uint8)
+        s2 = torch.zeros_like(p1, dtype=torch.uint8) if two_state else None
+        blocks = (p1.numel() + 2047) // 2048
+        absmax1 = torch.zeros(blocks)
+        absmax2 = torch.zeros(blocks) if two_state else None
+        qmap1 = F.create_dynamic_map(signed=True)
+        qmap2 = F.create_dynamic_map(signed=False) if two_state else None
+
+    for step in range(1, 6):
+        g = torch.randn_like(p1) * 0.1
+        # reference: the update is scaled to a norm of at most max_unorm * ||p||
+        if two_state:
+            m.mul_(beta1).add_(g, alpha=1 - beta1)
+            v.mul_(beta2).addcmul_(g, g, value=1 - beta2)
+            update = (m / (1 - beta1**step)) / ((v / (1 - beta2**step)).sqrt() + eps)
+            max_norm = max_unorm * p1.norm()
+        else:
+            m = g.clone() if step == 1 else m * beta1 + g
+            update = m
+            max_norm = max_unorm * p1.norm() + eps
+        p1 -= lr * min(1.0, max_norm / update.norm()) * update
+
+        if state_bits == 32:
+            F.optimizer_update_32bit(
+                optim_name, g, p2, s1, beta1, eps, step, lr, s2, beta2, unorm_vec=unorm, max_unorm=max_unorm
+            )
+            torch.testing.assert_close(unorm.sqrt(), update.norm().reshape(1), atol=1e-6, rtol=1e-4)
+        else:
+            F.optimizer_update_8bit_blockwise(
+                optim_name,
+                g,
+                p2,
+                s1,
+                s2,
+                beta1,
+                beta2,
+                eps,
+                step,
+                lr,
+                qmap1,
+                qmap2,
+                absmax1,
+                absmax2,
+                unorm_vec=unorm,
+                max_unorm=max_unorm,
+            )
+
+    atol, rtol = (1e-5, 1e-4) if state_bits == 32 else (2e-3, 1e-2)
+    torch.testing.assert_close(p2, p1, atol=atol, rtol=rtol)
+
+
+def test_optimizer_update_32bit_cpu_stochastic_rounding():
+    # updates of 1e-4 per step are below the precision of bf16 around 1.0
+    n = 1 << 20
+    g = torch.full((n,), 1e-2, dtype=torch.bfloat16)
+    lr, steps = 1e-2, 20
+    ref = 1.0 - steps * lr * g[0].item()
+
+    def run(rounding_seed, num_threads=None, multi=False):
+        p = torch.ones(n, dtype=torch.bfloat16)
+        s1 = torch.zeros(n)
+        F.set_cpu_num_threads(num_threads)
+        try:
+            for step in range(1, steps + 1):
+                if multi:
+                    F.optimizer_update_32bit_multi(
+                        "momentum", [g], [p], [s1], 0.0, 1e-8, step, lr, rounding_seeds=[rounding_seed]
+                    )
+                else:
+                    F.optimizer_update_32bit("momentum", g, p, s1, 0.0, 1e-8, step, lr, rounding_seed=rounding_seed)
+        finally:
+            F.set_cpu_num_threads(None)
+        return p
+
+    # rounding to nearest loses every update, stochastic rounding keeps them in expectation
+    assert (run(None) == 1.0).all()
+    p = run(1234)
+    assert abs(p.float().mean().item() - ref) < 1e-4
+    # the random bits only depend on the seed, the step and the position of each value
+    torch.testing.assert_close(run(1234, num_threads=1), p, rtol=0, atol=0)
+    torch.testing.assert_close(run(1234, multi=True), p, rtol=0, atol=0)
+    assert not torch.equal(run(4321), p)
+
+
+def test_cpu_jobs():
+    As = [torch.randn(1024, 1024), torch.randn(333, 77, dtype=torch.float16)]
+    job = F.submit_quantize_blockwise_batched(As, blocksize=256)
+    assert job.wait(timeout=60)
+    assert job.done()
+    results = job.result()
+    for A, (C, S) in zip(As, results):
+        C1, S1 = F.quantize_blockwise(A.float(), blocksize=256)
+        torch.testing.assert_close(C, C1)
+        torch.testing.assert_close(S.absmax, S1.absmax)
+
+    # callbacks run on the native thread that finished the job
+    finished = threading.Event()
+    job = F.submit_dequantize_blockwise_batched([C for C, _ in results], [S for _, S in results])
+    job.add_done_callback(lambda j: finished.set())
+    assert finished.wait(timeout=60)
+    for out, (C, S) in zip(job.result(), results):
+        torch.testing.assert_close(out, F.dequantize_blockwise(C, S))
+
+    # a callback registered after completion runs right away on the calling thread
+    job = F.submit_quantize_blockwise_batched(As[:1])
+    job.wait()
+    called = []
+    job.add_done_callback(called.append)
+    assert called == [job]
+
+    # a pending callback does not keep the job alive, and dropping the handle waits for it
+    finished = []
+    job = F.submit_quantize_blockwise_batched(As)
+    job.add_done_callback(lambda j: (time.sleep(0.05), j.result(), finished.append(True)))
+    job_ref = weakref.ref(job)
+    del job
+    assert job_ref() is None and finished == [True]
+
+    p1 = torch.randn(4096, 257)
+    p2 = p1.clone()
+    g = torch.randn_like(p1)
+    states1 = [torch.zeros_like(p1) for _ in range(2)]
+    states2 = [torch.zeros_like(p1) for _ in range(2)]
+    F.optimizer_update_32bit("adam", g, p1, states1[0], 0.9, 1e-8, 1, 1e-3, states2[0], 0.999, weight_decay=0.01)
+    job = F.submit_optimizer_update_32bit(
+        "adam", g, p2, states1[1], 0.9, 1e-8, 1, 1e-3, states2[1], 0.999, weight_decay=0.01
+    )
+    assert job.result() is None
+    torch.testing.assert_close(p1, p2, rtol=0, atol=0)
+    torch.testing.assert_close(states2[0], states2[1], rtol=0, atol=0)
+
+
+@pytest.mark.parametrize("dim", [37, 600], ids=id_formatter("dim"))
+def test_histogram_scatter_add_2d_cpu(dim):
+    # 600x600 bins are too many to privatize and take the sorting path
+    n = 100000
+    histogram = torch.rand(dim, dim)
+    index1 = torch.randint(0, dim, (n,), dtype=torch.int32)
+    index2 = torch.randint(0, dim, (n,), dtype=torch.int32)
+    source = torch.randn(n)
+
+    expected = histogram.clone()
+    expected.view(-1).index_put_((index1.long() * dim + index2.long(),), source, accumulate=True)
+    F.histogram_scatter_add_2d(histogram, index1, index2, source)
+    torch.testing.assert_close(histogram, expected)
+
+
+def test_cpu_deterministic_reductions():
+    dim, n = 37, 1000000
+    index1 = torch.randint(0, dim, (n,), dtype=torch.int32)
+    index2 = torch.randint(0, dim, (n,), dtype=torch.int32)
+    source = torch.randn(n)
+    results = []
+    try:
+        F.set_cpu_deterministic(True)
+        assert F.get_cpu_deterministic()
+        for num_threads in [1, 3, 8]:
+            F.set_cpu_num_threads(num_threads)
+            histogram = torch.zeros(dim, dim)
+            F.histogram_scatter_add_2d(histogram, index1, index2, source)
+            results.append(histogram)
+    finally:
+        F.set_cpu_deterministic(False)
+        F.set_cpu_num_threads(None)
+    # bitwise, not just close
+    assert all(torch.equal(results[0], histogram) for histogram in results)
+
+
+def _all_reduce_worker(name, rank, world_size, n, results):
+    torch.manual_seed(rank)
+    A = torch.randn(n)
+    reducer = F.CpuAllReduce(name, rank, world_size, chunk_size=8192, blocksize=256, timeout=30.0)
+    results.put((rank, A, reducer.all_reduce(A.clone()), reducer.all_reduce(A.clone(), average=True)))
+
+
+@pytest.mark.skipif(not hasattr(os, "fork"), reason="needs fork and POSIX shared memory")
+@pytest.mark.parametrize("world_size", [1, 3, 4])
+def test_cpu_quantized_all_reduce(world_size):
+    # several chunks and a last one that leaves some ranks without a shard
+    n = 3 * 8192 + 1000
+    context = multiprocessing.get_context("fork")
+    results = context.Queue()
+    name = f"/bnb-test-{os.getpid()}-{world_size}"
+    workers = [
+        context.Process(target=_all_reduce_worker, args=(name, rank, world_size, n, results))
+        for rank in range(world_size)
+    ]
+    for worker in workers:
+        worker.start()
+    outputs = sorted((results.get(timeout=60) for _ in workers), key=lambda output: output[0])
+    for worker in workers:
+        worker.join()
+        assert worker.exitcode == 0
+
+    expected = sum(output[1] for output in outputs)
+    atol = 0.05 * expected.abs().max().item()
+    for _, _, total, mean in outputs:
+        # every rank gets the same values, up to the error of two 8-bit quantizations
+        assert torch.equal(total, outputs[0][2])
+        assert torch.equal(mean, outputs[0][3])
+        torch.testing.assert_close(total, expected, atol=atol, rtol=0)
+        torch.testing.assert_close(mean, expected / world_size, atol=atol / world_size, rtol=0)
+
+
+@pytest.mark.parametrize("quant_type", ["8bit", "nf4"])
+@pytest.mark.parametrize("residual_dtype", [torch.float32, torch.bfloat16], ids=describe_dtype)
+def test_error_feedback_compressor_cpu(quant_type, residual_dtype):
+    compressor = F.ErrorFeedbackCompressor(
+        (100, 37), quant_type=quant_type, blocksize=64, residual_dtype=residual_dtype
+    )
+    grads = [torch.randn(100, 37) for _ in range(10)]
+    decoded = []
+    for grad in grads:
+        residual = compressor.residual.float()
+        payload, state = compressor.compress(grad)
+        if quant_type == "8bit":
+            decoded.append(F.dequantize_blockwise(payload, state))
+            expected, _ = F.quantize_blockwise(grad + residual, code=state.code, blocksize=64)
+        else:
+            decoded.append(F.dequantize_4bit(payload, state))
+            expected, _ = F.quantize_4bit(grad + residual, blocksize=64, quant_type=quant_type)
+        assert torch.equal(payload, expected)
+        # the residual holds what this step lost
+        torch.testing.assert_close(compressor.residual.float(), grad + residual - decoded[-1], atol=0.02, rtol=0.01)
+
+    # the errors do not add up over the steps: all but the last residual were sent
+    atol = 1e-4 if residual_dtype == torch.float32 else 0.05
+    torch.testing.assert_close(sum(decoded) - sum(grads), -compressor.residual.float(), atol=atol, rtol=0)
+
+
+def test_cpu_weight_cache():
+    weights = [torch.randn(256, 512, dtype=torch.bfloat16) for _ in range(3)]
+    quantized = [F.quantize_4bit(W, blocksize=64, quant_type="nf4") for W in weights]
+    expected = [F.dequantize_4bit(qW, state) for qW, state in quantized]
+    weight_bytes = 256 * 512 * 2
+    try:
+        F.set_cpu_weight_cache(2 * weight_bytes, admit_after=2)
+        F.clear_cpu_weight_cache()
+        for _ in range(3):
+            for (qW, state), W in zip(quantized[:2], expected):
+                assert torch.equal(F.dequantize_4bit(qW, state, cache=True), W)
+        stats = F.get_cpu_weight_cache_stats()
+        # admitted on the second lookup, hit on the third
+        assert stats["entries"] == 2 and stats["used_bytes"] == 2 * weight_bytes and stats["hits"] == 2
+
+        # a third hot weight evicts the least recently used one
+        for _ in range(2):
+            assert torch.equal(F.dequantize_4bit(*quantized[2], cache=True), expected[2])
+        assert F.get_cpu_weight_cache_stats()["entries"] == 2
+
+        # in-place changes of the weight are not served from the cache
+        qW, state = quantized[2]
+        qW.copy_(quantized[0][0])
+        state.absmax.copy_(quantized[0][1].absmax)
+        assert torch.equal(F.dequantize_4bit(qW, state, cache=True), expected[0])
+
+        # nor are in-place changes of only the absmax values, plain or nested
+        for compress_statistics in TRUE_FALSE:
+            qW, state = F.quantize_4bit(
+                weights[0], blocksize=64, quant_type="nf4", compress_statistics=compress_statistics
+            )
+            for _ in range(3):
+                F.dequantize_4bit(qW, state, cache=True)
+            (state.state2.absmax if compress_statistics else state.absmax).mul_(2)
+            misses = F.get_cpu_weight_cache_stats()["misses"]
+            assert torch.equal(F.dequantize_4bit(qW, state, cache=True), F.dequantize_4bit(qW, state))
+            assert F.get_cpu_weight_cache_stats()["misses"] == misses + 1
+
+        # entries of freed weights are dropped
+        del quantized, qW, state
+        assert F.get_cpu_weight_cache_stats()["entries"] == 0
+    finally:
+        F.set_cpu_weight_cache(0)
+
+
+@pytest.mark.parametrize("direct", TRUE_FALSE, ids=id_formatter("direct"))
+def test_quantized_checkpoint_cpu(tmp_path, direct):
+    path = tmp_path / "model.bnb"
+    W = torch.randn(1000, 2048, dtype=torch.bfloat16)
+    bias = torch.randn(1000, dtype=torch.bfloat16)
+    with F.QuantizedCheckpointWriter(path, direct=direct) as writer:
+        state = writer.add_quantized_4bit("weight", W, blocksize=64, quant_type="nf4")
+        writer.add_tensor("bias", bias)
+    assert not (tmp_path / "model.bnb.tmp").exists()
+
+    tensors = F.load_quantized_checkpoint(path)
+    qW, expected_state = F.quantize_4bit(W, blocksize=64, quant_type="nf4")
+    assert torch.equal(tensors["weight"], qW)
+    assert torch.equal(tensors["bias"], bias)
+    quant_state = {k[len("weight.") :]: v for k, v in tensors.items() if k.startswith("weight.")}
+    loaded_state = F.QuantState.from_dict(quant_state, device=torch.device("cpu"))
+    assert loaded_state == expected_state == state
+    assert torch.equal(F.dequantize_4bit(tensors["weight"], loaded_state), F.dequantize_4bit(qW, expected_state))
+
+    # a failed save leaves neither the file nor a partial one behind
+    with pytest.raises(KeyError), F.QuantizedCheckpointWriter(tmp_path / "failed.bnb") as writer:
+        writer.add_tensor("bias", bias)
+        raise KeyError("bias")
+    assert sorted(p.name for p in tmp_path.iterdir()) == ["model.bnb"]
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, torch.float16, torch.bfloat16], ids=describe_dtype)
+@pytest.mark.parametrize("quant_type", ["fp4", "nf4"])
+@pytest.mark.parametrize("double_quant", TRUE_FALSE, ids=id_formatter("double_quant"))
+def test_gemm_4bit_cpu(dtype, quant_type, double_quant):
+    # odd sizes leave a partial panel and a remainder of rows in the micro-kernel
+    W = torch.randn(333, 1024, dtype=dtype)
+    qW, state = F.quantize_4bit(W, blocksize=64, quant_type=quant_type, compress_statistics=double_quant)
+    W2 = F.dequantize_4bit(qW, state)
+    assert W2.dtype == dtype
+    code = F.get_4bit_type(quant_type, device="cpu")
+    absmax = F.dequantize_blockwise(state.absmax, state.state2) + state.offset if double_quant else state.absmax
+    assert ((W2.float() - W.float()).abs().view(-1, 64) <= absmax.view(-1, 1) * 0.2).all()
+    if dtype == torch.float32:
+        # every value is an entry of the code scaled by the absmax of its block
+        scaled = W2.view(-1, 64) / absmax.view(-1, 1)
+        assert torch.isclose(scaled.unsqueeze(-1), code.view(1, 1, -1), atol=1e-6).any(-1).all()
+    if torch.cuda.is_available():
+        qW_cuda, _ = F.quantize_4bit(W.cuda(), blocksize=64, quant_type=quant_type)
+        torch.testing.assert_close(qW, qW_cuda.cpu(), rtol=0, atol=0)
+
+    packed = F.prepack_4bit(qW, state)
+    for rows in [1, 7, 130]:
+        A = torch.randn(rows, 1024, dtype=dtype)
+        out = F.gemm_4bit_prepacked(A, packed)
+        assert out.shape == (rows, 333) and out.dtype == dtype
+        expected = A.float() @ W2.float().t()
+        torch.testing.assert_close(out.float(), expected, atol=1e-3 if dtype == torch.float32 else 0.5, rtol=1e-2)
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, torch.bfloat16], ids=describe_dtype)
+@pytest.mark.parametrize("double_quant", TRUE_FALSE, ids=id_formatter("double_quant"))
+def test_gemm_4bit_transposed_cpu(dtype, double_quant):
+    # 333 input features: a partial panel, and blocks that straddle the rows of W
+    W = torch.randn(300, 333, dtype=dtype)
+    qW, state = F.quantize_4bit(W, blocksize=64, quant_type="nf4", compress_statistics=double_quant)
+    W2 = F.dequantize_4bit(qW, state)
+    G = torch.randn(2, 5, 300, dtype=dtype)
+    out = F.gemm_4bit_transposed(G, qW, state)
+    assert out.shape == (2, 5, 333) and out.dtype == dtype
+    expected = G.float() @ W2.float()
+    torch.testing.assert_close(out.float(), expected, atol=1e-3 if dtype == torch.float32 else 0.5, rtol=1e-2)
+
+    # the input gradient of a 4-bit layer takes the same path
+    x = torch.randn(5, 333, dtype=dtype, requires_grad=True)
+    bnb.matmul_4bit(x, qW.t(), quant_state=state).backward(G[0])
+    torch.testing.assert_close(x.grad.float(), expected[0], atol=1e-3 if dtype == torch.float32 else 0.5, rtol=1e-2)
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, torch.bfloat16], ids=describe_dtype)
+def test_gemv_4bit_lora_cpu(dtype):
+    W = torch.randn(300, 256, dtype=dtype)
+    qW, state = F.quantize_4bit(W, blocksize=64, quant_type="nf4", compress_statistics=True)
+    W2 = F.dequantize_4bit(qW, state).float()
+    # the same token in every row, so that the rows only differ by their adapter
+    x = torch.randn(1, 256, dtype=dtype).expand(6, 256).contiguous()
+    lora_A = torch.randn(3, 8, 256, dtype=dtype) * 0.1
+    lora_B = torch.randn(3, 300, 8, dtype=dtype) * 0.1
+    scaling = torch.tensor([0.5, 1.0, 2.0])
+    adapter_ids = torch.tensor([2, 0, -1, 2, 1, 2])
+    out = F.gemv_4bit_lora(x, qW, state, lora_A, lora_B, scaling, adapter_ids)
+    assert out.shape == (6, 300) and out.dtype == dtype
+
+    expected = x.float() @ W2.t()
+    for i, adapter in enumerate(adapter_ids.tolist()):
+        if adapter >= 0:
+            h = x[i].float() @ lora_A[adapter].float().t()
+            expected[i] += scaling[adapter] * (h @ lora_B[adapter].float().t())
+    torch.testing.assert_close(out.float(), expected, atol=1e-3 if dtype == torch.float32 else 0.5, rtol=1e-2)
+
+    # a single adapter for all rows
+    out = F.gemv_4bit_lora(x[:1], qW, state, lora_A[1], lora_B[1], scaling=1.0)
+    torch.testing.assert_close(out.float(), expected[4:5], atol=1e-3 if dtype == torch.float32 else 0.5, rtol=1e-2)
+
+    with pytest.raises(ValueError):
+        F.gemv_4bit_lora(x, qW, state, lora_A, lora_B, scaling, adapter_ids=torch.tensor([0, 1, 2, 3, 0, 0]))
+
+
+@pytest.mark.parametrize("source", ["dynamic", "fp8_e4m3", "fp4", "nf4"])
+@pytest.mark.parametrize("target", ["dynamic", "fp8_e5m2", "fp4", "nf4"])
+def test_requantize_cpu(source, target):
+    # an odd number of values, and blocks of the source that hold several of the target
+    A = torch.randn(333, 97)
+    if source in ("fp4", "nf4"):
+        qA, state = F.quantize_4bit(A, blocksize=128, quant_type=source, compress_statistics=True)
+        A2 = F.dequantize_4bit(qA, state)
+    elif source == "dynamic":
+        qA, state = F.quantize_blockwise(A, blocksize=4096)
+        A2 = F.dequantize_blockwise(qA, state)
+    else:
+        qA, state = F.quantize_fp8_blockwise(A, exponent_bits=4, blocksize=256)
+        A2 = F.dequantize_blockwise(qA, state)
+
+    # the same as dequantizing and quantizing again, with nested absmax values for 4-bit targets
+    out, out_state = F.requantize(qA, state, quant_type=target, blocksize=64, compress_statistics=target in ("fp4", "nf4"))
+    if target in ("fp4", "nf4"):
+        expected, expected_state = F.quantize_4bit(A2, blocksize=64, quant_type=target, compress_statistics=True)
+        torch.testing.assert_close(F.dequantize_4bit(out, out_state), F.dequantize_4bit(expected, expected_state))
+    elif target == "dynamic":
+        expected, expected_state = F.quantize_blockwise(A2, blocksize=64)
+        torch.testing.assert_close(out_state.absmax, expected_state.absmax)
+    else:
+        expected, expected_state = F.quantize_fp8_blockwise(A2, exponent_bits=5, blocksize=64)
+        torch.testing.assert_close(out_state.absmax, expected_state.absmax)
+    torch.testing.assert_close(out, expected, rtol=0, atol=0)
+
+
+@pytest.mark.parametrize("quant_type", ["8bit", "fp4", "nf4"])
+@pytest.mark.parametrize("mode", ["sum", "mean"])
+def test_embedding_bag_quantized_cpu(quant_type, mode):
+    table = torch.randn(1000, 192)
+    if quant_type == "8bit":
+        qtable, state = F.quantize_blockwise(table, blocksize=64)
+        dequantized = F.dequantize_blockwise(qtable, state)
+    else:
+        qtable, state = F.quantize_4bit(table, blocksize=64, quant_type=quant_type)
+        dequantized = F.dequantize_4bit(qtable, state)
+
+    indices = torch.randint(0, 1000, (300,))
+    indices[:5] = 3
+    offsets = torch.sort(torch.randint(0, 300, (40,))).values
+    offsets[0] = 0
+    weights = torch.rand(300) if mode == "sum" else None
+    out = F.embedding_bag_quantized(indices, qtable, state, offsets, weights, mode=mode, padding_idx=3)
+    expected = torch.nn.functional.embedding_bag(
+        indices, dequantized, offsets, mode=mode, per_sample_weights=weights, padding_idx=3
+    )
+    torch.testing.assert_close(out, expected)
+
+    # 2D indices are bags of equal size
+    indices = torch.randint(0, 1000, (8, 5))
+    out = F.embedding_bag_quantized(indices, qtable, state, mode=mode)
+    torch.testing.assert_close(out, torch.nn.functional.embedding_bag(indices, dequantized, mode=mode))
+
+
+@pytest.mark.parametrize("quant_type", ["8bit", "fp4", "nf4"])
+@pytest.mark.parametrize("dtype", [torch.float32, torch.bfloat16], ids=describe_dtype)
+def test_quantized_kv_cache_cpu(quant_type, dtype):
+    num_heads, capacity, head_dim = 2, 16, 64
+    cache = F.QuantizedKVCache(num_heads, capacity, head_dim, quant_type=quant_type, blocksize=32)
+    rows = torch.randn(num_heads, 20, head_dim, dtype=dtype)
+    cache.append(rows[:, :9])
+    cache.append(rows[:, 9:])
+    assert cache.length == 20 and cache.window == capacity
+
+    # the ring buffer holds the last positions, quantized like quantize_blockwise/quantize_4bit
+    last = rows[:, -capacity:].float().reshape(-1)
+    if quant_type == "8bit":
+        q, state = F.quantize_blockwise(last, blocksize=32)
+        keys = F.dequantize_blockwise(q, state)
+    else:
+        q, state = F.quantize_4bit(last, blocksize=32, quant_type=quant_type)
+        keys = F.dequantize_4bit(q, state)
+    keys = keys.reshape(num_heads, capacity, head_dim)
+
+    # 4 query heads share the 2 kv heads
+    query = torch.randn(4, 3, head_dim, dtype=dtype)
+    scores = cache.scores(query)
+    expected = query.float() @ keys.repeat_interleave(2, dim=0).transpose(1, 2) * head_dim**-0.5
+    torch.testing.assert_close(scores, expected, atol=1e-4, rtol=1e-4)
+
+    probs = torch.softmax(scores, dim=-1)
+    probs[:, :, 0] = 0
+    out = cache.attend(probs)
+    torch.testing.assert_close(out, probs @ keys.repeat_interleave(2, dim=0), atol=1e-5, rtol=1e-4)
+
+
+@pytest.mark.parametrize("exponent_bits", [2, 4, 5])
+@pytest.mark.parametrize("dtype", [torch.float32, torch.bfloat16], ids=describe_dtype)
+def test_quantize_fp8_blockwise_cpu(exponent_bits, dtype):
+    code = F.create_fp8_map(True, exponent_bits, 7 - exponent_bits)
+    A = torch.randn(1000, 257, dtype=dtype) * torch.logspace(-6, 0, 257)
+    A[0, :10] = 0
+    # values that are in the code and halfway between two values of it
+    A[1, :255] = (code[:-1] + code[1:]) / 2 * A.abs().max()
+    A[2, :256] = code * A.abs().max()
+
+    out, state = F.quantize_fp8_blockwise(A, exponent_bits, blocksize=256)
+    expected, expected_state = F.quantize_blockwise(A.float(), code=code.clone(), blocksize=256)
+    assert torch.equal(out, expected)
+    torch.testing.assert_close(state.absmax, expected_state.absmax)
+    assert state.dtype == dtype and torch.equal(state.code, code)
+
+
+@pytest.mark.parametrize("nested", TRUE_FALSE, ids=id_formatter("nested"))
+def test_quantization_error_stats_cpu(nested):
+    A = torch.randn(1000, 333)
+    A[3, 7] = 50
+    configs = [
+        {"quant_type": "8bit", "blocksize": 256, "nested": nested},
+        {"quant_type": "fp4", "blocksize": 64, "nested": nested},
+        {"quant_type": "nf4", "blocksize": 128, "nested": nested},
+    ]
+    results = F.quantization_error_stats(A, configs, return_quantized=True)
+
+    for config, result in zip(configs, results):
+        if config["quant_type"] == "8bit":
+            expected, _ = F.quantize_blockwise(A, blocksize=config["blocksize"])
+            out, state = result["quantized"]
+            dequantized = F.dequantize_blockwise(out, state)
+        else:
+            expected, _ = F.quantize_4bit(A, blocksize=config["blocksize"], quant_type=config["quant_type"])
+            out, state = result["quantized"]
+            dequantized = F.dequantize_4bit(out, state)
+        assert torch.equal(out, expected)
+        assert state.nested == nested
+
+        error = (A - dequantized).abs()
+        torch.testing.assert_close(result["mse"], error.square().mean().item(), rtol=1e-4, atol=0)
+        torch.testing.assert_close(result["max_abs_error"], error.max().item(), rtol=1e-4, atol=0)
+        sqnr = 10 * math.log10(A.square().sum().item() / error.square().sum().item())
+        torch.testing.assert_close(result["sqnr"], sqnr, rtol=1e-4, atol=0)
+        # without nesting, at least the largest value of each block is at the end of the code
+        assert result["saturated"].shape == ((A.numel() + config["blocksize"] - 1) // config["blocksize"],)
+        if not nested:
+            assert result["saturated"].min() >= 1
+
+
 def test_fp8_quant():
     for e_bits in range(1, 7):
         p_bits = 7 - e_bits
@@ -221,3 +221,63 @@ def test_params4bit_real_serialization():
     # there was a bug where deepcopy would modify the original object
     assert dict_keys_before == dict_keys_after
     assert dict_keys_before == dict_keys_deserialized
+
+
+@pytest.mark.parametrize("compress_statistics", TRUE_FALSE)
+@pytest.mark.parametrize("quant_type", ["nf4", "fp4"])
+def test_linear4bit_prefill_cpu(quant_type, compress_statistics):
+    W = torch.randn(300, 256)
+    bias = torch.randn(300)
+    qW, state = bnb.functional.quantize_4bit(
+        W, blocksize=64, quant_type=quant_type, compress_statistics=compress_statistics
+    )
+    linear_q = bnb.nn.Linear4bit(256, 300, compute_dtype=torch.float32, quant_type=quant_type, device="meta")
+    linear_q.weight = bnb.nn.Params4bit.from_prequantized(qW, state.as_dict(packed=True), device="cpu")
+    linear_q.bias = torch.nn.Parameter(bias)
+
+    # several tokens go through the 4-bit GEMM, packing the panels for every call without a
+    # weight cache budget
+    x = torch.randn(2, 7, 256)
+    expected = torch.nn.functional.linear(x, bnb.functional.dequantize_4bit(qW, state), bias)
+    torch.testing.assert_close(linear_q(x), expected, atol=1e-3, rtol=1e-3)
+    assert not hasattr(linear_q.weight, "_prepacked_4bit")
+
+    # and with one, keep them in the weight cache, packing them again after the absmax values
+    # changed in place
+    bnb.functional.set_cpu_weight_cache(1 << 20, admit_after=1)
+    try:
+        bnb.functional.clear_cpu_weight_cache()
+        torch.testing.assert_close(linear_q(x), expected, atol=1e-3, rtol=1e-3)
+        torch.testing.assert_close(linear_q(x), expected, atol=1e-3, rtol=1e-3)
+        stats = bnb.functional.get_cpu_weight_cache_stats()
+        assert (stats["hits"], stats["misses"], stats["entries"]) == (1, 1, 1)
+
+        quant_state = linear_q.weight.quant_state
+        (quant_state.state2.absmax if compress_statistics else quant_state.absmax).mul_(2)
+        expected = torch.nn.functional.linear(x, bnb.functional.dequantize_4bit(qW, quant_state), bias)
+        torch.testing.assert_close(linear_q(x), expected, atol=1e-3, rtol=1e-3)
+        assert bnb.functional.get_cpu_weight_cache_stats()["misses"] == 2
+    finally:
+        bnb.functional.set_cpu_weight_cache(0)
+
+
+@pytest.mark.parametrize("out_features", [100, 300])
+def test_linear4bit_weight_cache_cpu(out_features):
+    # 100 input features are not a multiple of the blocksize, so the forward dequantizes the
+    # weight through the weight cache, which serves it from the second call on
+    W = torch.randn(out_features, 100)
+    qW, state = bnb.functional.quantize_4bit(W, blocksize=64, quant_type="nf4")
+    linear_q = bnb.nn.Linear4bit(100, out_features, compute_dtype=torch.float32, quant_type="nf4", device="meta")
+    linear_q.weight = bnb.nn.Params4bit.from_prequantized(qW, state.as_dict(packed=True), device="cpu")
+    linear_q.bias = torch.nn.Parameter(torch.randn(out_features))
+
+    x = torch.randn(2, 5, 100)
+    expected = torch.nn.functional.linear(x, bnb.functional.dequantize_4bit(qW, state), linear_q.bias)
+    try:
+        bnb.functional.set_cpu_weight_cache(1 << 20, admit_after=2)
+        bnb.functional.clear_cpu_weight_cache()
+        for _ in range(3):
+            torch.testing.assert_close(linear_q(x), expected)
+        assert bnb.functional.get_cpu_weight_cache_stats()["hits"] == 1
+    finally:
+        bnb.functional.set_cpu_weight_cache(0)
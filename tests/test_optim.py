@@ -198,6 +198,133 @@ def test_optimizer32bit(dim1, dim2, gtype, optim_name):
             assert bnb_optimizer.state[p2]["unorm_vec"] > 0.0
 
 
+@pytest.mark.parametrize("optim_name", ["adam", "momentum", "lion"], ids=id_formatter("opt"))
+def test_optimizer32bit_cpu_fused(optim_name):
+    # many small parameters, updated with one native call per step
+    params1 = [torch.randn(dim, 7) * 0.1 for dim in range(1, 200)]
+    params2 = [p.clone() for p in params1]
+    torch_optimizer = str2optimizers[optim_name][0](params1)
+    bnb_optimizer = str2optimizers[optim_name][1](params2)
+
+    for i in range(k):
+        for p1, p2 in zip(params1, params2):
+            p1.grad = torch.randn_like(p1) * 0.01
+            p2.grad = p1.grad.clone()
+        bnb_optimizer.step()
+        torch_optimizer.step()
+
+    for p1, p2 in zip(params1, params2):
+        assert_most_approx_close(p1, p2, atol=1e-6, rtol=1e-5, max_error_count=10)
+        for name1, name2 in str2statenames[optim_name]:
+            torch.testing.assert_close(
+                torch_optimizer.state[p1][name1], bnb_optimizer.state[p2][name2], atol=1e-6, rtol=1e-5
+            )
+
+
+@pytest.mark.parametrize("optim_name", ["adam", "lion"], ids=id_formatter("opt"))
+def test_optimizer32bit_cpu_fused_max_grad_norm(optim_name):
+    # the gradients of all parameters are clipped to one global norm in the fused update
+    params1 = [torch.randn(dim, 7) * 0.1 for dim in range(1, 50)]
+    params2 = [p.clone() for p in params1]
+    torch_optimizer = str2optimizers[optim_name][0](params1)
+    mng = bnb.optim.GlobalOptimManager.get_instance()
+    mng.initialize()
+    try:
+        mng.override_config(params2, "max_grad_norm", 0.5)
+        mng.register_parameters(params2)
+        bnb_optimizer = str2optimizers[optim_name][1](params2)
+
+        for i in range(10):
+            for p1, p2 in zip(params1, params2):
+                p1.grad = torch.randn_like(p1)
+                p2.grad = p1.grad.clone()
+            assert torch.nn.utils.clip_grad_norm_(params1, 0.5) > 0.5
+            bnb_optimizer.step()
+            torch_optimizer.step()
+
+        for p1, p2 in zip(params1, params2):
+            torch.testing.assert_close(p1, p2, atol=1e-5, rtol=1e-4)
+
+        # the other parameters do not silently skip clipping
+        p0 = torch.randn(10, 7).t()
+        mng.initialize()
+        mng.override_config(p0, "max_grad_norm", 0.5)
+        mng.register_parameters([p0])
+        bad_optimizer = str2optimizers[optim_name][1]([p0])
+        p0.grad = torch.randn_like(p0)
+        with pytest.raises(NotImplementedError):
+            bad_optimizer.step()
+    finally:
+        mng.initialize()
+
+
+@pytest.mark.parametrize("optim_name", ["adam", "lion"], ids=id_formatter("opt"))
+@pytest.mark.parametrize("blocksize", [64, 128], ids=id_formatter("blocksize"))
+def test_optimizer4bit_cpu(optim_name, blocksize):
+    p0 = torch.randn(1024, 1025) * 0.1
+    p1 = p0.clone()
+    p2 = p0.clone()
+    torch_optimizer = str2optimizers[optim_name][0]([p1])
+    mng = bnb.optim.GlobalOptimManager.get_instance()
+    mng.initialize()
+    try:
+        mng.override_config(p2, "blocksize_4bit", blocksize)
+        mng.register_parameters([p2])
+        bnb_optimizer = str2optimizers[optim_name][1]([p2], optim_bits=4)
+
+        for i in range(10):
+            p1.grad = torch.randn_like(p1) * 0.01
+            p2.grad = p1.grad.clone()
+            bnb_optimizer.step()
+            torch_optimizer.step()
+
+        mng.initialize()
+        mng.override_config(p0, "blocksize_4bit", 100)
+        mng.register_parameters([p0])
+        bad_optimizer = str2optimizers[optim_name][1]([p0], optim_bits=4)
+        p0.grad = torch.randn_like(p0)
+        with pytest.raises(ValueError):
+            bad_optimizer.step()
+    finally:
+        mng.initialize()
+
+    # two values per byte and one absmax per blocksize values
+    state = bnb_optimizer.state[p2]
+    for i in range(1, 3 if optim_name == "adam" else 2):
+        assert state[f"state{i}"].numel() == (p0.numel() + 1) // 2
+        assert state[f"absmax{i}"].numel() == (p0.numel() + blocksize - 1) // blocksize
+    update1, update2 = (p1 - p0).flatten(), (p2 - p0).flatten()
+    assert torch.nn.functional.cosine_similarity(update1, update2, dim=0) > 0.97
+    assert (update1 - update2).norm() < 0.25 * update1.norm()
+
+
+@pytest.mark.parametrize("optim_name", ["paged_adam", "paged_lion"], ids=id_formatter("opt"))
+def test_paged_optimizer_cpu(optim_name, tmp_path):
+    F.set_cpu_paged_dir(tmp_path)
+    try:
+        # the small parameter keeps its state in RAM
+        params1 = [torch.randn(1024, 257) * 0.1, torch.randn(1024, 1024) * 0.1, torch.randn(64) * 0.1]
+        params2 = [p.clone() for p in params1]
+        ref_optimizer = str2optimizers[optim_name.replace("paged_", "")][1](params1)
+        paged_optimizer = str2optimizers[optim_name][1](params2)
+
+        for i in range(5):
+            for p1, p2 in zip(params1, params2):
+                p1.grad = torch.randn_like(p1) * 0.01
+                p2.grad = p1.grad.clone()
+            ref_optimizer.step()
+            paged_optimizer.step()
+
+        for p1, p2 in zip(params1, params2):
+            state = paged_optimizer.state[p2]
+            assert getattr(state["state1"], "is_paged", False) == (p2.numel() >= 1e5)
+            torch.testing.assert_close(p1, p2, rtol=0, atol=0)
+            for _, name in str2statenames[optim_name]:
+                torch.testing.assert_close(ref_optimizer.state[p1][name], state[name], rtol=0, atol=0)
+    finally:
+        F.set_cpu_paged_dir(None)
+
+
 @pytest.mark.parametrize("dim1", [1024], ids=id_formatter("dim1"))
 @pytest.mark.parametrize("dim2", [32, 1024, 4097], ids=id_formatter("dim2"))
 @pytest.mark.parametrize("gtype", [torch.float32, torch.float16], ids=describe_dtype)